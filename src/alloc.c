@@ -0,0 +1,34 @@
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+static _Thread_local AllocCount counts;
+
+void* mmc_malloc(size_t size) {
+    counts.calls++;
+    counts.bytes += size;
+    return malloc(size);
+}
+
+void* mmc_calloc(size_t n, size_t size) {
+    counts.calls++;
+    counts.bytes += (unsigned long long)n * size;
+    return calloc(n, size);
+}
+
+void* mmc_realloc(void *p, size_t size) {
+    counts.calls++;
+    counts.bytes += size;
+    return realloc(p, size);
+}
+
+char* mmc_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = mmc_malloc(len);
+    if (copy) memcpy(copy, s, len);
+    return copy;
+}
+
+AllocCount alloc_count(void) {
+    return counts;
+}
@@ -0,0 +1,23 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+/* Counting front ends to the C allocator. The library allocates only
+   through these, so a profile can say what each stage cost in calls and
+   bytes; memory they return is released with plain free(). Counts are
+   kept per thread and only ever grow: take one before and after the
+   work being measured. */
+typedef struct {
+    unsigned long calls;        // malloc, calloc, realloc and strdup calls
+    unsigned long long bytes;   // bytes they asked for
+} AllocCount;
+
+void* mmc_malloc(size_t size);
+void* mmc_calloc(size_t n, size_t size);
+void* mmc_realloc(void *p, size_t size);
+char* mmc_strdup(const char *s);
+
+AllocCount alloc_count(void);   // the calling thread's totals
+
+#endif // ALLOC_H
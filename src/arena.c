@@ -0,0 +1,81 @@
+#include "arena.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t off;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(Arena *a, size_t chunk_size) {
+    a->first = a->cur = NULL;
+    a->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+    a->used = a->allocs = a->high_water = 0;
+    a->reserved = a->chunks = 0;
+}
+
+static ArenaChunk* new_chunk(Arena *a, size_t min_size) {
+    size_t size = a->chunk_size > min_size ? a->chunk_size : min_size;
+    ArenaChunk *c = mmc_malloc(sizeof(*c) + size);
+    if (!c) {
+        fprintf(stderr, "Out of memory allocating arena chunk\n");
+        exit(EXIT_FAILURE);
+    }
+    c->next = NULL;
+    c->size = size;
+    c->off = 0;
+    a->reserved += size;
+    a->chunks++;
+    return c;
+}
+
+void* arena_alloc(Arena *a, size_t size) {
+    size = align_up(size);
+
+    if (!a->cur) {
+        if (!a->first) a->first = new_chunk(a, size);
+        a->cur = a->first;
+    }
+
+    // Walk forward through chunks kept from before the last reset,
+    // appending a fresh one only when none of them has room
+    while (a->cur->size - a->cur->off < size) {
+        if (!a->cur->next) a->cur->next = new_chunk(a, size);
+        a->cur = a->cur->next;
+        a->cur->off = 0;
+    }
+
+    void *p = a->cur->data + a->cur->off;
+    a->cur->off += size;
+    a->used += size;
+    a->allocs++;
+    if (a->used > a->high_water) a->high_water = a->used;
+    return p;
+}
+
+void arena_reset(Arena *a) {
+    if (a->first) a->first->off = 0;
+    a->cur = a->first;
+    a->used = 0;
+    a->allocs = 0;
+}
+
+void arena_free(Arena *a) {
+    ArenaChunk *c = a->first;
+    while (c) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    arena_init(a, a->chunk_size);
+}
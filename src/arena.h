@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Bump allocator: objects are carved out of large chunks and released
+   all at once with arena_reset / arena_free. */
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *cur;        // chunk currently being bumped
+    size_t chunk_size;
+    size_t used;            // bytes handed out since the last reset
+    size_t allocs;          // allocations since the last reset
+    size_t high_water;      // peak of `used` over the arena's lifetime
+    size_t reserved;        // bytes held in chunks
+    size_t chunks;
+} Arena;
+
+void arena_init(Arena *a, size_t chunk_size);
+void* arena_alloc(Arena *a, size_t size);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+#endif // ARENA_H
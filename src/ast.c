@@ -1,53 +1,156 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include "ast.h"
+#include "alloc.h"
 #include <math.h>
 
-ASTNode* make_num(double v) {
-    ASTNode *n = malloc(sizeof(ASTNode));
-    n->type = NODE_NUM;
-    n->value = v;
-    n->left = n->right = NULL;
-    return n;
+#define BUILDER_INITIAL_SLOTS 1024
+
+void ast_builder_init(ASTBuilder *b, Arena *a) {
+    b->arena = a;
+    b->slots = NULL;
+    b->nslots = 0;
+    b->nodes = 0;
+    b->deduped = 0;
+    b->var_names = NULL;
+    b->nvars = b->vars_cap = 0;
 }
-double eval(ASTNode *n) {
-    if (!n) return 0.0;
-    switch (n->type) {
-      case NODE_NUM:  return n->value;
-      case NODE_ADD:  return eval(n->left) + eval(n->right);
-      case NODE_SUB:  return eval(n->left) - eval(n->right);
-      case NODE_MUL:  return eval(n->left) * eval(n->right);
-      case NODE_DIV:  return eval(n->left) / eval(n->right);
-      case NODE_POW:  return pow(eval(n->left), eval(n->right));
-      case NODE_NEG:  return -eval(n->left);
-      case NODE_SIN:  return sin(eval(n->left));
-      case NODE_COS:  return cos(eval(n->left));
-      case NODE_TAN:  return tan(eval(n->left));
-      case NODE_LOG:  return log(eval(n->left));
-      case NODE_EXP:  return exp(eval(n->left));
-      case NODE_SQRT: return sqrt(eval(n->left));
+
+void ast_builder_reset(ASTBuilder *b) {
+    if (b->slots) memset(b->slots, 0, b->nslots * sizeof(*b->slots));
+    b->nodes = 0;
+    b->deduped = 0;
+    b->nvars = 0;       // the names themselves live in the arena
+}
+
+void ast_builder_free(ASTBuilder *b) {
+    free(b->slots);
+    free(b->var_names);
+    ast_builder_init(b, b->arena);
+}
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h * 0xff51afd7ed558ccdULL;
+}
+
+static uint64_t hash_node(NodeType t, double v, const ASTNode *l, const ASTNode *r) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    uint64_t h = mix(t, bits);
+    h = mix(h, l ? l->id + 1 : 0);
+    h = mix(h, r ? r->id + 1 : 0);
+    return h ^ (h >> 29);
+}
+
+/* The key of a leaf: a literal's value, or a variable's index */
+static double leaf_key(const ASTNode *n) {
+    return n->type == NODE_VAR ? (double)n->var : n->value;
+}
+
+/* Literals compare by bit pattern so that 0 and -0 stay distinct */
+static int same_node(const ASTNode *n, NodeType t, double v, const ASTNode *l, const ASTNode *r) {
+    if (n->type != t || n->left != l || n->right != r) return 0;
+    if (t == NODE_VAR) return n->var == (unsigned)v;
+    return t != NODE_NUM || memcmp(&n->value, &v, sizeof(v)) == 0;
+}
+
+static void grow(ASTBuilder *b) {
+    size_t nslots = b->nslots ? b->nslots * 2 : BUILDER_INITIAL_SLOTS;
+    ASTNode **slots = mmc_calloc(nslots, sizeof(*slots));
+    if (!slots) {
+        fprintf(stderr, "Out of memory growing AST table\n");
+        exit(EXIT_FAILURE);
     }
-    return 0.0;
+    for (size_t i = 0; i < b->nslots; i++) {
+        ASTNode *n = b->slots[i];
+        if (!n) continue;
+        size_t j = hash_node(n->type, leaf_key(n), n->left, n->right) & (nslots - 1);
+        while (slots[j]) j = (j + 1) & (nslots - 1);
+        slots[j] = n;
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->nslots = nslots;
 }
 
-ASTNode* make_bin(NodeType t, ASTNode *l, ASTNode *r) {
-    ASTNode *n = malloc(sizeof(ASTNode));
+static ASTNode* intern(ASTBuilder *b, NodeType t, double v, ASTNode *l, ASTNode *r) {
+    if (2 * (b->nodes + 1) > b->nslots) grow(b);
+
+    size_t mask = b->nslots - 1;
+    size_t i = hash_node(t, v, l, r) & mask;
+    while (b->slots[i]) {
+        if (same_node(b->slots[i], t, v, l, r)) {
+            b->deduped++;
+            return b->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    ASTNode *n = arena_alloc(b->arena, sizeof(ASTNode));
     n->type = t;
+    n->id = (unsigned)b->nodes++;
+    n->value = t == NODE_NUM ? v : 0.0;
+    if (t == NODE_VAR) n->var = (unsigned)v;
     n->left = l;
     n->right = r;
+    b->slots[i] = n;
     return n;
 }
 
-ASTNode* make_unary(NodeType t, ASTNode *c) {
-    ASTNode *n = malloc(sizeof(ASTNode));
-    n->type = t;
-    n->left = c;
-    n->right = NULL;
-    return n;
+ASTNode* make_num(ASTBuilder *b, double v) {
+    return intern(b, NODE_NUM, v, NULL, NULL);
+}
+
+/* Variables are numbered by first appearance; every use of a name gets
+   the same node */
+ASTNode* make_var(ASTBuilder *b, const char *name) {
+    size_t k = 0;
+    while (k < b->nvars && strcmp(b->var_names[k], name) != 0) k++;
+    if (k == b->nvars) {
+        if (b->nvars == b->vars_cap) {
+            b->vars_cap = b->vars_cap ? b->vars_cap * 2 : 8;
+            b->var_names = mmc_realloc(b->var_names, b->vars_cap * sizeof(*b->var_names));
+            if (!b->var_names) {
+                fprintf(stderr, "Out of memory growing variable table\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        size_t len = strlen(name) + 1;
+        char *copy = arena_alloc(b->arena, len);
+        memcpy(copy, name, len);
+        b->var_names[b->nvars++] = copy;
+    }
+    return intern(b, NODE_VAR, (double)k, NULL, NULL);
+}
+
+double eval(ASTNode *n, const double *vars) {
+    if (!n) return 0.0;
+    switch (n->type) {
+      case NODE_NUM:  return n->value;
+      case NODE_VAR:  return vars[n->var];
+      case NODE_ADD:  return eval(n->left, vars) + eval(n->right, vars);
+      case NODE_SUB:  return eval(n->left, vars) - eval(n->right, vars);
+      case NODE_MUL:  return eval(n->left, vars) * eval(n->right, vars);
+      case NODE_DIV:  return eval(n->left, vars) / eval(n->right, vars);
+      case NODE_POW:  return pow(eval(n->left, vars), eval(n->right, vars));
+      case NODE_NEG:  return -eval(n->left, vars);
+      case NODE_SIN:  return sin(eval(n->left, vars));
+      case NODE_COS:  return cos(eval(n->left, vars));
+      case NODE_TAN:  return tan(eval(n->left, vars));
+      case NODE_LOG:  return log(eval(n->left, vars));
+      case NODE_EXP:  return exp(eval(n->left, vars));
+      case NODE_SQRT: return sqrt(eval(n->left, vars));
+    }
+    return 0.0;
+}
+
+ASTNode* make_bin(ASTBuilder *b, NodeType t, ASTNode *l, ASTNode *r) {
+    return intern(b, t, 0.0, l, r);
 }
 
-void free_ast(ASTNode *n) {
-    if (!n) return;
-    free_ast(n->left);
-    free_ast(n->right);
-    free(n);
+ASTNode* make_unary(ASTBuilder *b, NodeType t, ASTNode *c) {
+    return intern(b, t, 0.0, c, NULL);
 }
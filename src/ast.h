@@ -1,20 +1,55 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stddef.h>
+#include "arena.h"
+
 typedef enum {
     NODE_NUM, NODE_ADD, NODE_SUB, NODE_MUL, NODE_DIV, NODE_POW,
-    NODE_NEG, NODE_SIN, NODE_COS, NODE_TAN, NODE_LOG, NODE_EXP, NODE_SQRT
+    NODE_NEG, NODE_SIN, NODE_COS, NODE_TAN, NODE_LOG, NODE_EXP, NODE_SQRT,
+    NODE_VAR
 } NodeType;
 
 typedef struct ASTNode {
     NodeType type;
-    double value;
+    unsigned id;            // dense per builder, for side tables in later stages
+    union {
+        double value;       // NODE_NUM
+        unsigned var;       // NODE_VAR: index into the builder's variable table
+    };
     struct ASTNode *left, *right;
 } ASTNode;
 
-ASTNode* make_num(double v);
-ASTNode* make_bin(NodeType t, ASTNode *l, ASTNode *r);
-ASTNode* make_unary(NodeType t, ASTNode *c);
-void free_ast(ASTNode *n);
-double eval(ASTNode *n);
-#endif // AST_H
\ No newline at end of file
+/* Node factory. Constructors are hash-consed: asking for a node that is
+   structurally identical to one already built returns the existing node,
+   so repeated subterms share storage and the "tree" is really a DAG.
+   Nodes live in the builder's arena; there is no per-node free, they go
+   away with arena_reset / arena_free after ast_builder_reset. */
+typedef struct {
+    Arena *arena;
+    ASTNode **slots;        // open-addressed table of every node built
+    size_t nslots;
+    size_t nodes;           // distinct nodes built, also the next id
+    size_t deduped;         // constructor calls answered by an existing node
+    char **var_names;       // distinct variable names, in order of first use
+    size_t nvars, vars_cap;
+} ASTBuilder;
+
+/* Values bound to a builder's variables, indexed by ASTNode.var */
+typedef struct {
+    const char *const *names;
+    const double *values;
+    const unsigned char *bound;     // nonzero where a value was supplied
+    size_t count;
+} VarEnv;
+
+void ast_builder_init(ASTBuilder *b, Arena *a);
+void ast_builder_reset(ASTBuilder *b);
+void ast_builder_free(ASTBuilder *b);
+
+ASTNode* make_num(ASTBuilder *b, double v);
+ASTNode* make_bin(ASTBuilder *b, NodeType t, ASTNode *l, ASTNode *r);
+ASTNode* make_unary(ASTBuilder *b, NodeType t, ASTNode *c);
+ASTNode* make_var(ASTBuilder *b, const char *name);
+double eval(ASTNode *n, const double *vars);
+#endif // AST_H
@@ -0,0 +1,263 @@
+#include "batch.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define BATCH_BLOCK 256     // rows per kernel call, 2 KiB per buffer
+
+typedef void (*BinKernel)(double *d, const double *a, const double *b, size_t n);
+typedef void (*UnKernel)(double *d, const double *a, size_t n);
+typedef void (*FmaKernel)(double *d, const double *a, const double *b, const double *c, size_t n);
+
+typedef struct {
+    BinKernel bin[IR_VAR + 1];
+    UnKernel un[IR_VAR + 1];
+    FmaKernel fma;
+    unsigned vec;       // bit per IROp computed in vectors rather than through libm
+} KernelSet;
+
+/* ---- scalar kernels: libm throughout, bit-identical to eval() ---- */
+
+#define SBIN(name, expr)                                                    \
+static void name(double *d, const double *a, const double *b, size_t n) {  \
+    for (size_t i = 0; i < n; i++) d[i] = expr;                             \
+}
+#define SUN(name, expr)                                                     \
+static void name(double *d, const double *a, size_t n) {                    \
+    for (size_t i = 0; i < n; i++) d[i] = expr;                             \
+}
+
+SBIN(s_add, a[i] + b[i])
+SBIN(s_sub, a[i] - b[i])
+SBIN(s_mul, a[i] * b[i])
+SBIN(s_div, a[i] / b[i])
+SBIN(s_pow, pow(a[i], b[i]))
+static void s_fma(double *d, const double *a, const double *b, const double *c, size_t n) {
+    for (size_t i = 0; i < n; i++) d[i] = fma(a[i], b[i], c[i]);
+}
+
+SUN(s_neg, -a[i])
+SUN(s_sin, sin(a[i]))
+SUN(s_cos, cos(a[i]))
+SUN(s_tan, tan(a[i]))
+SUN(s_log, log(a[i]))
+SUN(s_exp, exp(a[i]))
+SUN(s_sqrt, sqrt(a[i]))
+
+static const KernelSet scalar_kernels = {
+    .bin = {
+        [IR_ADD] = s_add, [IR_SUB] = s_sub, [IR_MUL] = s_mul,
+        [IR_DIV] = s_div, [IR_POW] = s_pow
+    },
+    .un = {
+        [IR_NEG] = s_neg, [IR_SIN] = s_sin, [IR_COS] = s_cos, [IR_TAN] = s_tan,
+        [IR_LOG] = s_log, [IR_EXP] = s_exp, [IR_SQRT] = s_sqrt
+    },
+    .fma = s_fma
+};
+
+/* ---- vector kernels, one copy per instruction set ---- */
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define BATCH_X86 1
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define VLEN 4
+#define KN(name) name##_avx2
+#define VSQRT(x) _mm256_sqrt_pd(x)
+#include "batch_kernels.h"
+#undef VLEN
+#undef KN
+#undef VSQRT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define VLEN 8
+#define KN(name) name##_avx512
+#define VSQRT(x) _mm512_sqrt_pd(x)
+#define VFMA(a, b, c) _mm512_fmadd_pd(a, b, c)
+#include "batch_kernels.h"
+#undef VLEN
+#undef KN
+#undef VSQRT
+#undef VFMA
+#pragma GCC pop_options
+#endif
+
+/* ---- instruction set selection ---- */
+
+/* What the CPU supports, found once by whichever thread gets there
+   first and never written again */
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+static unsigned cpu_isas = 1u << BATCH_SCALAR;     // bit per BatchIsa
+
+static void detect_cpu(void) {
+#ifdef BATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) cpu_isas |= 1u << BATCH_AVX2;
+    if (__builtin_cpu_supports("avx512f")) cpu_isas |= 1u << BATCH_AVX512;
+#endif
+}
+
+static int isa_supported(BatchIsa isa) {
+    pthread_once(&cpu_once, detect_cpu);
+    return (cpu_isas >> isa) & 1;
+}
+
+BatchIsa batch_best_isa(void) {
+    return isa_supported(BATCH_AVX512) ? BATCH_AVX512 :
+           isa_supported(BATCH_AVX2) ? BATCH_AVX2 : BATCH_SCALAR;
+}
+
+int batch_set_isa(BatchProgram *bp, BatchIsa isa) {
+    if (!isa_supported(isa)) return -1;
+    bp->isa = isa;
+    return 0;
+}
+
+const char* batch_isa_name(BatchIsa isa) {
+    switch (isa) {
+        case BATCH_AVX512: return "avx512";
+        case BATCH_AVX2:   return "avx2";
+        case BATCH_SCALAR: break;
+    }
+    return "scalar";
+}
+
+static const KernelSet* kernels_for(BatchIsa isa) {
+#ifdef BATCH_X86
+    if (isa == BATCH_AVX512) return &kernels_avx512;
+    if (isa == BATCH_AVX2) return &kernels_avx2;
+#endif
+    (void)isa;
+    return &scalar_kernels;
+}
+
+/* ---- compilation: give each register a block buffer ---- */
+
+void batch_compile(BatchProgram *bp, const IRProgram *ir, const FmSet *fast) {
+    int nregs = ir->nregs ? ir->nregs : 1;
+    bp->count = ir->count;
+    bp->nregs = ir->nregs;
+    bp->code = mmc_malloc((ir->count ? ir->count : 1) * sizeof(*bp->code));
+    bp->buf = mmc_malloc(nregs * sizeof(*bp->buf));
+    int *last_use = mmc_malloc(nregs * sizeof(*last_use));
+    int *free_bufs = mmc_malloc(nregs * sizeof(*free_bufs));
+    unsigned char *temp = mmc_malloc(nregs);     // defined by a kernel
+    if (!bp->code || !bp->buf || !last_use || !free_bufs || !temp) {
+        fprintf(stderr, "Out of memory compiling batch program\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ir->count) memcpy(bp->code, ir->code, ir->count * sizeof(*bp->code));
+    bp->result = ir->count ? ir->code[ir->count - 1].dst : -1;
+    bp->nvars = 0;
+    bp->nbufs = 0;
+    bp->isa = batch_best_isa();
+    for (int op = 0; op <= IR_VAR; op++) bp->fast[op] = fast ? fast->k[op] : NULL;
+
+    for (int v = 0; v < ir->nregs; v++) {
+        bp->buf[v] = -1;
+        last_use[v] = -1;
+        temp[v] = 0;
+    }
+    // Constants are broadcast once per call and keep their buffers
+    for (int i = 0; i < ir->count; i++) {
+        const IRInstr *c = &ir->code[i];
+        if (c->a >= 0) last_use[c->a] = i;
+        if (c->b >= 0) last_use[c->b] = i;
+        if (c->op == IR_FMA) last_use[c->c] = i;
+        if (c->op == IR_CONST) bp->buf[c->dst] = bp->nbufs++;
+        else if (c->op != IR_VAR) temp[c->dst] = 1;
+        if (c->op == IR_VAR && c->var >= bp->nvars) bp->nvars = c->var + 1;
+    }
+
+    // Kernels are elementwise, so a result may reuse the buffer of an
+    // operand that dies at the same instruction
+    int nfree = 0;
+    for (int i = 0; i < ir->count; i++) {
+        const IRInstr *c = &ir->code[i];
+        if (c->op == IR_VAR || c->op == IR_CONST) continue;
+        int ops[3] = { c->a, c->b, c->op == IR_FMA ? c->c : -1 };
+        for (int k = 0; k < 3; k++) {
+            int v = ops[k];
+            if (v < 0 || !temp[v] || last_use[v] != i || (k >= 1 && ops[0] == v) || (k == 2 && ops[1] == v)) continue;
+            free_bufs[nfree++] = bp->buf[v];
+        }
+        bp->buf[c->dst] = nfree ? free_bufs[--nfree] : bp->nbufs++;
+    }
+    free(last_use);
+    free(free_bufs);
+    free(temp);
+}
+
+void batch_free(BatchProgram *bp) {
+    free(bp->code);
+    free(bp->buf);
+    memset(bp, 0, sizeof(*bp));
+}
+
+/* ---- evaluation ---- */
+
+static void fm_block(const FmKernel *k, double *d, const double *a, size_t n) {
+    for (size_t i = 0; i < n; i++) d[i] = fm_eval(k, a[i]);
+}
+
+void batch_eval(const BatchProgram *bp, const double *const *columns,
+                double *out, size_t rows) {
+    if (bp->result < 0) {
+        for (size_t i = 0; i < rows; i++) out[i] = NAN;
+        return;
+    }
+
+    const KernelSet *ks = kernels_for(bp->isa);
+    double *mem = mmc_malloc(((size_t)bp->nbufs + 1) * BATCH_BLOCK * sizeof(double));
+    const double **operand = mmc_malloc((bp->nregs + 1) * sizeof(*operand));
+    if (!mem || !operand) {
+        fprintf(stderr, "Out of memory in batch evaluation\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int v = 0; v < bp->nregs; v++) {
+        operand[v] = bp->buf[v] >= 0 ? mem + (size_t)bp->buf[v] * BATCH_BLOCK : NULL;
+    }
+    for (int i = 0; i < bp->count; i++) {
+        const IRInstr *c = &bp->code[i];
+        if (c->op != IR_CONST) continue;
+        double *p = mem + (size_t)bp->buf[c->dst] * BATCH_BLOCK;
+        for (int j = 0; j < BATCH_BLOCK; j++) p[j] = c->imm;
+    }
+
+    const IRInstr *last = &bp->code[bp->count - 1];
+    for (size_t start = 0; start < rows; start += BATCH_BLOCK) {
+        size_t n = rows - start < BATCH_BLOCK ? rows - start : BATCH_BLOCK;
+
+        for (int i = 0; i < bp->count; i++) {
+            const IRInstr *c = &bp->code[i];
+            if (c->op == IR_CONST) continue;
+            if (c->op == IR_VAR) {
+                operand[c->dst] = columns[c->var] + start;
+                continue;
+            }
+
+            // The statement's value goes straight to the output
+            double *d = c == last ? out + start : mem + (size_t)bp->buf[c->dst] * BATCH_BLOCK;
+            const FmKernel *k = bp->fast[c->op];
+            if (c->op == IR_FMA) ks->fma(d, operand[c->a], operand[c->b], operand[c->c], n);
+            else if (ir_is_binary(c->op)) ks->bin[c->op](d, operand[c->a], operand[c->b], n);
+            else if (k && !(ks->vec & (1u << c->op))) fm_block(k, d, operand[c->a], n);
+            else ks->un[c->op](d, operand[c->a], n);
+        }
+
+        if (last->op == IR_CONST || last->op == IR_VAR) {
+            memcpy(out + start, operand[last->dst], n * sizeof(double));
+        }
+    }
+
+    free(operand);
+    free(mem);
+}
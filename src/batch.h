@@ -0,0 +1,56 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include "ir.h"
+#include "fastmath.h"
+
+/* Column-wise evaluation of one statement over many rows.
+
+   The optimized IR is run a block of rows at a time: each instruction is
+   a kernel over arrays, so dispatch is paid once per block rather than
+   once per row, and the arithmetic runs in AVX2 or AVX-512 vectors when
+   the CPU has them. exp, log, sin and cos have vector implementations
+   that stay within a few ulp of libm; tan and pow call libm per lane.
+   Fused multiply-adds are AVX-512 instructions, and libm's fma, which
+   rounds the same, elsewhere. The scalar kernels call libm throughout
+   and give the same bits as eval().
+
+   Under fast math the scalar kernels, and tan in every instruction set,
+   run the selected fastmath.h kernels instead and give the same bits as
+   the JIT. The vector exp, log, sin, cos and sqrt are kept. */
+
+typedef enum {
+    BATCH_SCALAR,
+    BATCH_AVX2,
+    BATCH_AVX512
+} BatchIsa;
+
+typedef struct {
+    IRInstr *code;      // private copy of the optimized IR
+    int count;
+    int nregs;
+    int result;         // register holding the statement's value
+    int *buf;           // per register: block buffer, -1 for variables
+    int nbufs;
+    int nvars;          // columns read: variables 0 .. nvars-1
+    const FmKernel *fast[IR_VAR + 1];   // per IROp, NULL for libm
+    BatchIsa isa;       // kernels batch_eval uses
+} BatchProgram;
+
+/* Prepare ir for batch_eval; bp owns a copy, ir can be reused after.
+   fast is the fast-math selection, or NULL. The program runs the best
+   kernels the CPU supports unless batch_set_isa picks others. */
+void batch_compile(BatchProgram *bp, const IRProgram *ir, const FmSet *fast);
+void batch_free(BatchProgram *bp);
+
+/* columns[k] holds `rows` values of variable k; out receives one result
+   per row */
+void batch_eval(const BatchProgram *bp, const double *const *columns,
+                double *out, size_t rows);
+
+BatchIsa batch_best_isa(void);      // of this CPU and build
+int batch_set_isa(BatchProgram *bp, BatchIsa isa);  // -1 if this CPU/build cannot run it
+const char* batch_isa_name(BatchIsa isa);
+
+#endif // BATCH_H
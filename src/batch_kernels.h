@@ -0,0 +1,214 @@
+/* Vector kernels for batch.c, included once per instruction set with
+   VLEN (doubles per vector), KN(name) (name suffix), VSQRT and, where
+   the set has fused multiply-adds, VFMA defined and the matching target
+   options in effect. No include guard. */
+
+typedef double KN(vd) __attribute__((vector_size(VLEN * 8)));
+typedef long long KN(vi) __attribute__((vector_size(VLEN * 8)));
+#define vd KN(vd)
+#define vi KN(vi)
+
+static inline vd KN(load)(const double *p) {
+    vd v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void KN(store)(double *p, vd v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline vd KN(splat)(double x) {
+    return (vd){ 0 } + x;
+}
+
+/* lanes of a where m is set, of b elsewhere */
+static inline vd KN(sel)(vi m, vd a, vd b) {
+    return (vd)((m & (vi)a) | (~m & (vi)b));
+}
+
+/* Adding 1.5 * 2^52 rounds to an integer held in the low mantissa bits,
+   which converts between doubles and int64 lanes without needing
+   AVX-512DQ */
+#define SHIFTER 0x1.8p52
+
+static inline vd KN(v_exp)(vd x) {
+    // Beyond these the result is inf or 0 anyway; NaN passes through
+    x = KN(sel)(x > KN(splat)(710.0), KN(splat)(710.0), x);
+    x = KN(sel)(x < KN(splat)(-746.0), KN(splat)(-746.0), x);
+
+    vd kd = x * 1.44269504088896338700e+00 + SHIFTER;
+    vi ki = (vi)kd - (vi)KN(splat)(SHIFTER);
+    vd k = kd - SHIFTER;
+    vd r = (x - k * 6.93147180369123816490e-01) - k * 1.90821492927058770002e-10;
+
+    // e^r on |r| <= ln2/2, Taylor to degree 13
+    vd p = KN(splat)(1.0 / 6227020800.0);
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    // 2^k in two halves so neither overflows the exponent field
+    vi k1 = ki >> 1;
+    vi k2 = ki - k1;
+    vd s1 = (vd)((k1 + 1023) << 52);
+    vd s2 = (vd)((k2 + 1023) << 52);
+    return p * s1 * s2;
+}
+
+/* fdlibm's log: x = 2^e * m with m in [sqrt(2)/2, sqrt(2)) */
+static inline vd KN(v_log)(vd x) {
+    vi sub = (x < KN(splat)(0x1p-1022)) & (x > KN(splat)(0.0));
+    vd xs = KN(sel)(sub, x * 0x1p54, x);
+    vi bits = (vi)xs;
+    vi e = ((bits >> 52) & 0x7ff) - 1023 - (sub & 54);
+    vd m = (vd)((bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
+    vi big = m > KN(splat)(1.41421356237309504880);
+    m = KN(sel)(big, m * 0.5, m);
+    e = e - big;
+
+    vd f = m - 1.0;
+    vd hfsq = 0.5 * f * f;
+    vd s = f / (2.0 + f);
+    vd z = s * s;
+    vd w = z * z;
+    vd t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    vd t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 +
+                 w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    vd R = t2 + t1;
+    vd dk = (vd)(e + (vi)KN(splat)(SHIFTER)) - SHIFTER;
+    vd y = dk * 6.93147180369123816490e-01 -
+           ((hfsq - (s * (hfsq + R) + dk * 1.90821492927058770002e-10)) - f);
+
+    y = KN(sel)(x == KN(splat)(0.0), KN(splat)(-INFINITY), y);
+    y = KN(sel)(x == KN(splat)(INFINITY), x, y);
+    y = KN(sel)((x < KN(splat)(0.0)) | (x != x), KN(splat)(NAN), y);
+    return y;
+}
+
+/* sin (want_cos 0) or cos (1): reduce by pi/2 with a four-part
+   constant, then fdlibm's kernels on [-pi/4, pi/4]. Lanes too large for
+   that reduction, and inf/NaN, are handed to libm. */
+static inline vd KN(v_sincos)(vd x, int want_cos) {
+    vd kd = x * 6.36619772367581382433e-01 + SHIFTER;
+    vi q = (vi)kd - (vi)KN(splat)(SHIFTER);
+    vd k = kd - SHIFTER;
+    vd r = (((x - k * 1.57079632673412561417e+00) - k * 6.07710050630396597660e-11) -
+            k * 2.02226624871116645580e-21) - k * 8.47842766036889956997e-32;
+
+    vd z = r * r;
+    vd sr = r + z * r * (-1.66666666666666324348e-01 + z * (8.33333333332248946124e-03 +
+            z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06 +
+            z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)))));
+    vd hz = 0.5 * z;
+    vd w = 1.0 - hz;
+    vd cr = w + (((1.0 - w) - hz) + z * z * (4.16666666666666019037e-02 +
+            z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 +
+            z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 +
+            z * -1.13596475577881948265e-11))))));
+
+    vi n = (q + want_cos) & 3;
+    vd res = KN(sel)((n & 1) != 0, cr, sr);
+    res = KN(sel)((n & 2) != 0, -res, res);
+
+    vd ax = (vd)((vi)x & 0x7fffffffffffffffLL);
+    vi slow = ~(ax <= KN(splat)(1e5));
+    for (int l = 0; l < VLEN; l++) {
+        if (slow[l]) res[l] = want_cos ? cos(x[l]) : sin(x[l]);
+    }
+    return res;
+}
+
+static inline vd KN(v_sin)(vd x) { return KN(v_sincos)(x, 0); }
+static inline vd KN(v_cos)(vd x) { return KN(v_sincos)(x, 1); }
+static inline vd KN(v_sqrt)(vd x) { return VSQRT(x); }
+static inline vd KN(v_neg)(vd x) { return -x; }
+
+static inline vd KN(v_tan)(vd x) {
+    for (int l = 0; l < VLEN; l++) x[l] = tan(x[l]);
+    return x;
+}
+
+#define VBIN(name, expr)                                                    \
+static void KN(name)(double *d, const double *pa, const double *pb, size_t n) { \
+    size_t i = 0;                                                           \
+    for (; i + VLEN <= n; i += VLEN) {                                      \
+        vd a = KN(load)(pa + i), b = KN(load)(pb + i);                      \
+        KN(store)(d + i, expr);                                             \
+    }                                                                       \
+    for (; i < n; i++) {                                                    \
+        double a = pa[i], b = pb[i];                                        \
+        d[i] = expr;                                                        \
+    }                                                                       \
+}
+
+VBIN(k_add, a + b)
+VBIN(k_sub, a - b)
+VBIN(k_mul, a * b)
+VBIN(k_div, a / b)
+
+static void KN(k_pow)(double *d, const double *a, const double *b, size_t n) {
+    for (size_t i = 0; i < n; i++) d[i] = pow(a[i], b[i]);
+}
+
+static void KN(k_fma)(double *d, const double *pa, const double *pb, const double *pc, size_t n) {
+    size_t i = 0;
+#ifdef VFMA
+    for (; i + VLEN <= n; i += VLEN) {
+        KN(store)(d + i, VFMA(KN(load)(pa + i), KN(load)(pb + i), KN(load)(pc + i)));
+    }
+#endif
+    for (; i < n; i++) d[i] = fma(pa[i], pb[i], pc[i]);
+}
+
+/* The last partial vector is padded rather than finished in scalar code,
+   so a row's result does not depend on where it falls in the block */
+#define VUN(name, fn)                                                       \
+static void KN(name)(double *d, const double *a, size_t n) {                \
+    size_t i = 0;                                                           \
+    for (; i + VLEN <= n; i += VLEN) KN(store)(d + i, fn(KN(load)(a + i))); \
+    if (i < n) {                                                            \
+        double t[VLEN];                                                     \
+        for (int l = 0; l < VLEN; l++) t[l] = a[i + l < n ? i + l : i];     \
+        KN(store)(t, fn(KN(load)(t)));                                      \
+        memcpy(d + i, t, (n - i) * sizeof(double));                         \
+    }                                                                       \
+}
+
+VUN(k_neg, KN(v_neg))
+VUN(k_sin, KN(v_sin))
+VUN(k_cos, KN(v_cos))
+VUN(k_tan, KN(v_tan))
+VUN(k_log, KN(v_log))
+VUN(k_exp, KN(v_exp))
+VUN(k_sqrt, KN(v_sqrt))
+
+static const KernelSet KN(kernels) = {
+    .bin = {
+        [IR_ADD] = KN(k_add), [IR_SUB] = KN(k_sub), [IR_MUL] = KN(k_mul),
+        [IR_DIV] = KN(k_div), [IR_POW] = KN(k_pow)
+    },
+    .un = {
+        [IR_NEG] = KN(k_neg), [IR_SIN] = KN(k_sin), [IR_COS] = KN(k_cos),
+        [IR_TAN] = KN(k_tan), [IR_LOG] = KN(k_log), [IR_EXP] = KN(k_exp),
+        [IR_SQRT] = KN(k_sqrt)
+    },
+    .fma = KN(k_fma),
+    .vec = 1u << IR_SIN | 1u << IR_COS | 1u << IR_LOG | 1u << IR_EXP | 1u << IR_SQRT
+};
+
+#undef VBIN
+#undef VUN
+#undef SHIFTER
+#undef vd
+#undef vi
@@ -0,0 +1,209 @@
+#include "binfmt.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BIN_FILE_BUFFER (64 * 1024)
+
+/* ---- writing ---- */
+
+void bin_writer_init(BinWriter *w, FILE *fp) {
+    memset(w, 0, sizeof(*w));
+    w->fp = fp;
+}
+
+void bin_flush(BinWriter *w) {
+    if (!w->fp) return;
+    if (w->len > 0) fwrite(w->buf, 1, w->len, w->fp);
+    w->len = 0;
+    fflush(w->fp);
+}
+
+void bin_writer_free(BinWriter *w) {
+    bin_flush(w);
+    free(w->buf);
+    memset(w, 0, sizeof(*w));
+}
+
+static unsigned char* reserve(BinWriter *w, size_t n) {
+    if (w->len + n > w->cap) {
+        size_t cap = w->cap ? w->cap : BIN_FILE_BUFFER;
+        while (cap < w->len + n) cap *= 2;
+        unsigned char *p = mmc_realloc(w->buf, cap);
+        if (!p) {
+            fprintf(stderr, "Out of memory growing binary output\n");
+            exit(EXIT_FAILURE);
+        }
+        w->buf = p;
+        w->cap = cap;
+    }
+    unsigned char *p = w->buf + w->len;
+    w->len += n;
+    return p;
+}
+
+static void put_le(unsigned char *p, unsigned long long v, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+void bin_u8(BinWriter *w, unsigned v) {
+    *reserve(w, 1) = (unsigned char)v;
+}
+
+void bin_u32(BinWriter *w, unsigned long v) {
+    put_le(reserve(w, 4), v, 4);
+}
+
+void bin_f64(BinWriter *w, double v) {
+    unsigned long long bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_le(reserve(w, 8), bits, 8);
+}
+
+void bin_str(BinWriter *w, const char *s) {
+    size_t n = strlen(s);
+    bin_u32(w, n);
+    memcpy(reserve(w, n + 1), s, n + 1);
+}
+
+void bin_write_header(BinWriter *w) {
+    memcpy(reserve(w, 4), BIN_MAGIC, 4);
+    bin_u32(w, BIN_VERSION);
+}
+
+void bin_begin_record(BinWriter *w, unsigned index, double result, const DiagList *errors) {
+    w->record = w->len;
+    bin_u32(w, 0);          // patched by bin_end_record
+    bin_u32(w, index);
+    bin_f64(w, result);
+    put_le(reserve(w, 2), errors->count, 2);
+    for (int i = 0; i < errors->count; i++) put_le(reserve(w, 2), errors->codes[i], 2);
+}
+
+void bin_end_record(BinWriter *w) {
+    put_le(w->buf + w->record, w->len - w->record - 4, 4);
+    // Complete records only ever leave the buffer
+    if (w->fp && w->len >= BIN_FILE_BUFFER / 2) {
+        fwrite(w->buf, 1, w->len, w->fp);
+        w->len = 0;
+    }
+}
+
+void bin_begin_payload(BinWriter *w, BinPayload kind) {
+    bin_u8(w, kind);
+    w->payload = w->len;
+    bin_u32(w, 0);
+}
+
+void bin_end_payload(BinWriter *w) {
+    put_le(w->buf + w->payload, w->len - w->payload - 4, 4);
+}
+
+/* ---- reading ---- */
+
+static unsigned long long get_le(const unsigned char *p, int n) {
+    unsigned long long v = 0;
+    for (int i = n - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+/* The next n bytes, or NULL past the end */
+static const unsigned char* take(BinCursor *c, size_t n) {
+    if (c->bad || !c->p || (size_t)(c->end - c->p) < n) {
+        c->bad = 1;
+        return NULL;
+    }
+    const unsigned char *p = c->p;
+    c->p += n;
+    return p;
+}
+
+int bin_at_end(const BinCursor *c) {
+    return !c->p || c->p >= c->end;
+}
+
+unsigned bin_read_u8(BinCursor *c) {
+    const unsigned char *p = take(c, 1);
+    return p ? *p : 0;
+}
+
+unsigned long bin_read_u32(BinCursor *c) {
+    const unsigned char *p = take(c, 4);
+    return p ? (unsigned long)get_le(p, 4) : 0;
+}
+
+double bin_read_f64(BinCursor *c) {
+    const unsigned char *p = take(c, 8);
+    unsigned long long bits = p ? get_le(p, 8) : 0;
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+const char* bin_read_str(BinCursor *c) {
+    unsigned long n = bin_read_u32(c);
+    const unsigned char *p = c->bad ? NULL : take(c, (size_t)n + 1);
+    if (!p || p[n] != '\0') {
+        c->bad = 1;
+        return "";
+    }
+    return (const char *)p;
+}
+
+int bin_read_header(FILE *in) {
+    unsigned char h[8];
+    if (fread(h, 1, sizeof(h), in) != sizeof(h)) return -1;
+    if (memcmp(h, BIN_MAGIC, 4) != 0 || get_le(h + 4, 4) != BIN_VERSION) return -1;
+    return 0;
+}
+
+int bin_read_record(FILE *in, BinRecord *r) {
+    unsigned char lenbuf[4];
+    size_t got = fread(lenbuf, 1, sizeof(lenbuf), in);
+    if (got == 0) return 0;
+    if (got != sizeof(lenbuf)) return -1;
+
+    size_t len = (size_t)get_le(lenbuf, 4);
+    if (len > r->cap) {
+        unsigned char *p = mmc_realloc(r->buf, len);
+        if (!p) return -1;
+        r->buf = p;
+        r->cap = len;
+    }
+    if (fread(r->buf, 1, len, in) != len) return -1;
+
+    BinCursor c = { r->buf, r->buf + len, 0 };
+    r->index = (unsigned)bin_read_u32(&c);
+    r->result = bin_read_f64(&c);
+    const unsigned char *p = take(&c, 2);
+    r->nerrors = p ? (int)get_le(p, 2) : 0;
+    if (r->nerrors > r->errors_cap) {
+        DiagCode *e = mmc_realloc(r->errors, r->nerrors * sizeof(*e));
+        if (!e) return -1;
+        r->errors = e;
+        r->errors_cap = r->nerrors;
+    }
+    for (int i = 0; i < r->nerrors; i++) {
+        p = take(&c, 2);
+        r->errors[i] = p ? (DiagCode)get_le(p, 2) : DIAG_OTHER;
+    }
+
+    memset(r->payload, 0, sizeof(r->payload));
+    while (!c.bad && !bin_at_end(&c)) {
+        unsigned kind = bin_read_u8(&c);
+        size_t n = bin_read_u32(&c);
+        const unsigned char *body = take(&c, n);
+        if (!body) break;
+        if (kind > 0 && kind < BIN_NKINDS) {
+            r->payload[kind].p = body;
+            r->payload[kind].end = body + n;
+        }
+    }
+    return c.bad ? -1 : 1;
+}
+
+void bin_record_free(BinRecord *r) {
+    free(r->buf);
+    free(r->errors);
+    memset(r, 0, sizeof(*r));
+}
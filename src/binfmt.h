@@ -0,0 +1,124 @@
+#ifndef BINFMT_H
+#define BINFMT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "diag.h"
+
+/* Binary output: a stream of length-prefixed records, one per statement,
+   for consumers that want results without parsing text.
+
+   All integers are little-endian, doubles are raw IEEE-754 binary64 in
+   the same byte order, and strings are a u32 length, the bytes and a
+   terminating 0 (not counted in the length).
+
+       header   "MMCB", u32 version
+       record   u32 length of everything after this field
+                u32 statement index
+                f64 result (NaN when there is none)
+                u16 error count, then one u16 DiagCode per semantic error
+                payloads to the end of the record, each
+                    u8 BinPayload kind, u32 length, the payload
+
+   Payloads appear only for the stages that were emitted, in kind order.
+   Their layouts, with "..." meaning repeated to the end of the payload:
+
+       BIN_TOKENS    (str type, str text)...
+       BIN_AST       the tree in preorder: u8 NodeType, then an f64 for
+                     NODE_NUM, a str name for NODE_VAR, or the operands
+       BIN_DEDUP     u32 constructor calls answered by an existing node
+       BIN_RANGE     f64 lo, f64 hi, u8 safe, u32 safe nodes, u32 nodes,
+                     str warning...
+       BIN_MESSAGES  str semantic error..., matching the codes
+       BIN_IR        str instruction...
+       BIN_OPT       str instruction...
+       BIN_ASM       (u8 section, str line)..., ASM_SECTION_* sections
+       BIN_REGALLOC  u32 registers used, spills, call saves, call
+                     reloads, frame bytes
+       BIN_OPT_PASSES u32 rounds, u32 instructions before, u32 after,
+                     (str pass, u32 instructions it changed)...
+       BIN_PEEPHOLE  u32 instructions before, u32 after, (str rule, u32
+                     times it applied)...
+
+   Readers should skip payload kinds they do not know. */
+
+#define BIN_MAGIC   "MMCB"
+#define BIN_VERSION 1
+
+typedef enum {
+    BIN_TOKENS = 1,
+    BIN_AST,
+    BIN_DEDUP,
+    BIN_RANGE,
+    BIN_MESSAGES,
+    BIN_IR,
+    BIN_OPT,
+    BIN_ASM,
+    BIN_REGALLOC,
+    BIN_OPT_PASSES,
+    BIN_PEEPHOLE,
+    BIN_NKINDS
+} BinPayload;
+
+/* ---- writing ---- */
+
+/* Records are assembled in buf, then written to fp (when set) once the
+   buffer holds enough of them and on bin_flush */
+typedef struct {
+    FILE *fp;
+    unsigned char *buf;
+    size_t len, cap;
+    size_t record;          // offset of the open record's length field
+    size_t payload;         // and of the open payload's
+} BinWriter;
+
+void bin_writer_init(BinWriter *w, FILE *fp);
+void bin_writer_free(BinWriter *w);     // flushes first when writing to a FILE
+void bin_flush(BinWriter *w);
+
+void bin_write_header(BinWriter *w);
+void bin_begin_record(BinWriter *w, unsigned index, double result, const DiagList *errors);
+void bin_end_record(BinWriter *w);
+void bin_begin_payload(BinWriter *w, BinPayload kind);
+void bin_end_payload(BinWriter *w);
+
+void bin_u8(BinWriter *w, unsigned v);
+void bin_u32(BinWriter *w, unsigned long v);
+void bin_f64(BinWriter *w, double v);
+void bin_str(BinWriter *w, const char *s);
+
+/* ---- reading ---- */
+
+/* Position inside a payload. Reads past its end return zeros and set
+   `bad`; p is NULL for a payload the record does not have. */
+typedef struct {
+    const unsigned char *p, *end;
+    int bad;
+} BinCursor;
+
+typedef struct {
+    unsigned index;
+    double result;
+    int nerrors;
+    DiagCode *errors;
+    BinCursor payload[BIN_NKINDS];
+    /* storage, reused by the next bin_read_record */
+    unsigned char *buf;
+    size_t cap;
+    int errors_cap;
+} BinRecord;
+
+/* 0 after a header of this version, -1 otherwise */
+int bin_read_header(FILE *in);
+/* 1 with the next record in r, 0 at end of input, -1 on a truncated or
+   malformed record. Zero-initialize r before the first call. */
+int bin_read_record(FILE *in, BinRecord *r);
+void bin_record_free(BinRecord *r);
+
+int bin_at_end(const BinCursor *c);
+unsigned bin_read_u8(BinCursor *c);
+unsigned long bin_read_u32(BinCursor *c);
+double bin_read_f64(BinCursor *c);
+const char* bin_read_str(BinCursor *c);    // points into the record
+
+#endif // BINFMT_H
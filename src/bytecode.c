@@ -0,0 +1,231 @@
+#include "bytecode.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+/* Per-node compile state, indexed by node id and stamped like the other
+   stages' side tables */
+struct NodeUse {
+    unsigned gen;
+    int uses;           // parents referring to the node
+    int slot;           // -1 until a shared node has been emitted
+};
+
+static NodeUse* node_use(Bytecode *bc, ASTNode *n) {
+    if (n->id >= bc->uses_cap) {
+        size_t cap = bc->uses_cap ? bc->uses_cap : 1024;
+        while (cap <= n->id) cap *= 2;
+        NodeUse *p = mmc_realloc(bc->uses, cap * sizeof(*p));
+        if (!p) {
+            fprintf(stderr, "Out of memory growing bytecode table\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = bc->uses_cap; i < cap; i++) p[i].gen = 0;
+        bc->uses = p;
+        bc->uses_cap = cap;
+    }
+    NodeUse *u = &bc->uses[n->id];
+    if (u->gen != bc->gen) {
+        u->gen = bc->gen;
+        u->uses = 0;
+        u->slot = -1;
+    }
+    return u;
+}
+
+static void put(Bytecode *bc, const void *data, size_t n) {
+    if (bc->len + n > bc->cap) {
+        size_t cap = bc->cap ? bc->cap : 256;
+        while (cap < bc->len + n) cap *= 2;
+        unsigned char *p = mmc_realloc(bc->code, cap);
+        if (!p) {
+            fprintf(stderr, "Out of memory growing bytecode\n");
+            exit(EXIT_FAILURE);
+        }
+        bc->code = p;
+        bc->cap = cap;
+    }
+    memcpy(bc->code + bc->len, data, n);
+    bc->len += n;
+}
+
+static void put_op(Bytecode *bc, BcOp op) {
+    unsigned char c = (unsigned char)op;
+    put(bc, &c, 1);
+}
+
+static void push(Bytecode *bc) {
+    if (++bc->depth > bc->max_stack) bc->max_stack = bc->depth;
+}
+
+static void count_uses(Bytecode *bc, ASTNode *n) {
+    if (!n) return;
+    if (node_use(bc, n)->uses++ > 0) return;
+    count_uses(bc, n->left);
+    count_uses(bc, n->right);
+}
+
+static void emit(ASTNode *n, Bytecode *bc) {
+    NodeUse *u = node_use(bc, n);
+    if (u->slot >= 0) {
+        uint32_t slot = (uint32_t)u->slot;
+        put_op(bc, BC_LOAD);
+        put(bc, &slot, sizeof(slot));
+        push(bc);
+        return;
+    }
+
+    switch (n->type) {
+        case NODE_NUM:
+            put_op(bc, BC_CONST);
+            put(bc, &n->value, sizeof(double));
+            push(bc);
+            break;
+        case NODE_VAR: {
+            uint32_t var = n->var;
+            put_op(bc, BC_VAR);
+            put(bc, &var, sizeof(var));
+            push(bc);
+            break;
+        }
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_POW:
+            emit(n->left, bc);
+            emit(n->right, bc);
+            put_op(bc, BC_ADD + (n->type - NODE_ADD));
+            bc->depth--;
+            break;
+        default: {
+            // unary nodes are laid out in the same order in all three enums
+            const FmKernel *k = bc->fast ? bc->fast->k[IR_NEG + (n->type - NODE_NEG)] : NULL;
+            emit(n->left, bc);
+            if (k) {
+                put_op(bc, BC_KERNEL);
+                put(bc, &k, sizeof(k));
+            } else {
+                put_op(bc, BC_NEG + (n->type - NODE_NEG));
+            }
+            break;
+        }
+    }
+
+    // the table may have grown while the children were emitted
+    u = node_use(bc, n);
+    if (u->uses > 1) {
+        uint32_t slot = (uint32_t)bc->nslots++;
+        u->slot = (int)slot;
+        put_op(bc, BC_STORE);
+        put(bc, &slot, sizeof(slot));
+    }
+}
+
+void bc_compile(ASTNode *root, Bytecode *bc, const FmSet *fast) {
+    if (++bc->gen == 0) {
+        for (size_t i = 0; i < bc->uses_cap; i++) bc->uses[i].gen = 0;
+        bc->gen = 1;
+    }
+    bc->len = 0;
+    bc->max_stack = 0;
+    bc->depth = bc->nslots = 0;
+    bc->fast = fast;
+    count_uses(bc, root);
+    emit(root, bc);
+    put_op(bc, BC_RET);
+}
+
+void bc_free(Bytecode *bc) {
+    free(bc->code);
+    free(bc->uses);
+    memset(bc, 0, sizeof(*bc));
+}
+
+/* ---- interpreter ---- */
+
+/* Threaded dispatch: with GNU C every handler jumps straight to the next
+   one through a label table, otherwise a switch in a loop does the same */
+#if defined(__GNUC__)
+#define VM_START()  goto *labels[*pc++];
+#define VM_CASE(op) L_##op:
+#define VM_NEXT()   goto *labels[*pc++]
+#else
+#define VM_START()  for (;;) switch ((BcOp)*pc++) {
+#define VM_CASE(op) case op:
+#define VM_NEXT()   break
+#endif
+
+#define SMALL_FRAME 64
+
+double bc_run(const Bytecode *bc, const double *vars) {
+    double small[SMALL_FRAME];
+    size_t need = (size_t)bc->max_stack + (size_t)bc->nslots;
+    double *frame = need <= SMALL_FRAME ? small : mmc_malloc(need * sizeof(double));
+    if (!frame) {
+        fprintf(stderr, "Out of memory in bytecode frame\n");
+        exit(EXIT_FAILURE);
+    }
+    double *slots = frame;
+    double *sp = frame + bc->nslots;    // one past the top value
+    const unsigned char *pc = bc->code;
+    uint32_t slot;
+    const FmKernel *k;
+    double result;
+
+#if defined(__GNUC__)
+    static void *labels[] = {
+        &&L_BC_CONST, &&L_BC_VAR, &&L_BC_LOAD, &&L_BC_STORE,
+        &&L_BC_ADD, &&L_BC_SUB, &&L_BC_MUL, &&L_BC_DIV, &&L_BC_POW,
+        &&L_BC_NEG, &&L_BC_SIN, &&L_BC_COS, &&L_BC_TAN, &&L_BC_LOG,
+        &&L_BC_EXP, &&L_BC_SQRT, &&L_BC_KERNEL, &&L_BC_RET
+    };
+#endif
+    VM_START()
+    VM_CASE(BC_CONST)
+        memcpy(sp++, pc, sizeof(double));
+        pc += sizeof(double);
+        VM_NEXT();
+    VM_CASE(BC_VAR)
+        memcpy(&slot, pc, sizeof(slot));
+        pc += sizeof(slot);
+        *sp++ = vars[slot];
+        VM_NEXT();
+    VM_CASE(BC_LOAD)
+        memcpy(&slot, pc, sizeof(slot));
+        pc += sizeof(slot);
+        *sp++ = slots[slot];
+        VM_NEXT();
+    VM_CASE(BC_STORE)
+        memcpy(&slot, pc, sizeof(slot));
+        pc += sizeof(slot);
+        slots[slot] = sp[-1];
+        VM_NEXT();
+    VM_CASE(BC_ADD)  sp--; sp[-1] = sp[-1] + sp[0]; VM_NEXT();
+    VM_CASE(BC_SUB)  sp--; sp[-1] = sp[-1] - sp[0]; VM_NEXT();
+    VM_CASE(BC_MUL)  sp--; sp[-1] = sp[-1] * sp[0]; VM_NEXT();
+    VM_CASE(BC_DIV)  sp--; sp[-1] = sp[-1] / sp[0]; VM_NEXT();
+    VM_CASE(BC_POW)  sp--; sp[-1] = pow(sp[-1], sp[0]); VM_NEXT();
+    VM_CASE(BC_NEG)  sp[-1] = -sp[-1]; VM_NEXT();
+    VM_CASE(BC_SIN)  sp[-1] = sin(sp[-1]); VM_NEXT();
+    VM_CASE(BC_COS)  sp[-1] = cos(sp[-1]); VM_NEXT();
+    VM_CASE(BC_TAN)  sp[-1] = tan(sp[-1]); VM_NEXT();
+    VM_CASE(BC_LOG)  sp[-1] = log(sp[-1]); VM_NEXT();
+    VM_CASE(BC_EXP)  sp[-1] = exp(sp[-1]); VM_NEXT();
+    VM_CASE(BC_SQRT) sp[-1] = sqrt(sp[-1]); VM_NEXT();
+    VM_CASE(BC_KERNEL)
+        memcpy(&k, pc, sizeof(k));
+        pc += sizeof(k);
+        sp[-1] = fm_eval(k, sp[-1]);
+        VM_NEXT();
+    VM_CASE(BC_RET)
+        result = sp[-1];
+        if (frame != small) free(frame);
+        return result;
+#if !defined(__GNUC__)
+    }
+#endif
+}
@@ -0,0 +1,50 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stddef.h>
+#include "ast.h"
+#include "fastmath.h"
+
+/* Flat stack-machine bytecode for one expression.
+
+   Each instruction is a one-byte opcode. BC_CONST is followed by its
+   double inline, BC_VAR by a 4-byte variable index, BC_LOAD/BC_STORE
+   by a 4-byte slot number and BC_KERNEL by an FmKernel pointer. Nodes
+   the DAG shares are computed once, stored to a slot and reloaded at
+   their other uses, so the program does the same arithmetic as eval()
+   in the same order and gives bit-identical results. Under fast math
+   the selected functions are BC_KERNEL instead, with the JIT's bits. */
+typedef enum {
+    BC_CONST,           // push inline double
+    BC_VAR,             // push vars[index]
+    BC_LOAD,            // push slot
+    BC_STORE,           // copy top of stack to slot, leaving it in place
+    BC_ADD, BC_SUB, BC_MUL, BC_DIV, BC_POW,
+    BC_NEG, BC_SIN, BC_COS, BC_TAN, BC_LOG, BC_EXP, BC_SQRT,
+    BC_KERNEL,          // fast-math kernel on top of stack
+    BC_RET              // return top of stack
+} BcOp;
+
+typedef struct NodeUse NodeUse;
+
+typedef struct {
+    unsigned char *code;
+    size_t len, cap;
+    int max_stack;      // deepest the operand stack gets
+    int nslots;         // shared-value slots
+    /* compile scratch, kept so recompiling into the same Bytecode does
+       not reallocate it */
+    NodeUse *uses;      // per node id, stamped with `gen`
+    size_t uses_cap;
+    unsigned gen;
+    int depth;
+    const FmSet *fast;
+} Bytecode;
+
+/* Replace bc's contents with the program for root, with fast the
+   fast-math selection or NULL. Zero-initialize bc before first use. */
+void bc_compile(ASTNode *root, Bytecode *bc, const FmSet *fast);
+double bc_run(const Bytecode *bc, const double *vars);
+void bc_free(Bytecode *bc);
+
+#endif // BYTECODE_H
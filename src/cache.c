@@ -0,0 +1,287 @@
+#include "cache.h"
+#include "alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t cache_hash(const void *key, size_t len) {
+    // FNV-1a; entries keep the whole key, so collisions only cost a probe
+    const unsigned char *p = key;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+#ifdef _WIN32
+
+MmcCache* cache_open(const char *path, size_t size) {
+    (void)size;
+    fprintf(stderr, "%s: the compilation cache needs mmap, not available on this platform\n", path);
+    return NULL;
+}
+
+void cache_close(MmcCache *k) { (void)k; }
+void cache_lock(MmcCache *k, int exclusive) { (void)k; (void)exclusive; }
+void cache_unlock(MmcCache *k) { (void)k; }
+
+const unsigned char* cache_find(MmcCache *k, uint64_t hash, const void *key, size_t klen,
+                                size_t *vlen) {
+    (void)k; (void)hash; (void)key; (void)klen; (void)vlen;
+    return NULL;
+}
+
+void cache_store(MmcCache *k, uint64_t hash, const void *key, size_t klen,
+                 const void *val, size_t vlen) {
+    (void)k; (void)hash; (void)key; (void)klen; (void)val; (void)vlen;
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "ir.h"
+#include "codegen.h"
+
+/* Set by the build to a checksum of the sources; without it every
+   compile of this file counts as a new build */
+#ifndef MMC_BUILD_ID
+#define MMC_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+#define CACHE_MAGIC  "MMCC"
+#define CACHE_FORMAT 1
+#define CACHE_MIN_SIZE (64 * 1024)
+#define CACHE_PROBES 8              // slots tried per key
+
+/* File layout: header, slot table, log. Fields are native-endian; a
+   file only ever serves the build that created it. */
+typedef struct {
+    char magic[4];
+    uint32_t format;
+    uint64_t build;
+    uint64_t size;
+    uint64_t nslots;                // a power of two
+    uint64_t log_off, log_cap;
+    uint64_t write_pos;             // bytes ever appended to the log
+} CacheHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t pos;                   // write_pos the entry was appended at
+    uint32_t len;                   // 0: empty slot
+    uint32_t pad;
+} CacheSlot;
+
+/* A log entry: this header, the key, the value, padding to 8 bytes.
+   Entries never wrap around the end of the log. */
+typedef struct {
+    uint64_t hash;
+    uint32_t klen, vlen;
+} CacheEntry;
+
+/* The layout is taken from the header once, at open: another build may
+   reformat the file later, and the shared header would then describe a
+   table this mapping does not hold */
+struct MmcCache {
+    int fd;
+    unsigned char *map;
+    size_t size;
+    uint64_t build;
+    CacheHeader *hdr;
+    CacheSlot *slots;
+    uint64_t nslots;
+    unsigned char *log;
+    uint64_t log_cap;
+};
+
+static uint64_t build_stamp(void) {
+    // The stored stage results hold these structures field by field
+    char id[256];
+    snprintf(id, sizeof(id), "%s/%zu/%zu/%zu", MMC_BUILD_ID,
+             sizeof(IRInstr), sizeof(AsmInstr), sizeof(double));
+    return cache_hash(id, strlen(id));
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+/* The header describes a file of `size` bytes written by `build` whose
+   slot table and log lie inside it */
+static int valid_header(const CacheHeader *h, uint64_t build, uint64_t size) {
+    if (memcmp(h->magic, CACHE_MAGIC, 4) != 0 || h->format != CACHE_FORMAT ||
+        h->build != build || h->size != size) return 0;
+    if (h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0 ||
+        h->nslots > (size - sizeof(CacheHeader)) / sizeof(CacheSlot)) return 0;
+    return h->log_off == align8(sizeof(CacheHeader) + h->nslots * sizeof(CacheSlot)) &&
+           h->log_off < size && h->log_cap == ((size - h->log_off) & ~(uint64_t)7) && h->log_cap > 0;
+}
+
+static void format_file(MmcCache *k, uint64_t build) {
+    uint64_t nslots = 64;
+    while (nslots * 1024 < k->size) nslots *= 2;
+
+    memset(k->map, 0, sizeof(CacheHeader) + nslots * sizeof(CacheSlot));
+    CacheHeader *h = k->hdr;
+    memcpy(h->magic, CACHE_MAGIC, 4);
+    h->format = CACHE_FORMAT;
+    h->build = build;
+    h->size = k->size;
+    h->nslots = nslots;
+    h->log_off = align8(sizeof(CacheHeader) + nslots * sizeof(CacheSlot));
+    h->log_cap = (k->size - h->log_off) & ~(uint64_t)7;
+    h->write_pos = 0;
+}
+
+/* A mapping of the file's first `size` bytes, or NULL */
+static unsigned char* map_file(int fd, size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+MmcCache* cache_open(const char *path, size_t size) {
+    if (size < CACHE_MIN_SIZE) size = CACHE_MIN_SIZE;
+    size = (size + 4095) & ~(size_t)4095;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    flock(fd, LOCK_EX);
+
+    // A valid file keeps the size it was created with: truncating it
+    // would pull the mapping out from under other processes using it
+    uint64_t build = build_stamp();
+    unsigned char *map = NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= CACHE_MIN_SIZE &&
+        (map = map_file(fd, (size_t)st.st_size)) != NULL) {
+        if (valid_header((const CacheHeader *)map, build, (uint64_t)st.st_size)) {
+            size = (size_t)st.st_size;
+        } else {
+            munmap(map, (size_t)st.st_size);
+            map = NULL;
+        }
+    }
+    int fresh = !map;
+    if (fresh) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0 || !(map = map_file(fd, size))) {
+            perror(path);
+            flock(fd, LOCK_UN);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    MmcCache *k = mmc_malloc(sizeof(*k));
+    if (!k) {
+        fprintf(stderr, "Out of memory opening cache\n");
+        exit(EXIT_FAILURE);
+    }
+    k->fd = fd;
+    k->map = map;
+    k->size = size;
+    k->build = build;
+    k->hdr = (CacheHeader *)map;
+    if (fresh) format_file(k, build);
+    k->slots = (CacheSlot *)(k->map + sizeof(CacheHeader));
+    k->nslots = k->hdr->nslots;
+    k->log = k->map + k->hdr->log_off;
+    k->log_cap = k->hdr->log_cap;
+
+    flock(fd, LOCK_UN);
+    return k;
+}
+
+void cache_close(MmcCache *k) {
+    if (!k) return;
+    munmap(k->map, k->size);
+    close(k->fd);
+    free(k);
+}
+
+void cache_lock(MmcCache *k, int exclusive) {
+    flock(k->fd, exclusive ? LOCK_EX : LOCK_SH);
+}
+
+void cache_unlock(MmcCache *k) {
+    flock(k->fd, LOCK_UN);
+}
+
+/* The file still has the layout it had at open. Called under the lock,
+   which a reformatting process holds until it is done; the header page
+   is mapped whatever the file's size. */
+static int unchanged(const MmcCache *k) {
+    return k->hdr->build == k->build && k->hdr->size == k->size;
+}
+
+/* The log has not wrapped onto the slot's entry since it was written */
+static int slot_live(const MmcCache *k, const CacheSlot *s) {
+    return s->len && k->hdr->write_pos - s->pos <= k->log_cap;
+}
+
+const unsigned char* cache_find(MmcCache *k, uint64_t hash, const void *key, size_t klen,
+                                size_t *vlen) {
+    if (!unchanged(k)) return NULL;
+    for (int p = 0; p < CACHE_PROBES; p++) {
+        const CacheSlot *s = &k->slots[(hash + p) & (k->nslots - 1)];
+        if (s->hash != hash || !slot_live(k, s) || s->pos % k->log_cap + s->len > k->log_cap) continue;
+
+        const unsigned char *at = k->log + s->pos % k->log_cap;
+        const CacheEntry *e = (const CacheEntry *)at;
+        if (e->hash != hash || e->klen != klen ||
+            align8(sizeof(*e) + e->klen + e->vlen) != s->len) continue;
+        if (memcmp(at + sizeof(*e), key, klen) != 0) continue;
+        *vlen = e->vlen;
+        return at + sizeof(*e) + klen;
+    }
+    return NULL;
+}
+
+void cache_store(MmcCache *k, uint64_t hash, const void *key, size_t klen,
+                 const void *val, size_t vlen) {
+    CacheHeader *h = k->hdr;
+    size_t len = align8(sizeof(CacheEntry) + klen + vlen);
+    if (len > k->log_cap / 4 || !unchanged(k)) return;
+
+    // Append, skipping the tail of the log if the entry does not fit there
+    uint64_t off = h->write_pos % k->log_cap;
+    if (off + len > k->log_cap) {
+        h->write_pos += k->log_cap - off;
+        off = 0;
+    }
+    unsigned char *at = k->log + off;
+    CacheEntry e = { hash, (uint32_t)klen, (uint32_t)vlen };
+    memcpy(at, &e, sizeof(e));
+    memcpy(at + sizeof(e), key, klen);
+    memcpy(at + sizeof(e) + klen, val, vlen);
+    uint64_t pos = h->write_pos;
+    h->write_pos += len;
+
+    // Reuse the key's own slot, else a dead one, else the oldest
+    CacheSlot *victim = NULL;
+    for (int p = 0; p < CACHE_PROBES; p++) {
+        CacheSlot *s = &k->slots[(hash + p) & (k->nslots - 1)];
+        if (s->hash == hash && s->len) {
+            victim = s;
+            break;
+        }
+        if (!slot_live(k, s)) {
+            if (!victim || slot_live(k, victim)) victim = s;
+        } else if (!victim || (slot_live(k, victim) && s->pos < victim->pos)) {
+            victim = s;
+        }
+    }
+    victim->hash = hash;
+    victim->pos = pos;
+    victim->len = (uint32_t)len;
+}
+
+#endif // _WIN32
@@ -0,0 +1,44 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistent key/value store in one memory-mapped file, for compiled
+   statements that recur across runs.
+
+   The file has a fixed size, chosen when it is created; opening an
+   existing file keeps its size. Values go into a ring log behind a
+   hashed slot table. When the log wraps, the oldest entries are
+   overwritten, so the file never grows and eviction is first-in
+   first-out. A file written by a different build of the compiler is
+   wiped on open, since the stored values are only meaningful to the
+   build that wrote them. If that happens while a cache is open, its
+   lookups miss and its stores are dropped from then on.
+
+   Processes may share a file: lookups hold a shared flock and stores an
+   exclusive one. Within a process a cache must be used from one thread
+   at a time. */
+typedef struct MmcCache MmcCache;
+
+/* NULL with a message on stderr if the file cannot be opened or mapped */
+MmcCache* cache_open(const char *path, size_t size);
+void cache_close(MmcCache *k);
+
+/* Bracket lookups (shared) or stores (exclusive); a no-op where file
+   locks are unavailable */
+void cache_lock(MmcCache *k, int exclusive);
+void cache_unlock(MmcCache *k);
+
+uint64_t cache_hash(const void *key, size_t len);
+
+/* The value stored under key, pointing into the mapping and valid until
+   cache_unlock; NULL when there is none */
+const unsigned char* cache_find(MmcCache *k, uint64_t hash, const void *key, size_t klen,
+                                size_t *vlen);
+/* Replaces any value under key. Values too large for the log are
+   dropped. */
+void cache_store(MmcCache *k, uint64_t hash, const void *key, size_t klen,
+                 const void *val, size_t vlen);
+
+#endif // CACHE_H
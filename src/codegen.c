@@ -1,236 +1,709 @@
 #include "codegen.h"
+#include "alloc.h"
 #include "ir.h"
-#include "opt.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
 
-static cJSON *code_arr = NULL;
-static cJSON *data_section = NULL;
-static int const_count = 0;
+/* xmm0 and xmm1 carry libm arguments and results and stage operands that
+   live on the stack; values are allocated to xmm2..xmm15. Every xmm
+   register is caller-saved in the SysV ABI, so anything live across a
+   call is stored before it and reloaded after.
 
-typedef struct {
-    char *temp;
-    const char *reg;
-} RegAlloc;
-
-static RegAlloc reg_map[16];
-static int reg_count = 0;
-
-// Tracks which math functions are actually used
-static int used_sin = 0;
-static int used_cos = 0;
-static int used_tan = 0;
-static int used_exp = 0;
-static int used_log = 0;
-static int used_sqrt = 0;
-static int used_pow = 0;
-
-// Tracks last result register
-static const char *result_reg = NULL;
-
-static const char* allocate_xmm_register(const char *temp) {
-    for (int i = 0; i < reg_count; i++) {
-        if (strcmp(reg_map[i].temp, temp) == 0) {
-            return reg_map[i].reg;
+   Inline fast-math kernels work in xmm0, xmm1 and xmm11..xmm15, so
+   programs that have them allocate xmm2..xmm10 only. */
+#define FIRST_ALLOC_REG 2
+#define KERNEL_REG 11
+#define T0 0
+#define T1 1
+#define T2 11
+#define T3 12
+#define T4 13
+#define T5 14
+#define T6 15
+
+/* The variables pointer arrives in rdi. rdi does not survive calls, so
+   functions that call libm keep it in the callee-saved rbx instead. */
+#define GPR_RBX 3
+#define GPR_RDI 7
+
+/* per virtual register allocator state */
+struct VRegState {
+    int start, end;     // defining instruction, last use (IR indices)
+    int reg;            // xmm register, -1 while on the stack
+    int slot;           // stack offset, -1 until it needs one
+    int saved;          // slot holds the current value
+};
+
+static const char *func_names[] = {
+    [IR_SIN] = "sin", [IR_COS] = "cos", [IR_TAN] = "tan", [IR_EXP] = "exp",
+    [IR_LOG] = "log", [IR_SQRT] = "sqrt", [IR_POW] = "pow"
+};
+
+static Loc xmm(int n) { Loc l = { LOC_XMM, n, 0 }; return l; }
+static Loc stack_slot(int off) { Loc l = { LOC_STACK, off, 0 }; return l; }
+static Loc imm(int n) { Loc l = { LOC_IMM, n, 0 }; return l; }
+static Loc no_loc(void) { Loc l = { LOC_NONE, 0, 0 }; return l; }
+static Loc gpr(int n) { Loc l = { LOC_GPR, n, 0 }; return l; }
+static Loc var_slot(int base, int var) { Loc l = { LOC_VAR, 8 * var, base }; return l; }
+
+static void emit3(CodegenCtx *c, AsmOp op, Loc dst, Loc src, Loc src2) {
+    if (c->prog.count == c->prog.cap) {
+        c->prog.cap = c->prog.cap ? c->prog.cap * 2 : 64;
+        c->prog.code = mmc_realloc(c->prog.code, c->prog.cap * sizeof(*c->prog.code));
+        if (!c->prog.code) {
+            fprintf(stderr, "Out of memory growing assembly\n");
+            exit(EXIT_FAILURE);
         }
     }
+    AsmInstr i = { op, dst, src, src2 };
+    c->prog.code[c->prog.count++] = i;
+}
 
-    if (reg_count >= 16) {
-        fprintf(stderr, "Register spill detected for temp %s\n", temp);
-        exit(EXIT_FAILURE);
+static void emit(CodegenCtx *c, AsmOp op, Loc dst, Loc src) {
+    emit3(c, op, dst, src, no_loc());
+}
+
+static Loc add_data_label(CodegenCtx *c, double value) {
+    if (c->prog.nconsts == c->prog.consts_cap) {
+        c->prog.consts_cap = c->prog.consts_cap ? c->prog.consts_cap * 2 : 32;
+        c->prog.consts = mmc_realloc(c->prog.consts, c->prog.consts_cap * sizeof(*c->prog.consts));
+        if (!c->prog.consts) {
+            fprintf(stderr, "Out of memory growing constant pool\n");
+            exit(EXIT_FAILURE);
+        }
     }
-    
-    const char *regs[] = {"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", 
-                         "xmm5", "xmm6", "xmm7", "xmm8", "xmm9",
-                         "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"};
-    
-    reg_map[reg_count].temp = strdup(temp);
-    reg_map[reg_count].reg = regs[reg_count];
-    return regs[reg_count++];
-}
-
-static void add_data_label(double value) {
-    char label[32];
-    sprintf(label, "const_%d", const_count++);
-    
-    cJSON *obj = cJSON_CreateObject();
-    cJSON_AddStringToObject(obj, "label", label);
-    cJSON_AddNumberToObject(obj, "value", value);
-    cJSON_AddItemToArray(data_section, obj);
-}
-
-void init_codegen() {
-    // Free reg_map temp strings
-    for (int i = 0; i < reg_count; i++) {
-        free(reg_map[i].temp);
-        reg_map[i].temp = NULL;
-    }
-    if (code_arr) cJSON_Delete(code_arr);
-    if (data_section) cJSON_Delete(data_section);
-    
-    code_arr = cJSON_CreateArray();
-    data_section = cJSON_CreateArray();
-    const_count = 0;
-    reg_count = 0;
-    result_reg = NULL;
-    
-    // Reset math function usage
-    used_sin = used_cos = used_tan = used_exp = used_log = used_sqrt = used_pow = 0;
-
-    cJSON *text_section = cJSON_CreateArray();
-    cJSON_AddItemToArray(text_section, cJSON_CreateString("section .text"));
-    cJSON_AddItemToArray(text_section, cJSON_CreateString("global main"));
-    cJSON_AddItemToArray(code_arr, text_section);
-
-    cJSON *rodata = cJSON_CreateArray();
-    cJSON_AddItemToArray(rodata, cJSON_CreateString("section .rodata"));
-    cJSON_AddItemToArray(code_arr, rodata);
-}
-
-cJSON* get_code_json() {
-    return code_arr;
-}
-
-void generate_assembly() {
-    cJSON *ir = get_opt_json();
-    cJSON *text_section = cJSON_GetArrayItem(code_arr, 0); // Text section
-    cJSON *rodata = cJSON_GetArrayItem(code_arr, 1);       // Rodata section
-
-    // Add main label
-    cJSON_AddItemToArray(text_section, cJSON_CreateString("main:"));
-    
-    char asm_line[256];
-    cJSON *instr;
-    cJSON_ArrayForEach(instr, ir) {
-        const char *code = cJSON_GetStringValue(instr);
-        char temp[16], a[16], op[10], b[16], func[10];
-        double value;
-
-        if (sscanf(code, "%15s = %15s %9s %15s", temp, a, op, b) == 4) {
-            const char *reg_a = allocate_xmm_register(a);
-            const char *reg_b = allocate_xmm_register(b);
-            const char *reg_out = allocate_xmm_register(temp);
-            result_reg = reg_out;
-
-            // Direct computation without redundant moves
-            if (strcmp(op, "+") == 0) {
-                sprintf(asm_line, "addsd %s, %s", reg_a, reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-                sprintf(asm_line, "movsd %s, %s", reg_out, reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            } 
-            else if (strcmp(op, "-") == 0) {
-                // Correct order: a - b
-                sprintf(asm_line, "subsd %s, %s", reg_a, reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-                sprintf(asm_line, "movsd %s, %s", reg_out, reg_a);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            } 
-            else if (strcmp(op, "*") == 0) {
-                sprintf(asm_line, "mulsd %s, %s", reg_a, reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-                sprintf(asm_line, "movsd %s, %s", reg_out, reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            } 
-            else if (strcmp(op, "/") == 0) {
-                // Correct order: a / b
-                sprintf(asm_line, "divsd %s, %s", reg_a, reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-                sprintf(asm_line, "movsd %s, %s", reg_out, reg_a);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            } 
-            else if (strcmp(op, "^") == 0) {
-                used_pow = 1;
-                sprintf(asm_line, "movsd xmm0, %s", reg_a);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-                sprintf(asm_line, "movsd xmm1, %s", reg_b);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-                cJSON_AddItemToArray(text_section, cJSON_CreateString("call pow"));
-                sprintf(asm_line, "movsd %s, xmm0", reg_out);
-                cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            }
+    c->prog.consts[c->prog.nconsts] = value;
+    Loc l = { LOC_CONST, c->prog.nconsts++, 0 };
+    return l;
+}
+
+/* A pool entry holding an integer bit pattern */
+static Loc add_data_bits(CodegenCtx *c, uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return add_data_label(c, value);
+}
+
+void init_codegen(CodegenCtx *c) {
+    c->prog.count = 0;
+    c->prog.nconsts = 0;
+    c->prog.funcs = 0;
+    c->prog.frame_size = 0;
+    c->prog.regs_used = c->prog.spills = c->prog.saves = c->prog.reloads = 0;
+    memset(&c->prog.peephole, 0, sizeof(c->prog.peephole));
+}
+
+const AsmProgram* get_asm(const CodegenCtx *c) {
+    return &c->prog;
+}
+
+static int is_libm_call(IROp op) {
+    return op == IR_POW || op == IR_SIN || op == IR_COS || op == IR_TAN ||
+           op == IR_LOG || op == IR_EXP || op == IR_SQRT;
+}
+
+/* The fast-math kernel replacing op's libm call, if any */
+static const FmKernel* kernel_of(const CodegenCtx *c, IROp op) {
+    return c->fast ? c->fast->k[op] : NULL;
+}
+
+/* ---- linear-scan allocation ---- */
+
+static int slot_of(CodegenCtx *c, int v) {
+    if (c->vregs[v].slot < 0) c->vregs[v].slot = 8 * c->slot_count++;
+    return c->vregs[v].slot;
+}
+
+static Loc loc_of(CodegenCtx *c, int v) {
+    return c->vregs[v].reg >= 0 ? xmm(c->vregs[v].reg) : stack_slot(c->vregs[v].slot);
+}
+
+static void release(CodegenCtx *c, int idx) {
+    int v = c->active[idx];
+    c->reg_owner[c->vregs[v].reg] = -1;
+    c->active[idx] = c->active[--c->active_count];
+}
+
+/* Free the registers of values whose last use is before instruction i */
+static void expire(CodegenCtx *c, int i) {
+    for (int k = c->active_count - 1; k >= 0; k--) {
+        if (c->vregs[c->active[k]].end < i) release(c, k);
+    }
+}
+
+/* Give vreg v a register, evicting the active value that is needed
+   furthest in the future if none is free */
+static void allocate(CodegenCtx *c, int v) {
+    for (int r = FIRST_ALLOC_REG; r < c->alloc_end; r++) {
+        if (c->reg_owner[r] < 0) {
+            c->reg_owner[r] = v;
+            c->reg_touched[r] = 1;
+            c->vregs[v].reg = r;
+            c->active[c->active_count++] = v;
+            return;
         }
-        else if (sscanf(code, "%15s = %lf", temp, &value) == 2) {
-            const char *reg = allocate_xmm_register(temp);
-            result_reg = reg;
-            add_data_label(value);
-            sprintf(asm_line, "movsd %s, [const_%d]", reg, const_count-1);
-            cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
+    }
+
+    int victim = 0;
+    for (int k = 1; k < c->active_count; k++) {
+        if (c->vregs[c->active[k]].end > c->vregs[c->active[victim]].end) victim = k;
+    }
+
+    c->prog.spills++;
+    int w = c->active[victim];
+    if (c->vregs[w].end <= c->vregs[v].end) {
+        // v itself is the value needed last: it lives on the stack
+        c->vregs[v].reg = -1;
+        slot_of(c, v);
+        return;
+    }
+
+    // Split w: it stays in memory from here on
+    int r = c->vregs[w].reg;
+    if (!c->vregs[w].saved) {
+        emit(c, ASM_MOVSD, stack_slot(slot_of(c, w)), xmm(r));
+        c->vregs[w].saved = 1;
+    }
+    c->vregs[w].reg = -1;
+    c->active[victim] = v;
+    c->reg_owner[r] = v;
+    c->vregs[v].reg = r;
+}
+
+/* Store every register value still needed after instruction i */
+static int save_live(CodegenCtx *c, int i, int dst, int *saved) {
+    int n = 0;
+    for (int k = 0; k < c->active_count; k++) {
+        int v = c->active[k];
+        if (v == dst || c->vregs[v].end <= i) continue;
+        if (!c->vregs[v].saved) {
+            emit(c, ASM_MOVSD, stack_slot(slot_of(c, v)), xmm(c->vregs[v].reg));
+            c->vregs[v].saved = 1;
+            c->prog.saves++;
         }
-        else if (sscanf(code, "%15s = %9s %15s", temp, func, a) == 3) {
-            const char *reg_a = allocate_xmm_register(a);
-            const char *reg_out = allocate_xmm_register(temp);
-            result_reg = reg_out;
-
-            // Track used math functions
-            if (strcmp(func, "sin") == 0) used_sin = 1;
-            else if (strcmp(func, "cos") == 0) used_cos = 1;
-            else if (strcmp(func, "tan") == 0) used_tan = 1;
-            else if (strcmp(func, "exp") == 0) used_exp = 1;
-            else if (strcmp(func, "log") == 0) used_log = 1;
-            else if (strcmp(func, "sqrt") == 0) used_sqrt = 1;
-
-            // Optimized math function call
-            sprintf(asm_line, "movsd xmm0, %s", reg_a);
-            cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            sprintf(asm_line, "call %s", func);
-            cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
-            sprintf(asm_line, "movsd %s, xmm0", reg_out);
-            cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
+        saved[n++] = v;
+    }
+    return n;
+}
+
+static void restore_live(CodegenCtx *c, const int *saved, int n) {
+    for (int k = 0; k < n; k++) {
+        int v = saved[k];
+        emit(c, ASM_MOVSD, xmm(c->vregs[v].reg), stack_slot(c->vregs[v].slot));
+        c->prog.reloads++;
+    }
+}
+
+/* Write the value staged in xmm0 to dst's home */
+static void store_result(CodegenCtx *c, int dst) {
+    if (c->vregs[dst].reg >= 0) {
+        emit(c, ASM_MOVSD, xmm(c->vregs[dst].reg), xmm(0));
+    } else {
+        emit(c, ASM_MOVSD, stack_slot(c->vregs[dst].slot), xmm(0));
+        c->vregs[dst].saved = 1;
+    }
+}
+
+static void lower_call(CodegenCtx *c, const IRInstr *code, int i) {
+    int saved[NUM_XMM];
+    c->prog.funcs |= 1u << code->op;
+
+    int n = save_live(c, i, code->dst, saved);
+    if (code->op == IR_POW) {
+        // a goes to xmm0 last: loading b first cannot clobber it
+        emit(c, ASM_MOVSD, xmm(1), loc_of(c, code->b));
+    }
+    emit(c, ASM_MOVSD, xmm(0), loc_of(c, code->a));
+    Loc fn = { LOC_FUNC, code->op, 0 };
+    emit(c, ASM_CALL, fn, no_loc());
+    restore_live(c, saved, n);
+    store_result(c, code->dst);
+}
+
+/* ---- fast-math kernels: the operations of fastmath.c, in its order ---- */
+
+/* fastmath.c's horner2 with u^2 already in u2 and the two chains in a
+   and b; returns whichever of them holds the value */
+static int emit_horner2(CodegenCtx *c, const double *p, int n, int u, int u2, int a, int b) {
+    emit(c, ASM_MOVSD, xmm(a), add_data_label(c, p[0]));
+    emit(c, ASM_MOVSD, xmm(b), add_data_label(c, p[1]));
+    for (int i = 2; i < n; i += 2) {
+        emit(c, ASM_MULSD, xmm(a), xmm(u2));
+        emit(c, ASM_ADDSD, xmm(a), add_data_label(c, p[i]));
+        if (i + 1 < n) {
+            emit(c, ASM_MULSD, xmm(b), xmm(u2));
+            emit(c, ASM_ADDSD, xmm(b), add_data_label(c, p[i + 1]));
         }
     }
+    if (n % 2) {
+        emit(c, ASM_MULSD, xmm(b), xmm(u));
+        emit(c, ASM_ADDSD, xmm(b), xmm(a));
+        return b;
+    }
+    emit(c, ASM_MULSD, xmm(a), xmm(u));
+    emit(c, ASM_ADDSD, xmm(a), xmm(b));
+    return a;
+}
 
-    // Move final result to xmm0 for return
-    if (result_reg) {
-        if (strcmp(result_reg, "xmm0") != 0) {
-            sprintf(asm_line, "movsd xmm0, %s", result_reg);
-            cJSON_AddItemToArray(text_section, cJSON_CreateString(asm_line));
+/* u2 = u * u */
+static void emit_square(CodegenCtx *c, int u2, int u) {
+    emit(c, ASM_MOVSD, xmm(u2), xmm(u));
+    emit(c, ASM_MULSD, xmm(u2), xmm(u));
+}
+
+/* The packed operations need their memory operands 16-byte aligned, and
+   the pool is not, so their constants are staged in a register */
+static void emit_bits_op(CodegenCtx *c, AsmOp op, int dst, int tmp, uint64_t bits) {
+    emit(c, ASM_MOVSD, xmm(tmp), add_data_bits(c, bits));
+    emit(c, op, xmm(dst), xmm(tmp));
+}
+
+/* x in T0; returns the register holding e^x */
+static int emit_exp(CodegenCtx *c, const FmKernel *k) {
+    emit(c, ASM_MAXSD, xmm(T0), add_data_label(c, FM_EXP_MIN));
+    emit(c, ASM_MINSD, xmm(T0), add_data_label(c, FM_EXP_MAX));
+    emit(c, ASM_MOVSD, xmm(T1), xmm(T0));                   // kd
+    emit(c, ASM_MULSD, xmm(T1), add_data_label(c, FM_INV_LN2));
+    emit(c, ASM_ADDSD, xmm(T1), add_data_label(c, FM_SHIFTER + 1023));
+    emit(c, ASM_MOVSD, xmm(T2), xmm(T1));                   // n
+    emit(c, ASM_SUBSD, xmm(T2), add_data_label(c, FM_SHIFTER + 1023));
+    emit(c, ASM_MOVSD, xmm(T3), xmm(T2));                   // r
+    emit(c, ASM_MULSD, xmm(T3), add_data_label(c, FM_LN2_HI));
+    emit(c, ASM_SUBSD, xmm(T0), xmm(T3));
+    emit(c, ASM_MULSD, xmm(T2), add_data_label(c, FM_LN2_LO));
+    emit(c, ASM_SUBSD, xmm(T0), xmm(T2));
+    emit_square(c, T2, T0);
+    int y = emit_horner2(c, k->p1, k->n1, T0, T2, T3, T4);
+    emit(c, ASM_PSLLQ, xmm(T1), imm(52));                   // 2^k
+    emit(c, ASM_MULSD, xmm(y), xmm(T1));
+    return y;
+}
+
+static int emit_log(CodegenCtx *c, const FmKernel *k) {
+    emit_bits_op(c, ASM_PSUBQ, T0, T2, FM_LOG_MC);          // t
+    emit(c, ASM_MOVSD, xmm(T1), xmm(T0));                   // e
+    emit(c, ASM_PSRLQ, xmm(T1), imm(52));
+    emit(c, ASM_MOVSD, xmm(T2), add_data_label(c, FM_SHIFTER));
+    emit(c, ASM_ORPD, xmm(T1), xmm(T2));
+    emit(c, ASM_SUBSD, xmm(T1), add_data_label(c, FM_SHIFTER + 1022));
+    emit_bits_op(c, ASM_ANDPD, T0, T2, FM_MANT);            // f
+    emit_bits_op(c, ASM_PADDQ, T0, T2, FM_LOG_M0);
+    emit(c, ASM_SUBSD, xmm(T0), add_data_label(c, 1.0));
+    emit(c, ASM_MOVSD, xmm(T2), xmm(T0));                   // s
+    emit(c, ASM_ADDSD, xmm(T2), add_data_label(c, 2.0));
+    emit(c, ASM_DIVSD, xmm(T0), xmm(T2));
+    emit(c, ASM_MOVSD, xmm(T2), xmm(T0));                   // z
+    emit(c, ASM_MULSD, xmm(T2), xmm(T0));
+    emit_square(c, T3, T2);
+    int q = emit_horner2(c, k->p1, k->n1, T2, T3, T4, T5);
+    emit(c, ASM_MULSD, xmm(q), xmm(T2));
+    emit(c, ASM_ADDSD, xmm(T0), xmm(T0));
+    emit(c, ASM_MULSD, xmm(q), xmm(T0));
+    emit(c, ASM_ADDSD, xmm(q), xmm(T0));
+    emit(c, ASM_MOVSD, xmm(T2), xmm(T1));
+    emit(c, ASM_MULSD, xmm(T2), add_data_label(c, FM_LN2_LO));
+    emit(c, ASM_ADDSD, xmm(T2), xmm(q));
+    emit(c, ASM_MULSD, xmm(T1), add_data_label(c, FM_LN2_HI));
+    emit(c, ASM_ADDSD, xmm(T1), xmm(T2));
+    return T1;
+}
+
+static int emit_trig(CodegenCtx *c, const FmKernel *k) {
+    double sh = k->op == IR_COS ? FM_SHIFTER + 1 : FM_SHIFTER;
+    emit(c, ASM_MOVSD, xmm(T1), xmm(T0));                   // kd
+    emit(c, ASM_MULSD, xmm(T1), add_data_label(c, FM_TWO_OVER_PI));
+    emit(c, ASM_ADDSD, xmm(T1), add_data_label(c, sh));
+    emit(c, ASM_MOVSD, xmm(T2), xmm(T1));                   // n
+    emit(c, ASM_SUBSD, xmm(T2), add_data_label(c, sh));
+    emit(c, ASM_MOVSD, xmm(T3), xmm(T2));                   // r
+    emit(c, ASM_MULSD, xmm(T3), add_data_label(c, FM_PIO2_1));
+    emit(c, ASM_SUBSD, xmm(T0), xmm(T3));
+    emit(c, ASM_MOVSD, xmm(T3), xmm(T2));
+    emit(c, ASM_MULSD, xmm(T3), add_data_label(c, FM_PIO2_2));
+    emit(c, ASM_SUBSD, xmm(T0), xmm(T3));
+    emit(c, ASM_MULSD, xmm(T2), add_data_label(c, FM_PIO2_3));
+    emit(c, ASM_SUBSD, xmm(T0), xmm(T2));
+    emit(c, ASM_MOVSD, xmm(T2), xmm(T0));                   // z
+    emit(c, ASM_MULSD, xmm(T2), xmm(T0));
+    emit_square(c, T3, T2);
+    int sr = emit_horner2(c, k->p1, k->n1, T2, T3, T4, T5); // sin r
+    emit(c, ASM_MULSD, xmm(sr), xmm(T2));
+    emit(c, ASM_MULSD, xmm(sr), xmm(T0));
+    emit(c, ASM_ADDSD, xmm(sr), xmm(T0));
+    int cr = emit_horner2(c, k->p2, k->n2, T2, T3, sr == T4 ? T5 : T4, T6);
+    emit(c, ASM_MULSD, xmm(cr), xmm(T2));                   // cos r
+    emit(c, ASM_ADDSD, xmm(cr), add_data_label(c, 1.0));
+    emit(c, ASM_MOVSD, xmm(T0), xmm(T1));                   // mask of odd quadrants
+    emit_bits_op(c, ASM_ANDPD, T0, T2, 1);
+    emit(c, ASM_XORPD, xmm(T2), xmm(T2));
+    emit(c, ASM_PSUBQ, xmm(T2), xmm(T0));
+    if (k->op == IR_TAN) {
+        emit(c, ASM_MOVSD, xmm(T0), xmm(sr));
+        emit(c, ASM_XORPD, xmm(T0), xmm(cr));
+        emit(c, ASM_ANDPD, xmm(T0), xmm(T2));
+        emit(c, ASM_XORPD, xmm(sr), xmm(T0));
+        emit(c, ASM_XORPD, xmm(cr), xmm(T0));
+        emit(c, ASM_DIVSD, xmm(sr), xmm(cr));
+        emit_bits_op(c, ASM_ANDPD, T2, T0, FM_SIGN);
+        emit(c, ASM_XORPD, xmm(sr), xmm(T2));
+    } else {
+        emit(c, ASM_XORPD, xmm(cr), xmm(sr));
+        emit(c, ASM_ANDPD, xmm(cr), xmm(T2));
+        emit(c, ASM_XORPD, xmm(sr), xmm(cr));
+        emit_bits_op(c, ASM_ANDPD, T1, T0, 2);              // sign of the quadrant
+        emit(c, ASM_PSLLQ, xmm(T1), imm(62));
+        emit(c, ASM_XORPD, xmm(sr), xmm(T1));
+    }
+    return sr;
+}
+
+static void lower_kernel(CodegenCtx *c, const FmKernel *k, const IRInstr *code) {
+    int d = code->dst;
+    Loc out = c->vregs[d].reg >= 0 ? xmm(c->vregs[d].reg) : xmm(0);
+    if (k->op == IR_SQRT) {
+        emit(c, ASM_SQRTSD, out, loc_of(c, code->a));
+        if (c->vregs[d].reg < 0) store_result(c, d);
+        return;
+    }
+
+    emit(c, ASM_MOVSD, xmm(T0), loc_of(c, code->a));
+    int r;
+    switch (k->op) {
+        case IR_EXP: r = emit_exp(c, k); break;
+        case IR_LOG: r = emit_log(c, k); break;
+        default:     r = emit_trig(c, k); break;
+    }
+    if (c->vregs[d].reg >= 0) {
+        emit(c, ASM_MOVSD, out, xmm(r));
+    } else {
+        emit(c, ASM_MOVSD, stack_slot(c->vregs[d].slot), xmm(r));
+        c->vregs[d].saved = 1;
+    }
+}
+
+static void lower_arith(CodegenCtx *c, AsmOp op, const IRInstr *code) {
+    Loc a = loc_of(c, code->a);
+    Loc b = loc_of(c, code->b);
+    int d = code->dst;
+
+    // The destination is never an operand's register (operands expire
+    // strictly after this instruction), so a two-address form is safe
+    Loc out = c->vregs[d].reg >= 0 ? xmm(c->vregs[d].reg) : xmm(0);
+    emit(c, ASM_MOVSD, out, a);
+    emit(c, op, out, b);
+    if (c->vregs[d].reg < 0) store_result(c, d);
+}
+
+/* dst = a * b + c accumulates in dst's register. The multiplicand in
+   the VEX.vvvv field has to be a register, so a spilled a swaps with b
+   or is staged in xmm1. */
+static void lower_fma(CodegenCtx *c, const IRInstr *code) {
+    Loc a = loc_of(c, code->a);
+    Loc b = loc_of(c, code->b);
+    int d = code->dst;
+    if (a.kind != LOC_XMM && b.kind == LOC_XMM) {
+        Loc t = a;
+        a = b;
+        b = t;
+    } else if (a.kind != LOC_XMM) {
+        emit(c, ASM_MOVSD, xmm(1), a);
+        a = xmm(1);
+    }
+
+    Loc out = c->vregs[d].reg >= 0 ? xmm(c->vregs[d].reg) : xmm(0);
+    emit(c, ASM_MOVSD, out, loc_of(c, code->c));
+    emit3(c, ASM_VFMADD231SD, out, a, b);
+    if (c->vregs[d].reg < 0) store_result(c, d);
+}
+
+void generate_assembly(CodegenCtx *c, const IRProgram *ir) {
+    if (ir->nregs > c->vregs_cap) {
+        c->vregs_cap = ir->nregs;
+        c->vregs = mmc_realloc(c->vregs, c->vregs_cap * sizeof(*c->vregs));
+    }
+    for (int v = 0; v < ir->nregs; v++) {
+        c->vregs[v].start = c->vregs[v].end = -1;
+        c->vregs[v].reg = c->vregs[v].slot = -1;
+        c->vregs[v].saved = 0;
+    }
+    for (int r = 0; r < NUM_XMM; r++) {
+        c->reg_owner[r] = -1;
+        c->reg_touched[r] = 0;
+    }
+    c->active_count = 0;
+    c->slot_count = 0;
+
+    /* live intervals; the last instruction's value is returned */
+    int has_calls = 0, has_vars = 0;
+    c->alloc_end = NUM_XMM;
+    for (int i = 0; i < ir->count; i++) {
+        const IRInstr *code = &ir->code[i];
+        c->vregs[code->dst].start = c->vregs[code->dst].end = i;
+        if (code->a >= 0) c->vregs[code->a].end = i;
+        if (code->b >= 0) c->vregs[code->b].end = i;
+        if (code->op == IR_FMA) c->vregs[code->c].end = i;
+        const FmKernel *k = is_libm_call(code->op) ? kernel_of(c, code->op) : NULL;
+        if (k && k->op != IR_SQRT) c->alloc_end = KERNEL_REG;
+        else if (!k && is_libm_call(code->op)) has_calls = 1;
+        if (code->op == IR_VAR) has_vars = 1;
+    }
+    int result = ir->count > 0 ? ir->code[ir->count - 1].dst : -1;
+    if (result >= 0) c->vregs[result].end = ir->count;
+
+    int var_base = GPR_RDI;
+    int pushed = 0;
+    if (has_vars && has_calls) {
+        emit(c, ASM_PUSH, gpr(GPR_RBX), no_loc());
+        emit(c, ASM_MOV, gpr(GPR_RBX), gpr(GPR_RDI));
+        var_base = GPR_RBX;
+        pushed = 8;
+    }
+
+    // Frame size is patched in once the number of stack slots is known
+    int frame_at = c->prog.count;
+    emit(c, ASM_SUB_RSP, no_loc(), imm(0));
+    for (int i = 0; i < ir->count; i++) {
+        const IRInstr *code = &ir->code[i];
+
+        expire(c, i);
+        allocate(c, code->dst);
+
+        if (is_libm_call(code->op)) {
+            const FmKernel *k = kernel_of(c, code->op);
+            if (k) lower_kernel(c, k, code);
+            else lower_call(c, code, i);
+            continue;
         }
+
+        switch (code->op) {
+            case IR_CONST: {
+                Loc k = add_data_label(c, code->imm);
+                if (c->vregs[code->dst].reg >= 0) {
+                    emit(c, ASM_MOVSD, xmm(c->vregs[code->dst].reg), k);
+                } else {
+                    emit(c, ASM_MOVSD, xmm(0), k);
+                    store_result(c, code->dst);
+                }
+                break;
+            }
+            case IR_VAR: {
+                Loc v = var_slot(var_base, code->var);
+                if (c->vregs[code->dst].reg >= 0) {
+                    emit(c, ASM_MOVSD, xmm(c->vregs[code->dst].reg), v);
+                } else {
+                    emit(c, ASM_MOVSD, xmm(0), v);
+                    store_result(c, code->dst);
+                }
+                break;
+            }
+            case IR_ADD: lower_arith(c, ASM_ADDSD, code); break;
+            case IR_SUB: lower_arith(c, ASM_SUBSD, code); break;
+            case IR_MUL: lower_arith(c, ASM_MULSD, code); break;
+            case IR_DIV: lower_arith(c, ASM_DIVSD, code); break;
+            case IR_FMA: lower_fma(c, code); break;
+            case IR_NEG: {
+                // Multiplying by -1.0 flips the sign exactly, zeros included
+                Loc out = c->vregs[code->dst].reg >= 0 ? xmm(c->vregs[code->dst].reg) : xmm(0);
+                emit(c, ASM_MOVSD, out, add_data_label(c, -1.0));
+                emit(c, ASM_MULSD, out, loc_of(c, code->a));
+                if (c->vregs[code->dst].reg < 0) store_result(c, code->dst);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // Move final result to xmm0 for return
+    if (result >= 0) {
+        emit(c, ASM_MOVSD, xmm(0), loc_of(c, result));
     }
-    
-    // Add return instruction
-    cJSON_AddItemToArray(text_section, cJSON_CreateString("ret"));
+
+    /* frame: calls need rsp 16-byte aligned, and it is 8 off at entry
+       plus whatever the prologue pushed */
+    int frame = 8 * c->slot_count;
+    if (has_calls && (frame + pushed + 8) % 16 != 0) frame += 8;
+    c->prog.frame_size = frame;
+    if (frame > 0) {
+        c->prog.code[frame_at].src = imm(frame);
+        emit(c, ASM_ADD_RSP, no_loc(), imm(frame));
+    } else {
+        memmove(c->prog.code + frame_at, c->prog.code + frame_at + 1,
+                (c->prog.count - frame_at - 1) * sizeof(*c->prog.code));
+        c->prog.count--;
+    }
+    if (pushed) emit(c, ASM_POP, gpr(GPR_RBX), no_loc());
+    emit(c, ASM_RET, no_loc(), no_loc());
+
+    for (int r = FIRST_ALLOC_REG; r < c->alloc_end; r++) {
+        c->prog.regs_used += c->reg_touched[r];
+    }
+}
+
+/* ---- rendering ---- */
+
+static const char *gpr_names[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi" };
+
+static void format_loc(Loc l, char *buf, size_t size) {
+    switch (l.kind) {
+        case LOC_GPR:   snprintf(buf, size, "%s", gpr_names[l.n]); break;
+        case LOC_VAR:   snprintf(buf, size, "[%s+%d]", gpr_names[l.base], l.n); break;
+        case LOC_XMM:   snprintf(buf, size, "xmm%d", l.n); break;
+        case LOC_STACK: snprintf(buf, size, "[rsp+%d]", l.n); break;
+        case LOC_CONST: snprintf(buf, size, "[const_%d]", l.n); break;
+        case LOC_FUNC:  snprintf(buf, size, "%s", func_names[l.n]); break;
+        case LOC_IMM:   snprintf(buf, size, "%d", l.n); break;
+        case LOC_NONE:  buf[0] = '\0'; break;
+    }
+}
+
+void asm_format_instr(const AsmInstr *i, char *buf, size_t size) {
+    static const char *mnemonics[] = {
+        [ASM_MOVSD] = "movsd", [ASM_ADDSD] = "addsd", [ASM_SUBSD] = "subsd",
+        [ASM_MULSD] = "mulsd", [ASM_DIVSD] = "divsd", [ASM_SQRTSD] = "sqrtsd",
+        [ASM_MAXSD] = "maxsd", [ASM_MINSD] = "minsd", [ASM_ANDPD] = "andpd",
+        [ASM_ORPD] = "orpd", [ASM_XORPD] = "xorpd", [ASM_PADDQ] = "paddq",
+        [ASM_PSUBQ] = "psubq", [ASM_PSLLQ] = "psllq", [ASM_PSRLQ] = "psrlq",
+        [ASM_VADDSD] = "vaddsd", [ASM_VSUBSD] = "vsubsd", [ASM_VMULSD] = "vmulsd",
+        [ASM_VDIVSD] = "vdivsd", [ASM_VFMADD231SD] = "vfmadd231sd", [ASM_CALL] = "call",
+        [ASM_SUB_RSP] = "sub", [ASM_ADD_RSP] = "add", [ASM_PUSH] = "push",
+        [ASM_POP] = "pop", [ASM_MOV] = "mov", [ASM_RET] = "ret"
+    };
+    char dst[32], src[32], src2[32];
+    format_loc(i->dst, dst, sizeof(dst));
+    format_loc(i->src, src, sizeof(src));
+    format_loc(i->src2, src2, sizeof(src2));
+
+    if (i->op == ASM_RET) snprintf(buf, size, "ret");
+    else if (i->op == ASM_CALL) snprintf(buf, size, "call %s", dst);
+    else if (i->op == ASM_PUSH || i->op == ASM_POP) snprintf(buf, size, "%s %s", mnemonics[i->op], dst);
+    else if (i->op == ASM_SUB_RSP || i->op == ASM_ADD_RSP) snprintf(buf, size, "%s rsp, %s", mnemonics[i->op], src);
+    else if (i->op == ASM_MOVSD && i->dst.kind == LOC_XMM && i->src.kind == LOC_XMM)
+        snprintf(buf, size, "movapd %s, %s", dst, src);     // full copy, no merge with dst
+    else if (i->src2.kind != LOC_NONE) snprintf(buf, size, "%s %s, %s, %s", mnemonics[i->op], dst, src, src2);
+    else snprintf(buf, size, "%s %s, %s", mnemonics[i->op], dst, src);
+}
+
+void asm_program_lines(const AsmProgram *p, AsmLineFn fn, void *user) {
+    char line[96];
 
     // Add extern declarations only for used functions
-    if (used_sin || used_cos || used_tan || used_exp || used_log || used_sqrt || used_pow) {
-        // Insert externs at the beginning of the text section
-        int insert_index = 0;
-        cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("; Extern declarations"));
-        if (used_sin) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern sin"));
-        if (used_cos) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern cos"));
-        if (used_tan) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern tan"));
-        if (used_exp) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern exp"));
-        if (used_log) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern log"));
-        if (used_sqrt) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern sqrt"));
-        if (used_pow) cJSON_InsertItemInArray(text_section, insert_index++, cJSON_CreateString("extern pow"));
+    if (p->funcs) {
+        static const IROp order[] = { IR_SIN, IR_COS, IR_TAN, IR_EXP, IR_LOG, IR_SQRT, IR_POW };
+        fn(user, ASM_SECTION_TEXT, "; Extern declarations");
+        for (size_t k = 0; k < sizeof(order) / sizeof(order[0]); k++) {
+            if (!(p->funcs & (1u << order[k]))) continue;
+            snprintf(line, sizeof(line), "extern %s", func_names[order[k]]);
+            fn(user, ASM_SECTION_TEXT, line);
+        }
+    }
+    fn(user, ASM_SECTION_TEXT, "section .text");
+    fn(user, ASM_SECTION_TEXT, "global main");
+    fn(user, ASM_SECTION_TEXT, "main:");
+    for (int i = 0; i < p->count; i++) {
+        asm_format_instr(&p->code[i], line, sizeof(line));
+        fn(user, ASM_SECTION_TEXT, line);
     }
 
     // Add constants to rodata
-    if (data_section->child) {
-        for (int i = 0; i < const_count; i++) {
-            cJSON *entry = cJSON_GetArrayItem(data_section, i);
-            char line[64];
-            sprintf(line, "const_%d: dq %.17g", i, 
-                   cJSON_GetObjectItem(entry, "value")->valuedouble);
-            cJSON_AddItemToArray(rodata, cJSON_CreateString(line));
+    fn(user, ASM_SECTION_RODATA, "section .rodata");
+    for (int i = 0; i < p->nconsts; i++) {
+        double v = p->consts[i];
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        // NASM reads a dq operand with neither a point nor an exponent as
+        // an integer, and has no spelling for subnormals, -0 or NaN
+        // payloads: those go out as their bits
+        if (bits && fpclassify(v) != FP_NORMAL) {
+            snprintf(line, sizeof(line), "const_%d: dq 0x%016llx", i, (unsigned long long)bits);
+        } else {
+            int n = snprintf(line, sizeof(line), "const_%d: dq ", i);
+            snprintf(line + n, sizeof(line) - n, "%.17g", v);
+            if (!strpbrk(line + n, ".e")) strncat(line, ".0", sizeof(line) - strlen(line) - 1);
         }
+        fn(user, ASM_SECTION_RODATA, line);
     }
+}
 
-    // Write to file
-    // FILE *fp = fopen("output.asm", "w");
-    // if (!fp) {
-    //     perror("Failed to open output file");
-    //     exit(EXIT_FAILURE);
-    // }
+/* JSON form: one array of lines per section */
+typedef struct {
+    JsonWriter *w;
+    int section;            // the one whose array is open
+} JsonLines;
+
+static void json_line(void *user, int section, const char *line) {
+    JsonLines *jl = user;
+    if (section != jl->section) {
+        json_end_array(jl->w);
+        json_begin_array(jl->w);
+        jl->section = section;
+    }
+    json_string(jl->w, line);
+}
+
+void asm_program_json(JsonWriter *w, const AsmProgram *p) {
+    JsonLines jl = { w, ASM_SECTION_TEXT };
+    json_begin_array(w);
+    json_begin_array(w);
+    asm_program_lines(p, json_line, &jl);
+    json_end_array(w);
+    json_end_array(w);
+}
+
+void asm_regalloc_json(JsonWriter *w, const AsmProgram *p) {
+    json_begin_object(w);
+    json_key(w, "registers_used");
+    json_number(w, p->regs_used);
+    json_key(w, "spills");
+    json_number(w, p->spills);
+    json_key(w, "call_saves");
+    json_number(w, p->saves);
+    json_key(w, "call_reloads");
+    json_number(w, p->reloads);
+    json_key(w, "frame_bytes");
+    json_number(w, p->frame_size);
+    json_end_object(w);
+}
 
-    // cJSON *section;
-    // cJSON_ArrayForEach(section, code_arr) {
-    //     cJSON *line;
-    //     cJSON_ArrayForEach(line, section) {
-    //         fprintf(fp, "%s\n", cJSON_GetStringValue(line));
-    //     }
-    // }
+void asm_program_copy(AsmProgram *dst, const AsmProgram *src) {
+    AsmInstr *code = dst->code;
+    double *consts = dst->consts;
+    if (dst->cap < src->count) {
+        code = mmc_realloc(code, src->count * sizeof(*code));
+        dst->cap = src->count;
+    }
+    if (dst->consts_cap < src->nconsts) {
+        consts = mmc_realloc(consts, src->nconsts * sizeof(*consts));
+        dst->consts_cap = src->nconsts;
+    }
+    if ((src->count && !code) || (src->nconsts && !consts)) {
+        fprintf(stderr, "Out of memory copying assembly\n");
+        exit(EXIT_FAILURE);
+    }
+    int cap = dst->cap, consts_cap = dst->consts_cap;
+    *dst = *src;
+    dst->code = code;
+    dst->cap = cap;
+    dst->consts = consts;
+    dst->consts_cap = consts_cap;
+    if (src->count) memcpy(code, src->code, src->count * sizeof(*code));
+    if (src->nconsts) memcpy(consts, src->consts, src->nconsts * sizeof(*consts));
+}
+
+void asm_program_free(AsmProgram *p) {
+    free(p->code);
+    free(p->consts);
+    memset(p, 0, sizeof(*p));
+}
 
-    // fclose(fp);
-}
\ No newline at end of file
+void codegen_ctx_free(CodegenCtx *c) {
+    asm_program_free(&c->prog);
+    free(c->vregs);
+    free(c->peep);
+    free(c->pool_map);
+    free(c->slot_live);
+    memset(c, 0, sizeof(*c));
+}
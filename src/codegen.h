@@ -1,10 +1,142 @@
 #ifndef CODEGEN_H
 #define CODEGEN_H
 
-#include "cJSON.h"
+#include <stddef.h>
+#include "json.h"
+#include "ir.h"
+#include "fastmath.h"
 
-void init_codegen(void);
-cJSON* get_code_json(void);
-void generate_assembly(void);
+/* x86-64 (SysV) code for the optimized IR, kept as structured
+   instructions so it can be rendered as NASM text or encoded directly.
+   The generated function is `double f(const double *vars)`: variable k
+   is read from vars[k] and the value is returned in xmm0. Under fast
+   math the selected kernels are emitted inline instead of libm calls.
+   generate_assembly lowers one IR instruction at a time, and
+   peephole_asm then cleans up what that leaves behind. */
+typedef enum {
+    ASM_MOVSD,          // dst <- src (xmm <-> xmm/stack/const); movapd xmm <- xmm
+    ASM_ADDSD, ASM_SUBSD, ASM_MULSD, ASM_DIVSD,     // xmm dst op= src
+    ASM_SQRTSD, ASM_MAXSD, ASM_MINSD,
+    ASM_ANDPD, ASM_ORPD, ASM_XORPD,     // bitwise on whole registers, xmm src only
+    ASM_PADDQ, ASM_PSUBQ,               // 64-bit integer lanes, xmm src only
+    ASM_PSLLQ, ASM_PSRLQ,               // shift lanes of xmm dst by imm
+    ASM_VADDSD, ASM_VSUBSD, ASM_VMULSD, ASM_VDIVSD,     // AVX: xmm dst <- xmm src op src2
+    ASM_VFMADD231SD,    // FMA: xmm dst <- xmm src * src2 + dst, rounded once
+    ASM_CALL,           // call libm function, args/result in xmm0/xmm1
+    ASM_SUB_RSP,        // sub rsp, imm
+    ASM_ADD_RSP,        // add rsp, imm
+    ASM_PUSH, ASM_POP,  // push/pop a general register (dst)
+    ASM_MOV,            // general register dst <- src
+    ASM_RET
+} AsmOp;
 
-#endif // CODEGEN_H
\ No newline at end of file
+typedef enum {
+    LOC_NONE,
+    LOC_XMM,            // n = register number
+    LOC_STACK,          // n = byte offset from rsp
+    LOC_CONST,          // n = index into the constant pool
+    LOC_FUNC,           // n = IROp of the libm function
+    LOC_IMM,            // n = immediate
+    LOC_GPR,            // n = general register number (rax=0 ... rdi=7)
+    LOC_VAR             // n = byte offset from the variables pointer in `base`
+} LocKind;
+
+typedef struct {
+    LocKind kind;
+    int n;
+    int base;           // LOC_VAR only: general register holding vars
+} Loc;
+
+typedef struct {
+    AsmOp op;
+    Loc dst, src;
+    Loc src2;           // second source of the VEX forms, else LOC_NONE
+} AsmInstr;
+
+/* Rules of peephole_asm */
+typedef enum {
+    PEEP_CONSTS,        // duplicate constant-pool entries merged
+    PEEP_FORWARD,       // stack reloads and single-use loads turned into operands
+    PEEP_COALESCE,      // register copies removed by renaming
+    PEEP_DEAD,          // instructions whose result nothing reads
+    PEEP_AVX,           // copy-and-operate pairs fused into AVX forms
+    PEEP_NRULES
+} PeepRule;
+
+/* What peephole_asm did to a program */
+typedef struct {
+    int before, after;          // instruction counts
+    int changed[PEEP_NRULES];   // entries, operands, copies, instructions or pairs
+} PeepReport;
+
+typedef struct {
+    AsmInstr *code;
+    int count, cap;
+    double *consts;     // .rodata pool, one qword per entry
+    int nconsts, consts_cap;
+    unsigned funcs;     // bit per IROp called through libm
+    int frame_size;     // bytes reserved below the return address
+    /* register allocator statistics */
+    int regs_used;      // distinct allocatable xmm registers touched
+    int spills;         // values evicted to the stack by register pressure
+    int saves;          // stores of live values before libm calls
+    int reloads;        // loads of those values after the calls
+    PeepReport peephole;
+} AsmProgram;
+
+#define NUM_XMM 16
+
+typedef struct VRegState VRegState;
+typedef struct PeepInstr PeepInstr;
+
+/* State of code generation. Zero-initialize before first use; every
+   thread running the pipeline needs its own. */
+typedef struct {
+    AsmProgram prog;
+    VRegState *vregs;
+    int vregs_cap;
+    int reg_owner[NUM_XMM];     // vreg held by each xmm, -1 if free
+    int reg_touched[NUM_XMM];
+    int active[NUM_XMM];        // vregs currently in registers
+    int active_count;
+    int slot_count;
+    int alloc_end;              // allocatable registers end before this xmm
+    const FmSet *fast;          // set by the caller, NULL for libm throughout
+    int avx;                    // set by the caller: peephole_asm may use AVX forms
+    /* peephole_asm's scratch */
+    PeepInstr *peep;            // per instruction
+    int peep_cap;
+    int *pool_map;              // hash table of entries, then old index -> new
+    int pool_map_cap;
+    unsigned char *slot_live;   // per stack slot
+    int slot_live_cap;
+} CodegenCtx;
+
+void init_codegen(CodegenCtx *c);
+void generate_assembly(CodegenCtx *c, const IRProgram *ir);    // from the optimized IR
+const AsmProgram* get_asm(const CodegenCtx *c);
+
+/* Rewrite the generated program in place, same result bits: merge
+   equal constants, forward stack reloads and single-use loads into the
+   instructions that read them, coalesce register copies and drop
+   instructions whose results are never read.
+   With avx set, a copy followed by an add, subtract, multiply or divide
+   of the copied register becomes one three-operand VEX instruction,
+   which needs a CPU with AVX. The counts go to prog.peephole. */
+void peephole_asm(CodegenCtx *c);
+const char* peep_rule_name(PeepRule r);     // "consts", ...
+void peep_report_json(JsonWriter *w, const PeepReport *r);
+void codegen_ctx_free(CodegenCtx *c);
+
+void asm_program_copy(AsmProgram *dst, const AsmProgram *src);  // dst zeroed or from an earlier copy
+void asm_program_free(AsmProgram *p);
+
+/* The NASM text, a line at a time: .text first, then .rodata */
+enum { ASM_SECTION_TEXT, ASM_SECTION_RODATA };
+typedef void (*AsmLineFn)(void *user, int section, const char *line);
+void asm_program_lines(const AsmProgram *p, AsmLineFn fn, void *user);
+void asm_program_json(JsonWriter *w, const AsmProgram *p);    // the same text as arrays
+void asm_regalloc_json(JsonWriter *w, const AsmProgram *p);
+void asm_format_instr(const AsmInstr *i, char *buf, size_t size);
+
+#endif // CODEGEN_H
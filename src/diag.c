@@ -0,0 +1,56 @@
+#include "diag.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+void diag_add(DiagList *d, DiagCode code, const char *msg) {
+    if (d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 4;
+        char **p = mmc_realloc(d->msgs, cap * sizeof(*p));
+        DiagCode *q = p ? mmc_realloc(d->codes, cap * sizeof(*q)) : NULL;
+        if (!q) {
+            fprintf(stderr, "Out of memory growing diagnostics\n");
+            exit(EXIT_FAILURE);
+        }
+        d->msgs = p;
+        d->codes = q;
+        d->cap = cap;
+    }
+    size_t len = strlen(msg) + 1;
+    char *s = mmc_malloc(len);
+    if (!s) {
+        fprintf(stderr, "Out of memory copying diagnostic\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(s, msg, len);
+    d->codes[d->count] = code;
+    d->msgs[d->count++] = s;
+}
+
+void diag_clear(DiagList *d) {
+    for (int i = 0; i < d->count; i++) free(d->msgs[i]);
+    d->count = 0;
+}
+
+void diag_copy(DiagList *dst, const DiagList *src) {
+    diag_clear(dst);
+    for (int i = 0; i < src->count; i++) diag_add(dst, src->codes[i], src->msgs[i]);
+}
+
+void diag_free(DiagList *d) {
+    diag_clear(d);
+    free(d->msgs);
+    free(d->codes);
+    d->msgs = NULL;
+    d->codes = NULL;
+    d->cap = 0;
+}
+
+void diag_json(JsonWriter *w, const DiagList *d) {
+    json_begin_array(w);
+    for (int i = 0; i < d->count; i++) {
+        json_string(w, d->msgs[i]);
+    }
+    json_end_array(w);
+}
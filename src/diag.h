@@ -0,0 +1,39 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include "json.h"
+
+/* What a diagnostic is about. The numbers are stable: the binary output
+   carries them in place of the messages, so only append. */
+typedef enum {
+    DIAG_OTHER = 0,
+    DIAG_UNBOUND_VARIABLE,
+    DIAG_DIVISION_BY_ZERO,
+    DIAG_ZERO_POW,              // zero raised to a non-positive power
+    DIAG_TAN_ASYMPTOTE,
+    DIAG_LOG_DOMAIN,
+    DIAG_EXP_OVERFLOW,
+    DIAG_SQRT_DOMAIN,
+    DIAG_MATH_ERRNO,            // libm reported EDOM or ERANGE
+    DIAG_OVERFLOW,
+    DIAG_UNDEFINED,             // NaN result
+    DIAG_UNDERFLOW,
+    DIAG_PRECISION,             // beyond double precision limits
+    DIAG_NEG_POW_BASE           // negative base, non-integer exponent
+} DiagCode;
+
+/* Growable list of diagnostic messages and their codes; the list owns
+   copies of the messages. Zero-initialize before first use. */
+typedef struct {
+    char **msgs;
+    DiagCode *codes;
+    int count, cap;
+} DiagList;
+
+void diag_add(DiagList *d, DiagCode code, const char *msg);
+void diag_clear(DiagList *d);       // drops the messages, keeps the storage
+void diag_copy(DiagList *dst, const DiagList *src);
+void diag_free(DiagList *d);
+void diag_json(JsonWriter *w, const DiagList *d);     // array of strings
+
+#endif // DIAG_H
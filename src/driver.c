@@ -0,0 +1,810 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json.h"
+#include "binfmt.h"
+#include "mymathc.h"
+#include "driver.h"
+#include "alloc.h"
+#include "elfobj.h"
+#include "pool.h"
+#include <math.h>
+#include <time.h>
+
+/* Settings applied to the context each run creates */
+typedef struct {
+    char *name;
+    double value;
+} Binding;
+
+static EvalBackend eval_backend = EVAL_TREE;
+static int jobs = 1;                // threads for compile_program
+static unsigned emit = EMIT_ALL;    // EMIT_* fields written
+static OutputFormat format = FORMAT_JSON;
+static MmcCache *cache = NULL;      // shared by every run, also under --serve
+static const char *cache_path = NULL;
+static size_t cache_size = 0;
+static MmcCache **worker_caches = NULL;  // compile_programs' workers past the first
+static int nworker_caches = 0;
+static int profile = 0;
+static double fast_math = 0;        // ulp budget, 0 when off
+static int avx = 0;
+static int contract = 0;            // fma contraction
+static FILE *object = NULL;         // ELF object written after the run
+static const char *object_path = NULL;
+static const char *object_prefix = "f";
+static int object_failed = 0;
+static Binding *bindings = NULL;
+static int nbindings = 0;
+
+void set_eval_backend(EvalBackend b) {
+    eval_backend = b;
+}
+
+void set_jobs(int n) {
+    jobs = n;
+}
+
+void set_output_format(OutputFormat f) {
+    format = f;
+}
+
+void set_profile(int on) {
+    profile = on;
+}
+
+void set_fast_math(double max_ulp) {
+    fast_math = max_ulp;
+}
+
+void set_avx(int on) {
+    avx = on;
+}
+
+void set_fma(int on) {
+    contract = on;
+}
+
+int set_cache(const char *path, size_t size) {
+    MmcCache *k = mmc_cache_open(path, size);
+    if (!k) return -1;
+    mmc_cache_close(cache);
+    for (int w = 0; w < nworker_caches; w++) mmc_cache_close(worker_caches[w]);
+    free(worker_caches);
+    worker_caches = NULL;
+    nworker_caches = 0;
+    cache = k;
+    cache_path = path;
+    cache_size = size;
+    return 0;
+}
+
+int set_object(const char *path, const char *prefix) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (object) fclose(object);
+    object = f;
+    object_path = path;
+    object_prefix = prefix;
+    return 0;
+}
+
+int close_object(void) {
+    if (!object) return 0;
+    if (fclose(object) != 0 && !object_failed) {
+        perror(object_path);
+        object_failed = 1;
+    }
+    object = NULL;
+    return object_failed ? -1 : 0;
+}
+
+/* --emit names, each selecting output fields and the stages behind them */
+static const struct {
+    const char *name;
+    unsigned emit;
+} emit_names[] = {
+    { "tokens",   EMIT_TOKENS },
+    { "ast",      EMIT_AST },
+    { "range",    EMIT_RANGE },
+    { "semantic", EMIT_SEMANTIC },
+    { "ir",       EMIT_IR },
+    { "opt",      EMIT_OPT },
+    { "asm",      EMIT_ASM },
+    { "results",  EMIT_RESULTS },
+};
+
+int set_emit(const char *list) {
+    unsigned mask = 0;
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        size_t k;
+        for (k = 0; k < sizeof(emit_names) / sizeof(emit_names[0]); k++) {
+            if (strlen(emit_names[k].name) == len && strncmp(emit_names[k].name, p, len) == 0) break;
+        }
+        if (k == sizeof(emit_names) / sizeof(emit_names[0])) return -1;
+        mask |= emit_names[k].emit;
+        p += len;
+        if (*p == ',') p++;
+    }
+    if (!mask) return -1;
+    emit = mask;
+    return 0;
+}
+
+void bind_variable(const char *name, double value) {
+    for (int i = 0; i < nbindings; i++) {
+        if (strcmp(bindings[i].name, name) == 0) {
+            bindings[i].value = value;
+            return;
+        }
+    }
+    bindings = realloc(bindings, (nbindings + 1) * sizeof(*bindings));
+    bindings[nbindings].name = strdup(name);
+    bindings[nbindings].value = value;
+    nbindings++;
+}
+
+/* A context with the current settings, compiling on `threads` threads
+   and looking statements up in `k` */
+static MmcContext* new_context(MmcCache *k, int threads) {
+    MmcContext *c = mmc_create();
+    if (!c) {
+        fprintf(stderr, "Out of memory creating compiler context\n");
+        exit(EXIT_FAILURE);
+    }
+    mmc_set_backend(c, eval_backend);
+    mmc_set_jobs(c, threads);
+
+    // Only run what the emitted fields need; the AST comes with parsing
+    unsigned stages = 0;
+    if (emit & EMIT_TOKENS)   stages |= MMC_TOKENS;
+    if (emit & EMIT_RANGE)    stages |= MMC_RANGE;
+    if (emit & EMIT_SEMANTIC) stages |= MMC_SEMANTIC;
+    if (emit & EMIT_IR)       stages |= MMC_IR;
+    if (emit & EMIT_OPT)      stages |= MMC_OPT;
+    if (emit & EMIT_ASM)      stages |= MMC_ASM;
+    if (emit & EMIT_RESULTS)  stages |= MMC_VALUE;
+    if (object)               stages |= MMC_ASM;
+    mmc_set_stages(c, stages);
+    mmc_set_cache(c, k);
+    mmc_set_profile(c, profile);
+    mmc_set_fast_math(c, fast_math);
+    mmc_set_avx(c, avx);
+    mmc_set_fma(c, contract);
+    for (int i = 0; i < nbindings; i++) mmc_bind(c, bindings[i].name, bindings[i].value);
+    return c;
+}
+
+/* ---- utility to write the AST as JSON ---- */
+static void ast_json(JsonWriter *w, const MmcContext *c, ASTNode *n) {
+    json_begin_object(w);
+    switch(n->type) {
+        case NODE_NUM:
+            json_key(w, "type");
+            json_string(w, "NUMBER");
+            json_key(w, "value");
+            json_number(w, n->value);
+            break;
+        case NODE_VAR:
+            json_key(w, "type");
+            json_string(w, "VAR");
+            json_key(w, "name");
+            json_string(w, mmc_var_name(c, n->var));
+            break;
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_POW:
+            json_key(w, "type");
+            json_string(w, (n->type == NODE_ADD) ? "ADD" :
+                           (n->type == NODE_SUB) ? "SUB" :
+                           (n->type == NODE_MUL) ? "MUL" :
+                           (n->type == NODE_DIV) ? "DIV" : "POW");
+            json_key(w, "left");
+            ast_json(w, c, n->left);
+            json_key(w, "right");
+            ast_json(w, c, n->right);
+            break;
+        case NODE_NEG:
+        case NODE_SIN:
+        case NODE_COS:
+        case NODE_TAN:
+        case NODE_LOG:
+        case NODE_EXP:
+        case NODE_SQRT:
+            json_key(w, "type");
+            json_string(w, (n->type == NODE_NEG) ? "NEG" :
+                           (n->type == NODE_SIN) ? "SIN" :
+                           (n->type == NODE_COS) ? "COS" :
+                           (n->type == NODE_TAN) ? "TAN" :
+                           (n->type == NODE_LOG) ? "LOG" :
+                           (n->type == NODE_EXP) ? "EXP" : "SQRT");
+            json_key(w, "operand");
+            ast_json(w, c, n->left);
+            break;
+        default: break;
+    }
+    json_end_object(w);
+}
+
+/* ---- one writer per stage of a compiled statement ---- */
+typedef void (*FieldWriter)(JsonWriter *w, const MmcContext *c, const MmcResult *r);
+
+static void write_tokens(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    json_begin_array(w);
+    for (int i = 0; i < r->ntokens; i++) {
+        json_begin_object(w);
+        json_key(w, "type");
+        json_string(w, r->tokens[i].type);
+        json_key(w, "value");
+        json_string(w, r->tokens[i].text);
+        json_end_object(w);
+    }
+    json_end_array(w);
+}
+
+static void write_ast(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    ast_json(w, c, r->ast);
+}
+
+static void write_dedup(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    json_number(w, (double)r->deduped);
+}
+
+static void write_range(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    range_report_json(w, &r->range);
+}
+
+static void write_semantic(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    diag_json(w, &r->errors);
+}
+
+static void write_ir(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    json_begin_array(w);
+    ir_program_json(w, &r->ir);
+    json_end_array(w);
+}
+
+static void write_opt(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    ir_program_json(w, &r->opt_ir);
+}
+
+static void write_asm(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    asm_program_json(w, &r->code);
+}
+
+static void write_regalloc(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    asm_regalloc_json(w, &r->code);
+}
+
+static void write_opt_passes(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    opt_report_json(w, &r->opt_report);
+}
+
+static void write_peephole(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    peep_report_json(w, &r->code.peephole);
+}
+
+static void write_result(JsonWriter *w, const MmcContext *c, const MmcResult *r) {
+    // NaN is written as null
+    json_number(w, r->value);
+}
+
+/* ---- the same fields as binfmt.h payloads ---- */
+typedef void (*BinFieldWriter)(BinWriter *w, const MmcContext *c, const MmcResult *r);
+
+static void bin_tokens(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    for (int i = 0; i < r->ntokens; i++) {
+        bin_str(w, r->tokens[i].type);
+        bin_str(w, r->tokens[i].text);
+    }
+}
+
+static void bin_ast_node(BinWriter *w, const MmcContext *c, const ASTNode *n) {
+    bin_u8(w, n->type);
+    switch (n->type) {
+        case NODE_NUM:
+            bin_f64(w, n->value);
+            break;
+        case NODE_VAR:
+            bin_str(w, mmc_var_name(c, n->var));
+            break;
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_POW:
+            bin_ast_node(w, c, n->left);
+            bin_ast_node(w, c, n->right);
+            break;
+        default:
+            bin_ast_node(w, c, n->left);
+            break;
+    }
+}
+
+static void bin_ast(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_ast_node(w, c, r->ast);
+}
+
+static void bin_dedup(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_u32(w, r->deduped);
+}
+
+static void bin_range(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_f64(w, r->range.iv.lo);
+    bin_f64(w, r->range.iv.hi);
+    bin_u8(w, r->range.safe != 0);
+    bin_u32(w, r->range.safe_nodes);
+    bin_u32(w, r->range.nodes);
+    for (int i = 0; i < r->range.warnings.count; i++) bin_str(w, r->range.warnings.msgs[i]);
+}
+
+static void bin_semantic(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    for (int i = 0; i < r->errors.count; i++) bin_str(w, r->errors.msgs[i]);
+}
+
+static void bin_ir_lines(BinWriter *w, const IRProgram *p) {
+    char line[128];
+    for (int i = 0; i < p->count; i++) {
+        ir_format_instr(&p->code[i], p->var_names, line, sizeof(line));
+        bin_str(w, line);
+    }
+}
+
+static void bin_ir(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_ir_lines(w, &r->ir);
+}
+
+static void bin_opt(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_ir_lines(w, &r->opt_ir);
+}
+
+static void bin_asm_line(void *user, int section, const char *line) {
+    bin_u8(user, section);
+    bin_str(user, line);
+}
+
+static void bin_asm(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    asm_program_lines(&r->code, bin_asm_line, w);
+}
+
+static void bin_regalloc(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_u32(w, r->code.regs_used);
+    bin_u32(w, r->code.spills);
+    bin_u32(w, r->code.saves);
+    bin_u32(w, r->code.reloads);
+    bin_u32(w, r->code.frame_size);
+}
+
+static void bin_opt_passes(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_u32(w, r->opt_report.rounds);
+    bin_u32(w, r->opt_report.before);
+    bin_u32(w, r->opt_report.after);
+    for (int k = 0; k < OPT_NPASSES; k++) {
+        bin_str(w, opt_pass_name(k));
+        bin_u32(w, r->opt_report.changed[k]);
+    }
+}
+
+static void bin_peephole(BinWriter *w, const MmcContext *c, const MmcResult *r) {
+    bin_u32(w, r->code.peephole.before);
+    bin_u32(w, r->code.peephole.after);
+    for (int k = 0; k < PEEP_NRULES; k++) {
+        bin_str(w, peep_rule_name(k));
+        bin_u32(w, r->code.peephole.changed[k]);
+    }
+}
+
+/* Output order, with each field's key in the column-wise program object
+   and in a streamed record, the --emit name that selects it, and its
+   binary payload (results go in the record header instead) */
+static const struct {
+    const char *column;
+    const char *record;
+    unsigned emit;
+    FieldWriter write;
+    BinPayload bin;
+    BinFieldWriter bin_write;
+} fields[] = {
+    { "tokens",     "tokens",     EMIT_TOKENS,   write_tokens,     BIN_TOKENS,     bin_tokens },
+    { "asts",       "ast",        EMIT_AST,      write_ast,        BIN_AST,        bin_ast },
+    { "dedup",      "dedup",      EMIT_AST,      write_dedup,      BIN_DEDUP,      bin_dedup },
+    { "ranges",     "range",      EMIT_RANGE,    write_range,      BIN_RANGE,      bin_range },
+    { "semantic",   "semantic",   EMIT_SEMANTIC, write_semantic,   BIN_MESSAGES,   bin_semantic },
+    { "ir",         "ir",         EMIT_IR,       write_ir,         BIN_IR,         bin_ir },
+    { "opt_ir",     "opt_ir",     EMIT_OPT,      write_opt,        BIN_OPT,        bin_opt },
+    { "asm",        "asm",        EMIT_ASM,      write_asm,        BIN_ASM,        bin_asm },
+    { "regalloc",   "regalloc",   EMIT_ASM,      write_regalloc,   BIN_REGALLOC,   bin_regalloc },
+    { "opt_passes", "opt_passes", EMIT_OPT,      write_opt_passes, BIN_OPT_PASSES, bin_opt_passes },
+    { "peephole",   "peephole",   EMIT_ASM,      write_peephole,   BIN_PEEPHOLE,   bin_peephole },
+    { "results",    "result",     EMIT_RESULTS,  write_result,     0,              NULL },
+};
+#define NFIELDS (sizeof(fields) / sizeof(fields[0]))
+
+/* ---- --profile statistics ---- */
+
+/* The library's steps, then writing the statement's output */
+#define COST_JSON MMC_NSTAGES
+#define NCOSTS (MMC_NSTAGES + 1)
+
+static const char *cost_names[NCOSTS] = {
+    [MMC_STAGE_PARSE] = "parse", [MMC_STAGE_CACHE] = "cache", [MMC_STAGE_RANGE] = "range",
+    [MMC_STAGE_SEMANTIC] = "semantic", [MMC_STAGE_IR] = "ir", [MMC_STAGE_OPT] = "opt",
+    [MMC_STAGE_ASM] = "asm", [MMC_STAGE_VALUE] = "value", [COST_JSON] = "json"
+};
+
+/* Totals over a run's statements */
+typedef struct {
+    double start;
+    unsigned long statements;
+    MmcCost cost[NCOSTS];
+    unsigned long nodes, ir_instrs, opt_instrs;
+    int max_registers;
+} RunStats;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time and allocations from here to cost_end go to `cost` */
+typedef struct {
+    double t;
+    AllocCount a;
+} CostStart;
+
+static CostStart cost_begin(void) {
+    CostStart s = { now(), alloc_count() };
+    return s;
+}
+
+static void cost_end(MmcCost *cost, CostStart s) {
+    AllocCount a = alloc_count();
+    cost->seconds += now() - s.t;
+    cost->allocs += a.calls - s.a.calls;
+    cost->bytes += a.bytes - s.a.bytes;
+}
+
+static void costs_json(JsonWriter *w, const MmcCost *lib, const MmcCost *json) {
+    json_begin_object(w);
+    for (int k = 0; k < NCOSTS; k++) {
+        const MmcCost *cost = k < MMC_NSTAGES ? &lib[k] : json;
+        json_key(w, cost_names[k]);
+        json_begin_object(w);
+        json_key(w, "ns");
+        json_number(w, round(cost->seconds * 1e9));
+        json_key(w, "allocs");
+        json_number(w, (double)cost->allocs);
+        json_key(w, "bytes");
+        json_number(w, (double)cost->bytes);
+        json_end_object(w);
+    }
+    json_end_object(w);
+}
+
+/* A statement's costs and sizes; `json` is what writing its fields cost */
+static void stats_json(JsonWriter *w, const MmcResult *r, const MmcCost *json) {
+    json_begin_object(w);
+    json_key(w, "stages");
+    costs_json(w, r->cost, json);
+    json_key(w, "nodes");
+    json_number(w, (double)r->nodes);
+    json_key(w, "ir_instructions");
+    json_number(w, r->ir.count);
+    json_key(w, "opt_instructions");
+    json_number(w, r->opt_ir.count);
+    json_key(w, "registers");
+    json_number(w, r->code.regs_used);
+    json_end_object(w);
+}
+
+static void run_add(RunStats *run, const MmcResult *r, const MmcCost *json) {
+    run->statements++;
+    for (int k = 0; k < NCOSTS; k++) {
+        const MmcCost *cost = k < MMC_NSTAGES ? &r->cost[k] : json;
+        run->cost[k].seconds += cost->seconds;
+        run->cost[k].allocs += cost->allocs;
+        run->cost[k].bytes += cost->bytes;
+    }
+    run->nodes += r->nodes;
+    run->ir_instrs += r->ir.count;
+    run->opt_instrs += r->opt_ir.count;
+    if (r->code.regs_used > run->max_registers) run->max_registers = r->code.regs_used;
+}
+
+/* The run's totals; stage times add up over threads, so with -j they
+   can exceed the wall time */
+static void run_stats_json(JsonWriter *w, const RunStats *run) {
+    json_begin_object(w);
+    json_key(w, "statements");
+    json_number(w, (double)run->statements);
+    json_key(w, "wall_ns");
+    json_number(w, round((now() - run->start) * 1e9));
+    json_key(w, "stages");
+    costs_json(w, run->cost, &run->cost[COST_JSON]);
+    json_key(w, "nodes");
+    json_number(w, (double)run->nodes);
+    json_key(w, "ir_instructions");
+    json_number(w, (double)run->ir_instrs);
+    json_key(w, "opt_instructions");
+    json_number(w, (double)run->opt_instrs);
+    json_key(w, "max_registers");
+    json_number(w, run->max_registers);
+    json_end_object(w);
+}
+
+/* streaming mode: one compact JSON object per line */
+typedef struct {
+    JsonWriter w;
+    RunStats run;           // with --profile
+} JsonStream;
+
+static void emit_record(MmcContext *c, int index, void *user) {
+    JsonStream *s = user;
+    JsonWriter *w = &s->w;
+    const MmcResult *r = mmc_result(c, index);
+
+    MmcCost json = { 0 };
+    CostStart start = profile ? cost_begin() : (CostStart){ 0 };
+    json_begin_object(w);
+    for (size_t f = 0; f < NFIELDS; f++) {
+        if (!(fields[f].emit & emit)) continue;
+        json_key(w, fields[f].record);
+        fields[f].write(w, c, r);
+    }
+    if (cache) {
+        json_key(w, "cached");
+        json_bool(w, r->cached);
+    }
+    if (profile) {
+        cost_end(&json, start);
+        run_add(&s->run, r, &json);
+        json_key(w, "stats");
+        stats_json(w, r, &json);
+    }
+    json_end_object(w);
+    json_raw(w, "\n", 1);
+    json_flush(w);
+
+    // Nothing outlives the record, so the statement's nodes can go now
+    mmc_reset(c);
+}
+
+/* One binary record; the result is NaN unless results are emitted */
+static void bin_record(BinWriter *w, const MmcContext *c, int index, unsigned number) {
+    const MmcResult *r = mmc_result(c, index);
+    bin_begin_record(w, number, (emit & EMIT_RESULTS) ? r->value : NAN, &r->errors);
+    for (size_t f = 0; f < NFIELDS; f++) {
+        if (!(fields[f].emit & emit) || !fields[f].bin_write) continue;
+        bin_begin_payload(w, fields[f].bin);
+        fields[f].bin_write(w, c, r);
+        bin_end_payload(w);
+    }
+    bin_end_record(w);
+}
+
+typedef struct {
+    BinWriter w;
+    unsigned next;          // statement number across resets
+} BinStream;
+
+static void emit_bin_record(MmcContext *c, int index, void *user) {
+    BinStream *s = user;
+    bin_record(&s->w, c, index, s->next++);
+    bin_flush(&s->w);
+    mmc_reset(c);
+}
+
+/* Every statement that compiled, as <prefix><statement number> */
+static void write_object(const MmcContext *c) {
+    int n = mmc_statement_count(c);
+    size_t name_size = strlen(object_prefix) + 12;
+    ElfFunc *funcs = malloc((n ? n : 1) * sizeof(*funcs));
+    char *names = malloc((n ? n : 1) * name_size);
+    if (!funcs || !names) {
+        fprintf(stderr, "Out of memory writing object\n");
+        exit(EXIT_FAILURE);
+    }
+    int nfuncs = 0;
+    for (int i = 0; i < n; i++) {
+        const MmcResult *r = mmc_result(c, i);
+        if (r->errors.count > 0 || r->code.count == 0) continue;
+        char *name = names + (size_t)nfuncs * name_size;
+        snprintf(name, name_size, "%s%d", object_prefix, i);
+        funcs[nfuncs].name = name;
+        funcs[nfuncs].code = &r->code;
+        nfuncs++;
+    }
+    if (elf_write_object(object, funcs, nfuncs) < 0) {
+        fprintf(stderr, "%s: cannot write object\n", object_path);
+        object_failed = 1;
+    }
+    free(funcs);
+    free(names);
+}
+
+static void compile_input(MmcContext *c, const char *src, FILE *in) {
+    if (src) {
+        mmc_compile_string(c, src);
+    } else {
+        mmc_compile_file(c, in);
+    }
+}
+
+void stream_program(const char *src, FILE *in, FILE *out) {
+    if (format == FORMAT_BINARY) {
+        BinStream s = { .next = 0 };
+        bin_writer_init(&s.w, out);
+        bin_write_header(&s.w);
+        bin_flush(&s.w);
+        MmcContext *c = new_context(cache, jobs);
+        mmc_set_statement_hook(c, emit_bin_record, &s);
+        compile_input(c, src, in);
+        mmc_destroy(c);
+        bin_writer_free(&s.w);
+        return;
+    }
+
+    JsonStream s = { .run = { .start = now() } };
+    json_writer_init(&s.w, out, 0);
+    MmcContext *c = new_context(cache, jobs);
+    mmc_set_statement_hook(c, emit_record, &s);
+    compile_input(c, src, in);
+    mmc_destroy(c);
+    if (profile) {
+        // A last line with the totals, after every record
+        json_begin_object(&s.w);
+        json_key(&s.w, "run_stats");
+        run_stats_json(&s.w, &s.run);
+        json_end_object(&s.w);
+        json_raw(&s.w, "\n", 1);
+    }
+    json_writer_free(&s.w);
+}
+
+static void compile_with(const char *src, FILE *in, JsonWriter *w, MmcCache *k, int threads) {
+    // A fresh context per run, so the arena statistics cover only this program
+    RunStats run = { .start = now() };
+    MmcContext *c = new_context(k, threads);
+    compile_input(c, src, in);
+    int n = mmc_statement_count(c);
+
+    // Output is written column by column, so each statement's share is
+    // summed over the columns
+    MmcCost *json = NULL;
+    if (profile) {
+        json = calloc(n ? n : 1, sizeof(*json));
+        if (!json) {
+            fprintf(stderr, "Out of memory profiling output\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    json_begin_object(w);
+    for (size_t f = 0; f < NFIELDS; f++) {
+        if (!(fields[f].emit & emit)) continue;
+        json_key(w, fields[f].column);
+        json_begin_array(w);
+        for (int i = 0; i < n; i++) {
+            CostStart start = profile ? cost_begin() : (CostStart){ 0 };
+            fields[f].write(w, c, mmc_result(c, i));
+            if (profile) cost_end(&json[i], start);
+        }
+        json_end_array(w);
+    }
+    if (profile) {
+        json_key(w, "stats");
+        json_begin_array(w);
+        for (int i = 0; i < n; i++) {
+            const MmcResult *r = mmc_result(c, i);
+            stats_json(w, r, &json[i]);
+            run_add(&run, r, &json[i]);
+        }
+        json_end_array(w);
+        free(json);
+    }
+
+    /* arena statistics, taken before the nodes are released */
+    const Arena *a = mmc_arena(c);
+    json_key(w, "arena");
+    json_begin_object(w);
+    json_key(w, "nodes");
+    json_number(w, a->allocs);
+    json_key(w, "bytes_used");
+    json_number(w, a->used);
+    json_key(w, "high_water");
+    json_number(w, a->high_water);
+    json_key(w, "reserved");
+    json_number(w, a->reserved);
+    json_key(w, "chunks");
+    json_number(w, a->chunks);
+    json_end_object(w);
+
+    if (k) {
+        unsigned long hits, misses;
+        mmc_cache_counts(c, &hits, &misses);
+        json_key(w, "cache");
+        json_begin_object(w);
+        json_key(w, "hits");
+        json_number(w, hits);
+        json_key(w, "misses");
+        json_number(w, misses);
+        json_end_object(w);
+    }
+    if (profile) {
+        json_key(w, "run_stats");
+        run_stats_json(w, &run);
+    }
+    json_end_object(w);
+
+    if (object) write_object(c);
+    mmc_destroy(c);
+}
+
+void compile_program(const char *src, FILE *in, JsonWriter *w) {
+    compile_with(src, in, w, cache, jobs);
+}
+
+typedef struct {
+    const char *const *srcs;
+    JsonWriter *ws;
+    int threads;            // per program
+} ProgramJobs;
+
+static void program_job(void *arg, int worker, int i) {
+    ProgramJobs *pj = arg;
+    MmcCache *k = worker && cache ? worker_caches[worker - 1] : cache;
+    json_writer_clear(&pj->ws[i]);
+    compile_with(pj->srcs[i], NULL, &pj->ws[i], k, pj->threads);
+}
+
+/* Workers after the first need a cache of their own, since a cache is
+   used from one thread at a time; as many workers run as have one */
+static int open_worker_caches(int nworkers) {
+    if (!cache) return nworkers;
+    if (nworkers - 1 > nworker_caches) {
+        MmcCache **k = realloc(worker_caches, (nworkers - 1) * sizeof(*k));
+        if (!k) {
+            fprintf(stderr, "Out of memory opening caches\n");
+            exit(EXIT_FAILURE);
+        }
+        worker_caches = k;
+        while (nworker_caches < nworkers - 1) {
+            MmcCache *opened = mmc_cache_open(cache_path, cache_size);
+            if (!opened) break;
+            worker_caches[nworker_caches++] = opened;
+        }
+    }
+    return nworker_caches + 1 < nworkers ? nworker_caches + 1 : nworkers;
+}
+
+void compile_programs(const char *const *srcs, int n, JsonWriter *ws) {
+    int threads = jobs > 0 ? jobs : pool_cpu_count();
+    int nworkers = open_worker_caches(threads < n ? threads : n);
+    // One program gets every thread; several get one each
+    ProgramJobs pj = { srcs, ws, nworkers > 1 ? 1 : jobs };
+    pool_run(nworkers, n, program_job, &pj);
+}
+
+void compile_program_binary(const char *src, FILE *in, FILE *out) {
+    MmcContext *c = new_context(cache, jobs);
+    compile_input(c, src, in);
+    int n = mmc_statement_count(c);
+
+    BinWriter w;
+    bin_writer_init(&w, out);
+    bin_write_header(&w);
+    for (int i = 0; i < n; i++) bin_record(&w, c, i, (unsigned)i);
+    bin_writer_free(&w);
+
+    if (object) write_object(c);
+    mmc_destroy(c);
+}
@@ -0,0 +1,104 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include <stdio.h>
+#include "json.h"
+#include "mymathc.h"
+
+/* The command-line front end over libmymathc: each run gets a fresh
+   context and renders its results as JSON.
+
+   Both entry points read the program from `src` when it is non-NULL and
+   from `in` otherwise. */
+
+void set_eval_backend(EvalBackend b);
+
+/* Give variable `name` a value for every later run. Statements that use
+   a variable with no binding get a semantic error. */
+void bind_variable(const char *name, double value);
+
+/* Output fields, selected with set_emit */
+enum {
+    EMIT_TOKENS   = 1 << 0,
+    EMIT_AST      = 1 << 1,     // with the dedup counts
+    EMIT_RANGE    = 1 << 2,
+    EMIT_SEMANTIC = 1 << 3,
+    EMIT_IR       = 1 << 4,
+    EMIT_OPT      = 1 << 5,
+    EMIT_ASM      = 1 << 6,     // with the register allocation summary
+    EMIT_RESULTS  = 1 << 7,
+    EMIT_ALL      = (1 << 8) - 1
+};
+
+/* Write only the fields named in a comma-separated list of tokens, ast,
+   range, semantic, ir, opt, asm and results; stages no field needs are
+   not run at all. -1 on an unknown name, leaving the selection as it
+   was. */
+int set_emit(const char *list);
+
+/* JSON text, or the length-prefixed records of binfmt.h */
+typedef enum {
+    FORMAT_JSON,
+    FORMAT_BINARY
+} OutputFormat;
+
+/* Format stream_program writes; compile_program is always JSON */
+void set_output_format(OutputFormat f);
+
+/* Look statements up in, and add them to, the compilation cache at
+   `path`, a file of `size` bytes; runs then report hits and misses.
+   -1 if the file cannot be opened. */
+int set_cache(const char *path, size_t size);
+
+/* With --profile, JSON output also carries a "stats" object per
+   statement: time, allocation calls and bytes for each stage and for
+   writing the statement's fields, AST node and IR instruction counts,
+   and registers used. A "run_stats" object sums them up for the run;
+   compile_program adds it after the arena statistics and stream_program
+   writes it as a final line. Binary output has no statistics. */
+void set_profile(int on);
+
+/* Trade exact results for speed within max_ulp of libm, 0 for off; see
+   mmc_set_fast_math */
+void set_fast_math(double max_ulp);
+
+/* Let generated code use AVX three-operand forms; see mmc_set_avx */
+void set_avx(int on);
+
+/* Contract multiply-adds into FMA instructions; see mmc_set_fma */
+void set_fma(int on);
+
+/* Also write every statement that compiles into the relocatable ELF
+   object at `path` (see elfobj.h), as the function <prefix><n> for
+   statement n, once compile_program or compile_program_binary has run.
+   -1 if the file cannot be created. */
+int set_object(const char *path, const char *prefix);
+/* Close the object; -1 if writing it failed, after a message on stderr */
+int close_object(void);
+
+/* Threads compile_program spreads statements over, and compile_programs
+   programs; 0 means one per online CPU. Output is the same for any
+   count. */
+void set_jobs(int n);
+
+/* Run every statement through all stages and write one object holding
+   a column array per stage, plus the run's arena statistics, to `w`. */
+void compile_program(const char *src, FILE *in, JsonWriter *w);
+
+/* compile_program for each of n programs into ws[i], which is cleared
+   first. The programs are spread over the set_jobs threads, one context
+   each; a lone program gets all of them. Output is as for n calls in a
+   row, except that a statement repeated within the programs may miss
+   the cache more than once. */
+void compile_programs(const char *const *srcs, int n, JsonWriter *ws);
+
+/* Write one compact JSON record per statement to `out` as soon as its
+   ';' is reduced, keeping nothing from earlier statements. In binary
+   format the records follow a header and are flushed one at a time. */
+void stream_program(const char *src, FILE *in, FILE *out);
+
+/* compile_program's statements as binary records, numbered from 0, with
+   no arena trailer. Dedup counts span the program, as in compile_program. */
+void compile_program_binary(const char *src, FILE *in, FILE *out);
+
+#endif // DRIVER_H
@@ -0,0 +1,299 @@
+#include "elfobj.h"
+#include "encode.h"
+#include "alloc.h"
+#include "ir.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/* The parts of the format written here, with the values of the System V
+   gABI and the x86-64 psABI. Everything is little-endian. */
+#define ET_REL          1
+#define EM_X86_64       62
+#define SHT_PROGBITS    1
+#define SHT_SYMTAB      2
+#define SHT_STRTAB      3
+#define SHT_RELA        4
+#define SHF_ALLOC       0x2
+#define SHF_EXECINSTR   0x4
+#define SHF_INFO_LINK   0x40
+#define STB_LOCAL       0
+#define STB_GLOBAL      1
+#define STT_NOTYPE      0
+#define STT_FUNC        2
+#define STT_SECTION     3
+#define R_X86_64_PC32   2
+#define R_X86_64_PLT32  4
+
+#define EHDR_SIZE   64
+#define SHDR_SIZE   64
+#define SYM_SIZE    24
+#define RELA_SIZE   24
+#define TEXT_ALIGN  16
+
+/* An empty .note.GNU-stack tells the linker the code needs no
+   executable stack */
+enum { SEC_NULL, SEC_TEXT, SEC_RODATA, SEC_RELA, SEC_SYMTAB, SEC_STRTAB,
+       SEC_SHSTRTAB, SEC_NOTE, NSECTIONS };
+
+static const char *section_names[NSECTIONS] = {
+    "", ".text", ".rodata", ".rela.text", ".symtab", ".strtab",
+    ".shstrtab", ".note.GNU-stack"
+};
+
+/* Symbols: the null one, the section symbols relocations are taken
+   against, then the functions and the libm functions they call */
+enum { SYM_TEXT = 1, SYM_RODATA, FIRST_GLOBAL };
+
+static const char *libm_names[] = {
+    [IR_SIN] = "sin", [IR_COS] = "cos", [IR_TAN] = "tan", [IR_EXP] = "exp",
+    [IR_LOG] = "log", [IR_SQRT] = "sqrt", [IR_POW] = "pow"
+};
+#define NLIBM (int)(sizeof(libm_names) / sizeof(libm_names[0]))
+
+static void put8(ByteBuf *b, unsigned v) {
+    unsigned char c = (unsigned char)v;
+    bytebuf_put(b, &c, 1);
+}
+
+static void put16(ByteBuf *b, unsigned v) {
+    put8(b, v & 0xff);
+    put8(b, (v >> 8) & 0xff);
+}
+
+static void put32(ByteBuf *b, uint32_t v) {
+    for (int i = 0; i < 4; i++) put8(b, (v >> (8 * i)) & 0xff);
+}
+
+static void put64(ByteBuf *b, uint64_t v) {
+    for (int i = 0; i < 8; i++) put8(b, (unsigned)(v >> (8 * i)) & 0xff);
+}
+
+static void put_sym(ByteBuf *b, uint32_t name, unsigned bind, unsigned type,
+                    unsigned shndx, uint64_t value, uint64_t size) {
+    put32(b, name);
+    put8(b, (bind << 4) | type);
+    put8(b, 0);                 // default visibility
+    put16(b, shndx);
+    put64(b, value);
+    put64(b, size);
+}
+
+static void put_shdr(ByteBuf *b, uint32_t name, uint32_t type, uint64_t flags,
+                     uint64_t offset, uint64_t size, uint32_t link, uint32_t info,
+                     uint64_t align, uint64_t entsize) {
+    put32(b, name);
+    put32(b, type);
+    put64(b, flags);
+    put64(b, 0);                // sh_addr: assigned by the linker
+    put64(b, offset);
+    put64(b, size);
+    put32(b, link);
+    put32(b, info);
+    put64(b, align);
+    put64(b, entsize);
+}
+
+static uint32_t add_string(ByteBuf *strtab, const char *s) {
+    uint32_t at = (uint32_t)strtab->len;
+    bytebuf_put(strtab, s, strlen(s) + 1);
+    return at;
+}
+
+/* The .rodata pool: every distinct bit pattern once, found through an
+   open-addressed table of entry indices */
+typedef struct {
+    uint64_t *bits;
+    int count;
+    int *table;         // -1 where free
+    size_t mask;
+} Pool;
+
+static void pool_init(Pool *p, size_t max_entries) {
+    size_t cap = 16;
+    while (cap < 2 * max_entries) cap *= 2;
+    p->bits = mmc_malloc((max_entries ? max_entries : 1) * sizeof(*p->bits));
+    p->table = mmc_malloc(cap * sizeof(*p->table));
+    if (!p->bits || !p->table) {
+        fprintf(stderr, "Out of memory building constant pool\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < cap; i++) p->table[i] = -1;
+    p->mask = cap - 1;
+    p->count = 0;
+}
+
+static int pool_intern(Pool *p, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    size_t i = (size_t)((bits * 0x9e3779b97f4a7c15ull) >> 32) & p->mask;
+    while (p->table[i] >= 0) {
+        if (p->bits[p->table[i]] == bits) return p->table[i];
+        i = (i + 1) & p->mask;
+    }
+    p->bits[p->count] = bits;
+    p->table[i] = p->count;
+    return p->count++;
+}
+
+static void pool_free(Pool *p) {
+    free(p->bits);
+    free(p->table);
+}
+
+int elf_write_object(FILE *out, const ElfFunc *funcs, int n) {
+    unsigned called = 0;
+    size_t nconsts = 0;
+    int max_consts = 0;
+    for (int f = 0; f < n; f++) {
+        called |= funcs[f].code->funcs;
+        nconsts += funcs[f].code->nconsts;
+        if (funcs[f].code->nconsts > max_consts) max_consts = funcs[f].code->nconsts;
+    }
+
+    // libm symbols follow the functions, in IROp order
+    int libm_sym[NLIBM];
+    int nsyms = FIRST_GLOBAL + n;
+    for (int op = 0; op < NLIBM; op++) {
+        libm_sym[op] = libm_names[op] && (called & (1u << op)) ? nsyms++ : -1;
+    }
+
+    Pool pool;
+    pool_init(&pool, nconsts);
+    int *entry = mmc_malloc((max_consts ? max_consts : 1) * sizeof(*entry));
+    uint64_t *start = mmc_malloc((n ? n : 1) * sizeof(*start));
+    uint64_t *length = mmc_malloc((n ? n : 1) * sizeof(*length));
+    if (!entry || !start || !length) {
+        fprintf(stderr, "Out of memory writing object\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* .text and its relocations, one function after another */
+    ByteBuf text = { 0 }, rela = { 0 };
+    EncodedCode enc = { 0 };
+    int status = 0;
+    for (int f = 0; f < n; f++) {
+        const AsmProgram *p = funcs[f].code;
+        if (encode_asm(p, NULL, &enc) < 0) {
+            status = -1;
+            break;
+        }
+        while (text.len % TEXT_ALIGN) put8(&text, 0xCC);   // int3
+        start[f] = text.len;
+        length[f] = enc.text.len;
+        bytebuf_put(&text, enc.text.bytes, enc.text.len);
+
+        for (int i = 0; i < p->nconsts; i++) entry[i] = pool_intern(&pool, p->consts[i]);
+        for (int i = 0; i < enc.nfixups; i++) {
+            // the fields hold target - (field + 4), which is S + A - P
+            // with the addend 4 short of the target
+            const Fixup *x = &enc.fixups[i];
+            int64_t addend;
+            uint64_t info;
+            if (x->kind == FIX_CONST) {
+                addend = (int64_t)entry[x->index] * 8 - 4;
+                info = (uint64_t)SYM_RODATA << 32 | R_X86_64_PC32;
+            } else {
+                addend = -4;
+                info = (uint64_t)libm_sym[x->index] << 32 | R_X86_64_PLT32;
+            }
+            put64(&rela, start[f] + x->offset);
+            put64(&rela, info);
+            put64(&rela, (uint64_t)addend);
+        }
+    }
+    encoded_free(&enc);
+    free(entry);
+
+    if (status == 0) {
+        ByteBuf strtab = { 0 }, symtab = { 0 }, shstrtab = { 0 };
+        add_string(&strtab, "");
+        put_sym(&symtab, 0, STB_LOCAL, STT_NOTYPE, 0, 0, 0);
+        put_sym(&symtab, 0, STB_LOCAL, STT_SECTION, SEC_TEXT, 0, 0);
+        put_sym(&symtab, 0, STB_LOCAL, STT_SECTION, SEC_RODATA, 0, 0);
+        for (int f = 0; f < n; f++) {
+            put_sym(&symtab, add_string(&strtab, funcs[f].name), STB_GLOBAL, STT_FUNC,
+                    SEC_TEXT, start[f], length[f]);
+        }
+        for (int op = 0; op < NLIBM; op++) {
+            if (libm_sym[op] < 0) continue;
+            put_sym(&symtab, add_string(&strtab, libm_names[op]), STB_GLOBAL, STT_NOTYPE, 0, 0, 0);
+        }
+        uint32_t sh_name[NSECTIONS];
+        for (int s = 0; s < NSECTIONS; s++) sh_name[s] = add_string(&shstrtab, section_names[s]);
+
+        /* the file: header, section contents, section headers */
+        ByteBuf file = { 0 };
+        uint64_t off[NSECTIONS] = { 0 }, size[NSECTIONS] = { 0 };
+        const ByteBuf *body[NSECTIONS] = {
+            [SEC_TEXT] = &text, [SEC_RELA] = &rela, [SEC_SYMTAB] = &symtab,
+            [SEC_STRTAB] = &strtab, [SEC_SHSTRTAB] = &shstrtab
+        };
+        static const unsigned char zero[EHDR_SIZE] = { 0 };
+        bytebuf_put(&file, zero, EHDR_SIZE);
+        for (int s = SEC_TEXT; s < NSECTIONS; s++) {
+            bytebuf_align(&file, s == SEC_TEXT ? TEXT_ALIGN : 8);
+            off[s] = file.len;
+            if (s == SEC_RODATA) {
+                for (int i = 0; i < pool.count; i++) put64(&file, pool.bits[i]);
+            } else if (body[s]) {
+                bytebuf_put(&file, body[s]->bytes, body[s]->len);
+            }
+            size[s] = file.len - off[s];
+        }
+
+        bytebuf_align(&file, 8);
+        uint64_t shoff = file.len;
+        put_shdr(&file, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        put_shdr(&file, sh_name[SEC_TEXT], SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+                 off[SEC_TEXT], size[SEC_TEXT], 0, 0, TEXT_ALIGN, 0);
+        put_shdr(&file, sh_name[SEC_RODATA], SHT_PROGBITS, SHF_ALLOC,
+                 off[SEC_RODATA], size[SEC_RODATA], 0, 0, 8, 0);
+        put_shdr(&file, sh_name[SEC_RELA], SHT_RELA, SHF_INFO_LINK,
+                 off[SEC_RELA], size[SEC_RELA], SEC_SYMTAB, SEC_TEXT, 8, RELA_SIZE);
+        put_shdr(&file, sh_name[SEC_SYMTAB], SHT_SYMTAB, 0,
+                 off[SEC_SYMTAB], size[SEC_SYMTAB], SEC_STRTAB, FIRST_GLOBAL, 8, SYM_SIZE);
+        put_shdr(&file, sh_name[SEC_STRTAB], SHT_STRTAB, 0,
+                 off[SEC_STRTAB], size[SEC_STRTAB], 0, 0, 1, 0);
+        put_shdr(&file, sh_name[SEC_SHSTRTAB], SHT_STRTAB, 0,
+                 off[SEC_SHSTRTAB], size[SEC_SHSTRTAB], 0, 0, 1, 0);
+        put_shdr(&file, sh_name[SEC_NOTE], SHT_PROGBITS, 0,
+                 off[SEC_NOTE], 0, 0, 0, 1, 0);
+
+        ByteBuf h = { 0 };
+        static const unsigned char ident[16] = {
+            0x7f, 'E', 'L', 'F', 2, 1, 1    // 64-bit, little-endian, version 1, System V ABI
+        };
+        bytebuf_put(&h, ident, sizeof(ident));
+        put16(&h, ET_REL);
+        put16(&h, EM_X86_64);
+        put32(&h, 1);                   // e_version
+        put64(&h, 0);                   // e_entry
+        put64(&h, 0);                   // e_phoff: no program headers
+        put64(&h, shoff);
+        put32(&h, 0);                   // e_flags
+        put16(&h, EHDR_SIZE);
+        put16(&h, 0);                   // e_phentsize
+        put16(&h, 0);                   // e_phnum
+        put16(&h, SHDR_SIZE);
+        put16(&h, NSECTIONS);
+        put16(&h, SEC_SHSTRTAB);
+        memcpy(file.bytes, h.bytes, EHDR_SIZE);
+
+        if (fwrite(file.bytes, 1, file.len, out) != file.len || fflush(out) != 0) status = -1;
+
+        bytebuf_free(&h);
+        bytebuf_free(&file);
+        bytebuf_free(&strtab);
+        bytebuf_free(&symtab);
+        bytebuf_free(&shstrtab);
+    }
+
+    bytebuf_free(&text);
+    bytebuf_free(&rela);
+    free(start);
+    free(length);
+    pool_free(&pool);
+    return status;
+}
@@ -0,0 +1,25 @@
+#ifndef ELFOBJ_H
+#define ELFOBJ_H
+
+#include <stdio.h>
+#include "codegen.h"
+
+/* Relocatable ELF64 objects for x86-64, so generated functions can be
+   linked straight into a C program with no assembler in between.
+
+   Every function becomes a global `double name(const double *vars)` in
+   .text. Their constants share one .rodata pool that holds each bit
+   pattern once and is addressed RIP-relative through R_X86_64_PC32
+   relocations; libm calls are R_X86_64_PLT32 relocations against the
+   undefined sin, cos, ... symbols, so link with -lm. */
+
+typedef struct {
+    const char *name;           // symbol, unique within the object
+    const AsmProgram *code;
+} ElfFunc;
+
+/* Write n functions to `out` as one object. -1 when a program cannot be
+   encoded or the write fails. */
+int elf_write_object(FILE *out, const ElfFunc *funcs, int n);
+
+#endif // ELFOBJ_H
@@ -0,0 +1,243 @@
+#include "encode.h"
+#include "alloc.h"
+#include "ir.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+void bytebuf_put(ByteBuf *b, const void *data, size_t n) {
+    if (n == 0) return;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n) cap *= 2;
+        unsigned char *p = mmc_realloc(b->bytes, cap);
+        if (!p) {
+            fprintf(stderr, "Out of memory growing code buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        b->bytes = p;
+        b->cap = cap;
+    }
+    memcpy(b->bytes + b->len, data, n);
+    b->len += n;
+}
+
+void bytebuf_align(ByteBuf *b, size_t align) {
+    static const unsigned char zero[16] = { 0 };
+    while (b->len % align) bytebuf_put(b, zero, 1);
+}
+
+void bytebuf_free(ByteBuf *b) {
+    free(b->bytes);
+    b->bytes = NULL;
+    b->len = b->cap = 0;
+}
+
+static void put8(ByteBuf *b, unsigned v) {
+    unsigned char c = (unsigned char)v;
+    bytebuf_put(b, &c, 1);
+}
+
+static void put32(ByteBuf *b, int32_t v) {
+    unsigned char c[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+    bytebuf_put(b, c, 4);
+}
+
+static void put64(ByteBuf *b, uint64_t v) {
+    for (int i = 0; i < 8; i++) put8(b, (unsigned)(v >> (8 * i)));
+}
+
+static void add_fixup(EncodedCode *c, FixupKind kind, int index) {
+    if (c->nfixups == c->fixups_cap) {
+        c->fixups_cap = c->fixups_cap ? c->fixups_cap * 2 : 16;
+        c->fixups = mmc_realloc(c->fixups, c->fixups_cap * sizeof(*c->fixups));
+        if (!c->fixups) {
+            fprintf(stderr, "Out of memory growing fixups\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    Fixup f = { kind, c->text.len, index };
+    c->fixups[c->nfixups++] = f;
+    put32(&c->text, 0);
+}
+
+/* ModRM and what follows it; the high bits of reg and of an xmm rm are
+   the prefix's business */
+static void put_modrm(EncodedCode *c, int reg, Loc rm) {
+    ByteBuf *b = &c->text;
+    int r = reg & 7;
+    switch (rm.kind) {
+        case LOC_XMM:
+            put8(b, 0xC0 | (r << 3) | (rm.n & 7));
+            break;
+        case LOC_STACK:
+            // [rsp + disp]: rm=100 selects a SIB byte, SIB 0x24 is plain rsp
+            if (rm.n == 0) {
+                put8(b, 0x04 | (r << 3));
+                put8(b, 0x24);
+            } else if (rm.n < 128) {
+                put8(b, 0x44 | (r << 3));
+                put8(b, 0x24);
+                put8(b, rm.n);
+            } else {
+                put8(b, 0x84 | (r << 3));
+                put8(b, 0x24);
+                put32(b, rm.n);
+            }
+            break;
+        case LOC_VAR:
+            // [base + disp]; rbx and rdi need neither a SIB byte nor a
+            // displacement when it is zero
+            if (rm.n == 0) {
+                put8(b, (r << 3) | rm.base);
+            } else if (rm.n < 128) {
+                put8(b, 0x40 | (r << 3) | rm.base);
+                put8(b, rm.n);
+            } else {
+                put8(b, 0x80 | (r << 3) | rm.base);
+                put32(b, rm.n);
+            }
+            break;
+        case LOC_CONST:
+            // [rip + disp32]
+            put8(b, 0x05 | (r << 3));
+            add_fixup(c, FIX_CONST, rm.n);
+            break;
+        default:
+            break;
+    }
+}
+
+/* prefix [REX] 0F opcode ModRM ... for SSE2 double ops; `reg` is the
+   xmm in ModRM.reg, `rm` the register or memory operand */
+static void sse_op(EncodedCode *c, unsigned prefix, unsigned opcode, int reg, Loc rm) {
+    ByteBuf *b = &c->text;
+    put8(b, prefix);
+    unsigned rex = 0x40;
+    if (reg >= 8) rex |= 0x04;                          // REX.R
+    if (rm.kind == LOC_XMM && rm.n >= 8) rex |= 0x01;   // REX.B
+    if (rex != 0x40) put8(b, rex);
+    put8(b, 0x0F);
+    put8(b, opcode);
+    put_modrm(c, reg, rm);
+}
+
+/* VEX prefix fields: the opcode map, and W with the implied prefix */
+#define VEX_0F      0x01
+#define VEX_0F38    0x02
+#define VEX_F2      0x03        // W0, pp=F2: the sd arithmetic
+#define VEX_66_W1   0x81        // W1, pp=66: the sd FMA forms
+
+/* VEX.LIG opcode ModRM ... for the AVX and FMA scalar double ops, reg
+   <- vvvv op rm. The two-byte C5 form only has map 0F, W0 and no room
+   for REX.B, so anything else, an xmm8+ rm included, takes the
+   three-byte C4 form; memory operands never need REX.X or REX.B here.
+   The R, X, B and vvvv fields are stored inverted. */
+static void vex_op(EncodedCode *c, unsigned map, unsigned wpp, unsigned opcode, int reg, int vvvv, Loc rm) {
+    ByteBuf *b = &c->text;
+    unsigned tail = (wpp & 0x80) | ((~vvvv & 15) << 3) | (wpp & 0x03);     // W vvvv L0 pp
+    int rm_high = rm.kind == LOC_XMM && rm.n >= 8;
+    if (map != VEX_0F || (wpp & 0x80) || rm_high) {
+        put8(b, 0xC4);
+        put8(b, (reg < 8) << 7 | 0x40 | !rm_high << 5 | map);     // R X B map
+        put8(b, tail);
+    } else {
+        put8(b, 0xC5);
+        put8(b, (reg < 8) << 7 | tail);
+    }
+    put8(b, opcode);
+    put_modrm(c, reg, rm);
+}
+
+static int encode_instr(const AsmInstr *i, void *const *func_addrs, EncodedCode *c) {
+    ByteBuf *b = &c->text;
+    switch (i->op) {
+        case ASM_MOVSD:
+            // Register copies use movapd: movsd xmm, xmm only writes the
+            // low lane and so depends on the destination's old value
+            if (i->dst.kind == LOC_XMM && i->src.kind == LOC_XMM) sse_op(c, 0x66, 0x28, i->dst.n, i->src);
+            else if (i->dst.kind == LOC_XMM) sse_op(c, 0xF2, 0x10, i->dst.n, i->src);
+            else if (i->src.kind == LOC_XMM) sse_op(c, 0xF2, 0x11, i->src.n, i->dst);
+            else return -1;
+            break;
+        case ASM_ADDSD: sse_op(c, 0xF2, 0x58, i->dst.n, i->src); break;
+        case ASM_MULSD: sse_op(c, 0xF2, 0x59, i->dst.n, i->src); break;
+        case ASM_SUBSD: sse_op(c, 0xF2, 0x5C, i->dst.n, i->src); break;
+        case ASM_DIVSD: sse_op(c, 0xF2, 0x5E, i->dst.n, i->src); break;
+        case ASM_SQRTSD: sse_op(c, 0xF2, 0x51, i->dst.n, i->src); break;
+        case ASM_MINSD: sse_op(c, 0xF2, 0x5D, i->dst.n, i->src); break;
+        case ASM_MAXSD: sse_op(c, 0xF2, 0x5F, i->dst.n, i->src); break;
+        case ASM_ANDPD: sse_op(c, 0x66, 0x54, i->dst.n, i->src); break;
+        case ASM_ORPD:  sse_op(c, 0x66, 0x56, i->dst.n, i->src); break;
+        case ASM_XORPD: sse_op(c, 0x66, 0x57, i->dst.n, i->src); break;
+        case ASM_PADDQ: sse_op(c, 0x66, 0xD4, i->dst.n, i->src); break;
+        case ASM_PSUBQ: sse_op(c, 0x66, 0xFB, i->dst.n, i->src); break;
+        case ASM_VADDSD: vex_op(c, VEX_0F, VEX_F2, 0x58, i->dst.n, i->src.n, i->src2); break;
+        case ASM_VMULSD: vex_op(c, VEX_0F, VEX_F2, 0x59, i->dst.n, i->src.n, i->src2); break;
+        case ASM_VSUBSD: vex_op(c, VEX_0F, VEX_F2, 0x5C, i->dst.n, i->src.n, i->src2); break;
+        case ASM_VDIVSD: vex_op(c, VEX_0F, VEX_F2, 0x5E, i->dst.n, i->src.n, i->src2); break;
+        case ASM_VFMADD231SD: vex_op(c, VEX_0F38, VEX_66_W1, 0xB9, i->dst.n, i->src.n, i->src2); break;
+        case ASM_PSLLQ:
+        case ASM_PSRLQ:
+            // 66 0F 73 /6 (left) or /2 (right) ib: the register is ModRM.rm
+            sse_op(c, 0x66, 0x73, i->op == ASM_PSLLQ ? 6 : 2, i->dst);
+            put8(b, i->src.n);
+            break;
+        case ASM_SUB_RSP:
+        case ASM_ADD_RSP:
+            // REX.W 81 /5 (sub) or /0 (add) with imm32
+            put8(b, 0x48);
+            put8(b, 0x81);
+            put8(b, i->op == ASM_SUB_RSP ? 0xEC : 0xC4);
+            put32(b, i->src.n);
+            break;
+        case ASM_CALL:
+            if (func_addrs) {
+                // mov rax, imm64; call rax
+                put8(b, 0x48);
+                put8(b, 0xB8);
+                put64(b, (uint64_t)(uintptr_t)func_addrs[i->dst.n]);
+                put8(b, 0xFF);
+                put8(b, 0xD0);
+            } else {
+                put8(b, 0xE8);
+                add_fixup(c, FIX_FUNC, i->dst.n);
+            }
+            break;
+        case ASM_PUSH:
+            put8(b, 0x50 + i->dst.n);
+            break;
+        case ASM_POP:
+            put8(b, 0x58 + i->dst.n);
+            break;
+        case ASM_MOV:
+            // REX.W 89 /r: mov r/m64, r64
+            put8(b, 0x48);
+            put8(b, 0x89);
+            put8(b, 0xC0 | (i->src.n << 3) | i->dst.n);
+            break;
+        case ASM_RET:
+            put8(b, 0xC3);
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+int encode_asm(const AsmProgram *p, void *const *func_addrs, EncodedCode *out) {
+    out->text.len = 0;
+    out->nfixups = 0;
+    for (int i = 0; i < p->count; i++) {
+        if (encode_instr(&p->code[i], func_addrs, out) < 0) return -1;
+    }
+    return 0;
+}
+
+void encoded_free(EncodedCode *c) {
+    bytebuf_free(&c->text);
+    free(c->fixups);
+    c->fixups = NULL;
+    c->nfixups = c->fixups_cap = 0;
+}
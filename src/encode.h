@@ -0,0 +1,43 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stddef.h>
+#include "codegen.h"
+
+/* x86-64 machine-code encoder for AsmProgram. */
+
+typedef struct {
+    unsigned char *bytes;
+    size_t len, cap;
+} ByteBuf;
+
+typedef enum {
+    FIX_CONST,      // rel32 to constant-pool entry `index`
+    FIX_FUNC        // rel32 to libm function `index` (an IROp)
+} FixupKind;
+
+/* A 32-bit field at `offset` holding target - (offset + 4) */
+typedef struct {
+    FixupKind kind;
+    size_t offset;
+    int index;
+} Fixup;
+
+typedef struct {
+    ByteBuf text;
+    Fixup *fixups;
+    int nfixups, fixups_cap;
+} EncodedCode;
+
+/* Encode p's instructions. When func_addrs is non-NULL (indexed by IROp)
+   calls become `mov rax, imm64; call rax` to those addresses, otherwise
+   `call rel32` with a FIX_FUNC fixup. Constant loads are always
+   RIP-relative with a FIX_CONST fixup. Returns 0 on success. */
+int encode_asm(const AsmProgram *p, void *const *func_addrs, EncodedCode *out);
+void encoded_free(EncodedCode *c);
+
+void bytebuf_put(ByteBuf *b, const void *data, size_t n);
+void bytebuf_align(ByteBuf *b, size_t align);
+void bytebuf_free(ByteBuf *b);
+
+#endif // ENCODE_H
@@ -0,0 +1,227 @@
+#include "fastmath.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/* Chebyshev interpolants of e^r on [-ln2/2, ln2/2], of (sin r - r)/r^3
+   and (cos r - 1)/r^2 in z = r^2 on [0, (pi/4)^2], and of the series
+   (log m - 2s)/(2s^3) in z = s^2 of fdlibm's log, s = f/(2+f). Highest
+   degree first. */
+static const double k_exp7[] = {
+    0.00019907582591325134, 0.0013948590286863383, 0.008333283518768105,
+    0.041666218139710595, 0.1666666678638044, 0.5000000107793876,
+    0.9999999999955055, 0.9999999999595294
+};
+static const double k_exp8[] = {
+    2.4876178959085513e-05, 0.00019915881871396035, 0.001388882165071769,
+    0.008333266071022454, 0.0416666668910917, 0.16666666891180545,
+    0.49999999999797773, 0.999999999979769, 1.0
+};
+static const double k_exp9[] = {
+    2.763265575933203e-06, 2.488447635159146e-05, 0.0001984119061583585,
+    0.0013888801714761622, 0.008333333367332009, 0.041666667040776456,
+    0.16666666666615607, 0.4999999999943814, 1.0000000000000013,
+    1.0000000000000135
+};
+static const double k_exp10[] = {
+    2.7626371065696354e-07, 2.764019739169484e-06, 2.480150431378554e-05,
+    0.00019841170230570286, 0.001388888893251478, 0.008333333385699212,
+    0.041666666666573066, 0.16666666666554314, 0.5000000000000006,
+    1.0000000000000067, 1.0
+};
+static const double k_exp11[] = {
+    2.5110049204818658e-08, 2.763265472252779e-07, 2.755724088722987e-06,
+    2.4801485441561313e-05, 0.00019841269890076403, 0.0013888888952352863,
+    0.008333333333319589, 0.04166666666648795, 0.1666666666666668,
+    0.5000000000000019, 1.0, 1.0
+};
+
+static const double k_sin3[] = {
+    2.7249895230611676e-06, -0.000198400864995936, 0.008333331874273714,
+    -0.16666666663854168
+};
+static const double k_sin4[] = {
+    -2.4805611712122475e-08, 2.7555990664728974e-06, -0.00019841266916110632,
+    0.008333333331078323, -0.16666666666663885
+};
+static const double k_sin5[] = {
+    1.5918115263265974e-10, -2.505113165023518e-08, 2.7557316101617874e-06,
+    -0.00019841269836756774, 0.008333333333330948, -0.16666666666666666
+};
+static const double k_cos4[] = {
+    -2.7237108576245085e-07, 2.4799861846361453e-05, -0.0013888885090262895,
+    0.041666666637384386, -0.49999999999963873
+};
+static const double k_cos5[] = {
+    2.066548384659679e-09, -2.7555855220105783e-07, 2.4801582621951665e-05,
+    -0.0013888888882125252, 0.04166666666663091, -0.49999999999999967
+};
+static const double k_cos6[] = {
+    -1.1367988423294987e-11, 2.0875886564482672e-09, -2.755731556524682e-07,
+    2.4801587293690305e-05, -0.001388888888888077, 0.04166666666666664, -0.5
+};
+
+static const double k_log3[] = {
+    0.11665290969120946, 0.14275408299855774, 0.20000060938486,
+    0.33333333277225824
+};
+static const double k_log4[] = {
+    0.09681388418373767, 0.11095697246587528, 0.1428587731786638,
+    0.19999999398424337, 0.33333333333687726
+};
+static const double k_log5[] = {
+    0.083109735450887, 0.09070092601246624, 0.11111431238424771,
+    0.14285712068258175, 0.200000000056061, 0.3333333333333104
+};
+static const double k_log6[] = {
+    0.07308292712444311, 0.07665855309105386, 0.09091444727837474,
+    0.11111105565129939, 0.14285714313001635, 0.19999999999949722,
+    0.3333333333333335
+};
+
+#define N(p) (int)(sizeof(p) / sizeof(p[0]))
+#define TRIG(op, ulp, s, c) { op, ulp, s, N(s), c, N(c) }
+
+/* Cheapest first within each function */
+static const FmKernel kernels[] = {
+    TRIG(IR_SIN, 1.3e5, k_sin3, k_cos4),
+    TRIG(IR_SIN, 2100, k_sin4, k_cos4),
+    TRIG(IR_SIN, 130, k_sin4, k_cos5),
+    TRIG(IR_SIN, 3, k_sin5, k_cos5),
+    TRIG(IR_SIN, 2, k_sin5, k_cos6),
+    TRIG(IR_COS, 1.3e5, k_sin3, k_cos4),
+    TRIG(IR_COS, 2100, k_sin4, k_cos4),
+    TRIG(IR_COS, 130, k_sin4, k_cos5),
+    TRIG(IR_COS, 3, k_sin5, k_cos5),
+    TRIG(IR_COS, 2, k_sin5, k_cos6),
+    TRIG(IR_TAN, 1.9e5, k_sin3, k_cos4),
+    TRIG(IR_TAN, 2800, k_sin4, k_cos4),
+    TRIG(IR_TAN, 190, k_sin4, k_cos5),
+    TRIG(IR_TAN, 6, k_sin5, k_cos5),
+    TRIG(IR_TAN, 4, k_sin5, k_cos6),
+    { IR_LOG, 1.1e5, k_log3, N(k_log3), NULL, 0 },
+    { IR_LOG, 700, k_log4, N(k_log4), NULL, 0 },
+    { IR_LOG, 5, k_log5, N(k_log5), NULL, 0 },
+    { IR_LOG, 2, k_log6, N(k_log6), NULL, 0 },
+    { IR_EXP, 4e5, k_exp7, N(k_exp7), NULL, 0 },
+    { IR_EXP, 7000, k_exp8, N(k_exp8), NULL, 0 },
+    { IR_EXP, 130, k_exp9, N(k_exp9), NULL, 0 },
+    { IR_EXP, 5, k_exp10, N(k_exp10), NULL, 0 },
+    { IR_EXP, 2, k_exp11, N(k_exp11), NULL, 0 },
+    { IR_SQRT, 0, NULL, 0, NULL, 0 },
+};
+
+int fm_kernel_count(void) {
+    return N(kernels);
+}
+
+const FmKernel* fm_kernel_at(int i) {
+    return &kernels[i];
+}
+
+void fm_domain(IROp op, double *lo, double *hi) {
+    switch (op) {
+        case IR_EXP:  *lo = FM_EXP_MIN; *hi = FM_EXP_MAX; break;
+        case IR_LOG:  *lo = 0x1p-1021; *hi = 0x1p1023; break;
+        case IR_SQRT: *lo = 0x1p-1021; *hi = 0x1p1023; break;
+        default:      *lo = -1e5; *hi = 1e5; break;
+    }
+}
+
+void fm_select(FmSet *s, double max_ulp) {
+    memset(s, 0, sizeof(*s));
+    s->max_ulp = max_ulp;
+    if (max_ulp <= 0) return;
+    for (int i = 0; i < N(kernels); i++) {
+        const FmKernel *k = &kernels[i];
+        // the log kernels run no faster than libm's log in the JIT, so
+        // they would only cost accuracy
+        if (k->op == IR_LOG) continue;
+        if (!s->k[k->op] && k->max_ulp <= max_ulp) s->k[k->op] = k;
+    }
+}
+
+/* The operations below are the ones codegen emits, in the same order */
+
+static uint64_t to_bits(double x) {
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static double from_bits(uint64_t u) {
+    double x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+/* Horner's rule in u^2 on the odd and even coefficients at once, two
+   independent chains of half the length; n >= 2 */
+static double horner2(const double *p, int n, double u) {
+    double u2 = u * u;
+    double a = p[0], b = p[1];
+    for (int i = 2; i < n; i += 2) {
+        a = a * u2 + p[i];
+        if (i + 1 < n) b = b * u2 + p[i + 1];
+    }
+    // a has p[0], whose degree is n - 1
+    return n % 2 ? b * u + a : a * u + b;
+}
+
+/* 2^k is built in kd's exponent field: the integer k + 1023 sits in its
+   low bits, and shifting them up by 52 gives the double 2^k */
+static double fm_exp(const FmKernel *k, double x) {
+    x = x > FM_EXP_MIN ? x : FM_EXP_MIN;        // maxsd, minsd
+    x = x < FM_EXP_MAX ? x : FM_EXP_MAX;
+    double kd = x * FM_INV_LN2 + (FM_SHIFTER + 1023);
+    double n = kd - (FM_SHIFTER + 1023);
+    double r = x - n * FM_LN2_HI;
+    r = r - n * FM_LN2_LO;
+    return horner2(k->p1, k->n1, r) * from_bits(to_bits(kd) << 52);
+}
+
+/* Subtracting sqrt(2)/2's mantissa first puts m in [sqrt(2)/2, sqrt(2))
+   and moves the exponent to match */
+static double fm_log(const FmKernel *k, double x) {
+    uint64_t t = to_bits(x) - FM_LOG_MC;
+    double e = from_bits((t >> 52) | to_bits(FM_SHIFTER)) - (FM_SHIFTER + 1022);
+    double f = from_bits((t & FM_MANT) + FM_LOG_M0) - 1.0;
+    double s = f / (f + 2.0);
+    double z = s * s;
+    double q = horner2(k->p1, k->n1, z) * z;
+    s = s + s;
+    q = q * s + s;
+    return e * FM_LN2_HI + (e * FM_LN2_LO + q);
+}
+
+/* sin and cos of r both come out; the quadrant k picks one of them and
+   its sign. cos(x) = sin(x + pi/2), so it rounds with k one higher. */
+static double fm_trig(const FmKernel *k, double x) {
+    double sh = k->op == IR_COS ? FM_SHIFTER + 1 : FM_SHIFTER;
+    double kd = x * FM_TWO_OVER_PI + sh;
+    double n = kd - sh;
+    double r = x - n * FM_PIO2_1;
+    r = r - n * FM_PIO2_2;
+    r = r - n * FM_PIO2_3;
+    double z = r * r;
+    uint64_t sr = to_bits(horner2(k->p1, k->n1, z) * z * r + r);
+    uint64_t cr = to_bits(horner2(k->p2, k->n2, z) * z + 1.0);
+    uint64_t q = to_bits(kd);
+    uint64_t mask = 0 - (q & 1);                // odd quadrant: swap
+    if (k->op == IR_TAN) {
+        uint64_t d = (sr ^ cr) & mask;          // -cos/sin there
+        double t = from_bits(sr ^ d) / from_bits(cr ^ d);
+        return from_bits(to_bits(t) ^ (mask & FM_SIGN));
+    }
+    uint64_t res = sr ^ ((sr ^ cr) & mask);
+    return from_bits(res ^ ((q & 2) << 62));
+}
+
+double fm_eval(const FmKernel *k, double x) {
+    switch (k->op) {
+        case IR_EXP:  return fm_exp(k, x);
+        case IR_LOG:  return fm_log(k, x);
+        case IR_SQRT: return sqrt(x);
+        default:      return fm_trig(k, x);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include "ir.h"
+
+/* Polynomial kernels that stand in for libm under --fast-math.
+
+   Each kernel reduces its argument with a few exact steps and evaluates
+   a polynomial on a small interval: e^x = 2^k e^r with |r| <= ln2/2,
+   log x = e ln2 + log m with m in [sqrt(2)/2, sqrt(2)), and sin, cos
+   and tan through r = x - k pi/2 with |r| <= pi/4. Codegen emits the
+   same operations inline, so generated code and fm_eval agree to the
+   bit.
+
+   Every function has kernels of decreasing cost. max_ulp is the worst
+   error against libm that mymathc-fm-accuracy measured over fm_domain.
+   Outside that domain the kernels assume what fast math assumes:
+   - arguments are finite; NaN and infinity come out as garbage
+   - exp clamps its argument to [-708, 709]
+   - log expects a positive normal number
+   - sin, cos and tan lose accuracy beyond |x| = 1e5
+   sqrt is the sqrtsd instruction, correctly rounded like libm's. */
+typedef struct {
+    IROp op;                // IR_SIN, IR_COS, IR_TAN, IR_EXP, IR_LOG or IR_SQRT
+    double max_ulp;
+    const double *p1;       // highest degree first; exp: e^r, log: the
+    int n1;                 // series in s^2, trig: the sine part
+    const double *p2;       // trig: the cosine part
+    int n2;
+} FmKernel;
+
+/* The kernels for one budget */
+typedef struct {
+    double max_ulp;                     // 0: fast math off
+    const FmKernel *k[IR_VAR + 1];      // per IROp, NULL where libm is kept
+} FmSet;
+
+/* For each function the cheapest kernel within max_ulp; log always
+   keeps libm */
+void fm_select(FmSet *s, double max_ulp);
+double fm_eval(const FmKernel *k, double x);
+
+/* Every kernel, cheapest first for each function, and where its error
+   was measured */
+int fm_kernel_count(void);
+const FmKernel* fm_kernel_at(int i);
+void fm_domain(IROp op, double *lo, double *hi);
+
+/* Constants of the reduction steps, shared with codegen. Adding SHIFTER
+   rounds a double below 2^51 to an integer held in the low mantissa
+   bits. */
+#define FM_SHIFTER      0x1.8p52
+#define FM_EXP_MIN      -708.0
+#define FM_EXP_MAX      709.0
+#define FM_INV_LN2      1.44269504088896338700e+00
+#define FM_LN2_HI       6.93147180369123816490e-01      // exact times any exponent
+#define FM_LN2_LO       1.90821492927058770002e-10
+#define FM_LOG_MC       0x0006a09e667f3bcdULL           // mantissa bits of sqrt(2)/2
+#define FM_LOG_M0       0x3fe6a09e667f3bcdULL           // sqrt(2)/2
+#define FM_MANT         0x000fffffffffffffULL
+#define FM_SIGN         0x8000000000000000ULL
+#define FM_TWO_OVER_PI  6.36619772367581382433e-01
+#define FM_PIO2_1       1.57079632673412561417e+00      // pi/2 in three parts,
+#define FM_PIO2_2       6.07710050630396597660e-11      // the first two exact
+#define FM_PIO2_3       2.02226624871116645580e-21      // times k < 2^20
+
+#endif // FASTMATH_H
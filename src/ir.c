@@ -1,135 +1,174 @@
 #include "ir.h"
+#include "alloc.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <string.h>
 #include <math.h>
-#include "semantic.h"
 
-typedef struct IRInstr {
-    char *text;
-    struct IRInstr *next;
-} IRInstr;
+/* Register already holding each AST node's value, indexed by node id.
+   Entries stamped with an older generation belong to earlier statements,
+   which avoids clearing the table for every gen_ir call. */
+struct NodeReg {
+    unsigned gen;
+    int reg;
+};
 
-static IRInstr *ir_head = NULL;
-static IRInstr *ir_tail = NULL;
-static int temp_count = 0;
-static int ir_error = 0;
+void ir_program_clear(IRProgram *p) {
+    p->count = 0;
+    p->nregs = 0;
+}
 
+void ir_program_free(IRProgram *p) {
+    free(p->code);
+    p->code = NULL;
+    p->count = p->cap = p->nregs = 0;
+}
 
+/* dst keeps its own buffer, grown as needed */
+void ir_program_copy(IRProgram *dst, const IRProgram *src) {
+    ir_program_clear(dst);
+    for (int i = 0; i < src->count; i++) ir_append(dst, src->code[i]);
+    dst->nregs = src->nregs;
+    dst->var_names = src->var_names;
+}
 
-void init_ir() {
-    IRInstr *cur = ir_head;
-    while (cur) {
-        IRInstr *next = cur->next;
-        free(cur->text);
-        free(cur);
-        cur = next;
-    }
-    ir_head = NULL;
-    ir_tail = NULL;
-    temp_count = 0;
-    ir_error = 0;
-}
-
-static char* new_temp() {
-    if (ir_error) return NULL;
-    char *buf = malloc(16);
-    if (!buf) {
-        ir_error = 1;
-        init_ir();
-        return NULL;
+void ir_append(IRProgram *p, IRInstr instr) {
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 64;
+        IRInstr *code = mmc_realloc(p->code, cap * sizeof(*code));
+        if (!code) {
+            fprintf(stderr, "Out of memory growing IR\n");
+            exit(EXIT_FAILURE);
+        }
+        p->code = code;
+        p->cap = cap;
     }
-    sprintf(buf, "t%d", temp_count++);
-    return buf;
+    p->code[p->count++] = instr;
+    if (instr.dst >= p->nregs) p->nregs = instr.dst + 1;
 }
 
-static void emit(const char *fmt, ...) {
-    if (ir_error || !fmt) return;
-
-    va_list ap;
-    va_start(ap, fmt);
-    char buf[256];
-    vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
+int ir_is_binary(IROp op) {
+    return op == IR_ADD || op == IR_SUB || op == IR_MUL || op == IR_DIV || op == IR_POW;
+}
 
-    IRInstr *i = malloc(sizeof(*i));
-    if (!i) {
-        ir_error = 1;
-        init_ir();
-        return;
-    }
-    
-    i->text = strdup(buf);
-    if (!i->text) {
-        free(i);
-        ir_error = 1;
-        init_ir();
-        return;
+const char* ir_op_name(IROp op) {
+    switch (op) {
+        case IR_ADD:  return "+";
+        case IR_SUB:  return "-";
+        case IR_MUL:  return "*";
+        case IR_DIV:  return "/";
+        case IR_FMA:  return "fma";
+        case IR_POW:  return "^";
+        case IR_NEG:  return "-";
+        case IR_SIN:  return "sin";
+        case IR_COS:  return "cos";
+        case IR_TAN:  return "tan";
+        case IR_LOG:  return "log";
+        case IR_EXP:  return "exp";
+        case IR_SQRT: return "sqrt";
+        case IR_CONST:
+        case IR_VAR: break;
     }
-    
-    i->next = NULL;
+    return "?";
+}
 
-    if (!ir_head) {
-        ir_head = ir_tail = i;
-    } else {
-        ir_tail->next = i;
-        ir_tail = i;
-    }
+void init_ir(IRCtx *c) {
+    // Keep the buffer around, the next statement reuses it
+    ir_program_clear(&c->prog);
+    c->error = 0;
+}
+
+static int new_temp(IRCtx *c) {
+    return c->prog.nregs++;
+}
+
+static void emit(IRCtx *c, IROp op, int dst, int a, int b, double imm) {
+    IRInstr i = { .op = op, .dst = dst, .a = a, .b = b, .imm = imm, .c = -1 };
+    ir_append(&c->prog, i);
 }
 
 static int is_constant(ASTNode *n) {
     return n && n->type == NODE_NUM;
 }
 
-static char* gen_ir_internal(ASTNode *n) {
-    if (ir_error || !n) return NULL;
+static NodeReg* node_reg(IRCtx *c, ASTNode *n) {
+    if (n->id >= c->node_regs_cap) {
+        size_t cap = c->node_regs_cap ? c->node_regs_cap : 1024;
+        while (cap <= n->id) cap *= 2;
+        NodeReg *p = mmc_realloc(c->node_regs, cap * sizeof(*p));
+        if (!p) {
+            fprintf(stderr, "Out of memory growing IR node table\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = c->node_regs_cap; i < cap; i++) p[i].gen = 0;
+        c->node_regs = p;
+        c->node_regs_cap = cap;
+    }
+    return &c->node_regs[n->id];
+}
+
+static int gen_node(IRCtx *c, ASTNode *n);
+
+/* The AST is hash-consed, so a node reached twice is the same
+   subexpression: emit it once and hand out its register afterwards */
+static int gen_ir_internal(IRCtx *c, ASTNode *n) {
+    if (c->error || !n) return -1;
+
+    NodeReg *slot = node_reg(c, n);
+    if (slot->gen == c->gen) return slot->reg;
+
+    int t = gen_node(c, n);
+    if (t >= 0) {
+        slot = node_reg(c, n);  // the table may have moved while recursing
+        slot->gen = c->gen;
+        slot->reg = t;
+    }
+    return t;
+}
+
+static int gen_node(IRCtx *c, ASTNode *n) {
 
     // Try constant folding first
     if (is_constant(n)) {
-        char *t = new_temp();
-        if (!t) return NULL;
-        emit("%s = %.15g", t, n->value);
+        int t = new_temp(c);
+        emit(c, IR_CONST, t, -1, -1, n->value);
+        return t;
+    }
+
+    if (n->type == NODE_VAR) {
+        int t = new_temp(c);
+        IRInstr i = { .op = IR_VAR, .dst = t, .a = -1, .b = -1, .var = (int)n->var, .c = -1 };
+        ir_append(&c->prog, i);
         return t;
     }
 
     // Handle unary operations
     if (!n->right) {
-        char *a = gen_ir_internal(n->left);
-        if (!a) return NULL;
-        
-        char *t = new_temp();
-        if (!t) {
-            free(a);
-            return NULL;
-        }
+        int a = gen_ir_internal(c, n->left);
+        if (a < 0) return -1;
 
+        IROp op;
         switch(n->type) {
-            case NODE_NEG: emit("%s = -%s", t, a); break;
-            case NODE_SIN: emit("%s = sin %s", t, a); break;
-            case NODE_COS: emit("%s = cos %s", t, a); break;
-            case NODE_TAN: emit("%s = tan %s", t, a); break;
-            case NODE_LOG: emit("%s = log %s", t, a); break;
-            case NODE_EXP: emit("%s = exp %s", t, a); break;
-            case NODE_SQRT: emit("%s = sqrt %s", t, a); break;
+            case NODE_NEG: op = IR_NEG; break;
+            case NODE_SIN: op = IR_SIN; break;
+            case NODE_COS: op = IR_COS; break;
+            case NODE_TAN: op = IR_TAN; break;
+            case NODE_LOG: op = IR_LOG; break;
+            case NODE_EXP: op = IR_EXP; break;
+            case NODE_SQRT: op = IR_SQRT; break;
             default:
-                free(a);
-                free(t);
-                ir_error = 1;
-                return NULL;
+                c->error = 1;
+                return -1;
         }
-        free(a);
+        int t = new_temp(c);
+        emit(c, op, t, a, -1, 0.0);
         return t;
     }
 
     // Handle binary operations with constant folding
-    char *a = gen_ir_internal(n->left);
-    char *b = gen_ir_internal(n->right);
-    if (!a || !b) {
-        if (a) free(a);
-        if (b) free(b);
-        return NULL;
-    }
+    int a = gen_ir_internal(c, n->left);
+    int b = gen_ir_internal(c, n->right);
+    if (a < 0 || b < 0) return -1;
 
     // Check if both operands are constants
     if (is_constant(n->left) && is_constant(n->right)) {
@@ -150,60 +189,80 @@ static char* gen_ir_internal(ASTNode *n) {
         }
 
         if (valid) {
-            char *t = new_temp();
-            if (t) emit("%s = %.15g", t, result);
-            free(a);
-            free(b);
+            int t = new_temp(c);
+            emit(c, IR_CONST, t, -1, -1, result);
             return t;
         }
     }
 
-    char *t = new_temp();
-    if (!t) {
-        free(a);
-        free(b);
-        return NULL;
-    }
-
-    const char *op = NULL;
+    IROp op;
     switch(n->type) {
-        case NODE_ADD: op = "+"; break;
-        case NODE_SUB: op = "-"; break;
-        case NODE_MUL: op = "*"; break;
-        case NODE_DIV: op = "/"; break;
-        case NODE_POW: op = "^"; break;
+        case NODE_ADD: op = IR_ADD; break;
+        case NODE_SUB: op = IR_SUB; break;
+        case NODE_MUL: op = IR_MUL; break;
+        case NODE_DIV: op = IR_DIV; break;
+        case NODE_POW: op = IR_POW; break;
         default:
-            free(a);
-            free(b);
-            free(t);
-            ir_error = 1;
-            return NULL;
+            c->error = 1;
+            return -1;
     }
 
-    emit("%s = %s %s %s", t, a, op, b);
-    
-    free(a);
-    free(b);
+    int t = new_temp(c);
+    emit(c, op, t, a, b, 0.0);
     return t;
 }
 
-char* gen_ir(ASTNode *n) {
-    init_ir();  // Reset IR state for each generation
-    if (cJSON_GetArraySize(get_semantic_json()) > 0) {
-        ir_error = 1;
-        return gen_ir_internal(n);
+int gen_ir(IRCtx *c, ASTNode *n, const VarEnv *env) {
+    init_ir(c);     // Reset IR state for each generation
+    c->prog.var_names = env ? env->names : NULL;
+    if (++c->gen == 0) {
+        for (size_t i = 0; i < c->node_regs_cap; i++) c->node_regs[i].gen = 0;
+        c->gen = 1;
+    }
+    return gen_ir_internal(c, n);
+}
+
+const IRProgram* get_ir(const IRCtx *c) {
+    return &c->prog;
+}
+
+void ir_ctx_free(IRCtx *c) {
+    ir_program_free(&c->prog);
+    free(c->node_regs);
+    memset(c, 0, sizeof(*c));
+}
+
+void ir_format_instr(const IRInstr *i, const char *const *var_names, char *buf, size_t size) {
+    if (i->op == IR_CONST) {
+        // The shortest of 15 or 17 digits that reads back as the same double
+        int n = snprintf(buf, size, "t%d = ", i->dst);
+        if (n < 0 || (size_t)n >= size) return;
+        snprintf(buf + n, size - n, "%.15g", i->imm);
+        if (strtod(buf + n, NULL) != i->imm) snprintf(buf + n, size - n, "%.17g", i->imm);
+    } else if (i->op == IR_VAR) {
+        if (var_names) snprintf(buf, size, "t%d = %s", i->dst, var_names[i->var]);
+        else snprintf(buf, size, "t%d = var%d", i->dst, i->var);
+    } else if (ir_is_binary(i->op)) {
+        snprintf(buf, size, "t%d = t%d %s t%d", i->dst, i->a, ir_op_name(i->op), i->b);
+    } else if (i->op == IR_FMA) {
+        snprintf(buf, size, "t%d = fma t%d, t%d, t%d", i->dst, i->a, i->b, i->c);
+    } else if (i->op == IR_NEG) {
+        snprintf(buf, size, "t%d = -t%d", i->dst, i->a);
+    } else {
+        snprintf(buf, size, "t%d = %s t%d", i->dst, ir_op_name(i->op), i->a);
     }
-    return gen_ir_internal(n);
 }
 
-cJSON* get_ir_json() {
-    cJSON *arr = cJSON_CreateArray();
-    for (IRInstr *i = ir_head; i; i = i->next) {
-        cJSON_AddItemToArray(arr, cJSON_CreateString(i->text));
+void ir_program_json(JsonWriter *w, const IRProgram *p) {
+    char line[128];
+    json_begin_array(w);
+    for (int i = 0; i < p->count; i++) {
+        ir_format_instr(&p->code[i], p->var_names, line, sizeof(line));
+        json_string(w, line);
     }
-    return arr;
+    json_end_array(w);
 }
 
-int ir_has_error(void) {
-    return ir_error;
-}
\ No newline at end of file
+int ir_has_error(const IRCtx *c) {
+    return c->error;
+}
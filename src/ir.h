@@ -1,12 +1,70 @@
 #ifndef IR_H
 #define IR_H
 
+#include <stddef.h>
 #include "ast.h"
-#include "cJSON.h"
+#include "json.h"
 
-void init_ir(void);
-char* gen_ir(ASTNode *n);
-cJSON* get_ir_json(void);
-int ir_has_error(void);
+/* Three-address IR over numbered virtual registers (t0, t1, ...). */
+typedef enum {
+    IR_CONST,                           // dst = imm
+    IR_ADD, IR_SUB, IR_MUL, IR_DIV,     // dst = a op b
+    IR_FMA,                             // dst = a * b + c, rounded once
+    IR_POW,                             // dst = a ^ b
+    IR_NEG,                             // dst = -a
+    IR_SIN, IR_COS, IR_TAN,             // dst = f a
+    IR_LOG, IR_EXP, IR_SQRT,
+    IR_VAR                              // dst = input variable `var`
+} IROp;
+
+typedef struct {
+    IROp op;
+    int dst;
+    int a, b;           // operand registers, -1 when unused
+    double imm;         // value of IR_CONST
+    int var;            // variable index of IR_VAR
+    int c;              // addend register of IR_FMA, -1 for other ops
+} IRInstr;
+
+/* Instructions are stored contiguously and in execution order. */
+typedef struct {
+    IRInstr *code;
+    int count;
+    int cap;
+    int nregs;          // registers are numbered 0 .. nregs-1
+    const char *const *var_names;   // for rendering IR_VAR, may be NULL
+} IRProgram;
+
+typedef struct NodeReg NodeReg;
+
+/* State of IR generation. Zero-initialize before first use; every
+   thread running the pipeline needs its own. */
+typedef struct {
+    IRProgram prog;
+    int error;
+    NodeReg *node_regs;     // per node id, stamped with `gen`
+    size_t node_regs_cap;
+    unsigned gen;
+} IRCtx;
+
+void init_ir(IRCtx *c);
+/* Lower a tree that passed the semantic checks; returns the result
+   register, -1 on error */
+int gen_ir(IRCtx *c, ASTNode *n, const VarEnv *env);
+const IRProgram* get_ir(const IRCtx *c);
+int ir_has_error(const IRCtx *c);
+void ir_ctx_free(IRCtx *c);
+
+/* helpers shared by the later stages */
+void ir_program_clear(IRProgram *p);
+void ir_program_free(IRProgram *p);
+void ir_program_copy(IRProgram *dst, const IRProgram *src);
+void ir_append(IRProgram *p, IRInstr instr);
+int ir_is_binary(IROp op);
+const char* ir_op_name(IROp op);    // "+", "sin", ... as used in the text form
+
+/* text rendering, only done when the output asks for it */
+void ir_format_instr(const IRInstr *i, const char *const *var_names, char *buf, size_t size);
+void ir_program_json(JsonWriter *w, const IRProgram *p);
 
 #endif // IR_H
@@ -0,0 +1,110 @@
+/* MAP_ANONYMOUS is outside strict POSIX.1-2008 in glibc */
+#define _DEFAULT_SOURCE
+#include "jit.h"
+#include "encode.h"
+#include "ir.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifdef _WIN32
+
+int jit_compile(const AsmProgram *p, JitCode *out) {
+    (void)p;
+    memset(out, 0, sizeof(*out));
+    return -1;
+}
+
+void jit_free(JitCode *c) {
+    (void)c;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* libm entry points, indexed by IROp. Filled per call rather than once
+   so concurrent compiles never race on a shared table. */
+static void fill_libm_table(void **addr) {
+    addr[IR_POW]  = (void *)(uintptr_t)&pow;
+    addr[IR_SIN]  = (void *)(uintptr_t)&sin;
+    addr[IR_COS]  = (void *)(uintptr_t)&cos;
+    addr[IR_TAN]  = (void *)(uintptr_t)&tan;
+    addr[IR_LOG]  = (void *)(uintptr_t)&log;
+    addr[IR_EXP]  = (void *)(uintptr_t)&exp;
+    addr[IR_SQRT] = (void *)(uintptr_t)&sqrt;
+}
+
+/* Whether the CPU runs every instruction in p; only the AVX forms from
+   peephole_asm and the fused multiply-adds are optional */
+static int cpu_runs(const AsmProgram *p) {
+    int avx = 0, fma = 0;
+    for (int i = 0; i < p->count; i++) {
+        AsmOp op = p->code[i].op;
+        if (op == ASM_VADDSD || op == ASM_VSUBSD || op == ASM_VMULSD || op == ASM_VDIVSD) avx = 1;
+        if (op == ASM_VFMADD231SD) fma = 1;
+    }
+    if (!avx && !fma) return 1;
+#if defined(__GNUC__) && defined(__x86_64__)
+    return (!avx || __builtin_cpu_supports("avx")) && (!fma || __builtin_cpu_supports("fma"));
+#else
+    return 0;
+#endif
+}
+
+int jit_compile(const AsmProgram *p, JitCode *out) {
+    memset(out, 0, sizeof(*out));
+    if (!cpu_runs(p)) return -1;
+    void *libm_addr[IR_SQRT + 1] = { 0 };
+    fill_libm_table(libm_addr);
+
+    EncodedCode enc = { 0 };
+    if (encode_asm(p, libm_addr, &enc) < 0) {
+        encoded_free(&enc);
+        return -1;
+    }
+
+    // The constant pool follows the code, 8-byte aligned
+    size_t code_size = enc.text.len;
+    bytebuf_align(&enc.text, 8);
+    size_t pool = enc.text.len;
+    bytebuf_put(&enc.text, p->consts, (size_t)p->nconsts * sizeof(double));
+
+    for (int i = 0; i < enc.nfixups; i++) {
+        Fixup *f = &enc.fixups[i];
+        if (f->kind != FIX_CONST) continue;
+        int32_t rel = (int32_t)(pool + (size_t)f->index * sizeof(double) - (f->offset + 4));
+        memcpy(enc.text.bytes + f->offset, &rel, sizeof(rel));
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (enc.text.len + page - 1) / page * page;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        encoded_free(&enc);
+        return -1;
+    }
+    memcpy(mem, enc.text.bytes, enc.text.len);
+    encoded_free(&enc);
+
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return -1;
+    }
+
+    out->mem = mem;
+    out->size = size;
+    out->code_size = code_size;
+    // POSIX guarantees object and function pointers convert losslessly
+    memcpy(&out->fn, &mem, sizeof(out->fn));
+    return 0;
+}
+
+void jit_free(JitCode *c) {
+    if (c->mem) munmap(c->mem, c->size);
+    memset(c, 0, sizeof(*c));
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include "codegen.h"
+
+/* In-process backend: the codegen output encoded into an executable
+   page. The page is written while mapped read/write and only then
+   switched to read/execute, so it is never both at once. */
+
+typedef double (*JitFn)(const double *vars);   // vars[k] is variable k
+
+typedef struct {
+    void *mem;          // mapping holding code followed by the constants
+    size_t size;        // mapped bytes
+    size_t code_size;   // bytes of machine code at the start of mem
+    JitFn fn;
+} JitCode;
+
+/* Compile p into `out`. Returns 0 on success, -1 when the program cannot
+   be encoded, uses AVX or FMA instructions this CPU lacks, or the
+   platform has no executable mappings. */
+int jit_compile(const AsmProgram *p, JitCode *out);
+void jit_free(JitCode *c);
+
+#endif // JIT_H
@@ -0,0 +1,209 @@
+#include "json.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#define JSON_FILE_BUFFER (64 * 1024)
+
+#define JSON_LEVEL_OBJECT 1     // keys come before values
+#define JSON_LEVEL_ITEMS  2     // something was written at this level
+
+void json_writer_init(JsonWriter *w, FILE *fp, int pretty) {
+    memset(w, 0, sizeof(*w));
+    w->fp = fp;
+    w->pretty = pretty;
+}
+
+void json_flush(JsonWriter *w) {
+    if (w->fp && w->len > 0) {
+        fwrite(w->buf, 1, w->len, w->fp);
+        w->len = 0;
+    }
+    if (w->fp) fflush(w->fp);
+}
+
+void json_writer_clear(JsonWriter *w) {
+    w->len = 0;
+    w->depth = 0;
+}
+
+void json_writer_free(JsonWriter *w) {
+    json_flush(w);
+    free(w->buf);
+    free(w->levels);
+    memset(w, 0, sizeof(*w));
+}
+
+static void grow(JsonWriter *w, size_t need) {
+    size_t cap = w->cap ? w->cap : (w->fp ? JSON_FILE_BUFFER : 4096);
+    while (cap < need) cap *= 2;
+    char *p = mmc_realloc(w->buf, cap);
+    if (!p) {
+        fprintf(stderr, "Out of memory growing JSON output\n");
+        exit(EXIT_FAILURE);
+    }
+    w->buf = p;
+    w->cap = cap;
+}
+
+static void put(JsonWriter *w, const char *s, size_t n) {
+    if (w->len + n > w->cap) {
+        if (w->fp && w->cap > 0) {
+            // Hand the full buffer to stdio; oversized writes skip the copy
+            fwrite(w->buf, 1, w->len, w->fp);
+            w->len = 0;
+            if (n > w->cap) {
+                fwrite(s, 1, n, w->fp);
+                return;
+            }
+        } else {
+            grow(w, w->len + n);
+        }
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static void put_char(JsonWriter *w, char ch) {
+    if (w->len == w->cap) put(w, &ch, 1);
+    else w->buf[w->len++] = ch;
+}
+
+static void indent(JsonWriter *w, int n) {
+    for (int i = 0; i < n; i++) put_char(w, '\t');
+}
+
+void json_raw(JsonWriter *w, const char *s, size_t n) {
+    put(w, s, n);
+}
+
+/* Separator owed before a value: array elements are comma separated,
+   object values follow their key */
+static void before_value(JsonWriter *w) {
+    if (w->depth == 0) return;
+    unsigned char *lv = &w->levels[w->depth - 1];
+    if (*lv & JSON_LEVEL_OBJECT) return;
+    if (*lv & JSON_LEVEL_ITEMS) {
+        put_char(w, ',');
+        if (w->pretty) put_char(w, ' ');
+    }
+    *lv |= JSON_LEVEL_ITEMS;
+}
+
+static void open_level(JsonWriter *w, unsigned char kind) {
+    if ((size_t)w->depth == w->levels_cap) {
+        w->levels_cap = w->levels_cap ? w->levels_cap * 2 : 32;
+        unsigned char *p = mmc_realloc(w->levels, w->levels_cap);
+        if (!p) {
+            fprintf(stderr, "Out of memory growing JSON nesting\n");
+            exit(EXIT_FAILURE);
+        }
+        w->levels = p;
+    }
+    w->levels[w->depth++] = kind;
+}
+
+void json_begin_object(JsonWriter *w) {
+    before_value(w);
+    put_char(w, '{');
+    if (w->pretty) put_char(w, '\n');
+    open_level(w, JSON_LEVEL_OBJECT);
+}
+
+void json_end_object(JsonWriter *w) {
+    unsigned char lv = w->levels[--w->depth];
+    if (w->pretty) {
+        if (lv & JSON_LEVEL_ITEMS) put_char(w, '\n');
+        indent(w, w->depth);
+    }
+    put_char(w, '}');
+}
+
+void json_begin_array(JsonWriter *w) {
+    before_value(w);
+    put_char(w, '[');
+    open_level(w, 0);
+}
+
+void json_end_array(JsonWriter *w) {
+    w->depth--;
+    put_char(w, ']');
+}
+
+static void put_string(JsonWriter *w, const char *s) {
+    put_char(w, '"');
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch >= 32 && ch != '"' && ch != '\\') continue;
+        put(w, run, (size_t)(s - run));
+        run = s + 1;
+        switch (ch) {
+            case '"':  put(w, "\\\"", 2); break;
+            case '\\': put(w, "\\\\", 2); break;
+            case '\b': put(w, "\\b", 2); break;
+            case '\f': put(w, "\\f", 2); break;
+            case '\n': put(w, "\\n", 2); break;
+            case '\r': put(w, "\\r", 2); break;
+            case '\t': put(w, "\\t", 2); break;
+            default: {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", ch);
+                put(w, esc, 6);
+            }
+        }
+    }
+    put(w, run, (size_t)(s - run));
+    put_char(w, '"');
+}
+
+void json_key(JsonWriter *w, const char *key) {
+    unsigned char *lv = &w->levels[w->depth - 1];
+    if (*lv & JSON_LEVEL_ITEMS) {
+        put_char(w, ',');
+        if (w->pretty) put_char(w, '\n');
+    }
+    *lv |= JSON_LEVEL_ITEMS;
+    if (w->pretty) indent(w, w->depth);
+    put_string(w, key);
+    put_char(w, ':');
+    if (w->pretty) put_char(w, '\t');
+}
+
+void json_string(JsonWriter *w, const char *s) {
+    before_value(w);
+    put_string(w, s);
+}
+
+void json_number(JsonWriter *w, double d) {
+    before_value(w);
+    if (isnan(d) || isinf(d)) {
+        put(w, "null", 4);
+        return;
+    }
+    /* cJSON's rules: integral values in int range print as integers,
+       others with 15 digits unless that does not read back exactly */
+    char num[32];
+    int n;
+    int as_int = d >= INT_MAX ? INT_MAX : d <= INT_MIN ? INT_MIN : (int)d;
+    if (d == (double)as_int) {
+        n = snprintf(num, sizeof(num), "%d", as_int);
+    } else {
+        n = snprintf(num, sizeof(num), "%1.15g", d);
+        if (strtod(num, NULL) != d) n = snprintf(num, sizeof(num), "%1.17g", d);
+    }
+    put(w, num, (size_t)n);
+}
+
+void json_bool(JsonWriter *w, int b) {
+    before_value(w);
+    if (b) put(w, "true", 4);
+    else put(w, "false", 5);
+}
+
+void json_null(JsonWriter *w) {
+    before_value(w);
+    put(w, "null", 4);
+}
@@ -0,0 +1,47 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Streaming JSON writer. Values go straight into an output buffer as
+   they are produced; nothing is built in memory first. The pretty form
+   is laid out the way cJSON_Print lays it out (tab indents, arrays on
+   one line) and the compact form like cJSON_PrintUnformatted, numbers
+   included, so either can replace the other byte for byte.
+
+   With a FILE the buffer is written out whenever it fills and on
+   json_flush; without one it collects everything for the caller to
+   take from buf/len. Commas, colons and indentation are the writer's
+   job: callers only open and close containers, name keys and write
+   values. */
+typedef struct {
+    FILE *fp;               // sink, or NULL to keep the output in buf
+    char *buf;
+    size_t len, cap;
+    int pretty;
+    int depth;              // open containers
+    unsigned char *levels;  // per open container: JSON_LEVEL_* bits
+    size_t levels_cap;
+} JsonWriter;
+
+void json_writer_init(JsonWriter *w, FILE *fp, int pretty);
+void json_writer_clear(JsonWriter *w);  // drop buffered output, keep the storage
+void json_writer_free(JsonWriter *w);   // flushes first when writing to a FILE
+void json_flush(JsonWriter *w);
+
+void json_begin_object(JsonWriter *w);
+void json_end_object(JsonWriter *w);
+void json_begin_array(JsonWriter *w);
+void json_end_array(JsonWriter *w);
+void json_key(JsonWriter *w, const char *key);  // inside an object, before each value
+
+void json_string(JsonWriter *w, const char *s);
+void json_number(JsonWriter *w, double d);     // NaN and infinities become null
+void json_bool(JsonWriter *w, int b);
+void json_null(JsonWriter *w);
+
+/* Bytes outside any value, e.g. the newline between records */
+void json_raw(JsonWriter *w, const char *s, size_t n);
+
+#endif // JSON_H
@@ -1,205 +1,205 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "cJSON.h"
-#include "ast.h"
-#include "semantic.h"
-#include "ir.h"
-#include "opt.h"
-#include "codegen.h"
-#include "parser.tab.h"
-#include <math.h>
-
-/* ---- token & statement storage ---- */
-typedef struct {
-    cJSON *tokens;
-    ASTNode *ast;
-} Stmt;
-/* Flex buffer API ( provided by Flex ) */
-typedef struct yy_buffer_state *YY_BUFFER_STATE;
-extern YY_BUFFER_STATE yy_scan_string(const char *str);
-extern void           yy_delete_buffer(YY_BUFFER_STATE buffer);
-
-
-static Stmt *stmts = NULL;
-static int stmt_count = 0;
-
-static void generate_ir_for_statement(ASTNode *ast, cJSON *ir_array) {
-    init_ir();
-    if (!ir_has_error()) {
-        gen_ir(ast);
-        cJSON *ir_json = get_ir_json();
-        cJSON_AddItemToArray(ir_array, ir_json);
-    } else {
-        cJSON_AddItemToArray(ir_array, cJSON_CreateArray());
-    }
+#include <ctype.h>
+#include "json.h"
+#include "driver.h"
+#include "server.h"
+
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_FAST_MATH_ULP 4
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--stream] [--profile] [--eval-backend=tree|bytecode|jit] [--var name=value]...\n"
+                    "       %*s [--emit=stage,...] [--format=json|binary] [--cache=file [--cache-size=MB]]\n"
+                    "       %*s [--fast-math[=ulp]] [--avx] [--fma] [--object=file [--object-prefix=name]]\n"
+                    "       %*s [-j N] [-f file | expression]\n",
+            prog, (int)strlen(prog), "", (int)strlen(prog), "", (int)strlen(prog), "");
+    fprintf(stderr, "       %s --serve <socket>\n", prog);
+    fprintf(stderr, "  with neither a file nor an expression, input is read from stdin\n");
+    fprintf(stderr, "  --emit picks the output from tokens,ast,range,semantic,ir,opt,asm,results;\n"
+                    "    stages none of them need are skipped (default: all)\n");
+    fprintf(stderr, "  --format=binary writes length-prefixed records with raw doubles (see binfmt.h)\n");
+    fprintf(stderr, "  --cache reuses stage results of statements compiled before, kept in a file\n"
+                    "    created with --cache-size megabytes (default %d)\n", DEFAULT_CACHE_MB);
+    fprintf(stderr, "  --profile adds per-stage times, allocation counts and sizes for each\n"
+                    "    statement and the whole run (JSON output only)\n");
+    fprintf(stderr, "  --fast-math lets the optimizer use rewrites that change rounding, such as\n"
+                    "    multiply chains for x^n and reciprocals of constant divisors, and inlines\n"
+                    "    polynomial sin, cos, tan and exp within ulp of libm (default %d) for\n"
+                    "    |x| <= 1e5 and exp's x in [-708, 709]; outside that they are garbage\n",
+            DEFAULT_FAST_MATH_ULP);
+    fprintf(stderr, "  --avx lets generated code use vaddsd, vsubsd, vmulsd and vdivsd, which save\n"
+                    "    register copies; the code then needs an AVX CPU (same results)\n");
+    fprintf(stderr, "  --fma contracts a*b+c into vfmadd231sd, rounded once, which changes results;\n"
+                    "    the code then needs an FMA CPU. With --fast-math, polynomials are first\n"
+                    "    put in Horner form so more of them contract\n");
+    fprintf(stderr, "  --object also writes the statements that compile to a relocatable ELF64\n"
+                    "    object, as double <name><n>(const double *vars) for statement n\n"
+                    "    (default name f); link it with -lm. Not with --stream or --serve\n");
+    fprintf(stderr, "  -j N compiles statements, or under --serve batches of requests, on N threads\n"
+                    "    (0: one per CPU), not with --stream\n");
 }
 
+int main(int argc, char **argv) {
+    const char *input = NULL;
+    const char *path = NULL;
+    const char *socket_path = NULL;
+    int stream_mode = 0;
+    int binary = 0;
+    int profile = 0;
+    int jobs = -1;          // -j, -1 when not given
+    const char *cache_path = NULL;
+    long cache_mb = DEFAULT_CACHE_MB;
+    const char *object_path = NULL;
+    const char *object_prefix = "f";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            stream_mode = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--fast-math") == 0) {
+            set_fast_math(DEFAULT_FAST_MATH_ULP);
+        } else if (strncmp(argv[i], "--fast-math=", 12) == 0) {
+            char *end;
+            double ulp = strtod(argv[i] + 12, &end);
+            if (*end || end == argv[i] + 12 || !(ulp > 0)) {
+                usage(argv[0]);
+                return 1;
+            }
+            set_fast_math(ulp);
+        } else if (strcmp(argv[i], "--avx") == 0) {
+            set_avx(1);
+        } else if (strcmp(argv[i], "--fma") == 0) {
+            set_fma(1);
+        } else if (strncmp(argv[i], "--eval-backend=", 15) == 0) {
+            const char *name = argv[i] + 15;
+            if (strcmp(name, "tree") == 0) {
+                set_eval_backend(EVAL_TREE);
+            } else if (strcmp(name, "bytecode") == 0) {
+                set_eval_backend(EVAL_BYTECODE);
+            } else if (strcmp(name, "jit") == 0) {
+                set_eval_backend(EVAL_JIT);
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--emit=", 7) == 0) {
+            if (set_emit(argv[i] + 7) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            const char *name = argv[i] + 9;
+            if (strcmp(name, "json") == 0) {
+                binary = 0;
+            } else if (strcmp(name, "binary") == 0) {
+                binary = 1;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            set_output_format(binary ? FORMAT_BINARY : FORMAT_JSON);
+        } else if (strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8]) {
+            cache_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+            char *end;
+            cache_mb = strtol(argv[i] + 13, &end, 10);
+            if (*end || end == argv[i] + 13 || cache_mb < 1 || cache_mb > 65536) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--object=", 9) == 0 && argv[i][9]) {
+            object_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--object-prefix=", 16) == 0) {
+            // a C identifier, so the functions can be declared
+            const char *name = argv[i] + 16;
+            int ok = isalpha((unsigned char)name[0]) || name[0] == '_';
+            for (const char *p = name; ok && *p; p++) ok = isalnum((unsigned char)*p) || *p == '_';
+            if (!ok) {
+                usage(argv[0]);
+                return 1;
+            }
+            object_prefix = name;
+        } else if (strcmp(argv[i], "--var") == 0 && i + 1 < argc) {
+            char *eq = strchr(argv[++i], '=');
+            char *end = NULL;
+            double value = eq ? strtod(eq + 1, &end) : 0;
+            if (!eq || eq == argv[i] || *end || end == eq + 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            *eq = '\0';
+            bind_variable(argv[i], value);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strncmp(argv[i], "-j", 2) == 0 && (argv[i][2] || i + 1 < argc)) {
+            const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+            char *end;
+            long j = strtol(n, &end, 10);
+            if (*end || end == n || j < 0 || j > 1024) {
+                usage(argv[0]);
+                return 1;
+            }
+            jobs = (int)j;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            input = argv[i];
+        }
+    }
 
-/* collect tokens per statement */
-void add_token(const char *type, const char *text) {
-    if (stmt_count == 0) {
-        // Created the first statement entry when the first token is encountered
-        stmt_count++;
-        stmts = realloc(stmts, stmt_count * sizeof(*stmts));
-        stmts[0].tokens = cJSON_CreateArray();
-        stmts[0].ast = NULL;
+    if (object_path && (stream_mode || socket_path)) {
+        usage(argv[0]);
+        return 1;
     }
-    cJSON *tok = cJSON_CreateObject();
-    cJSON_AddStringToObject(tok, "type", type);
-    cJSON_AddStringToObject(tok, "value", text);
-    cJSON_AddItemToArray(stmts[stmt_count - 1].tokens, tok);
-}
+    if (profile && binary) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (jobs >= 0 && stream_mode) {
+        usage(argv[0]);
+        return 1;
+    }
+    set_profile(profile);
+    if (jobs >= 0) set_jobs(jobs);
 
-/* collects AST per statement */
-void add_statement(ASTNode *n) {
-    if (stmt_count > 0) {
-        // Assign the AST to the current statement
-        stmts[stmt_count - 1].ast = n;
+    if (cache_path && set_cache(cache_path, (size_t)cache_mb << 20) < 0) {
+        return 1;
     }
-    // Prepare for the next statement
-    stmt_count++;
-    stmts = realloc(stmts, stmt_count * sizeof(*stmts));
-    stmts[stmt_count - 1].tokens = cJSON_CreateArray();
-    stmts[stmt_count - 1].ast = NULL;
-}
 
-/* ---- utility to convert AST to JSON ---- */
-static cJSON* ast_to_json(ASTNode *n) {
-    if (!n) return NULL;
-    cJSON *o = cJSON_CreateObject();
-    switch(n->type) {
-        case NODE_NUM:
-            cJSON_AddStringToObject(o, "type", "NUMBER");
-            cJSON_AddNumberToObject(o, "value", n->value);
-            break;
-        case NODE_ADD: 
-        case NODE_SUB: 
-        case NODE_MUL: 
-        case NODE_DIV: 
-        case NODE_POW: 
-            cJSON_AddStringToObject(o, "type", (n->type == NODE_ADD) ? "ADD" :
-                                              (n->type == NODE_SUB) ? "SUB" :
-                                              (n->type == NODE_MUL) ? "MUL" :
-                                              (n->type == NODE_DIV) ? "DIV" : "POW");
-            cJSON_AddItemToObject(o, "left", ast_to_json(n->left));
-            cJSON_AddItemToObject(o, "right", ast_to_json(n->right));
-            break;
-        case NODE_NEG: 
-        case NODE_SIN: 
-        case NODE_COS: 
-        case NODE_TAN: 
-        case NODE_LOG: 
-        case NODE_EXP: 
-        case NODE_SQRT: 
-            cJSON_AddStringToObject(o, "type", (n->type == NODE_NEG) ? "NEG" :
-                                              (n->type == NODE_SIN) ? "SIN" :
-                                              (n->type == NODE_COS) ? "COS" :
-                                              (n->type == NODE_TAN) ? "TAN" :
-                                              (n->type == NODE_LOG) ? "LOG" :
-                                              (n->type == NODE_EXP) ? "EXP" : "SQRT");
-            cJSON_AddItemToObject(o, "operand", ast_to_json(n->left));
-            break;
-        default: break;
+    if (socket_path) {
+        return serve(socket_path) == 0 ? 0 : 1;
+    }
+    if (object_path && set_object(object_path, object_prefix) < 0) {
+        return 1;
     }
-    return o;
-}
 
-int main(int argc, char **argv) {
-    char input_buf[1024];
-    char *input = NULL;
-    if (argc > 1) {
-        input = argv[1];
-    } else {
-        if (!fgets(input_buf, sizeof(input_buf), stdin)) {
-            fprintf(stderr, "No input\n");
+    FILE *fp = stdin;
+    if (!input && path) {
+        fp = fopen(path, "r");
+        if (!fp) {
+            perror(path);
             return 1;
         }
-        input = input_buf;
     }
 
-    /* parse */
-    stmts = NULL; stmt_count = 0;
-    YY_BUFFER_STATE buf = yy_scan_string(input);
-    yyparse();
-    yy_delete_buffer(buf);
-
-    /* build JSON */
-    cJSON *root = cJSON_CreateObject();
-    cJSON *j_tokens = cJSON_CreateArray();
-    cJSON *j_asts   = cJSON_CreateArray();
-    cJSON *j_sem    = cJSON_CreateArray();
-    cJSON *j_ir     = cJSON_CreateArray();
-    cJSON *j_opt    = cJSON_CreateArray();
-    cJSON *j_code   = cJSON_CreateArray();
-    cJSON *j_res    = cJSON_CreateArray();
-
-
-
-
-    // After parsing, process each completed statement (stmt_count - 1)
-    int num_statements = stmt_count > 0 ? stmt_count - 1 : 0;
-
-    for (int i = 0; i < num_statements; i++) {
-        /* tokens */
-        cJSON_AddItemToArray(j_tokens, stmts[i].tokens);
-
-        /* AST JSON */
-        cJSON_AddItemToArray(j_asts, ast_to_json(stmts[i].ast));
-
-        /* semantics */
-        init_semantic();
-        check_semantics(stmts[i].ast);
-        cJSON *semantic_errors =cJSON_Duplicate( get_semantic_json(),1);
-        cJSON_AddItemToArray(j_sem, semantic_errors);
-
-        /* evaluation */
-        double val; 
-        if (cJSON_GetArraySize(semantic_errors) > 0) {
-            val = NAN;
-        } else {
-            val = eval(stmts[i].ast);
-        }
-
-        // Represent NaN as null in JSON
-
-        if (isnan(val)) {
-            cJSON_AddItemToArray(j_res, cJSON_CreateNull());
-        } else {
-            cJSON_AddItemToArray(j_res, cJSON_CreateNumber(val));
-        }
-
-        /* IR */
-        cJSON *ir_stmt = cJSON_CreateArray();
-        generate_ir_for_statement(stmts[i].ast, ir_stmt);
-        cJSON_AddItemToArray(j_ir, ir_stmt);
-
-
-
-        /* optimize */
-        init_opt();
-        cJSON_AddItemToArray(j_opt, get_opt_json());
-
-        /* codegen */
-         init_codegen();
-         generate_assembly();
-         cJSON_AddItemToArray(j_code,cJSON_Duplicate(get_code_json(), 1));
-        
-
-
-        free_ast(stmts[i].ast);
+    if (stream_mode) {
+        stream_program(input, fp, stdout);
+    } else if (binary) {
+        compile_program_binary(input, fp, stdout);
+    } else {
+        JsonWriter w;
+        json_writer_init(&w, stdout, 1);
+        compile_program(input, fp, &w);
+        json_raw(&w, "\n", 1);
+        json_writer_free(&w);
     }
-    
-    cJSON_AddItemToObject(root, "tokens",      j_tokens);
-    cJSON_AddItemToObject(root, "asts",        j_asts);
-    cJSON_AddItemToObject(root, "semantic",    j_sem);
-    cJSON_AddItemToObject(root, "ir",          j_ir);
-    cJSON_AddItemToObject(root, "opt_ir",      j_opt);
-    cJSON_AddItemToObject(root, "asm",         j_code);
-    cJSON_AddItemToObject(root, "results",     j_res);
 
-    char *out = cJSON_Print(root);
-    puts(out);
-    cJSON_Delete(root);
-    return 0;
+    if (fp != stdin) fclose(fp);
+    return close_object() == 0 ? 0 : 1;
 }
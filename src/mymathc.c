@@ -0,0 +1,931 @@
+#include "mymathc.h"
+#include "parse.h"
+#include "semantic.h"
+#include "opt.h"
+#include "jit.h"
+#include "bytecode.h"
+#include "batch.h"
+#include "pool.h"
+#include "cache.h"
+#include "binfmt.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+typedef struct {
+    char *name;
+    double value;
+} Binding;
+
+/* Everything one thread needs to run the stages on a statement */
+typedef struct {
+    RangeCtx range;
+    SemanticCtx sem;
+    IRCtx ir;
+    OptCtx opt;
+    CodegenCtx cg;
+    Bytecode bc;            // for EVAL_BYTECODE results
+} Worker;
+
+/* A statement's results, plus evaluators mmc_eval builds on first use */
+typedef struct {
+    MmcResult res;
+    MmcToken *tokens;
+    Bytecode bc;
+    int bc_ready;
+    JitCode jit;
+    int jit_state;          // 0 not tried yet, 1 ready, -1 unavailable
+    int has_code;           // codegen ran on a nonempty program
+} Stmt;
+
+/* A point in time and allocation, for charging the work since it to a
+   stage */
+typedef struct {
+    double t;
+    AllocCount a;
+} Mark;
+
+/* Position of a node or variable in the statement's canonical form */
+typedef struct {
+    unsigned gen;
+    unsigned local;
+} KeyMark;
+
+struct MmcContext {
+    ParseHooks hooks;       // first: the parser's callbacks cast back to the context
+    Arena arena;
+    ASTBuilder builder;
+    size_t dedup_mark;      // builder.deduped at the previous statement
+    size_t node_mark;       // builder.nodes at the previous statement
+    int profile;
+    FmSet fast;             // fast-math kernels, max_ulp 0 when off
+    int avx;                // peephole_asm may use AVX forms
+    int fma;                // the optimizer contracts into fused multiply-adds
+    Mark parse_mark;        // where the current statement's parse began
+
+    MmcToken *cur_tokens;   // tokens of the statement being lexed
+    int ncur_tokens, cur_tokens_cap;
+
+    Stmt **stmts;           // stable addresses, results are handed out
+    int nstmts, stmts_cap;
+    int ncompiled;          // stmts[0 .. ncompiled-1] have results
+
+    Binding *bindings;
+    int nbindings;
+    double *env_values;     // the builder's variables resolved against bindings
+    unsigned char *env_bound;
+    size_t env_cap;
+
+    EvalBackend backend;
+    unsigned stages;        // MMC_* requested by the caller
+    int jobs;
+    Worker *workers;        // kept across compiles so their tables are reused
+    int nworkers;
+
+    MmcStatementHook hook;
+    void *hook_user;
+
+    int *todo;              // statements compile_pending hands to workers
+    int todo_cap;
+
+    MmcCache *cache;        // NULL: compile everything
+    unsigned long cache_hits, cache_misses;
+    BinWriter key, val;     // buffers for the entry being looked up or stored
+    KeyMark *key_nodes;     // per node id, stamped with key_gen
+    size_t key_nodes_cap;
+    KeyMark *key_vars;      // per builder variable, stamped with key_gen
+    size_t key_vars_cap;
+    unsigned *local_vars;   // builder variable of each local variable number
+    size_t nlocal_vars, local_vars_cap;
+    unsigned key_gen;
+    unsigned key_count;     // nodes numbered so far
+};
+
+static void* xrealloc(void *p, size_t size, const char *what) {
+    void *q = mmc_realloc(p, size ? size : 1);
+    if (!q) {
+        fprintf(stderr, "Out of memory growing %s\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return q;
+}
+
+/* ---- profiling ---- */
+
+static Mark mark_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    Mark m = { ts.tv_sec + ts.tv_nsec * 1e-9, alloc_count() };
+    return m;
+}
+
+/* Add the work since `from` to `cost` and start the next step */
+static Mark charge(MmcCost *cost, Mark from) {
+    Mark to = mark_now();
+    cost->seconds += to.t - from.t;
+    cost->allocs += to.a.calls - from.a.calls;
+    cost->bytes += to.a.bytes - from.a.bytes;
+    return to;
+}
+
+/* ---- parser callbacks ---- */
+
+static void on_token(ParseHooks *h, const char *type, const char *text) {
+    MmcContext *c = (MmcContext *)h;
+    if (c->ncur_tokens == c->cur_tokens_cap) {
+        c->cur_tokens_cap = c->cur_tokens_cap ? c->cur_tokens_cap * 2 : 16;
+        c->cur_tokens = xrealloc(c->cur_tokens, c->cur_tokens_cap * sizeof(*c->cur_tokens), "token list");
+    }
+    // type is one of the lexer's literals; the text buffer is reused
+    size_t len = strlen(text) + 1;
+    char *copy = xrealloc(NULL, len, "token text");
+    memcpy(copy, text, len);
+    MmcToken t = { type, copy };
+    c->cur_tokens[c->ncur_tokens++] = t;
+}
+
+static void compile_pending(MmcContext *c);
+
+static void on_statement(ParseHooks *h, ASTNode *n) {
+    MmcContext *c = (MmcContext *)h;
+    Stmt *s = mmc_calloc(1, sizeof(*s));
+    if (!s) {
+        fprintf(stderr, "Out of memory adding statement\n");
+        exit(EXIT_FAILURE);
+    }
+    s->tokens = c->cur_tokens;
+    s->res.tokens = s->tokens;
+    s->res.ntokens = c->ncur_tokens;
+    s->res.ast = n;
+    s->res.deduped = c->builder.deduped - c->dedup_mark;
+    c->dedup_mark = c->builder.deduped;
+    s->res.nodes = c->builder.nodes - c->node_mark;
+    c->node_mark = c->builder.nodes;
+    if (c->profile) charge(&s->res.cost[MMC_STAGE_PARSE], c->parse_mark);
+    c->cur_tokens = NULL;
+    c->ncur_tokens = c->cur_tokens_cap = 0;
+
+    if (c->nstmts == c->stmts_cap) {
+        c->stmts_cap = c->stmts_cap ? c->stmts_cap * 2 : 64;
+        c->stmts = xrealloc(c->stmts, c->stmts_cap * sizeof(*c->stmts), "statement list");
+    }
+    c->stmts[c->nstmts++] = s;
+
+    if (c->hook) {
+        compile_pending(c);
+        c->hook(c, c->nstmts - 1, c->hook_user);
+    }
+    // The next statement's parse starts after this one's compile and hook
+    if (c->profile) c->parse_mark = mark_now();
+}
+
+/* ---- contexts ---- */
+
+MmcContext* mmc_create(void) {
+    MmcContext *c = mmc_calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    arena_init(&c->arena, 0);
+    ast_builder_init(&c->builder, &c->arena);
+    c->hooks.builder = &c->builder;
+    c->hooks.token = on_token;
+    c->hooks.statement = on_statement;
+    c->backend = EVAL_TREE;
+    c->stages = MMC_ALL;
+    c->jobs = 1;
+    return c;
+}
+
+static void free_tokens(MmcToken *tokens, int n) {
+    for (int i = 0; i < n; i++) free((char *)tokens[i].text);
+    free(tokens);
+}
+
+static void free_stmt(Stmt *s) {
+    free_tokens(s->tokens, s->res.ntokens);
+    range_report_free(&s->res.range);
+    diag_free(&s->res.errors);
+    ir_program_free(&s->res.ir);
+    ir_program_free(&s->res.opt_ir);
+    asm_program_free(&s->res.code);
+    bc_free(&s->bc);
+    if (s->jit_state > 0) jit_free(&s->jit);
+    free(s);
+}
+
+void mmc_reset(MmcContext *c) {
+    for (int i = 0; i < c->nstmts; i++) free_stmt(c->stmts[i]);
+    c->nstmts = c->ncompiled = 0;
+    ast_builder_reset(&c->builder);
+    arena_reset(&c->arena);
+    c->dedup_mark = 0;
+    c->node_mark = 0;
+}
+
+void mmc_destroy(MmcContext *c) {
+    if (!c) return;
+    mmc_reset(c);
+    free(c->stmts);
+    free_tokens(c->cur_tokens, c->ncur_tokens);
+    for (int i = 0; i < c->nbindings; i++) free(c->bindings[i].name);
+    free(c->bindings);
+    free(c->env_values);
+    free(c->env_bound);
+    for (int w = 0; w < c->nworkers; w++) {
+        Worker *k = &c->workers[w];
+        range_ctx_free(&k->range);
+        semantic_ctx_free(&k->sem);
+        ir_ctx_free(&k->ir);
+        opt_ctx_free(&k->opt);
+        codegen_ctx_free(&k->cg);
+        bc_free(&k->bc);
+    }
+    free(c->workers);
+    free(c->todo);
+    bin_writer_free(&c->key);
+    bin_writer_free(&c->val);
+    free(c->key_nodes);
+    free(c->key_vars);
+    free(c->local_vars);
+    ast_builder_free(&c->builder);
+    arena_free(&c->arena);
+    free(c);
+}
+
+void mmc_set_backend(MmcContext *c, EvalBackend b) {
+    c->backend = b;
+}
+
+void mmc_set_jobs(MmcContext *c, int n) {
+    c->jobs = n > 0 ? n : pool_cpu_count();
+}
+
+void mmc_set_stages(MmcContext *c, unsigned stages) {
+    c->stages = stages;
+    // Without tokens requested the lexer does not report them at all
+    c->hooks.token = (stages & MMC_TOKENS) ? on_token : NULL;
+}
+
+void mmc_set_profile(MmcContext *c, int on) {
+    c->profile = on;
+}
+
+void mmc_set_fast_math(MmcContext *c, double max_ulp) {
+    fm_select(&c->fast, max_ulp > 0 ? max_ulp : 0);
+}
+
+void mmc_set_avx(MmcContext *c, int on) {
+    c->avx = on;
+}
+
+void mmc_set_fma(MmcContext *c, int on) {
+    c->fma = on;
+}
+
+/* The requested stages plus everything they need */
+static unsigned needed_stages(const MmcContext *c) {
+    unsigned s = c->stages;
+    if ((s & MMC_VALUE) && c->backend == EVAL_JIT) s |= MMC_ASM;
+    if (s & MMC_ASM) s |= MMC_OPT;
+    if (s & MMC_OPT) s |= MMC_IR;
+    if (s & (MMC_IR | MMC_VALUE)) s |= MMC_SEMANTIC;
+    if (s & MMC_SEMANTIC) s |= MMC_RANGE;
+    return s;
+}
+
+void mmc_set_statement_hook(MmcContext *c, MmcStatementHook hook, void *user) {
+    c->hook = hook;
+    c->hook_user = user;
+}
+
+void mmc_bind(MmcContext *c, const char *name, double value) {
+    for (int i = 0; i < c->nbindings; i++) {
+        if (strcmp(c->bindings[i].name, name) == 0) {
+            c->bindings[i].value = value;
+            return;
+        }
+    }
+    c->bindings = xrealloc(c->bindings, (c->nbindings + 1) * sizeof(*c->bindings), "bindings");
+    size_t len = strlen(name) + 1;
+    c->bindings[c->nbindings].name = xrealloc(NULL, len, "bindings");
+    memcpy(c->bindings[c->nbindings].name, name, len);
+    c->bindings[c->nbindings].value = value;
+    c->nbindings++;
+}
+
+/* Look up every variable the builder has seen so far */
+static VarEnv resolve_variables(MmcContext *c) {
+    ASTBuilder *b = &c->builder;
+    if (b->nvars > c->env_cap) {
+        c->env_cap = b->nvars;
+        c->env_values = xrealloc(c->env_values, c->env_cap * sizeof(*c->env_values), "variable table");
+        c->env_bound = xrealloc(c->env_bound, c->env_cap * sizeof(*c->env_bound), "variable table");
+    }
+    for (size_t k = 0; k < b->nvars; k++) {
+        c->env_values[k] = NAN;
+        c->env_bound[k] = 0;
+        for (int i = 0; i < c->nbindings; i++) {
+            if (strcmp(c->bindings[i].name, b->var_names[k]) == 0) {
+                c->env_values[k] = c->bindings[i].value;
+                c->env_bound[k] = 1;
+                break;
+            }
+        }
+    }
+    VarEnv env = { (const char *const *)b->var_names, c->env_values, c->env_bound, b->nvars };
+    return env;
+}
+
+/* ---- compiling ---- */
+
+/* Run every stage on one statement with w's contexts and keep copies of
+   the results. Only reads shared state, so workers can run it at once. */
+static void process_statement(Worker *w, Stmt *s, const VarEnv *env,
+                              EvalBackend backend, unsigned stages, int profile, const FmSet *fast,
+                              int avx, int fma) {
+    MmcResult *r = &s->res;
+    Mark m = { 0 };
+    if (profile) m = mark_now();
+
+    /* range analysis, which lets the semantic pass skip safe subtrees */
+    if (stages & MMC_RANGE) {
+        init_range(&w->range);
+        analyze_ranges(&w->range, r->ast);
+        range_report_copy(&r->range, &w->range.report);
+        if (profile) m = charge(&r->cost[MMC_STAGE_RANGE], m);
+    }
+
+    /* semantics */
+    if (stages & MMC_SEMANTIC) {
+        init_semantic(&w->sem);
+        check_semantics(&w->sem, r->ast, env, &w->range);
+        diag_copy(&r->errors, &w->sem.errors);
+        if (profile) m = charge(&r->cost[MMC_STAGE_SEMANTIC], m);
+    }
+
+    /* IR; a tree with semantic errors gets an empty program */
+    if (stages & MMC_IR) {
+        init_ir(&w->ir);
+        if (r->errors.count == 0) {
+            gen_ir(&w->ir, r->ast, env);
+        }
+        ir_program_copy(&r->ir, get_ir(&w->ir));
+        if (profile) m = charge(&r->cost[MMC_STAGE_IR], m);
+    }
+
+    /* optimize */
+    if (stages & MMC_OPT) {
+        init_opt(&w->opt);
+        w->opt.fast_math = fast->max_ulp > 0;
+        w->opt.fma = fma;
+        ir_program_copy(&r->opt_ir, optimize_ir(&w->opt, get_ir(&w->ir)));
+        r->opt_report = w->opt.report;
+        if (profile) m = charge(&r->cost[MMC_STAGE_OPT], m);
+    }
+
+    /* codegen, then its clean-up */
+    if (stages & MMC_ASM) {
+        init_codegen(&w->cg);
+        w->cg.fast = fast;
+        w->cg.avx = avx;
+        generate_assembly(&w->cg, get_opt_ir(&w->opt));
+        peephole_asm(&w->cg);
+        asm_program_copy(&r->code, get_asm(&w->cg));
+        s->has_code = r->opt_ir.count > 0;
+        if (profile) m = charge(&r->cost[MMC_STAGE_ASM], m);
+    }
+
+    /* evaluation: the semantic pass already computed the value, unless
+       another backend was asked for */
+    if (!(stages & MMC_VALUE) || r->errors.count > 0) {
+        r->value = NAN;
+    } else if (backend == EVAL_BYTECODE) {
+        bc_compile(r->ast, &w->bc, fast);
+        r->value = bc_run(&w->bc, env->values);
+    } else if (backend == EVAL_JIT) {
+        JitCode jit;
+        if (jit_compile(get_asm(&w->cg), &jit) == 0) {
+            r->value = jit.fn(env->values);
+            jit_free(&jit);
+        } else {
+            r->value = semantic_value(&w->sem);
+        }
+    } else {
+        r->value = semantic_value(&w->sem);
+    }
+    if (profile && (stages & MMC_VALUE)) charge(&r->cost[MMC_STAGE_VALUE], m);
+}
+
+/* ---- compilation cache ----
+
+   A statement's key is its canonical form: the requested stages, the
+   backend, the fast-math, AVX and FMA settings, and the DAG in
+   postorder with each node written once, its children referred to by
+   position and its variables by name, binding and value. Hash-consing
+   makes equal trees equal DAGs, so equal keys mean equal stage results.
+   Variables are numbered in order of first use within the statement,
+   which makes the stored IR and code independent of the rest of the
+   program. */
+
+#define KEY_VERSION 6
+
+static KeyMark* grow_marks(KeyMark *m, size_t *cap, size_t need, const char *what) {
+    if (need <= *cap) return m;
+    size_t n = *cap ? *cap : 64;
+    while (n < need) n *= 2;
+    m = xrealloc(m, n * sizeof(*m), what);
+    memset(m + *cap, 0, (n - *cap) * sizeof(*m));
+    *cap = n;
+    return m;
+}
+
+static unsigned key_node(MmcContext *c, const ASTNode *n, const VarEnv *env) {
+    KeyMark *m = &c->key_nodes[n->id];
+    if (m->gen == c->key_gen) return m->local;
+
+    BinWriter *k = &c->key;
+    switch (n->type) {
+        case NODE_NUM:
+            bin_u8(k, n->type);
+            bin_f64(k, n->value);
+            break;
+        case NODE_VAR: {
+            KeyMark *v = &c->key_vars[n->var];
+            if (v->gen != c->key_gen) {
+                if (c->nlocal_vars == c->local_vars_cap) {
+                    c->local_vars_cap = c->local_vars_cap ? c->local_vars_cap * 2 : 16;
+                    c->local_vars = xrealloc(c->local_vars, c->local_vars_cap * sizeof(*c->local_vars),
+                                             "cache key");
+                }
+                v->gen = c->key_gen;
+                v->local = (unsigned)c->nlocal_vars;
+                c->local_vars[c->nlocal_vars++] = n->var;
+            }
+            bin_u8(k, n->type);
+            bin_str(k, env->names[n->var]);
+            bin_u8(k, env->bound[n->var]);
+            bin_f64(k, env->values[n->var]);
+            break;
+        }
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_POW: {
+            unsigned l = key_node(c, n->left, env);
+            unsigned r = key_node(c, n->right, env);
+            bin_u8(k, n->type);
+            bin_u32(k, l);
+            bin_u32(k, r);
+            break;
+        }
+        default: {
+            unsigned l = key_node(c, n->left, env);
+            bin_u8(k, n->type);
+            bin_u32(k, l);
+            break;
+        }
+    }
+
+    // Postorder: the children were numbered by the calls above
+    m->gen = c->key_gen;
+    m->local = c->key_count++;
+    return m->local;
+}
+
+/* Fill c->key for statement s, and the variable numbering with it */
+static uint64_t build_key(MmcContext *c, const Stmt *s, const VarEnv *env, unsigned stages) {
+    c->key_nodes = grow_marks(c->key_nodes, &c->key_nodes_cap, c->builder.nodes, "cache key");
+    c->key_vars = grow_marks(c->key_vars, &c->key_vars_cap, env->count, "cache key");
+    c->key_gen++;
+    c->nlocal_vars = 0;
+
+    c->key.len = 0;
+    c->key_count = 0;
+    bin_u32(&c->key, KEY_VERSION);
+    bin_u32(&c->key, stages);
+    bin_u8(&c->key, c->backend);
+    bin_f64(&c->key, c->fast.max_ulp);
+    bin_u8(&c->key, c->avx);
+    bin_u8(&c->key, c->fma);
+    key_node(c, s->res.ast, env);
+    return cache_hash(c->key.buf, c->key.len);
+}
+
+/* Signed fields travel as their 32-bit two's complement */
+static void write_int(BinWriter *w, int v) {
+    bin_u32(w, (unsigned long)(unsigned)v);
+}
+
+static int read_int(BinCursor *r) {
+    return (int)(unsigned)bin_read_u32(r);
+}
+
+static void write_diags(BinWriter *w, const DiagList *d) {
+    bin_u32(w, d->count);
+    for (int i = 0; i < d->count; i++) {
+        bin_u32(w, d->codes[i]);
+        bin_str(w, d->msgs[i]);
+    }
+}
+
+static void read_diags(BinCursor *r, DiagList *d) {
+    int n = (int)bin_read_u32(r);
+    for (int i = 0; i < n && !r->bad; i++) {
+        DiagCode code = (DiagCode)bin_read_u32(r);
+        diag_add(d, code, bin_read_str(r));
+    }
+}
+
+static void write_ir(MmcContext *c, BinWriter *w, const IRProgram *p) {
+    bin_u32(w, p->count);
+    bin_u32(w, p->nregs);
+    for (int i = 0; i < p->count; i++) {
+        const IRInstr *in = &p->code[i];
+        bin_u8(w, in->op);
+        write_int(w, in->dst);
+        write_int(w, in->a);
+        write_int(w, in->b);
+        write_int(w, in->op == IR_FMA ? in->c : -1);
+        bin_f64(w, in->imm);
+        write_int(w, in->op == IR_VAR ? (int)c->key_vars[in->var].local : in->var);
+    }
+}
+
+static void read_ir(MmcContext *c, BinCursor *r, IRProgram *p, const VarEnv *env) {
+    int n = (int)bin_read_u32(r);
+    int nregs = (int)bin_read_u32(r);
+    for (int i = 0; i < n && !r->bad; i++) {
+        IRInstr in;
+        in.op = (IROp)bin_read_u8(r);
+        in.dst = read_int(r);
+        in.a = read_int(r);
+        in.b = read_int(r);
+        in.c = read_int(r);
+        in.imm = bin_read_f64(r);
+        in.var = read_int(r);
+        if (in.op == IR_VAR) {
+            if (in.var < 0 || (size_t)in.var >= c->nlocal_vars) {
+                r->bad = 1;
+                break;
+            }
+            in.var = (int)c->local_vars[in.var];
+        }
+        ir_append(p, in);
+    }
+    p->nregs = nregs;
+    p->var_names = env->names;
+}
+
+static void write_report(BinWriter *w, const OptReport *r) {
+    write_int(w, r->rounds);
+    write_int(w, r->before);
+    write_int(w, r->after);
+    for (int k = 0; k < OPT_NPASSES; k++) write_int(w, r->changed[k]);
+}
+
+static void read_report(BinCursor *in, OptReport *r) {
+    r->rounds = read_int(in);
+    r->before = read_int(in);
+    r->after = read_int(in);
+    for (int k = 0; k < OPT_NPASSES; k++) r->changed[k] = read_int(in);
+}
+
+static void write_loc(MmcContext *c, BinWriter *w, Loc l) {
+    bin_u8(w, l.kind);
+    write_int(w, l.kind == LOC_VAR ? 8 * (int)c->key_vars[l.n / 8].local : l.n);
+    write_int(w, l.base);
+}
+
+static Loc read_loc(MmcContext *c, BinCursor *r) {
+    Loc l;
+    l.kind = (LocKind)bin_read_u8(r);
+    l.n = read_int(r);
+    l.base = read_int(r);
+    if (l.kind == LOC_VAR) {
+        if (l.n < 0 || (size_t)(l.n / 8) >= c->nlocal_vars) r->bad = 1;
+        else l.n = 8 * (int)c->local_vars[l.n / 8];
+    }
+    return l;
+}
+
+static void write_asm(MmcContext *c, BinWriter *w, const AsmProgram *p) {
+    bin_u32(w, p->count);
+    for (int i = 0; i < p->count; i++) {
+        bin_u8(w, p->code[i].op);
+        write_loc(c, w, p->code[i].dst);
+        write_loc(c, w, p->code[i].src);
+        write_loc(c, w, p->code[i].src2);
+    }
+    bin_u32(w, p->nconsts);
+    for (int i = 0; i < p->nconsts; i++) bin_f64(w, p->consts[i]);
+    bin_u32(w, p->funcs);
+    write_int(w, p->frame_size);
+    write_int(w, p->regs_used);
+    write_int(w, p->spills);
+    write_int(w, p->saves);
+    write_int(w, p->reloads);
+    write_int(w, p->peephole.before);
+    write_int(w, p->peephole.after);
+    for (int k = 0; k < PEEP_NRULES; k++) write_int(w, p->peephole.changed[k]);
+}
+
+static void read_asm(MmcContext *c, BinCursor *r, AsmProgram *p) {
+    int n = (int)bin_read_u32(r);
+    if (r->bad || (size_t)n > (size_t)(r->end - r->p)) {
+        r->bad = 1;
+        return;
+    }
+    p->code = xrealloc(NULL, n * sizeof(*p->code), "cached code");
+    p->cap = n;
+    for (int i = 0; i < n && !r->bad; i++) {
+        p->code[i].op = (AsmOp)bin_read_u8(r);
+        p->code[i].dst = read_loc(c, r);
+        p->code[i].src = read_loc(c, r);
+        p->code[i].src2 = read_loc(c, r);
+        p->count = i + 1;
+    }
+    n = (int)bin_read_u32(r);
+    if (r->bad || (size_t)n > (size_t)(r->end - r->p) / 8) {
+        r->bad = 1;
+        return;
+    }
+    p->consts = xrealloc(NULL, n * sizeof(*p->consts), "cached code");
+    p->consts_cap = p->nconsts = n;
+    for (int i = 0; i < n; i++) p->consts[i] = bin_read_f64(r);
+    p->funcs = (unsigned)bin_read_u32(r);
+    p->frame_size = read_int(r);
+    p->regs_used = read_int(r);
+    p->spills = read_int(r);
+    p->saves = read_int(r);
+    p->reloads = read_int(r);
+    p->peephole.before = read_int(r);
+    p->peephole.after = read_int(r);
+    for (int k = 0; k < PEEP_NRULES; k++) p->peephole.changed[k] = read_int(r);
+}
+
+/* The results of the given stages, in the numbering of the last build_key */
+static void encode_results(MmcContext *c, const Stmt *s, unsigned stages) {
+    const MmcResult *r = &s->res;
+    BinWriter *w = &c->val;
+    w->len = 0;
+    if (stages & MMC_RANGE) {
+        bin_f64(w, r->range.iv.lo);
+        bin_f64(w, r->range.iv.hi);
+        write_int(w, r->range.safe);
+        write_int(w, r->range.nodes);
+        write_int(w, r->range.safe_nodes);
+        write_diags(w, &r->range.warnings);
+    }
+    if (stages & MMC_SEMANTIC) write_diags(w, &r->errors);
+    if (stages & MMC_IR) write_ir(c, w, &r->ir);
+    if (stages & MMC_OPT) {
+        write_ir(c, w, &r->opt_ir);
+        write_report(w, &r->opt_report);
+    }
+    if (stages & MMC_ASM) {
+        write_asm(c, w, &r->code);
+        bin_u8(w, s->has_code);
+    }
+    bin_f64(w, r->value);
+}
+
+static void clear_results(Stmt *s) {
+    MmcResult *r = &s->res;
+    range_report_free(&r->range);
+    memset(&r->range, 0, sizeof(r->range));
+    diag_free(&r->errors);
+    ir_program_free(&r->ir);
+    ir_program_free(&r->opt_ir);
+    memset(&r->opt_report, 0, sizeof(r->opt_report));
+    asm_program_free(&r->code);
+    s->has_code = 0;
+}
+
+/* 0 with s's results filled in, -1 on a malformed entry */
+static int decode_results(MmcContext *c, Stmt *s, const unsigned char *val, size_t len,
+                          const VarEnv *env, unsigned stages) {
+    MmcResult *r = &s->res;
+    BinCursor in = { val, val + len, 0 };
+    if (stages & MMC_RANGE) {
+        r->range.iv.lo = bin_read_f64(&in);
+        r->range.iv.hi = bin_read_f64(&in);
+        r->range.safe = read_int(&in);
+        r->range.nodes = read_int(&in);
+        r->range.safe_nodes = read_int(&in);
+        read_diags(&in, &r->range.warnings);
+    }
+    if (stages & MMC_SEMANTIC) read_diags(&in, &r->errors);
+    if (stages & MMC_IR) read_ir(c, &in, &r->ir, env);
+    if (stages & MMC_OPT) {
+        read_ir(c, &in, &r->opt_ir, env);
+        read_report(&in, &r->opt_report);
+    }
+    if (stages & MMC_ASM) {
+        read_asm(c, &in, &r->code);
+        s->has_code = bin_read_u8(&in);
+    }
+    r->value = bin_read_f64(&in);
+    if (in.bad || !bin_at_end(&in)) {
+        clear_results(s);
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill in the pending statements the cache has, and list the others in
+   c->todo. Returns how many are left to compile. */
+static int lookup_pending(MmcContext *c, const VarEnv *env, unsigned stages) {
+    int ntodo = 0;
+    cache_lock(c->cache, 0);
+    for (int i = c->ncompiled; i < c->nstmts; i++) {
+        Stmt *s = c->stmts[i];
+        Mark m = { 0 };
+        if (c->profile) m = mark_now();
+        uint64_t hash = build_key(c, s, env, stages);
+        size_t len;
+        const unsigned char *val = cache_find(c->cache, hash, c->key.buf, c->key.len, &len);
+        if (val && decode_results(c, s, val, len, env, stages) == 0) {
+            s->res.cached = 1;
+            c->cache_hits++;
+        } else {
+            c->todo[ntodo++] = i;
+            c->cache_misses++;
+        }
+        if (c->profile) charge(&s->res.cost[MMC_STAGE_CACHE], m);
+    }
+    cache_unlock(c->cache);
+    return ntodo;
+}
+
+static void store_compiled(MmcContext *c, int ntodo, const VarEnv *env, unsigned stages) {
+    cache_lock(c->cache, 1);
+    for (int j = 0; j < ntodo; j++) {
+        Stmt *s = c->stmts[c->todo[j]];
+        Mark m = { 0 };
+        if (c->profile) m = mark_now();
+        uint64_t hash = build_key(c, s, env, stages);
+        encode_results(c, s, stages);
+        cache_store(c->cache, hash, c->key.buf, c->key.len, c->val.buf, c->val.len);
+        if (c->profile) charge(&s->res.cost[MMC_STAGE_CACHE], m);
+    }
+    cache_unlock(c->cache);
+}
+
+MmcCache* mmc_cache_open(const char *path, size_t size) {
+    return cache_open(path, size);
+}
+
+void mmc_cache_close(MmcCache *k) {
+    cache_close(k);
+}
+
+void mmc_set_cache(MmcContext *c, MmcCache *k) {
+    c->cache = k;
+}
+
+void mmc_cache_counts(const MmcContext *c, unsigned long *hits, unsigned long *misses) {
+    *hits = c->cache_hits;
+    *misses = c->cache_misses;
+}
+
+/* ---- parallel compile ---- */
+
+/* arguments shared by every job of one compile_pending run */
+typedef struct {
+    MmcContext *c;
+    const VarEnv *env;
+    unsigned stages;
+} CompileJobs;
+
+static void compile_job(void *arg, int worker, int i) {
+    CompileJobs *cj = arg;
+    MmcContext *c = cj->c;
+    process_statement(&c->workers[worker], c->stmts[c->todo[i]], cj->env, c->backend, cj->stages, c->profile,
+                      &c->fast, c->avx, c->fma);
+}
+
+/* Statements only share the finished AST and the variable values, so
+   they can be compiled in any order on any worker */
+static void compile_pending(MmcContext *c) {
+    int n = c->nstmts - c->ncompiled;
+    if (n <= 0) return;
+
+    if (n > c->todo_cap) {
+        c->todo_cap = c->nstmts;
+        c->todo = xrealloc(c->todo, c->todo_cap * sizeof(*c->todo), "statement list");
+    }
+    VarEnv env = resolve_variables(c);
+    unsigned stages = needed_stages(c);
+
+    // Only the parse-time outputs: nothing worth caching
+    int cached = c->cache && (stages & ~MMC_TOKENS);
+    int ntodo = n;
+    if (cached) {
+        ntodo = lookup_pending(c, &env, stages);
+    } else {
+        for (int i = 0; i < n; i++) c->todo[i] = c->ncompiled + i;
+    }
+
+    int jobs = c->hook ? 1 : c->jobs;
+    if (jobs > ntodo) jobs = ntodo;
+    if (jobs > c->nworkers) {
+        c->workers = xrealloc(c->workers, jobs * sizeof(*c->workers), "worker contexts");
+        memset(c->workers + c->nworkers, 0, (jobs - c->nworkers) * sizeof(*c->workers));
+        c->nworkers = jobs;
+    }
+
+    CompileJobs cj = { c, &env, stages };
+    if (ntodo > 0) pool_run(jobs, ntodo, compile_job, &cj);
+    if (cached && ntodo > 0) store_compiled(c, ntodo, &env, stages);
+    c->ncompiled = c->nstmts;
+}
+
+static int finish_parse(MmcContext *c, int rc) {
+    compile_pending(c);
+    // Tokens of a trailing statement without ';' are dropped
+    free_tokens(c->cur_tokens, c->ncur_tokens);
+    c->cur_tokens = NULL;
+    c->ncur_tokens = c->cur_tokens_cap = 0;
+    return rc == 0 ? c->nstmts : -1;
+}
+
+int mmc_compile_string(MmcContext *c, const char *src) {
+    if (c->profile) c->parse_mark = mark_now();
+    return finish_parse(c, parse_string(&c->hooks, src));
+}
+
+int mmc_compile_file(MmcContext *c, FILE *in) {
+    if (c->profile) c->parse_mark = mark_now();
+    return finish_parse(c, parse_file(&c->hooks, in));
+}
+
+/* ---- results ---- */
+
+int mmc_statement_count(const MmcContext *c) {
+    return c->ncompiled;
+}
+
+const MmcResult* mmc_result(const MmcContext *c, int index) {
+    if (index < 0 || index >= c->ncompiled) return NULL;
+    return &c->stmts[index]->res;
+}
+
+size_t mmc_var_count(const MmcContext *c) {
+    return c->builder.nvars;
+}
+
+const char* mmc_var_name(const MmcContext *c, unsigned var) {
+    return var < c->builder.nvars ? c->builder.var_names[var] : NULL;
+}
+
+const Arena* mmc_arena(const MmcContext *c) {
+    return &c->arena;
+}
+
+/* ---- evaluation ---- */
+
+double mmc_eval(MmcContext *c, int index, const double *vars) {
+    if (index < 0 || index >= c->ncompiled) return NAN;
+    Stmt *s = c->stmts[index];
+
+    // Statements with semantic errors or compiled without MMC_ASM have no
+    // code; walk the tree
+    if (c->backend == EVAL_JIT && s->has_code) {
+        if (s->jit_state == 0) s->jit_state = jit_compile(&s->res.code, &s->jit) == 0 ? 1 : -1;
+        if (s->jit_state > 0) return s->jit.fn(vars);
+    } else if (c->backend == EVAL_BYTECODE) {
+        if (!s->bc_ready) {
+            bc_compile(s->res.ast, &s->bc, &c->fast);
+            s->bc_ready = 1;
+        }
+        return bc_run(&s->bc, vars);
+    }
+    return eval(s->res.ast, vars);
+}
+
+void mmc_eval_columns(MmcContext *c, int index, const double *const *columns,
+                      double *out, size_t rows) {
+    if (index < 0 || index >= c->ncompiled) {
+        for (size_t i = 0; i < rows; i++) out[i] = NAN;
+        return;
+    }
+    Stmt *s = c->stmts[index];
+
+    if (s->res.opt_ir.count > 0) {
+        BatchProgram bp;
+        batch_compile(&bp, &s->res.opt_ir, &c->fast);
+        batch_eval(&bp, columns, out, rows);
+        batch_free(&bp);
+        return;
+    }
+
+    size_t nvars = c->builder.nvars;
+    double *row = xrealloc(NULL, (nvars ? nvars : 1) * sizeof(*row), "row buffer");
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t k = 0; k < nvars; k++) row[k] = columns[k][i];
+        out[i] = eval(s->res.ast, row);
+    }
+    free(row);
+}
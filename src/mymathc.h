@@ -0,0 +1,206 @@
+#ifndef MYMATHC_H
+#define MYMATHC_H
+
+/* libmymathc: the compiler as a library.
+
+   An MmcContext owns one compilation: the parsed statements, variable
+   bindings, every statement's stage results and the per-thread stage
+   state. Contexts share nothing, so each thread can drive its own; a
+   single context must not be used from two threads at once.
+
+       MmcContext *c = mmc_create();
+       mmc_bind(c, "x", 2.0);
+       int n = mmc_compile_string(c, "sin(x)^2; log(x);");
+       for (int i = 0; i < n; i++) {
+           const MmcResult *r = mmc_result(c, i);
+           // r->errors, r->ir, r->code, r->value, ...
+       }
+       double y = mmc_eval(c, 0, (double[]){ 0.5 });
+       mmc_destroy(c);
+
+   Link with -lmymathc -lm -pthread. */
+
+#include <stdio.h>
+#include <stddef.h>
+#include "arena.h"
+#include "ast.h"
+#include "diag.h"
+#include "range.h"
+#include "ir.h"
+#include "opt.h"
+#include "codegen.h"
+
+typedef struct MmcContext MmcContext;
+
+/* How the compile computes each statement's value. EVAL_BYTECODE
+   interprets a flat compiled form of the AST. EVAL_JIT runs the
+   generated code in-process and falls back to the tree walk where that
+   is not possible. */
+typedef enum {
+    EVAL_TREE,
+    EVAL_BYTECODE,
+    EVAL_JIT
+} EvalBackend;
+
+typedef struct {
+    const char *type;       // "NUMBER", "PLUS", ...
+    const char *text;
+} MmcToken;
+
+/* Steps mmc_set_profile measures, in the order a statement goes
+   through them */
+typedef enum {
+    MMC_STAGE_PARSE,        // lexing and parsing, up to the statement's ';'
+    MMC_STAGE_CACHE,        // lookup, and the store after a miss
+    MMC_STAGE_RANGE,
+    MMC_STAGE_SEMANTIC,
+    MMC_STAGE_IR,
+    MMC_STAGE_OPT,
+    MMC_STAGE_ASM,
+    MMC_STAGE_VALUE,
+    MMC_NSTAGES
+} MmcStage;
+
+/* What one step cost a statement */
+typedef struct {
+    double seconds;             // monotonic clock
+    unsigned long allocs;       // malloc, calloc, realloc and strdup calls
+    unsigned long long bytes;   // bytes those calls asked for
+} MmcCost;
+
+/* Every stage's output for one statement. Valid until the context is
+   reset or destroyed. */
+typedef struct {
+    const MmcToken *tokens;
+    int ntokens;
+    ASTNode *ast;
+    size_t deduped;         // constructor calls answered by an existing node
+    size_t nodes;           // nodes the statement added to the program's DAG
+    RangeReport range;
+    DiagList errors;        // semantic errors; IR and code are empty unless 0
+    IRProgram ir;
+    IRProgram opt_ir;
+    OptReport opt_report;   // what each optimizer pass did
+    AsmProgram code;        // x86-64, `double f(const double *vars)`
+    double value;           // at the bound variables, NaN on errors
+    int cached;             // range through value came from the cache
+    MmcCost cost[MMC_NSTAGES];  // with profiling on, else zero; stages that
+                                // did not run, or came from the cache, cost 0
+} MmcResult;
+
+/* Stages mmc_set_stages can switch on. Parsing always runs; a stage
+   also runs when a stage that is on needs it. Results of stages that did
+   not run are left empty, and the value is NaN without MMC_VALUE. */
+enum {
+    MMC_TOKENS   = 1 << 0,      // record MmcResult.tokens while lexing
+    MMC_RANGE    = 1 << 1,
+    MMC_SEMANTIC = 1 << 2,      // needs RANGE
+    MMC_IR       = 1 << 3,      // needs SEMANTIC
+    MMC_OPT      = 1 << 4,      // needs IR
+    MMC_ASM      = 1 << 5,      // needs OPT
+    MMC_VALUE    = 1 << 6,      // needs SEMANTIC, and ASM for EVAL_JIT
+    MMC_ALL      = (1 << 7) - 1
+};
+
+MmcContext* mmc_create(void);
+void mmc_destroy(MmcContext *c);
+
+void mmc_set_backend(MmcContext *c, EvalBackend b);
+void mmc_set_jobs(MmcContext *c, int n);    // threads per compile, 0: one per CPU
+void mmc_set_stages(MmcContext *c, unsigned stages);   // MMC_* bits, default MMC_ALL
+/* Record MmcResult.cost for every later statement; off by default. The
+   costs are taken on whichever thread ran the step, and allocations
+   count the library's own calls only. */
+void mmc_set_profile(MmcContext *c, int on);
+/* Trade accuracy for speed, within max_ulp of libm per function call
+   on the kernels' domains below; 0 turns it off, the default, when
+   optimized code gives the same bits as the unoptimized IR.
+
+   The optimizer makes rewrites that change results: multiply chains for
+   integer powers, reciprocals of any constant divisor, exp(log a) = a,
+   polynomials in one variable in Horner form and the like. sqrt becomes
+   sqrtsd, and sin, cos, tan and exp become the cheapest fastmath.h
+   kernels within max_ulp, inlined in the generated code; those with no
+   kernel that accurate keep calling libm, as log always does. This
+   changes what the generated code, EVAL_JIT, EVAL_BYTECODE and
+   mmc_eval_columns compute; the tree evaluator and the values the
+   semantic pass checks stay on libm.
+
+   The bound only holds for finite arguments with |x| <= 1e5 for sin,
+   cos and tan, and x in [-708, 709] for exp. Beyond that there is no
+   fallback to libm: trig kernels lose all accuracy (sin(1e9) is off by
+   about 1e15 ulp), exp clamps its argument instead of overflowing, and
+   NaN and infinity give garbage. */
+void mmc_set_fast_math(MmcContext *c, double max_ulp);
+
+/* Let the generated code use AVX's three-operand vaddsd, vsubsd, vmulsd
+   and vdivsd where they save a register copy. Results are unchanged;
+   EVAL_JIT falls back to the tree evaluator on CPUs without AVX, and
+   code written out needs an AVX machine to run. Off by default. */
+void mmc_set_avx(MmcContext *c, int on);
+
+/* Contract a * b + c, a * b - c and c - a * b into fused multiply-adds,
+   rounded once, which the generated code computes with vfmadd231sd.
+   This changes what the generated code, EVAL_JIT and mmc_eval_columns
+   compute, but not the bytecode or the tree evaluator. EVAL_JIT falls
+   back to the tree evaluator on CPUs without FMA, and code written out
+   needs an FMA machine to run. Off by default. */
+void mmc_set_fma(MmcContext *c, int on);
+
+/* Give variable `name` a value for every later compile. Statements that
+   use a variable with no binding get a semantic error. */
+void mmc_bind(MmcContext *c, const char *name, double value);
+
+/* Called as soon as each statement has been parsed and compiled, while
+   the parse is still running. The hook may read the result and may call
+   mmc_reset to drop everything so far, after which indices restart at 0.
+   With a hook set, compiles run on one thread. */
+typedef void (*MmcStatementHook)(MmcContext *c, int index, void *user);
+void mmc_set_statement_hook(MmcContext *c, MmcStatementHook hook, void *user);
+
+/* Persistent compilation cache: a file of `size` bytes, or the size an
+   existing file has, holding the stage results of statements compiled
+   before. Entries are keyed by each statement's canonical form together
+   with the bindings of its variables, the stages, the backend and the
+   fast-math, AVX and FMA settings. On a hit the range, semantic, IR,
+   opt and codegen stages are skipped. Contexts on one thread may share
+   an MmcCache, other threads should open their own, and processes may
+   share the file. The oldest entries make room for new ones, and a file
+   written by another build is wiped. NULL, with a message on stderr, if
+   it cannot be opened. */
+typedef struct MmcCache MmcCache;
+MmcCache* mmc_cache_open(const char *path, size_t size);
+void mmc_cache_close(MmcCache *k);
+void mmc_set_cache(MmcContext *c, MmcCache *k);    // NULL: no cache
+/* Statements looked up since the context was created; reset keeps them */
+void mmc_cache_counts(const MmcContext *c, unsigned long *hits, unsigned long *misses);
+
+/* Parse a program and run every stage on each statement, appending to
+   the statements already held. Returns the number of statements held,
+   or -1 after a syntax error (statements before it are still compiled). */
+int mmc_compile_string(MmcContext *c, const char *src);
+int mmc_compile_file(MmcContext *c, FILE *in);
+
+int mmc_statement_count(const MmcContext *c);
+const MmcResult* mmc_result(const MmcContext *c, int index);
+size_t mmc_var_count(const MmcContext *c);
+const char* mmc_var_name(const MmcContext *c, unsigned var);   // ASTNode.var / IRInstr.var
+const Arena* mmc_arena(const MmcContext *c);   // the node arena, for its statistics
+
+/* Value of statement `index` with variable k set to vars[k], using the
+   context's backend and no semantic checks. vars may be NULL for a
+   statement without variables. Statements compiled without MMC_ASM are
+   walked as trees. */
+double mmc_eval(MmcContext *c, int index, const double *vars);
+
+/* The same for `rows` points at once: variable k of row i is
+   columns[k][i]. Runs the SIMD batch engine on the optimized IR, or
+   walks the tree row by row when there is none. */
+void mmc_eval_columns(MmcContext *c, int index, const double *const *columns,
+                      double *out, size_t rows);
+
+/* Drop every statement, result and variable name; bindings and
+   settings are kept */
+void mmc_reset(MmcContext *c);
+
+#endif // MYMATHC_H
@@ -1,90 +1,723 @@
 #include "opt.h"
+#include "alloc.h"
 #include "ir.h"
-#include "cJSON.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <math.h>
 
-typedef struct {
-    char *temp;
-    double value;
-} Constant;
-
-static Constant constants[100];
-static int const_count = 0;
-static cJSON *opt_errors = NULL;  // Track optimization errors
-
-static double get_constant(const char *temp) {
-    for (int i = 0; i < const_count; i++) {
-        if (strcmp(constants[i].temp, temp) == 0) {
-            return constants[i].value;
-        }
+/* The optimizer is a pass manager over a copy of the IR. Each pass
+   rewrites c->prog and returns how many instructions it changed; a
+   round runs every pass in order, and rounds repeat until one changes
+   nothing. The IR is in SSA form, every register written once and
+   before its uses, and the result is the last instruction's register:
+   passes may rewrite that instruction but keep it last, writing the
+   same register. */
+
+#define OPT_MAX_ROUNDS 16       // a safety net; two or three are typical
+
+/* ---- constant propagation ---- */
+
+/* What the generated code computes for op; the same libm does both,
+   and fma() rounds once like vfmadd231sd */
+static double apply(IROp op, double x, double y, double z) {
+    switch (op) {
+        case IR_ADD:  return x + y;
+        case IR_SUB:  return x - y;
+        case IR_MUL:  return x * y;
+        case IR_DIV:  return x / y;
+        case IR_FMA:  return fma(x, y, z);
+        case IR_POW:  return pow(x, y);
+        case IR_NEG:  return -x;
+        case IR_SIN:  return sin(x);
+        case IR_COS:  return cos(x);
+        case IR_TAN:  return tan(x);
+        case IR_LOG:  return log(x);
+        case IR_EXP:  return exp(x);
+        case IR_SQRT: return sqrt(x);
+        case IR_CONST:
+        case IR_VAR: break;
     }
     return NAN;
 }
 
-static void fold_constants(cJSON *opt, const char *code) {
-    char out_temp[16], op[5], a_temp[16], b_temp[16];
-    double a_val, b_val, result;
-    
-    if (sscanf(code, "%15s = %15s %4s %15s", out_temp, a_temp, op, b_temp) == 4) {
-        a_val = get_constant(a_temp);
-        b_val = get_constant(b_temp);
-        
-        if (!isnan(a_val) && !isnan(b_val)) {
-            if (strcmp(op, "+") == 0) result = a_val + b_val;
-            else if (strcmp(op, "-") == 0) result = a_val - b_val;
-            else if (strcmp(op, "*") == 0) result = a_val * b_val;
-            else if (strcmp(op, "/") == 0) {
-                if (b_val == 0) {
-                    cJSON_AddItemToArray(opt_errors, cJSON_CreateString("Division by zero (optimized)"));
-                    cJSON_AddItemToArray(opt, cJSON_CreateString(code)); // Keep original IR
-                    return;
-                }
-                result = a_val / b_val;
-            } else return;
-
-            char folded[32];
-            sprintf(folded, "%s = %g", out_temp, result);
-            cJSON_AddItemToArray(opt, cJSON_CreateString(folded));
+/* Fold every instruction whose operands are known constants. Folds that
+   would produce an infinity or NaN are left to run, and reported. */
+static int constprop(OptCtx *c) {
+    IRProgram *p = &c->prog;
+    int folded = 0;
+    diag_clear(&c->errors);
+    for (int i = 0; i < p->count; i++) {
+        IRInstr *in = &p->code[i];
+        c->known[in->dst] = 0;
+        if (in->op == IR_CONST) {
+            c->known[in->dst] = 1;
+            c->values[in->dst] = in->imm;
+            continue;
+        }
+        if (in->op == IR_VAR || !c->known[in->a] || (in->b >= 0 && !c->known[in->b]) ||
+            (in->op == IR_FMA && !c->known[in->c])) continue;
+
+        double x = c->values[in->a], y = in->b >= 0 ? c->values[in->b] : 0.0;
+        double z = in->op == IR_FMA ? c->values[in->c] : 0.0;
+        if (in->op == IR_DIV && y == 0) {
+            diag_add(&c->errors, DIAG_DIVISION_BY_ZERO, "Division by zero (optimized)");
+            continue;
+        }
+        double v = apply(in->op, x, y, z);
+        if (!isfinite(v)) {
+            if (isnan(v)) diag_add(&c->errors, DIAG_UNDEFINED, "Undefined result (optimized)");
+            else diag_add(&c->errors, DIAG_OVERFLOW, "Overflow (optimized)");
+            continue;
+        }
+        in->op = IR_CONST;
+        in->a = in->b = -1;
+        in->imm = v;
+        c->known[in->dst] = 1;
+        c->values[in->dst] = v;
+        folded++;
+    }
+    return folded;
+}
+
+/* ---- algebraic simplification ---- */
+
+#define MAX_CHAIN_POW 32
+
+/* Knuth's power tree: x^n is x^power_tree[n] times x^k for some k met
+   on the way from 1 to power_tree[n]. Walking it gives a shortest
+   addition chain for every n up to MAX_CHAIN_POW. */
+static const unsigned char power_tree[MAX_CHAIN_POW + 1] = {
+    0, 0, 1, 2, 2, 3, 3, 5, 4, 6, 5, 10, 6, 10, 7, 10, 8,
+    16, 9, 14, 10, 14, 11, 13, 12, 15, 13, 18, 14, 28, 15, 28, 16
+};
+
+static void grow_tables(OptCtx *c, int nregs);
+
+/* Append to the program being built, recording where dst is defined */
+static int put(OptCtx *c, IRInstr in) {
+    grow_tables(c, in.dst + 1);
+    c->def[in.dst] = c->tmp.count;
+    ir_append(&c->tmp, in);
+    return in.dst;
+}
+
+static int new_reg(const OptCtx *c) {
+    return c->tmp.nregs;
+}
+
+/* The instruction defining reg, in its simplified form */
+static const IRInstr* def(const OptCtx *c, int reg) {
+    return &c->tmp.code[c->def[reg]];
+}
+
+/* reg holds v, telling 0 and -0 apart */
+static int is_const(const OptCtx *c, int reg, double v) {
+    const IRInstr *d = def(c, reg);
+    return d->op == IR_CONST && d->imm == v && !signbit(d->imm) == !signbit(v);
+}
+
+static int is_op(const OptCtx *c, int reg, IROp op) {
+    return def(c, reg)->op == op;
+}
+
+/* dst computes what reg does: a copy of reg's instruction, which
+   copy propagation then forwards and dead-code elimination removes */
+static int forward(OptCtx *c, int dst, int reg) {
+    IRInstr in = *def(c, reg);
+    in.dst = dst;
+    put(c, in);
+    return 1;
+}
+
+static int rewrite(OptCtx *c, IRInstr in, IROp op, int a, int b) {
+    in.op = op;
+    in.a = a;
+    in.b = b;
+    put(c, in);
+    return 1;
+}
+
+static int constant(OptCtx *c, IRInstr in, double v) {
+    in.op = IR_CONST;
+    in.a = in.b = -1;
+    in.imm = v;
+    put(c, in);
+    return 1;
+}
+
+/* 1/d is exact, so x * (1/d) rounds the same as x / d */
+static int exact_reciprocal(double d) {
+    int e;
+    double r = 1.0 / d;
+    return fabs(frexp(d, &e)) == 0.5 && isfinite(r);
+}
+
+/* x^n for 1 <= n <= MAX_CHAIN_POW into register dst, or a new one when
+   dst is -1; returns the register */
+static int power_chain(OptCtx *c, int x, int n, int dst) {
+    int path[MAX_CHAIN_POW + 1], len = 0;   // n down to 1
+    for (int k = n; k; k = power_tree[k]) path[len++] = k;
+    if (len == 1 && dst < 0) return x;
+
+    int reg[MAX_CHAIN_POW + 1];
+    reg[1] = x;
+    for (int i = len - 2; i >= 0; i--) {
+        int k = path[i], p = path[i + 1];
+        int d = i == 0 && dst >= 0 ? dst : new_reg(c);
+        IRInstr mul = { .op = IR_MUL, .dst = d, .a = reg[p], .b = reg[k - p], .c = -1 };
+        reg[k] = put(c, mul);
+    }
+    return reg[n];
+}
+
+/* Rewrite one instruction into c->tmp; returns 1 if it changed */
+static int simplify_instr(OptCtx *c, IRInstr in) {
+    int fast = c->fast_math;
+    switch (in.op) {
+        case IR_NEG:
+            if (is_op(c, in.a, IR_NEG)) return forward(c, in.dst, def(c, in.a)->a);
+            break;
+        case IR_ADD:
+            // x + -0 is x; x + 0 is not when x is -0
+            if (is_const(c, in.b, -0.0) || (fast && is_const(c, in.b, 0.0))) return forward(c, in.dst, in.a);
+            if (is_const(c, in.a, -0.0) || (fast && is_const(c, in.a, 0.0))) return forward(c, in.dst, in.b);
+            if (is_op(c, in.b, IR_NEG)) return rewrite(c, in, IR_SUB, in.a, def(c, in.b)->a);
+            if (is_op(c, in.a, IR_NEG)) return rewrite(c, in, IR_SUB, in.b, def(c, in.a)->a);
+            break;
+        case IR_SUB:
+            if (is_const(c, in.b, 0.0) || (fast && is_const(c, in.b, -0.0))) return forward(c, in.dst, in.a);
+            if (is_const(c, in.a, -0.0) || (fast && is_const(c, in.a, 0.0))) return rewrite(c, in, IR_NEG, in.b, -1);
+            if (is_op(c, in.b, IR_NEG)) return rewrite(c, in, IR_ADD, in.a, def(c, in.b)->a);
+            if (fast && in.a == in.b) return constant(c, in, 0.0);
+            break;
+        case IR_MUL:
+            if (is_const(c, in.b, 1.0)) return forward(c, in.dst, in.a);
+            if (is_const(c, in.a, 1.0)) return forward(c, in.dst, in.b);
+            if (is_const(c, in.b, -1.0)) return rewrite(c, in, IR_NEG, in.a, -1);
+            if (is_const(c, in.a, -1.0)) return rewrite(c, in, IR_NEG, in.b, -1);
+            if (is_op(c, in.a, IR_NEG) && is_op(c, in.b, IR_NEG))
+                return rewrite(c, in, IR_MUL, def(c, in.a)->a, def(c, in.b)->a);
+            if (fast && (is_const(c, in.a, 0.0) || is_const(c, in.b, 0.0))) return constant(c, in, 0.0);
+            if (fast && in.a == in.b && is_op(c, in.a, IR_SQRT)) return forward(c, in.dst, def(c, in.a)->a);
+            break;
+        case IR_DIV: {
+            if (is_const(c, in.b, 1.0)) return forward(c, in.dst, in.a);
+            if (is_const(c, in.b, -1.0)) return rewrite(c, in, IR_NEG, in.a, -1);
+            if (is_op(c, in.a, IR_NEG) && is_op(c, in.b, IR_NEG))
+                return rewrite(c, in, IR_DIV, def(c, in.a)->a, def(c, in.b)->a);
+            const IRInstr *d = def(c, in.b);
+            if (d->op == IR_CONST && d->imm != 0 && isfinite(d->imm) && isfinite(1.0 / d->imm)
+                && (fast || exact_reciprocal(d->imm))) {
+                IRInstr r = { .op = IR_CONST, .dst = new_reg(c), .a = -1, .b = -1,
+                              .imm = 1.0 / d->imm, .c = -1 };
+                return rewrite(c, in, IR_MUL, in.a, put(c, r));
+            }
+            break;
+        }
+        case IR_POW: {
+            // pow(x, 1) and pow(x, 0) are exact; libm's pow(x, 2) is not
+            // always the correctly rounded x * x, so chains need fast_math
+            if (is_const(c, in.b, 1.0)) return forward(c, in.dst, in.a);
+            if (is_const(c, in.b, 0.0) || is_const(c, in.b, -0.0)) return constant(c, in, 1.0);
+            if (!fast || !is_op(c, in.b, IR_CONST)) break;
+            double e = def(c, in.b)->imm;
+            if (e == 0.5) return rewrite(c, in, IR_SQRT, in.a, -1);
+            if (!(fabs(e) <= MAX_CHAIN_POW) || e != (int)e) break;
+            int n = (int)e;
+            if (n > 0) {
+                power_chain(c, in.a, n, in.dst);
+                return 1;
+            }
+            int x = power_chain(c, in.a, -n, -1);
+            IRInstr one = { .op = IR_CONST, .dst = new_reg(c), .a = -1, .b = -1, .imm = 1.0, .c = -1 };
+            return rewrite(c, in, IR_DIV, put(c, one), x);
+        }
+        case IR_EXP:
+            if (fast && is_op(c, in.a, IR_LOG)) return forward(c, in.dst, def(c, in.a)->a);
+            break;
+        case IR_LOG:
+            if (fast && is_op(c, in.a, IR_EXP)) return forward(c, in.dst, def(c, in.a)->a);
+            break;
+        default:
+            break;
+    }
+    put(c, in);
+    return 0;
+}
+
+/* Passes that rebuild the program put it together in c->tmp, then
+   swap it in */
+static void rebuild_begin(OptCtx *c) {
+    ir_program_clear(&c->tmp);
+    c->tmp.nregs = c->prog.nregs;
+    c->tmp.var_names = c->prog.var_names;
+}
+
+static void rebuild_end(OptCtx *c) {
+    IRProgram t = c->prog;
+    c->prog = c->tmp;
+    c->tmp = t;
+}
+
+/* Rebuild the program with identities cancelled and expensive
+   operations strength-reduced. New registers are numbered past the
+   existing ones, and new instructions go in front of their use. */
+static int simplify(OptCtx *c) {
+    IRProgram *p = &c->prog;
+    rebuild_begin(c);
+    int rewritten = 0;
+    for (int i = 0; i < p->count; i++) rewritten += simplify_instr(c, p->code[i]);
+    rebuild_end(c);
+    return rewritten;
+}
+
+/* How many instructions read each register */
+static void count_uses(OptCtx *c) {
+    const IRProgram *p = &c->prog;
+    memset(c->uses, 0, p->nregs * sizeof(*c->uses));
+    for (int i = 0; i < p->count; i++) {
+        const IRInstr *in = &p->code[i];
+        if (in->a >= 0) c->uses[in->a]++;
+        if (in->b >= 0) c->uses[in->b]++;
+        if (in->op == IR_FMA) c->uses[in->c]++;
+    }
+}
+
+/* ---- polynomials ---- */
+
+#define MAX_TERMS 64
+#define MONOMIAL_DEPTH 8        // deeper products are taken as they are
+
+/* One term of a sum: reg, subtracted if neg, is coef * x^k, where x is
+   -1 for a constant */
+typedef struct {
+    double coef;
+    int x, k;
+    int reg, neg;
+} Term;
+
+/* reg as coef * x^k. Products, powers and quotients of such terms by
+   constants combine while they agree on x; anything else is x^1 with
+   x = reg. */
+static void monomial(const OptCtx *c, int reg, Term *t, int depth) {
+    const IRInstr *d = def(c, reg);
+    Term u, v;
+    t->coef = 1.0;
+    t->x = reg;
+    t->k = 1;
+    if (depth > MONOMIAL_DEPTH) return;
+    switch (d->op) {
+        case IR_CONST:
+            t->coef = d->imm;
+            t->x = -1;
+            t->k = 0;
             return;
+        case IR_NEG:
+            monomial(c, d->a, &u, depth + 1);
+            u.coef = -u.coef;
+            break;
+        case IR_MUL:
+            monomial(c, d->a, &u, depth + 1);
+            monomial(c, d->b, &v, depth + 1);
+            if ((u.x >= 0 && v.x >= 0 && u.x != v.x) || u.k + v.k > MAX_CHAIN_POW) return;
+            u.coef *= v.coef;
+            if (u.x < 0) u.x = v.x;
+            u.k += v.k;
+            break;
+        case IR_DIV:
+            if (!is_op(c, d->b, IR_CONST)) return;
+            monomial(c, d->a, &u, depth + 1);
+            u.coef /= def(c, d->b)->imm;
+            break;
+        case IR_POW: {
+            if (!is_op(c, d->b, IR_CONST)) return;
+            double e = def(c, d->b)->imm;
+            monomial(c, d->a, &u, depth + 1);
+            if (u.x < 0 || !(e >= 1 && u.k * e <= MAX_CHAIN_POW) || e != (int)e) return;
+            u.coef = pow(u.coef, e);
+            u.k *= (int)e;
+            break;
         }
+        default:
+            return;
+    }
+    if (isfinite(u.coef)) *t = u;
+}
+
+/* The terms of the sum at reg, going into the sums only it reads;
+   returns the new count n, or -1 when there are too many */
+static int collect(const OptCtx *c, int reg, int neg, Term *t, int n, int depth) {
+    const IRInstr *d = def(c, reg);
+    if (depth > MAX_TERMS) return -1;
+    if (c->inner[reg] && (d->op == IR_ADD || d->op == IR_SUB)) {
+        n = collect(c, d->a, neg, t, n, depth + 1);
+        return n < 0 ? n : collect(c, d->b, d->op == IR_SUB ? !neg : neg, t, n, depth + 1);
     }
-    
-    double value;
-    if (sscanf(code, "%15s = %lf", out_temp, &value) == 2) {
-        constants[const_count].temp = strdup(out_temp);
-        constants[const_count].value = value;
-        const_count++;
+    if (c->inner[reg] && d->op == IR_NEG) return collect(c, d->a, !neg, t, n, depth + 1);
+    if (n == MAX_TERMS) return -1;
+    monomial(c, reg, &t[n], 0);
+    if (neg) t[n].coef = -t[n].coef;
+    t[n].reg = reg;
+    t[n].neg = neg;
+    return n + 1;
+}
+
+/* Registers read once, by a sum or a negation that is itself a term */
+static void mark_inner(OptCtx *c) {
+    const IRProgram *p = &c->prog;
+    memset(c->inner, 0, p->nregs);
+    for (int i = p->count - 1; i >= 0; i--) {
+        const IRInstr *in = &p->code[i];
+        if (in->op != IR_ADD && in->op != IR_SUB && !(in->op == IR_NEG && c->inner[in->dst])) continue;
+        if (c->uses[in->a] == 1) c->inner[in->a] = 1;
+        if (in->b >= 0 && c->uses[in->b] == 1) c->inner[in->b] = 1;
     }
-    
-    cJSON_AddItemToArray(opt, cJSON_CreateString(code));
 }
 
-cJSON* get_opt_json() {
-    cJSON *ir = get_ir_json();
-    cJSON *opt = cJSON_CreateArray();
-    const_count = 0;
+static int put_const(OptCtx *c, double v) {
+    IRInstr k = { .op = IR_CONST, .dst = new_reg(c), .a = -1, .b = -1, .imm = v, .c = -1 };
+    return put(c, k);
+}
+
+static int put_op(OptCtx *c, IROp op, int a, int b) {
+    IRInstr in = { .op = op, .dst = new_reg(c), .a = a, .b = b, .c = -1 };
+    return put(c, in);
+}
 
-    // Reset optimization errors
-    if (opt_errors) cJSON_Delete(opt_errors);
-    opt_errors = cJSON_CreateArray();
+/* The sum `in` as a polynomial in the x most of its terms are powers
+   of, by Horner's rule, plus the terms in anything else. Runs of zero
+   coefficients multiply by x^gap. Gives up, returning 0, unless two
+   terms are in x and one of them has degree 2 or more. */
+static int horner_instr(OptCtx *c, IRInstr in) {
+    Term t[MAX_TERMS];
+    int n = collect(c, in.a, 0, t, 0, 0);
+    if (n >= 0) n = collect(c, in.b, in.op == IR_SUB, t, n, 0);
+    if (n < 0) return 0;
 
-    cJSON *instr;
-    cJSON_ArrayForEach(instr, ir) {
-        const char *code = cJSON_GetStringValue(instr);
-        fold_constants(opt, code);
+    int x = -1, best = 1;
+    for (int i = 0; i < n; i++) {
+        if (t[i].x < 0) continue;
+        int terms = 0, top = 0;
+        for (int j = 0; j < n; j++) {
+            if (t[j].x != t[i].x) continue;
+            terms++;
+            if (t[j].k > top) top = t[j].k;
+        }
+        if (terms > best && top >= 2) {
+            x = t[i].x;
+            best = terms;
+        }
+    }
+    if (x < 0) return 0;
+
+    double coef[MAX_CHAIN_POW + 1] = { 0 };
+    int top = 0;
+    for (int i = 0; i < n; i++) {
+        if (t[i].x != x && t[i].x >= 0) continue;
+        coef[t[i].k] += t[i].coef;
+        if (t[i].k > top) top = t[i].k;
     }
+    while (top > 0 && coef[top] == 0) top--;
 
-    return opt;
+    int acc = put_const(c, coef[top]);
+    for (int k = top; k > 0;) {
+        int next = k - 1;
+        while (next >= 0 && coef[next] == 0) next--;
+        int xk = power_chain(c, x, next >= 0 ? k - next : k, -1);
+        acc = put_op(c, IR_MUL, acc, xk);
+        if (next < 0) break;
+        int ck = put_const(c, coef[next]);
+        acc = put_op(c, IR_ADD, acc, ck);
+        k = next;
+    }
+    for (int i = 0; i < n; i++) {
+        if (t[i].x != x && t[i].x >= 0) acc = put_op(c, t[i].neg ? IR_SUB : IR_ADD, acc, t[i].reg);
+    }
+    return forward(c, in.dst, acc);
 }
 
-void init_opt() {
-    for (int i = 0; i < const_count; i++) {
-        free(constants[i].temp);
+/* Rewrite each outermost sum whose terms make a polynomial. Fast math
+   only: Horner's rule rounds differently. */
+static int horner(OptCtx *c) {
+    if (!c->fast_math) return 0;
+    IRProgram *p = &c->prog;
+    count_uses(c);
+    mark_inner(c);
+    rebuild_begin(c);
+    int rewritten = 0;
+    for (int i = 0; i < p->count; i++) {
+        IRInstr in = p->code[i];
+        if ((in.op == IR_ADD || in.op == IR_SUB) && !c->inner[in.dst] && horner_instr(c, in)) rewritten++;
+        else put(c, in);
+    }
+    rebuild_end(c);
+    return rewritten;
+}
+
+/* ---- contraction ---- */
+
+/* The product in reg, if nothing else reads it */
+static const IRInstr* lone_product(const OptCtx *c, int reg) {
+    const IRInstr *d = def(c, reg);
+    return d->op == IR_MUL && c->uses[reg] == 1 ? d : NULL;
+}
+
+/* -reg, folded when reg is a constant */
+static int negate(OptCtx *c, int reg) {
+    const IRInstr *d = def(c, reg);
+    if (d->op == IR_CONST) return put_const(c, -d->imm);
+    return put_op(c, IR_NEG, reg, -1);
+}
+
+static int fuse(OptCtx *c, IRInstr in, int a, int b, int addend) {
+    in.op = IR_FMA;
+    in.a = a;
+    in.b = b;
+    in.c = addend;
+    put(c, in);
+    return 1;
+}
+
+/* p + q and q + p become fma(p's operands, q) for a product p nothing
+   else reads; p - q adds -q, and q - p multiplies by the negated
+   first operand. Products read elsewhere are left alone, they would be
+   computed twice. */
+static int contract_instr(OptCtx *c, IRInstr in) {
+    const IRInstr *m;
+    if (in.op == IR_ADD) {
+        if ((m = lone_product(c, in.a))) return fuse(c, in, m->a, m->b, in.b);
+        if ((m = lone_product(c, in.b))) return fuse(c, in, m->a, m->b, in.a);
+    } else if (in.op == IR_SUB) {
+        if ((m = lone_product(c, in.a))) {
+            int a = m->a, b = m->b;
+            return fuse(c, in, a, b, negate(c, in.b));
+        }
+        if ((m = lone_product(c, in.b))) {
+            int b = m->b, a = negate(c, m->a);
+            return fuse(c, in, a, b, in.a);
+        }
     }
-    const_count = 0;
-    if (opt_errors) cJSON_Delete(opt_errors);
-    opt_errors = NULL;
-}
\ No newline at end of file
+    put(c, in);
+    return 0;
+}
+
+static int contract(OptCtx *c) {
+    if (!c->fma) return 0;
+    IRProgram *p = &c->prog;
+    count_uses(c);
+    rebuild_begin(c);
+    int fused = 0;
+    for (int i = 0; i < p->count; i++) fused += contract_instr(c, p->code[i]);
+    rebuild_end(c);
+    return fused;
+}
+
+/* ---- copy propagation ---- */
+
+static int commutative(IROp op) {
+    return op == IR_ADD || op == IR_MUL;
+}
+
+/* Instructions computing the same value: constants with the same bits
+   (so 0 and -0 stay apart), the same variable, or the same operation on
+   the same registers, in either order where that cannot matter */
+static int same_value(const IRInstr *x, const IRInstr *y) {
+    if (x->op != y->op) return 0;
+    if (x->op == IR_CONST) return memcmp(&x->imm, &y->imm, sizeof(double)) == 0;
+    if (x->op == IR_VAR) return x->var == y->var;
+    if (x->op == IR_FMA && x->c != y->c) return 0;
+    if (x->a == y->a && x->b == y->b) return 1;
+    return (commutative(x->op) || x->op == IR_FMA) && x->a == y->b && x->b == y->a;
+}
+
+static uint64_t value_hash(const IRInstr *in) {
+    uint64_t h = (uint64_t)in->op * 0x9e3779b97f4a7c15ull;
+    if (in->op == IR_CONST) {
+        uint64_t bits;
+        memcpy(&bits, &in->imm, sizeof(bits));
+        h ^= bits;
+    } else if (in->op == IR_VAR) {
+        h ^= (uint64_t)in->var;
+    } else {
+        int a = in->a, b = in->b;
+        if ((commutative(in->op) || in->op == IR_FMA) && b < a) {
+            a = in->b;
+            b = in->a;
+        }
+        h ^= ((uint64_t)(unsigned)a << 32) | (unsigned)b;
+        if (in->op == IR_FMA) h ^= (uint64_t)(unsigned)in->c * 0x94d049bb133111ebull;
+    }
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    return h ^ (h >> 32);
+}
+
+/* Point every use of a value computed twice at its first computation.
+   The repeats are left for dead-code elimination. */
+static int copyprop(OptCtx *c) {
+    IRProgram *p = &c->prog;
+    int nslots = 64;
+    while (nslots < 2 * p->count) nslots *= 2;
+    if (nslots > c->nslots) {
+        c->slots = mmc_realloc(c->slots, nslots * sizeof(*c->slots));
+        if (!c->slots) {
+            fprintf(stderr, "Out of memory growing optimizer tables\n");
+            exit(EXIT_FAILURE);
+        }
+        c->nslots = nslots;
+    }
+    for (int s = 0; s < nslots; s++) c->slots[s] = -1;
+    for (int r = 0; r < p->nregs; r++) c->repl[r] = r;
+
+    int forwarded = 0;
+    for (int i = 0; i < p->count; i++) {
+        IRInstr *in = &p->code[i];
+        if (in->a >= 0) in->a = c->repl[in->a];
+        if (in->b >= 0) in->b = c->repl[in->b];
+        if (in->op == IR_FMA) in->c = c->repl[in->c];
+        if (i == p->count - 1) break;   // the result stays where it is
+
+        int s = (int)(value_hash(in) & (uint64_t)(nslots - 1));
+        while (c->slots[s] >= 0 && !same_value(&p->code[c->slots[s]], in)) s = (s + 1) & (nslots - 1);
+        if (c->slots[s] >= 0) {
+            c->repl[in->dst] = p->code[c->slots[s]].dst;
+            forwarded++;
+        } else {
+            c->slots[s] = i;
+        }
+    }
+    return forwarded;
+}
+
+/* ---- dead-code elimination ---- */
+
+/* Keep only what the result depends on */
+static int dce(OptCtx *c) {
+    IRProgram *p = &c->prog;
+    if (p->count == 0) return 0;
+    memset(c->live, 0, p->nregs);
+    c->live[p->code[p->count - 1].dst] = 1;
+    for (int i = p->count - 1; i >= 0; i--) {
+        const IRInstr *in = &p->code[i];
+        if (!c->live[in->dst]) continue;
+        if (in->a >= 0) c->live[in->a] = 1;
+        if (in->b >= 0) c->live[in->b] = 1;
+        if (in->op == IR_FMA) c->live[in->c] = 1;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < p->count; i++) {
+        if (c->live[p->code[i].dst]) p->code[kept++] = p->code[i];
+    }
+    int removed = p->count - kept;
+    p->count = kept;
+    return removed;
+}
+
+/* ---- pass manager ---- */
+
+typedef int (*PassFn)(OptCtx *c);
+
+/* A late pass runs only in rounds where the passes before it changed
+   nothing, so that it sees the program they leave: contraction would
+   otherwise fuse products simplification was about to fold away. */
+static const struct {
+    const char *name;
+    PassFn run;
+    int late;
+} passes[OPT_NPASSES] = {
+    [OPT_CONSTPROP] = { "constprop", constprop, 0 },
+    [OPT_HORNER]    = { "horner",    horner,    0 },
+    [OPT_SIMPLIFY]  = { "simplify",  simplify,  0 },
+    [OPT_COPYPROP]  = { "copyprop",  copyprop,  0 },
+    [OPT_DCE]       = { "dce",       dce,       0 },
+    [OPT_CONTRACT]  = { "contract",  contract,  1 },
+};
+
+const char* opt_pass_name(OptPass p) {
+    return passes[p].name;
+}
+
+static void grow_tables(OptCtx *c, int nregs) {
+    if (nregs <= c->regs_cap) return;
+    int cap = c->regs_cap * 2 > nregs ? c->regs_cap * 2 : nregs;
+    c->values = mmc_realloc(c->values, cap * sizeof(*c->values));
+    c->known = mmc_realloc(c->known, cap);
+    c->repl = mmc_realloc(c->repl, cap * sizeof(*c->repl));
+    c->def = mmc_realloc(c->def, cap * sizeof(*c->def));
+    c->live = mmc_realloc(c->live, cap);
+    c->uses = mmc_realloc(c->uses, cap * sizeof(*c->uses));
+    c->inner = mmc_realloc(c->inner, cap);
+    if (!c->values || !c->known || !c->repl || !c->def || !c->live || !c->uses || !c->inner) {
+        fprintf(stderr, "Out of memory growing optimizer tables\n");
+        exit(EXIT_FAILURE);
+    }
+    c->regs_cap = cap;
+}
+
+const IRProgram* optimize_ir(OptCtx *c, const IRProgram *ir) {
+    ir_program_copy(&c->prog, ir);
+    grow_tables(c, ir->nregs);
+    diag_clear(&c->errors);
+    memset(&c->report, 0, sizeof(c->report));
+    c->report.before = ir->count;
+
+    int changed = c->prog.count > 0;
+    while (changed && c->report.rounds < OPT_MAX_ROUNDS) {
+        changed = 0;
+        for (int k = 0; k < OPT_NPASSES; k++) {
+            if (passes[k].late && changed) continue;
+            int n = passes[k].run(c);
+            c->report.changed[k] += n;
+            changed += n;
+        }
+        c->report.rounds++;
+    }
+    c->report.after = c->prog.count;
+    return &c->prog;
+}
+
+const IRProgram* get_opt_ir(const OptCtx *c) {
+    return &c->prog;
+}
+
+void init_opt(OptCtx *c) {
+    ir_program_clear(&c->prog);
+    diag_clear(&c->errors);
+    memset(&c->report, 0, sizeof(c->report));
+}
+
+void opt_ctx_free(OptCtx *c) {
+    ir_program_free(&c->prog);
+    ir_program_free(&c->tmp);
+    diag_free(&c->errors);
+    free(c->values);
+    free(c->known);
+    free(c->repl);
+    free(c->def);
+    free(c->live);
+    free(c->uses);
+    free(c->inner);
+    free(c->slots);
+    memset(c, 0, sizeof(*c));
+}
+
+void opt_report_json(JsonWriter *w, const OptReport *r) {
+    json_begin_object(w);
+    json_key(w, "rounds");
+    json_number(w, r->rounds);
+    json_key(w, "before");
+    json_number(w, r->before);
+    json_key(w, "after");
+    json_number(w, r->after);
+    json_key(w, "passes");
+    json_begin_object(w);
+    for (int k = 0; k < OPT_NPASSES; k++) {
+        json_key(w, passes[k].name);
+        json_number(w, r->changed[k]);
+    }
+    json_end_object(w);
+    json_end_object(w);
+}
@@ -1,9 +1,63 @@
 #ifndef OPT_H
 #define OPT_H
 
-#include "cJSON.h"
+#include "ir.h"
+#include "diag.h"
+#include "json.h"
 
-void init_opt(void);
-cJSON* get_opt_json(void);
+/* Passes of the optimizer, in the order each round runs them */
+typedef enum {
+    OPT_CONSTPROP,          // fold instructions whose operands are all known
+    OPT_HORNER,             // polynomials into Horner form
+    OPT_SIMPLIFY,           // algebraic identities and strength reduction
+    OPT_COPYPROP,           // forward repeats of an earlier value to it
+    OPT_DCE,                // drop instructions the result does not use
+    OPT_CONTRACT,           // a * b + c into fused multiply-adds, once the rest settle
+    OPT_NPASSES
+} OptPass;
 
-#endif // OPT_H
\ No newline at end of file
+/* What one optimize_ir did */
+typedef struct {
+    int rounds;                 // until a round changed nothing
+    int before, after;          // instruction counts
+    int changed[OPT_NPASSES];   // instructions folded, rewritten, forwarded or removed
+} OptReport;
+
+/* State of the optimizer. Zero-initialize before first use; every
+   thread running the pipeline needs its own.
+
+   By default every rewrite gives the same bits as the code it replaces,
+   NaN payloads aside. With fast_math set, simplification also makes
+   rewrites that round differently or assume finite, in-domain values:
+   multiply chains for integer powers, reciprocals of any constant
+   divisor, exp(log a) = a and the like, and sums of terms c * x^k
+   become polynomials in Horner form. With fma set, a product whose only
+   use is an addition is fused with it into IR_FMA, rounded once. */
+typedef struct {
+    int fast_math;          // set by the caller, kept across statements
+    int fma;                // likewise
+    IRProgram prog;
+    IRProgram tmp;          // simplification builds the new program here
+    OptReport report;       // of the last optimize_ir
+    DiagList errors;        // folds that were refused
+    double *values;         // per register: its value where `known`
+    unsigned char *known;
+    int *repl;              // per register: the earlier one it repeats, or itself
+    int *def;               // per register: index of its instruction in tmp
+    unsigned char *live;
+    int *uses;              // per register: instructions reading it
+    unsigned char *inner;   // per register: a term of a larger sum
+    int regs_cap;
+    int *slots;             // value-numbering table of instruction indices
+    int nslots;
+} OptCtx;
+
+void init_opt(OptCtx *c);
+const IRProgram* optimize_ir(OptCtx *c, const IRProgram *ir);  // runs the passes over a copy of `ir`
+const IRProgram* get_opt_ir(const OptCtx *c);
+void opt_ctx_free(OptCtx *c);
+
+const char* opt_pass_name(OptPass p);   // "constprop", ...
+void opt_report_json(JsonWriter *w, const OptReport *r);
+
+#endif // OPT_H
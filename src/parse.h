@@ -0,0 +1,32 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdio.h>
+#include "ast.h"
+
+/* What the parser does with what it reads. The lexer and parser keep no
+   globals: every parse gets its own scanner, and reports back only
+   through the hooks it was given, so independent parses can run on
+   different threads. Embed ParseHooks first in a larger struct to carry
+   more state to the callbacks. */
+typedef struct ParseHooks ParseHooks;
+
+struct ParseHooks {
+    ASTBuilder *builder;    // every node is built here
+    /* each token as it is read, may be NULL */
+    void (*token)(ParseHooks *h, const char *type, const char *text);
+    /* each statement as its ';' is reduced */
+    void (*statement)(ParseHooks *h, ASTNode *n);
+};
+
+/* Parse a whole program; 0 on success, nonzero after a syntax error
+   (statements before it have already been delivered). From a pipe,
+   socket or terminal each line is parsed as soon as it arrives. */
+int parse_string(ParseHooks *h, const char *src);
+int parse_file(ParseHooks *h, FILE *in);
+
+/* Run only the scanner over src, delivering tokens to h->token; the
+   number of tokens read. For timing the lexer apart from the parser. */
+long lex_string(ParseHooks *h, const char *src);
+
+#endif // PARSE_H
@@ -2,22 +2,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "ast.h"
-
-extern int yylex(void);
-extern void yyerror(const char *);
-extern void add_statement(ASTNode *n);
+#include "alloc.h"
+#define YYMALLOC mmc_malloc
 %}
 
 %code requires {
-  #include "ast.h"
+  #include "parse.h"
+  typedef void *yyscan_t;
+}
+
+%code {
+  extern int yylex(YYSTYPE *lval, yyscan_t scanner);
+  static void yyerror(yyscan_t scanner, ParseHooks *hooks, const char *msg);
 }
 
+/* Reentrant: the scanner and the caller's hooks are threaded through;
+   every node built by the actions below comes from hooks->builder */
+%define api.pure full
+%lex-param { yyscan_t scanner }
+%parse-param { yyscan_t scanner } { ParseHooks *hooks }
+
 %union {
     double dval;
+    char *sval;
     ASTNode *node;
 }
 
 %token <dval> NUMBER
+%token <sval> IDENT
+%destructor { free($$); } <sval>
 %token SIN COS TAN LOG EXP SQRT
 %left '+' '-'
 %left '*' '/'
@@ -33,28 +46,31 @@ input:
   ;
 
 stmt:
-    expr ';'    { add_statement($1); }
+    expr ';'    { hooks->statement(hooks, $1); }
   ;
 
 expr:
-    NUMBER               { $$ = make_num($1); }
-  | expr '+' expr       { $$ = make_bin(NODE_ADD, $1, $3); }
-  | expr '-' expr       { $$ = make_bin(NODE_SUB, $1, $3); }
-  | expr '*' expr       { $$ = make_bin(NODE_MUL, $1, $3); }
-  | expr '/' expr       { $$ = make_bin(NODE_DIV, $1, $3); }
-  | '-' expr   %prec NEG{ $$ = make_unary(NODE_NEG, $2); }
-  | expr '^' expr       { $$ = make_bin(NODE_POW, $1, $3); }
+    NUMBER               { $$ = make_num(hooks->builder, $1); }
+  | IDENT               { $$ = make_var(hooks->builder, $1); free($1); }
+  | expr '+' expr       { $$ = make_bin(hooks->builder, NODE_ADD, $1, $3); }
+  | expr '-' expr       { $$ = make_bin(hooks->builder, NODE_SUB, $1, $3); }
+  | expr '*' expr       { $$ = make_bin(hooks->builder, NODE_MUL, $1, $3); }
+  | expr '/' expr       { $$ = make_bin(hooks->builder, NODE_DIV, $1, $3); }
+  | '-' expr   %prec NEG{ $$ = make_unary(hooks->builder, NODE_NEG, $2); }
+  | expr '^' expr       { $$ = make_bin(hooks->builder, NODE_POW, $1, $3); }
   | '(' expr ')'        { $$ = $2; }
-  | SIN '(' expr ')'    { $$ = make_unary(NODE_SIN, $3); }
-  | COS '(' expr ')'    { $$ = make_unary(NODE_COS, $3); }
-  | TAN '(' expr ')'    { $$ = make_unary(NODE_TAN, $3); }
-  | LOG '(' expr ')'    { $$ = make_unary(NODE_LOG, $3); }
-  | EXP '(' expr ')'    { $$ = make_unary(NODE_EXP, $3); }
-  | SQRT '(' expr ')'   { $$ = make_unary(NODE_SQRT, $3); }
+  | SIN '(' expr ')'    { $$ = make_unary(hooks->builder, NODE_SIN, $3); }
+  | COS '(' expr ')'    { $$ = make_unary(hooks->builder, NODE_COS, $3); }
+  | TAN '(' expr ')'    { $$ = make_unary(hooks->builder, NODE_TAN, $3); }
+  | LOG '(' expr ')'    { $$ = make_unary(hooks->builder, NODE_LOG, $3); }
+  | EXP '(' expr ')'    { $$ = make_unary(hooks->builder, NODE_EXP, $3); }
+  | SQRT '(' expr ')'   { $$ = make_unary(hooks->builder, NODE_SQRT, $3); }
   ;
 
 %%
 
-void yyerror(const char *s) {
-    fprintf(stderr, "Parse error: %s\n", s);
+static void yyerror(yyscan_t scanner, ParseHooks *hooks, const char *msg) {
+    (void)scanner;
+    (void)hooks;
+    fprintf(stderr, "Parse error: %s\n", msg);
 }
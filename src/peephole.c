@@ -0,0 +1,445 @@
+#include "codegen.h"
+#include "alloc.h"
+#include "ir.h"
+#include "json.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/* generate_assembly lowers one IR instruction at a time, so its output
+   copies operands into the destination before two-address arithmetic,
+   loads constants that are read once, reloads values after calls that
+   the next instruction overwrites and moves the result into xmm0 at the
+   end. A program is one basic block, so each rule below only scans
+   forwards or backwards from the instruction it rewrites.
+
+   Removed instructions are marked while the rules run and squeezed out
+   at the end. */
+
+struct PeepInstr {
+    unsigned short rd, wr;  // xmm registers it reads and writes
+    unsigned short live;    // xmm registers read after it before being written
+    unsigned char gone;     // removed
+};
+
+static const char *rule_names[PEEP_NRULES] = {
+    [PEEP_CONSTS] = "consts", [PEEP_FORWARD] = "forward",
+    [PEEP_COALESCE] = "coalesce", [PEEP_DEAD] = "dead", [PEEP_AVX] = "avx"
+};
+
+#define BIT(r) (1u << (r))
+#define ALL_XMM 0xffffu
+
+static Loc xmm(int n) { Loc l = { LOC_XMM, n, 0 }; return l; }
+
+static int is_xmm(Loc l, int r) { return l.kind == LOC_XMM && l.n == r; }
+
+static int is_mem(Loc l) {
+    return l.kind == LOC_STACK || l.kind == LOC_VAR || l.kind == LOC_CONST;
+}
+
+/* sd instructions whose source can be an m64 as well as a register */
+static int takes_mem(AsmOp op) {
+    return op == ASM_MOVSD || op == ASM_ADDSD || op == ASM_SUBSD || op == ASM_MULSD ||
+           op == ASM_DIVSD || op == ASM_SQRTSD || op == ASM_MAXSD || op == ASM_MINSD;
+}
+
+static int is_vex(AsmOp op) {
+    return op == ASM_VADDSD || op == ASM_VSUBSD || op == ASM_VMULSD || op == ASM_VDIVSD;
+}
+
+/* The xmm registers instruction i reads and writes, redone whenever a
+   rule rewrites it. Every xmm is caller-saved, and libm takes its
+   arguments in xmm0 and xmm1. */
+static void note_effects(CodegenCtx *c, int i) {
+    const AsmInstr *in = &c->prog.code[i];
+    unsigned r = 0, w = 0;
+    switch (in->op) {
+        case ASM_MOVSD:
+        case ASM_SQRTSD:
+            if (in->dst.kind == LOC_XMM) w = BIT(in->dst.n);
+            if (in->src.kind == LOC_XMM) r = BIT(in->src.n);
+            break;
+        case ASM_PSLLQ:
+        case ASM_PSRLQ:
+            r = w = BIT(in->dst.n);
+            break;
+        case ASM_CALL:
+            r = BIT(0) | (in->dst.n == IR_POW ? BIT(1) : 0);
+            w = ALL_XMM;
+            break;
+        case ASM_RET:
+            r = BIT(0);
+            break;
+        case ASM_VFMADD231SD:
+            r = w = BIT(in->dst.n);     // the addend
+            r |= BIT(in->src.n);
+            if (in->src2.kind == LOC_XMM) r |= BIT(in->src2.n);
+            break;
+        case ASM_SUB_RSP:
+        case ASM_ADD_RSP:
+        case ASM_PUSH:
+        case ASM_POP:
+        case ASM_MOV:
+            break;
+        default:
+            if (is_vex(in->op)) {
+                r = BIT(in->src.n);
+                if (in->src2.kind == LOC_XMM) r |= BIT(in->src2.n);
+            } else {
+                r = BIT(in->dst.n);     // two-address: dst op= src
+                if (in->src.kind == LOC_XMM) r |= BIT(in->src.n);
+            }
+            w = BIT(in->dst.n);
+            break;
+    }
+    c->peep[i].rd = (unsigned short)r;
+    c->peep[i].wr = (unsigned short)w;
+}
+
+static int next_live(const CodegenCtx *c, int i) {
+    for (i++; i < c->prog.count && c->peep[i].gone; i++) {}
+    return i;
+}
+
+/* Fill in every instruction's live registers. Rules that remove reads
+   leave them a superset, which is safe; rules that move a value to
+   another register keep them exact with move_live. */
+static void compute_live(CodegenCtx *c) {
+    unsigned live = 0;
+    for (int i = c->prog.count - 1; i >= 0; i--) {
+        if (c->peep[i].gone) continue;
+        c->peep[i].live = (unsigned short)live;
+        live = (live & ~c->peep[i].wr) | c->peep[i].rd;
+    }
+}
+
+static int live_after(const CodegenCtx *c, int i, int r) {
+    return (c->peep[i].live & BIT(r)) != 0;
+}
+
+/* The value in `from` lives in `to` over instructions [begin, end) */
+static void move_live(CodegenCtx *c, int begin, int end, int from, int to) {
+    for (int j = begin; j < end; j++) {
+        if (c->peep[j].live & BIT(from)) c->peep[j].live = (unsigned short)((c->peep[j].live & ~BIT(from)) | BIT(to));
+    }
+}
+
+static void rename_reg(CodegenCtx *c, int i, int from, int to) {
+    AsmInstr *in = &c->prog.code[i];
+    if (is_xmm(in->dst, from)) in->dst.n = to;
+    if (is_xmm(in->src, from)) in->src.n = to;
+    if (is_xmm(in->src2, from)) in->src2.n = to;
+    note_effects(c, i);
+}
+
+static void remove_at(CodegenCtx *c, int i, PeepRule rule) {
+    c->peep[i].gone = 1;
+    c->prog.peephole.changed[rule]++;
+}
+
+static void* grow(void *buf, int *cap, int need, size_t elem) {
+    if (*cap >= need) return buf;
+    buf = mmc_realloc(buf, need * elem);
+    if (!buf) {
+        fprintf(stderr, "Out of memory in peephole pass\n");
+        exit(EXIT_FAILURE);
+    }
+    *cap = need;
+    return buf;
+}
+
+/* ---- constants ---- */
+
+/* Every IR constant and kernel coefficient gets its own pool entry;
+   equal bit patterns share one */
+static void merge_consts(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    if (p->nconsts < 2) return;
+    int size = 16;
+    while (size < 2 * p->nconsts) size *= 2;
+    c->pool_map = grow(c->pool_map, &c->pool_map_cap, size + p->nconsts, sizeof(*c->pool_map));
+    int *table = c->pool_map, *remap = c->pool_map + size;
+    for (int h = 0; h < size; h++) table[h] = -1;
+
+    int n = 0;
+    for (int i = 0; i < p->nconsts; i++) {
+        uint64_t bits;
+        memcpy(&bits, &p->consts[i], sizeof(bits));
+        unsigned h = (unsigned)((bits * 0x9E3779B97F4A7C15ull) >> 32) & (size - 1);
+        while (table[h] >= 0 && memcmp(&p->consts[table[h]], &bits, sizeof(bits)) != 0) {
+            h = (h + 1) & (size - 1);
+        }
+        if (table[h] < 0) {
+            p->consts[n] = p->consts[i];
+            table[h] = n++;
+        }
+        remap[i] = table[h];
+    }
+    p->peephole.changed[PEEP_CONSTS] += p->nconsts - n;
+    p->nconsts = n;
+
+    for (int i = 0; i < p->count; i++) {
+        AsmInstr *in = &p->code[i];
+        if (in->src.kind == LOC_CONST) in->src.n = remap[in->src.n];
+        if (in->src2.kind == LOC_CONST) in->src2.n = remap[in->src2.n];
+    }
+}
+
+/* ---- forwarding ---- */
+
+/* `movsd [rsp+k], xmmA` ... `op X, [rsp+k]` reads A instead while
+   neither A nor the slot has changed; a reload into A itself goes. The
+   second source of a VEX form is forwarded the same way. */
+static void forward_stores(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    for (int i = 0; i < p->count; i++) {
+        const AsmInstr *st = &p->code[i];
+        if (c->peep[i].gone || st->op != ASM_MOVSD || st->dst.kind != LOC_STACK || st->src.kind != LOC_XMM) continue;
+        int off = st->dst.n, a = st->src.n;
+        for (int j = next_live(c, i); j < p->count; j = next_live(c, j)) {
+            AsmInstr *u = &p->code[j];
+            if (u->op == ASM_MOVSD && u->dst.kind == LOC_STACK && u->dst.n == off) break;
+            if (u->src.kind == LOC_STACK && u->src.n == off && takes_mem(u->op)) {
+                if (u->op == ASM_MOVSD && is_xmm(u->dst, a)) {
+                    remove_at(c, j, PEEP_FORWARD);
+                    continue;
+                }
+                u->src = xmm(a);
+                note_effects(c, j);
+                p->peephole.changed[PEEP_FORWARD]++;
+            }
+            if (u->src2.kind == LOC_STACK && u->src2.n == off) {
+                u->src2 = xmm(a);
+                note_effects(c, j);
+                p->peephole.changed[PEEP_FORWARD]++;
+            }
+            if (c->peep[j].wr & BIT(a)) break;
+        }
+    }
+}
+
+/* `movsd xmmR, m` whose one reader is `op X, xmmR` becomes `op X, m`,
+   unless the slot m names is stored to in between; likewise for the
+   second source of a VEX form. Packed ops are left alone: their memory
+   operands must be 16-byte aligned. */
+static void fold_loads(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    compute_live(c);
+    for (int i = 0; i < p->count; i++) {
+        const AsmInstr *ld = &p->code[i];
+        if (c->peep[i].gone || ld->op != ASM_MOVSD || ld->dst.kind != LOC_XMM || !is_mem(ld->src)) continue;
+        int r = ld->dst.n;
+        if (!live_after(c, i, r)) continue;     // dead, which sweep_dead sees to
+        for (int j = next_live(c, i); j < p->count; j = next_live(c, j)) {
+            AsmInstr *u = &p->code[j];
+            if (ld->src.kind == LOC_STACK && u->op == ASM_MOVSD && u->dst.kind == LOC_STACK &&
+                u->dst.n == ld->src.n) break;
+            unsigned rd = c->peep[j].rd, wr = c->peep[j].wr;
+            if (rd & BIT(r)) {
+                // a copy must land in a register: no memory-to-memory movsd
+                if (takes_mem(u->op) && u->dst.kind == LOC_XMM && is_xmm(u->src, r) &&
+                    u->dst.n != r && !live_after(c, j, r)) {
+                    u->src = ld->src;
+                    note_effects(c, j);
+                    remove_at(c, i, PEEP_FORWARD);
+                } else if (is_xmm(u->src2, r) && !is_xmm(u->src, r) && !is_xmm(u->dst, r) &&
+                           !live_after(c, j, r)) {
+                    u->src2 = ld->src;
+                    note_effects(c, j);
+                    remove_at(c, i, PEEP_FORWARD);
+                }
+                break;
+            }
+            if (wr & BIT(r)) break;
+        }
+    }
+}
+
+/* ---- copies ---- */
+
+/* `movapd R, S` with S dead afterwards: keep using S where R would be
+   read, up to R's next full definition. Two-address ops on R carry the
+   value along, so they are renamed too. Gives up where R has to be R:
+   libm arguments and the return value. */
+static int coalesce_forward(CodegenCtx *c, int i, int r, int s) {
+    AsmProgram *p = &c->prog;
+    int end;
+    for (end = next_live(c, i); end < p->count; end = next_live(c, end)) {
+        const AsmInstr *u = &p->code[end];
+        unsigned rd = c->peep[end].rd, wr = c->peep[end].wr;
+        if ((u->op == ASM_CALL || u->op == ASM_RET) && (rd & BIT(r))) return 0;
+        if ((wr & BIT(r)) && !(rd & BIT(r))) break;
+        if (wr & BIT(s)) {
+            if ((rd & BIT(r)) || live_after(c, end, r)) return 0;
+            break;
+        }
+    }
+    for (int j = next_live(c, i); j < end; j = next_live(c, j)) rename_reg(c, j, r, s);
+    move_live(c, i, end, r, s);
+    return 1;
+}
+
+/* Otherwise compute into R from S's last full definition on, provided
+   R is untouched over that stretch and no call sits in it. The
+   definition itself may read R: `movapd S, xmm0` after a call, worked
+   on and copied back for the return, then stays in xmm0 throughout. */
+static int coalesce_backward(CodegenCtx *c, int i, int r, int s) {
+    AsmProgram *p = &c->prog;
+    int def = -1;
+    for (int j = i - 1; j >= 0; j--) {
+        if (c->peep[j].gone) continue;
+        unsigned rd = c->peep[j].rd, wr = c->peep[j].wr;
+        if (p->code[j].op == ASM_CALL || (wr & BIT(r))) return 0;
+        if ((wr & BIT(s)) && !(rd & BIT(s))) {
+            def = j;
+            break;
+        }
+        if (rd & BIT(r)) return 0;
+    }
+    if (def < 0) return 0;
+    for (int j = def; j < i; j = next_live(c, j)) rename_reg(c, j, s, r);
+    move_live(c, def, i, s, r);
+    const AsmInstr *d = &p->code[def];
+    if (d->op == ASM_MOVSD && is_xmm(d->dst, r) && is_xmm(d->src, r)) remove_at(c, def, PEEP_COALESCE);
+    return 1;
+}
+
+static void coalesce(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    compute_live(c);
+    for (int i = 0; i < p->count; i++) {
+        const AsmInstr *in = &p->code[i];
+        if (c->peep[i].gone || in->op != ASM_MOVSD || in->dst.kind != LOC_XMM || in->src.kind != LOC_XMM) continue;
+        int r = in->dst.n, s = in->src.n;
+        if (r != s) {
+            if (live_after(c, i, s) || !live_after(c, i, r)) continue;
+            if (!coalesce_forward(c, i, r, s) && !coalesce_backward(c, i, r, s)) continue;
+        }
+        remove_at(c, i, PEEP_COALESCE);
+    }
+}
+
+/* ---- dead code ---- */
+
+/* Backwards over the program with the registers and stack slots that
+   are read later: a register write or a store nobody reads goes */
+static void sweep_dead(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    int nslots = p->frame_size / 8 + 1;
+    memset(c->slot_live, 0, nslots);
+    unsigned live = 0;
+    for (int i = p->count - 1; i >= 0; i--) {
+        if (c->peep[i].gone) continue;
+        const AsmInstr *in = &p->code[i];
+        unsigned rd = c->peep[i].rd, wr = c->peep[i].wr;
+        if (in->op == ASM_MOVSD && in->dst.kind == LOC_STACK) {
+            if (!c->slot_live[in->dst.n / 8]) {
+                remove_at(c, i, PEEP_DEAD);
+                continue;
+            }
+            c->slot_live[in->dst.n / 8] = 0;
+        } else if (in->dst.kind == LOC_XMM && in->op != ASM_CALL && !(wr & live)) {
+            remove_at(c, i, PEEP_DEAD);
+            continue;
+        }
+        if (in->src.kind == LOC_STACK) c->slot_live[in->src.n / 8] = 1;
+        if (in->src2.kind == LOC_STACK) c->slot_live[in->src2.n / 8] = 1;
+        live = (live & ~wr) | rd;
+    }
+}
+
+/* ---- AVX ---- */
+
+static AsmOp vex_form(AsmOp op) {
+    switch (op) {
+        case ASM_ADDSD: return ASM_VADDSD;
+        case ASM_SUBSD: return ASM_VSUBSD;
+        case ASM_MULSD: return ASM_VMULSD;
+        case ASM_DIVSD: return ASM_VDIVSD;
+        default:        return op;
+    }
+}
+
+/* `movapd R, S` ... `op R, X` becomes `vop R, S, X` when nothing in
+   between touches R or writes S. Loads are left alone: fusing one into
+   an add or multiply would swap its operands, and with two NaNs x86
+   returns the first one's payload, which the fast-math kernels can turn
+   into a finite result. */
+static void fuse_avx(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    for (int i = 0; i < p->count; i++) {
+        const AsmInstr *mv = &p->code[i];
+        if (c->peep[i].gone || mv->op != ASM_MOVSD || mv->dst.kind != LOC_XMM ||
+            mv->src.kind != LOC_XMM) continue;
+        int r = mv->dst.n, s = mv->src.n;
+        for (int j = next_live(c, i); j < p->count; j = next_live(c, j)) {
+            AsmInstr *u = &p->code[j];
+            unsigned rd = c->peep[j].rd, wr = c->peep[j].wr;
+            if (!((rd | wr) & BIT(r))) {
+                if (wr & BIT(s)) break;
+                continue;
+            }
+            AsmOp v = vex_form(u->op);
+            if (v == u->op || !is_xmm(u->dst, r)) break;
+            u->src2 = is_xmm(u->src, r) ? xmm(s) : u->src;
+            u->src = xmm(s);
+            u->op = v;
+            note_effects(c, j);
+            remove_at(c, i, PEEP_AVX);
+            break;
+        }
+    }
+}
+
+/* ---- driver ---- */
+
+
+void peephole_asm(CodegenCtx *c) {
+    AsmProgram *p = &c->prog;
+    memset(&p->peephole, 0, sizeof(p->peephole));
+    p->peephole.before = p->count;
+    c->peep = grow(c->peep, &c->peep_cap, p->count + 1, sizeof(*c->peep));
+    c->slot_live = grow(c->slot_live, &c->slot_live_cap, p->frame_size / 8 + 1, sizeof(*c->slot_live));
+    for (int i = 0; i < p->count; i++) {
+        c->peep[i].gone = 0;
+        note_effects(c, i);
+    }
+
+    merge_consts(c);
+    // each rule feeds the next; running them all again finds under 0.1%
+    // more on generated corpora
+    forward_stores(c);
+    fold_loads(c);
+    coalesce(c);
+    sweep_dead(c);
+    if (c->avx) fuse_avx(c);
+
+    int n = 0;
+    for (int i = 0; i < p->count; i++) {
+        if (!c->peep[i].gone) p->code[n++] = p->code[i];
+    }
+    p->count = n;
+    p->peephole.after = n;
+}
+
+const char* peep_rule_name(PeepRule r) {
+    return rule_names[r];
+}
+
+void peep_report_json(JsonWriter *w, const PeepReport *r) {
+    json_begin_object(w);
+    json_key(w, "before");
+    json_number(w, r->before);
+    json_key(w, "after");
+    json_number(w, r->after);
+    json_key(w, "rules");
+    json_begin_object(w);
+    for (int k = 0; k < PEEP_NRULES; k++) {
+        json_key(w, rule_names[k]);
+        json_number(w, r->changed[k]);
+    }
+    json_end_object(w);
+    json_end_object(w);
+}
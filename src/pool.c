@@ -0,0 +1,134 @@
+#include "pool.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Jobs a worker has not started yet. The owner takes from `next`,
+   thieves shorten `end`. */
+typedef struct {
+    pthread_mutex_t lock;
+    int next, end;
+} JobRange;
+
+typedef struct {
+    JobRange *ranges;
+    int nworkers;
+    PoolJob job;
+    void *arg;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} WorkerArg;
+
+static int remaining(JobRange *r) {
+    pthread_mutex_lock(&r->lock);
+    int n = r->end - r->next;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+static int take_own(JobRange *r) {
+    pthread_mutex_lock(&r->lock);
+    int j = r->next < r->end ? r->next++ : -1;
+    pthread_mutex_unlock(&r->lock);
+    return j;
+}
+
+/* Move the back half of the fullest other range into self's (empty)
+   range; 0 once there is nothing left to steal */
+static int steal(Pool *p, int self) {
+    for (;;) {
+        int victim = -1, most = 0;
+        for (int w = 0; w < p->nworkers; w++) {
+            if (w == self) continue;
+            int n = remaining(&p->ranges[w]);
+            if (n > most) {
+                most = n;
+                victim = w;
+            }
+        }
+        if (victim < 0) return 0;
+
+        JobRange *v = &p->ranges[victim];
+        pthread_mutex_lock(&v->lock);
+        int n = v->end - v->next;
+        if (n <= 0) {
+            // its owner got there first, look again
+            pthread_mutex_unlock(&v->lock);
+            continue;
+        }
+        int hi = v->end;
+        int lo = hi - (n + 1) / 2;
+        v->end = lo;
+        pthread_mutex_unlock(&v->lock);
+
+        JobRange *own = &p->ranges[self];
+        pthread_mutex_lock(&own->lock);
+        own->next = lo;
+        own->end = hi;
+        pthread_mutex_unlock(&own->lock);
+        return 1;
+    }
+}
+
+static void work(Pool *p, int self) {
+    do {
+        int j;
+        while ((j = take_own(&p->ranges[self])) >= 0) p->job(p->arg, self, j);
+    } while (steal(p, self));
+}
+
+static void* worker_main(void *arg) {
+    WorkerArg *w = arg;
+    work(w->pool, w->id);
+    return NULL;
+}
+
+void pool_run(int nworkers, int njobs, PoolJob job, void *arg) {
+    if (njobs <= 0) return;
+    if (nworkers > njobs) nworkers = njobs;
+    if (nworkers <= 1) {
+        for (int i = 0; i < njobs; i++) job(arg, 0, i);
+        return;
+    }
+
+    Pool p = { mmc_malloc(nworkers * sizeof(JobRange)), nworkers, job, arg };
+    pthread_t *threads = mmc_malloc(nworkers * sizeof(*threads));
+    WorkerArg *args = mmc_malloc(nworkers * sizeof(*args));
+    char *started = mmc_calloc(nworkers, 1);
+    if (!p.ranges || !threads || !args || !started) {
+        fprintf(stderr, "Out of memory starting worker pool\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int w = 0; w < nworkers; w++) {
+        pthread_mutex_init(&p.ranges[w].lock, NULL);
+        p.ranges[w].next = (int)((long long)njobs * w / nworkers);
+        p.ranges[w].end = (int)((long long)njobs * (w + 1) / nworkers);
+    }
+
+    // A worker that fails to start just leaves its range to be stolen
+    for (int w = 1; w < nworkers; w++) {
+        args[w].pool = &p;
+        args[w].id = w;
+        started[w] = pthread_create(&threads[w], NULL, worker_main, &args[w]) == 0;
+    }
+    work(&p, 0);
+    for (int w = 1; w < nworkers; w++) {
+        if (started[w]) pthread_join(threads[w], NULL);
+    }
+
+    for (int w = 0; w < nworkers; w++) pthread_mutex_destroy(&p.ranges[w].lock);
+    free(p.ranges);
+    free(threads);
+    free(args);
+    free(started);
+}
+
+int pool_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Fork-join work-stealing pool for independent jobs.
+
+   pool_run calls job(arg, worker, i) once for every i in [0, njobs),
+   from up to `nworkers` threads; the calling thread is worker 0 and
+   `worker` is always below nworkers, so callers can keep one context per
+   worker. Jobs start out split into one contiguous range per worker.
+   Each worker runs its own range front to back, and a worker that runs
+   dry steals the back half of the fullest remaining range. Returns once
+   every job has finished. */
+typedef void (*PoolJob)(void *arg, int worker, int job);
+
+void pool_run(int nworkers, int njobs, PoolJob job, void *arg);
+int pool_cpu_count(void);      // online processors, at least 1
+
+#endif // POOL_H
@@ -0,0 +1,333 @@
+#include "range.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#define M_PI 3.14159265358979323846
+#define M_PI_2 1.57079632679489661923
+
+/* Per-node result, indexed by node id and stamped like the other stages'
+   side tables so shared subtrees are analyzed once. */
+struct NodeRange {
+    unsigned gen;
+    int safe;
+    Interval iv;
+};
+
+static const Interval EVERYTHING = { -INFINITY, INFINITY };
+
+static NodeRange* node_range(RangeCtx *c, ASTNode *n) {
+    if (n->id >= c->node_ranges_cap) {
+        size_t cap = c->node_ranges_cap ? c->node_ranges_cap : 1024;
+        while (cap <= n->id) cap *= 2;
+        NodeRange *p = mmc_realloc(c->node_ranges, cap * sizeof(*p));
+        if (!p) {
+            fprintf(stderr, "Out of memory growing range table\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = c->node_ranges_cap; i < cap; i++) p[i].gen = 0;
+        c->node_ranges = p;
+        c->node_ranges_cap = cap;
+    }
+    return &c->node_ranges[n->id];
+}
+
+/* lookup without growing; NULL for nodes the last analysis never saw */
+static const NodeRange* find_range(const RangeCtx *c, ASTNode *n) {
+    if (n->id >= c->node_ranges_cap) return NULL;
+    const NodeRange *slot = &c->node_ranges[n->id];
+    return slot->gen == c->gen ? slot : NULL;
+}
+
+static void warn(RangeCtx *c, DiagCode code, const char *msg) {
+    diag_add(&c->report.warnings, code, msg);
+}
+
+/* ---- outward rounding ---- */
+static double down(double x, int ulps) {
+    while (ulps-- > 0 && isfinite(x)) x = nextafter(x, -INFINITY);
+    return x;
+}
+
+static double up(double x, int ulps) {
+    while (ulps-- > 0 && isfinite(x)) x = nextafter(x, INFINITY);
+    return x;
+}
+
+/* Bounds from a set of candidate endpoint values; a NaN candidate means
+   the operation is undefined somewhere in the box, so give up on it */
+static Interval hull(const double *v, int n, int ulps) {
+    Interval r = { v[0], v[0] };
+    for (int i = 0; i < n; i++) {
+        if (isnan(v[i])) return EVERYTHING;
+        if (v[i] < r.lo) r.lo = v[i];
+        if (v[i] > r.hi) r.hi = v[i];
+    }
+    r.lo = down(r.lo, ulps);
+    r.hi = up(r.hi, ulps);
+    return r;
+}
+
+static int contains(Interval a, double x) {
+    return a.lo <= x && x <= a.hi;
+}
+
+static int is_point(Interval a) {
+    return a.lo == a.hi;
+}
+
+/* Does [lo, hi] contain some point base + k*period? */
+static int hits_lattice(Interval a, double base, double period) {
+    if (!isfinite(a.lo) || !isfinite(a.hi)) return 1;
+    // A hair of slack so a rounded endpoint cannot slip past the point
+    double slack = 1e-12 * (1.0 + fmax(fabs(a.lo), fabs(a.hi)));
+    double k_lo = ceil((a.lo - slack - base) / period);
+    double k_hi = floor((a.hi + slack - base) / period);
+    return k_lo <= k_hi;
+}
+
+/* sin or cos from its values at the endpoints, which libm gets within
+   an ulp, and the maxima at peak + 2k*pi and minima half a period on.
+   Shifting the argument instead would add the rounding of the shift,
+   far more than an ulp of a result near zero. */
+static Interval trig_range(Interval a, double (*f)(double), double peak) {
+    if (a.hi - a.lo >= 2 * M_PI || fmax(fabs(a.lo), fabs(a.hi)) > 1e15) {
+        Interval r = { -1.0, 1.0 };
+        return r;
+    }
+    double v[2] = { f(a.lo), f(a.hi) };
+    Interval r = hull(v, 2, 1);
+    if (hits_lattice(a, peak, 2 * M_PI)) r.hi = 1.0;
+    if (hits_lattice(a, peak - M_PI, 2 * M_PI)) r.lo = -1.0;
+    if (r.lo < -1.0) r.lo = -1.0;
+    if (r.hi > 1.0) r.hi = 1.0;
+    return r;
+}
+
+static Interval pow_range(RangeCtx *c, Interval a, Interval b, int *failed) {
+    if (contains(a, 0.0) && b.lo <= 0.0) {
+        warn(c, DIAG_ZERO_POW, is_point(a) && is_point(b) ? "Zero raised to non-positive power"
+                                                      : "Possible zero raised to non-positive power");
+        *failed = 1;
+        return EVERYTHING;
+    }
+
+    if (a.lo > 0.0) {
+        // Positive base: monotone in each argument, extremes at corners
+        double v[4] = { pow(a.lo, b.lo), pow(a.lo, b.hi), pow(a.hi, b.lo), pow(a.hi, b.hi) };
+        return hull(v, 4, 2);
+    }
+
+    if (is_point(b) && b.lo == floor(b.lo) && fabs(b.lo) < 9007199254740992.0) {
+        // Integer exponent: x^k is monotone on each side of zero
+        double v[2] = { pow(a.lo, b.lo), pow(a.hi, b.lo) };
+        Interval r = hull(v, 2, 2);
+        int even = fmod(b.lo, 2.0) == 0.0;
+        if (even && contains(a, 0.0)) {
+            r.lo = 0.0;
+            if (b.lo < 0.0) r.hi = INFINITY;
+        }
+        return r;
+    }
+
+    warn(c, DIAG_NEG_POW_BASE, "Possible negative base with non-integer exponent");
+    *failed = 1;
+    return EVERYTHING;
+}
+
+static Interval analyze(RangeCtx *c, ASTNode *n, int *safe_out) {
+    NodeRange *slot = node_range(c, n);
+    if (slot->gen == c->gen) {
+        *safe_out = slot->safe;
+        return slot->iv;
+    }
+
+    int ls = 1, rs = 1;
+    Interval a = n->left ? analyze(c, n->left, &ls) : EVERYTHING;
+    Interval b = n->right ? analyze(c, n->right, &rs) : EVERYTHING;
+    int failed = 0;     // this node itself may fault
+    Interval r;
+
+    switch (n->type) {
+        case NODE_NUM:
+            r.lo = r.hi = n->value;
+            break;
+        case NODE_VAR:
+            // The formula must hold for any binding, not just this one
+            r = EVERYTHING;
+            break;
+        case NODE_ADD: {
+            double v[2] = { a.lo + b.lo, a.hi + b.hi };
+            r = hull(v, 2, 1);
+            break;
+        }
+        case NODE_SUB: {
+            double v[2] = { a.lo - b.hi, a.hi - b.lo };
+            r = hull(v, 2, 1);
+            break;
+        }
+        case NODE_MUL: {
+            double v[4] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+            r = hull(v, 4, 1);
+            break;
+        }
+        case NODE_DIV:
+            if (contains(b, 0.0)) {
+                warn(c, DIAG_DIVISION_BY_ZERO, is_point(b) ? "Division by zero" : "Possible division by zero");
+                failed = 1;
+                r = EVERYTHING;
+            } else {
+                double v[4] = { a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi };
+                r = hull(v, 4, 1);
+            }
+            break;
+        case NODE_POW:
+            r = pow_range(c, a, b, &failed);
+            break;
+        case NODE_NEG:
+            r.lo = -a.hi;
+            r.hi = -a.lo;
+            break;
+        case NODE_SIN:
+            r = trig_range(a, sin, M_PI_2);
+            break;
+        case NODE_COS:
+            r = trig_range(a, cos, 0.0);
+            break;
+        case NODE_TAN:
+            if (a.hi - a.lo >= M_PI || hits_lattice(a, M_PI_2, M_PI)) {
+                warn(c, DIAG_TAN_ASYMPTOTE, "Possible tangent asymptote");
+                failed = 1;
+                r = EVERYTHING;
+            } else {
+                double v[2] = { tan(a.lo), tan(a.hi) };
+                r = hull(v, 2, 2);
+            }
+            break;
+        case NODE_LOG:
+            if (a.hi <= 0.0) {
+                warn(c, DIAG_LOG_DOMAIN, "Logarithm of non-positive number");
+                failed = 1;
+                r = EVERYTHING;
+            } else if (a.lo <= 0.0) {
+                warn(c, DIAG_LOG_DOMAIN, "Possible logarithm of non-positive number");
+                failed = 1;
+                r.lo = -INFINITY;
+                r.hi = up(log(a.hi), 2);
+            } else {
+                double v[2] = { log(a.lo), log(a.hi) };
+                r = hull(v, 2, 2);
+            }
+            break;
+        case NODE_EXP: {
+            double v[2] = { exp(a.lo), exp(a.hi) };
+            r = hull(v, 2, 2);
+            if (r.lo < 0.0) r.lo = 0.0;
+            break;
+        }
+        case NODE_SQRT:
+            if (a.hi < 0.0) {
+                warn(c, DIAG_SQRT_DOMAIN, "Square root of negative number");
+                failed = 1;
+                r = EVERYTHING;
+            } else {
+                if (a.lo < 0.0) {
+                    warn(c, DIAG_SQRT_DOMAIN, "Possible square root of negative number");
+                    failed = 1;
+                }
+                double v[2] = { sqrt(fmax(a.lo, 0.0)), sqrt(a.hi) };
+                r = hull(v, 2, 1);
+            }
+            break;
+        default:
+            r = EVERYTHING;
+            failed = 1;
+            break;
+    }
+
+    // Finite operands producing an unbounded result: the node may overflow
+    int children_finite = isfinite(a.lo) && isfinite(a.hi) &&
+                          (!n->right || (isfinite(b.lo) && isfinite(b.hi)));
+    if (!failed && n->left && children_finite && (!isfinite(r.lo) || !isfinite(r.hi))) {
+        warn(c, DIAG_OVERFLOW, "Possible overflow");
+        failed = 1;
+    }
+
+    int safe = ls && rs && !failed && isfinite(r.lo) && isfinite(r.hi);
+    c->report.nodes++;
+    c->report.safe_nodes += safe;
+
+    slot = node_range(c, n);    // the table may have moved while recursing
+    slot->gen = c->gen;
+    slot->safe = safe;
+    slot->iv = r;
+    *safe_out = safe;
+    return r;
+}
+
+void init_range(RangeCtx *c) {
+    diag_clear(&c->report.warnings);
+    c->report.nodes = c->report.safe_nodes = 0;
+    c->report.safe = 0;
+    c->report.iv = EVERYTHING;
+    if (++c->gen == 0) {
+        for (size_t i = 0; i < c->node_ranges_cap; i++) c->node_ranges[i].gen = 0;
+        c->gen = 1;
+    }
+}
+
+void analyze_ranges(RangeCtx *c, ASTNode *root) {
+    if (!root) return;
+    c->report.iv = analyze(c, root, &c->report.safe);
+}
+
+Interval range_of(const RangeCtx *c, ASTNode *n) {
+    const NodeRange *slot = find_range(c, n);
+    return slot ? slot->iv : EVERYTHING;
+}
+
+int range_is_safe(const RangeCtx *c, ASTNode *n) {
+    const NodeRange *slot = find_range(c, n);
+    return slot && slot->safe;
+}
+
+void range_ctx_free(RangeCtx *c) {
+    free(c->node_ranges);
+    range_report_free(&c->report);
+    memset(c, 0, sizeof(*c));
+}
+
+void range_report_copy(RangeReport *dst, const RangeReport *src) {
+    DiagList warnings = dst->warnings;
+    *dst = *src;
+    dst->warnings = warnings;
+    diag_copy(&dst->warnings, &src->warnings);
+}
+
+void range_report_free(RangeReport *r) {
+    diag_free(&r->warnings);
+}
+
+static void bound_json(JsonWriter *w, double x) {
+    if (isfinite(x)) json_number(w, x);
+    else json_string(w, x > 0 ? "inf" : "-inf");
+}
+
+void range_report_json(JsonWriter *w, const RangeReport *r) {
+    json_begin_object(w);
+    json_key(w, "interval");
+    json_begin_array(w);
+    bound_json(w, r->iv.lo);
+    bound_json(w, r->iv.hi);
+    json_end_array(w);
+    json_key(w, "safe");
+    json_bool(w, r->safe);
+    json_key(w, "safe_nodes");
+    json_number(w, r->safe_nodes);
+    json_key(w, "nodes");
+    json_number(w, r->nodes);
+    json_key(w, "warnings");
+    diag_json(w, &r->warnings);
+    json_end_object(w);
+}
@@ -0,0 +1,48 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include "ast.h"
+#include "diag.h"
+#include "json.h"
+
+/* Closed interval [lo, hi]; endpoints may be infinite. */
+typedef struct {
+    double lo, hi;
+} Interval;
+
+/* What the analysis found for one tree */
+typedef struct {
+    Interval iv;            // bounds of the root
+    int safe;               // the root is safe
+    int nodes;              // distinct nodes analyzed
+    int safe_nodes;
+    DiagList warnings;
+} RangeReport;
+
+typedef struct NodeRange NodeRange;
+
+/* State of one analysis. Zero-initialize before first use; every thread
+   running the pipeline needs its own. */
+typedef struct {
+    NodeRange *node_ranges;     // per node id, stamped with `gen`
+    size_t node_ranges_cap;
+    unsigned gen;
+    RangeReport report;         // of the last analyze_ranges
+} RangeCtx;
+
+/* Interval abstract interpretation over the AST. Every node gets bounds
+   that contain its true value (endpoints are rounded outward), and
+   possible division by zero, domain errors and overflow are reported
+   without evaluating the expression. A subtree is "safe" when none of
+   its nodes can fail and its value is provably finite. */
+void init_range(RangeCtx *c);
+void analyze_ranges(RangeCtx *c, ASTNode *root);
+Interval range_of(const RangeCtx *c, ASTNode *n);
+int range_is_safe(const RangeCtx *c, ASTNode *n);  // 0 for nodes not covered by the last analysis
+void range_ctx_free(RangeCtx *c);
+
+void range_report_copy(RangeReport *dst, const RangeReport *src);
+void range_report_free(RangeReport *r);
+void range_report_json(JsonWriter *w, const RangeReport *r);
+
+#endif // RANGE_H
@@ -1,130 +1,184 @@
 #include "semantic.h"
 #include "ast.h"
-#include "cJSON.h"
+#include "range.h"
+#include "alloc.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <math.h>
 #include <float.h>
 #include <errno.h>
+#include <string.h>
 #define M_PI 3.14159265358979323846
 #define M_PI_2 1.57079632679489661923
 
 
-static cJSON *errors_arr = NULL;
+/* Value of each AST node for the current check, indexed by node id.
+   Shared (hash-consed) subtrees are evaluated and diagnosed once; stale
+   entries from earlier statements carry an older generation. */
+struct NodeVal {
+    unsigned gen;
+    double value;
+};
 
-static double eval_for_check(ASTNode *n) {
+static NodeVal* node_val(SemanticCtx *c, ASTNode *n) {
+    if (n->id >= c->node_vals_cap) {
+        size_t cap = c->node_vals_cap ? c->node_vals_cap : 1024;
+        while (cap <= n->id) cap *= 2;
+        NodeVal *p = mmc_realloc(c->node_vals, cap * sizeof(*p));
+        if (!p) {
+            fprintf(stderr, "Out of memory growing semantic node table\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = c->node_vals_cap; i < cap; i++) p[i].gen = 0;
+        c->node_vals = p;
+        c->node_vals_cap = cap;
+    }
+    return &c->node_vals[n->id];
+}
+
+static void report(SemanticCtx *c, DiagCode code, const char *msg) {
+    diag_add(&c->errors, code, msg);
+}
+
+/* Single bottom-up pass: children first, then this node's checks and
+   value. Returns the node's value. */
+static double check_node(SemanticCtx *c, ASTNode *n) {
     if (!n) return 0.0;
-    errno = 0;
+
+    NodeVal *slot = node_val(c, n);
+    if (slot->gen == c->gen) return slot->value;
+
+    double l = n->left ? check_node(c, n->left) : 0.0;
+    double r = n->right ? check_node(c, n->right) : 0.0;
     double result = 0.0;
-    
+    int flagged = 0;    // a domain check already explains this node's failure
+    // Range analysis proved this subtree cannot fault: skip the checks
+    int checked = !(c->ranges && range_is_safe(c->ranges, n));
+    const VarEnv *env = c->env;
+
+    errno = 0;
     switch (n->type) {
         case NODE_NUM:  result = n->value; break;
-        case NODE_ADD:  result = eval_for_check(n->left) + eval_for_check(n->right); break;
-        case NODE_SUB:  result = eval_for_check(n->left) - eval_for_check(n->right); break;
-        case NODE_MUL:  result = eval_for_check(n->left) * eval_for_check(n->right); break;
-        case NODE_DIV:  result = eval_for_check(n->left) / eval_for_check(n->right); break;
-        case NODE_POW:  result = pow(eval_for_check(n->left), eval_for_check(n->right)); break;
-        case NODE_NEG:  result = -eval_for_check(n->left); break;
-        case NODE_SIN:  result = sin(eval_for_check(n->left)); break;
-        case NODE_COS:  result = cos(eval_for_check(n->left)); break;
-        case NODE_TAN:  {
-            double angle = eval_for_check(n->left);
-            if (fabs(fmod(angle + M_PI_2, M_PI)) < 1e-6) {
-                cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Tangent asymptotic behavior"));
+        case NODE_VAR:
+            if (env && n->var < env->count && env->bound[n->var]) {
+                result = env->values[n->var];
+            } else {
+                char msg[96];
+                snprintf(msg, sizeof(msg), "Unbound variable '%s'",
+                         env && n->var < env->count ? env->names[n->var] : "?");
+                report(c, DIAG_UNBOUND_VARIABLE, msg);
+                result = NAN;
+                flagged = 1;
             }
-            result = tan(angle);
             break;
-        }
-        case NODE_LOG:  result = log(eval_for_check(n->left)); break;
-        case NODE_EXP:  {
-            double exponent = eval_for_check(n->left);
-            if (exponent > 700) {  // exp(709) overflows double
-                cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Exponential overflow"));
+        case NODE_ADD:  result = l + r; break;
+        case NODE_SUB:  result = l - r; break;
+        case NODE_MUL:  result = l * r; break;
+        case NODE_DIV:
+            if (checked && r == 0.0) {
+                report(c, DIAG_DIVISION_BY_ZERO, "Division by zero");
+                flagged = 1;
             }
-            result = exp(exponent);
+            result = l / r;
+            break;
+        case NODE_POW:
+            if (checked && l == 0.0 && r <= 0.0) {
+                report(c, DIAG_ZERO_POW, "Zero raised to non-positive power");
+                flagged = 1;
+            }
+            result = pow(l, r);
+            break;
+        case NODE_NEG:  result = -l; break;
+        case NODE_SIN:  result = sin(l); break;
+        case NODE_COS:  result = cos(l); break;
+        case NODE_TAN:
+            if (fabs(fmod(l + M_PI_2, M_PI)) < 1e-6) {
+                report(c, DIAG_TAN_ASYMPTOTE, "Tangent asymptotic behavior");
+            }
+            result = tan(l);
+            break;
+        case NODE_LOG:
+            if (checked && l <= 0.0) {
+                report(c, DIAG_LOG_DOMAIN, "Logarithm of non-positive number");
+                flagged = 1;
+            }
+            result = log(l);
+            break;
+        case NODE_EXP:
+            if (l > 700) {  // exp(709) overflows double
+                report(c, DIAG_EXP_OVERFLOW, "Exponential overflow");
+            }
+            result = exp(l);
+            break;
+        case NODE_SQRT:
+            if (checked && l < 0.0) {
+                report(c, DIAG_SQRT_DOMAIN, "Square root of negative number");
+                flagged = 1;
+            }
+            result = sqrt(l);
             break;
-        }
-        case NODE_SQRT: result = sqrt(eval_for_check(n->left)); break;
-        default:        result = 0.0; break;
     }
 
     // Check for math library errors
-    if (errno == ERANGE || errno == EDOM) {
-        cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Domain/range error in math function"));
-        errno = 0;
+    if (checked && !flagged && (errno == ERANGE || errno == EDOM)) {
+        report(c, DIAG_MATH_ERRNO, "Domain/range error in math function");
     }
-    
+    errno = 0;
+
+    slot = node_val(c, n);  // the table may have moved while recursing
+    slot->gen = c->gen;
+    slot->value = result;
     return result;
 }
 
-static void check_node(ASTNode *n) {
-    if (!n) return;
-    
-    if (n->type == NODE_DIV) {
-        double denom = eval_for_check(n->right);
-        if (denom == 0.0) {
-            cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Division by zero"));
-        }
-    }
-    
-    if (n->type == NODE_SQRT) {
-        double operand = eval_for_check(n->left);
-        if (operand < 0.0) {
-            cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Square root of negative number"));
-        }
-    }
-    
-    if (n->type == NODE_LOG) {
-        double operand = eval_for_check(n->left);
-        if (operand <= 0.0) {
-            cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Logarithm of non-positive number"));
-        }
-    }
-    
-    if (n->type == NODE_POW) {
-        double base = eval_for_check(n->left);
-        double exponent = eval_for_check(n->right);
-        if (base == 0.0 && exponent <= 0.0) {
-            cJSON_AddItemToArray(errors_arr, cJSON_CreateString("Zero raised to non-positive power"));
-        }
-    }
-    
-    check_node(n->left);
-    check_node(n->right);
+void init_semantic(SemanticCtx *c) {
+    diag_clear(&c->errors);
+    c->root_value = 0.0;
 }
 
-void init_semantic() {
-    if (errors_arr) cJSON_Delete(errors_arr);
-    errors_arr = cJSON_CreateArray();
-}
+void check_semantics(SemanticCtx *c, ASTNode *root, const VarEnv *env, const RangeCtx *ranges) {
+    c->env = env;
+    c->ranges = ranges;
+    if (++c->gen == 0) {
+        for (size_t i = 0; i < c->node_vals_cap; i++) c->node_vals[i].gen = 0;
+        c->gen = 1;
+    }
 
-void check_semantics(ASTNode *root) {
-    check_node(root);
-    
-    if (cJSON_GetArraySize(errors_arr) == 0) {
-        double result = eval_for_check(root);
-        
+    double result = check_node(c, root);
+    c->root_value = result;
+    c->env = NULL;
+    c->ranges = NULL;
+
+    // Whole-result checks only make sense for an otherwise clean tree
+    if (c->errors.count == 0) {
         if (isinf(result)) {
-            cJSON_AddItemToArray(errors_arr, 
-                cJSON_CreateString("Arithmetic overflow/underflow"));
+            report(c, DIAG_OVERFLOW, "Arithmetic overflow/underflow");
         }
         else if (isnan(result)) {
-            cJSON_AddItemToArray(errors_arr, 
-                cJSON_CreateString("Undefined mathematical result"));
+            report(c, DIAG_UNDEFINED, "Undefined mathematical result");
         }
         
         // Detect underflow (subnormal numbers)
         if (fpclassify(result) == FP_SUBNORMAL) {
-            cJSON_AddItemToArray(errors_arr,
-                cJSON_CreateString("Arithmetic underflow"));
+            report(c, DIAG_UNDERFLOW, "Arithmetic underflow");
         }
         
         if (fabs(result) > DBL_MAX) {
-            cJSON_AddItemToArray(errors_arr,
-                cJSON_CreateString("Result exceeds double precision limits"));
+            report(c, DIAG_PRECISION, "Result exceeds double precision limits");
         }
     }
 }
 
-cJSON* get_semantic_json() {
-    return cJSON_Duplicate(errors_arr, 1);
-}
\ No newline at end of file
+double semantic_value(const SemanticCtx *c) {
+    return c->root_value;
+}
+
+int semantic_error_count(const SemanticCtx *c) {
+    return c->errors.count;
+}
+
+void semantic_ctx_free(SemanticCtx *c) {
+    free(c->node_vals);
+    diag_free(&c->errors);
+    memset(c, 0, sizeof(*c));
+}
@@ -2,10 +2,29 @@
 #define SEMANTIC_H
 
 #include "ast.h"
-#include "cJSON.h"
+#include "range.h"
+#include "diag.h"
 
-void init_semantic(void);
-void check_semantics(ASTNode *root);
-cJSON* get_semantic_json(void);
+typedef struct NodeVal NodeVal;
+
+/* State of one check. Zero-initialize before first use; every thread
+   running the pipeline needs its own. */
+typedef struct {
+    DiagList errors;                // of the last checked tree
+    double root_value;
+    const VarEnv *env;              // only set during check_semantics
+    const RangeCtx *ranges;
+    NodeVal *node_vals;             // per node id, stamped with `gen`
+    size_t node_vals_cap;
+    unsigned gen;
+} SemanticCtx;
+
+void init_semantic(SemanticCtx *c);
+/* env may be NULL; subtrees that `ranges` proved safe skip the domain
+   checks, and a NULL `ranges` checks everything */
+void check_semantics(SemanticCtx *c, ASTNode *root, const VarEnv *env, const RangeCtx *ranges);
+double semantic_value(const SemanticCtx *c);    // value of the last checked tree
+int semantic_error_count(const SemanticCtx *c);
+void semantic_ctx_free(SemanticCtx *c);
 
 #endif // SEMANTIC_H
\ No newline at end of file
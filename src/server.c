@@ -0,0 +1,304 @@
+#include "server.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+
+int serve(const char *socket_path) {
+    (void)socket_path;
+    fprintf(stderr, "--serve needs Unix domain sockets, not available on this platform\n");
+    return -1;
+}
+
+#else
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "json.h"
+#include "driver.h"
+
+#define MAX_CLIENTS 64
+#define READ_CHUNK 4096
+#define MAX_PENDING_INPUT (16 * 1024 * 1024)
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buffer;
+
+typedef struct {
+    int fd;
+    Buffer in;              // bytes received but not yet answered
+    Buffer out;             // replies not yet written
+    size_t out_off;
+    int eof;                // peer closed its sending side
+    size_t taken;           // bytes of `in` holding requests of this batch
+} Client;
+
+/* A request of the current batch: a program in its client's input */
+typedef struct {
+    int client;
+    size_t off;
+} Request;
+
+static Client clients[MAX_CLIENTS];
+static int client_count = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+/* the batch, and a reply writer per request kept across batches */
+static Request *batch = NULL;
+static const char **programs = NULL;
+static JsonWriter *replies = NULL;
+static int batch_count = 0, batch_cap = 0;
+
+/* counters reported on shutdown */
+static unsigned long total_requests = 0;
+static unsigned long total_batches = 0;
+static unsigned long largest_batch = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void buffer_append(Buffer *b, const char *data, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : READ_CHUNK;
+        while (cap < b->len + n) cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) {
+            fprintf(stderr, "Out of memory in server buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void drop_client(int idx) {
+    close(clients[idx].fd);
+    free(clients[idx].in.data);
+    free(clients[idx].out.data);
+    clients[idx] = clients[--client_count];
+}
+
+static void accept_clients(int listen_fd) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) return;     // EAGAIN: nothing more to accept
+        if (client_count == MAX_CLIENTS || set_nonblocking(fd) < 0) {
+            close(fd);
+            continue;
+        }
+        Client *c = &clients[client_count++];
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+    }
+}
+
+/* Pull everything currently readable; returns -1 if the client is gone */
+static int read_client(Client *c) {
+    char chunk[READ_CHUNK];
+    for (;;) {
+        ssize_t n = read(c->fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            buffer_append(&c->in, chunk, (size_t)n);
+            if (c->in.len > MAX_PENDING_INPUT) return -1;
+        } else if (n == 0) {
+            c->eof = 1;
+            return 0;
+        } else {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+}
+
+static void add_request(int client, size_t off) {
+    if (batch_count == batch_cap) {
+        int cap = batch_cap ? 2 * batch_cap : 64;
+        batch = realloc(batch, cap * sizeof(*batch));
+        programs = realloc(programs, cap * sizeof(*programs));
+        replies = realloc(replies, cap * sizeof(*replies));
+        if (!batch || !programs || !replies) {
+            fprintf(stderr, "Out of memory in server batch\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = batch_cap; i < cap; i++) json_writer_init(&replies[i], NULL, 0);
+        batch_cap = cap;
+    }
+    batch[batch_count].client = client;
+    batch[batch_count].off = off;
+    batch_count++;
+}
+
+/* Add every complete line buffered for client idx to the batch, in
+   order, and after EOF also what follows the last newline */
+static void take_requests(int idx) {
+    Client *c = &clients[idx];
+    size_t start = 0;
+
+    for (size_t i = 0; i < c->in.len; i++) {
+        if (c->in.data[i] != '\n') continue;
+        c->in.data[i] = '\0';
+        add_request(idx, start);
+        start = i + 1;
+    }
+    if (c->eof && start < c->in.len) {
+        buffer_append(&c->in, "", 1);
+        add_request(idx, start);
+        start = c->in.len;
+    }
+    c->taken = start;
+}
+
+/* Compile the batch as one unit, spread over the -j threads, and queue
+   each reply on its client in request order */
+static void answer_batch(void) {
+    for (int i = 0; i < batch_count; i++) programs[i] = clients[batch[i].client].in.data + batch[i].off;
+    compile_programs(programs, batch_count, replies);
+    for (int i = 0; i < batch_count; i++) {
+        json_raw(&replies[i], "\n", 1);
+        buffer_append(&clients[batch[i].client].out, replies[i].buf, replies[i].len);
+    }
+    for (int i = 0; i < client_count; i++) {
+        Client *c = &clients[i];
+        memmove(c->in.data, c->in.data + c->taken, c->in.len - c->taken);
+        c->in.len -= c->taken;
+        c->taken = 0;
+    }
+}
+
+/* Write as much pending output as the socket takes; -1 on error */
+static int flush_client(Client *c) {
+    while (c->out_off < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out_off, c->out.len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    c->out.len = c->out_off = 0;
+    return 0;
+}
+
+static int open_listener(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 || set_nonblocking(fd) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve(const char *socket_path) {
+    int listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) return -1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    fprintf(stderr, "mymathc: serving on %s\n", socket_path);
+
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while (!stop_requested) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < client_count; i++) {
+            // After EOF the socket stays readable, so only wait to write
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = clients[i].eof ? 0 : POLLIN;
+            if (clients[i].out.len > clients[i].out_off) fds[i + 1].events |= POLLOUT;
+            fds[i + 1].revents = 0;
+        }
+
+        int polled = client_count;
+        if (poll(fds, (nfds_t)polled + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        // Drain every readable connection first so that requests which
+        // arrived together are answered together as one batch
+        int dead[MAX_CLIENTS] = {0};
+        for (int i = 0; i < polled; i++) {
+            if (!clients[i].eof && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                if (read_client(&clients[i]) < 0) dead[i] = 1;
+            }
+        }
+
+        batch_count = 0;
+        for (int i = 0; i < polled; i++) {
+            if (!dead[i]) take_requests(i);
+        }
+        if (batch_count) {
+            answer_batch();
+            total_batches++;
+            total_requests += batch_count;
+            if ((unsigned long)batch_count > largest_batch) largest_batch = batch_count;
+        }
+
+        for (int i = 0; i < polled; i++) {
+            if (!dead[i] && flush_client(&clients[i]) < 0) dead[i] = 1;
+            // Close once the peer is done sending and has all its replies
+            if (clients[i].eof && clients[i].out.len == 0) dead[i] = 1;
+        }
+        for (int i = polled - 1; i >= 0; i--) {
+            if (dead[i]) drop_client(i);
+        }
+
+        if (fds[0].revents & POLLIN) accept_clients(listen_fd);
+    }
+
+    while (client_count > 0) drop_client(client_count - 1);
+    for (int i = 0; i < batch_cap; i++) json_writer_free(&replies[i]);
+    free(batch);
+    free(programs);
+    free(replies);
+    close(listen_fd);
+    unlink(socket_path);
+
+    fprintf(stderr, "mymathc: %lu requests in %lu batches (largest %lu)\n",
+            total_requests, total_batches, largest_batch);
+    return 0;
+}
+
+#endif // _WIN32
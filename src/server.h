@@ -0,0 +1,18 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Long-lived compile server on a Unix domain socket.
+
+   Each request is one line holding a program, the last of a connection
+   may also end at EOF; its reply is one line with the compact JSON that
+   compile_program produces for it. A connection
+   may send any number of requests, and pipelined requests are answered
+   in order. Requests that are already waiting when the server wakes up,
+   from any connection, are compiled as one batch before it polls again,
+   spread over the -j threads (see compile_programs).
+
+   Returns 0 after a clean shutdown on SIGINT/SIGTERM, -1 on setup
+   failure. */
+int serve(const char *socket_path);
+
+#endif // SERVER_H
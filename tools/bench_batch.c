@@ -0,0 +1,206 @@
+/* Batch evaluation benchmark: rows/sec for one statement with variables.
+
+   usage: mymathc-bench-batch [-n rows] [expression]
+
+   Every variable gets a column of uniform random values in [-4, 4]. The
+   statement is evaluated row by row with eval(), the bytecode VM and the
+   JIT, then over whole columns with each batch instruction set the CPU
+   supports. The results are compared with eval()'s, in ulps and as a
+   relative error scaled by the largest result; for composite statements
+   the ulp count can be large where the result cancels to near zero while
+   the scaled error stays small. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "arena.h"
+#include "ast.h"
+#include "range.h"
+#include "semantic.h"
+#include "ir.h"
+#include "opt.h"
+#include "codegen.h"
+#include "jit.h"
+#include "bytecode.h"
+#include "batch.h"
+#include "parse.h"
+
+static const char *default_program =
+    "sin(x)*exp(-y*y/2) + log(1+x*x)*cos(y) - sqrt(x*x+y*y);";
+
+static ASTNode *root = NULL;
+
+static void add_statement(ParseHooks *h, ASTNode *n) {
+    (void)h;
+    if (!root) root = n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* distance in representable doubles; NaN only matches NaN */
+static uint64_t ulp_diff(double a, double b) {
+    if (isnan(a) || isnan(b)) return isnan(a) && isnan(b) ? 0 : UINT64_MAX;
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    if (ia < 0) ia = INT64_MIN - ia;
+    if (ib < 0) ib = INT64_MIN - ib;
+    return ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia;
+}
+
+static void report(const char *name, size_t rows, double secs, const double *ref, const double *got) {
+    printf("%-13s %10.3g rows/s", name, rows / secs);
+    if (ref && got) {
+        uint64_t worst = 0;
+        double worst_rel = 0.0, scale = 0.0;
+        size_t nan_mismatch = 0;
+        for (size_t i = 0; i < rows; i++)
+            if (isfinite(ref[i]) && fabs(ref[i]) > scale) scale = fabs(ref[i]);
+        for (size_t i = 0; i < rows; i++) {
+            uint64_t d = ulp_diff(ref[i], got[i]);
+            if (d == UINT64_MAX) {
+                nan_mismatch++;
+                continue;
+            }
+            if (d > worst) worst = d;
+            // relative to the column's magnitude, so cancellation near 0 doesn't dominate
+            if (d && scale > 0.0 && fabs(ref[i] - got[i]) / scale > worst_rel)
+                worst_rel = fabs(ref[i] - got[i]) / scale;
+        }
+        printf("   max %llu ulp, rel %.2g", (unsigned long long)worst, worst_rel);
+        if (nan_mismatch) printf(", %zu NaN mismatches", nan_mismatch);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    size_t rows = 1000000;
+    const char *src = default_program;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rows = strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-n rows] [expression]\n", argv[0]);
+            return 1;
+        } else {
+            src = argv[i];
+        }
+    }
+    if (rows < 1) rows = 1;
+
+    Arena arena;
+    ASTBuilder builder;
+    arena_init(&arena, 0);
+    ast_builder_init(&builder, &arena);
+    ParseHooks hooks = { &builder, NULL, add_statement };
+    parse_string(&hooks, src);
+    if (!root) {
+        fprintf(stderr, "no statement in input\n");
+        return 1;
+    }
+
+    // Compile with every variable bound to a harmless probe value
+    size_t nvars = builder.nvars;
+    double *probe = malloc((nvars + 1) * sizeof(double));
+    unsigned char *bound = malloc(nvars + 1);
+    for (size_t k = 0; k < nvars; k++) {
+        probe[k] = 0.5;
+        bound[k] = 1;
+    }
+    VarEnv env = { (const char *const *)builder.var_names, probe, bound, nvars };
+    RangeCtx range_ctx = { 0 };
+    SemanticCtx sem_ctx = { 0 };
+    IRCtx ir_ctx = { 0 };
+    OptCtx opt_ctx = { 0 };
+    CodegenCtx cg_ctx = { 0 };
+    init_range(&range_ctx);
+    analyze_ranges(&range_ctx, root);
+    init_semantic(&sem_ctx);
+    check_semantics(&sem_ctx, root, &env, &range_ctx);
+    if (semantic_error_count(&sem_ctx) > 0) {
+        fprintf(stderr, "statement has semantic errors at the probe point\n");
+        return 1;
+    }
+    init_ir(&ir_ctx);
+    gen_ir(&ir_ctx, root, &env);
+    init_opt(&opt_ctx);
+    optimize_ir(&opt_ctx, get_ir(&ir_ctx));
+    init_codegen(&cg_ctx);
+    generate_assembly(&cg_ctx, get_opt_ir(&opt_ctx));
+    peephole_asm(&cg_ctx);
+
+    srand(42);
+    double **cols = malloc((nvars + 1) * sizeof(*cols));
+    for (size_t k = 0; k < nvars; k++) {
+        cols[k] = malloc(rows * sizeof(double));
+        for (size_t i = 0; i < rows; i++) cols[k][i] = 8.0 * rand() / RAND_MAX - 4.0;
+    }
+    double *ref = malloc(rows * sizeof(double));
+    double *got = malloc(rows * sizeof(double));
+    double *row = malloc((nvars + 1) * sizeof(double));
+
+    printf("%zu rows, %zu variables\n", rows, nvars);
+
+    double t0 = now();
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t k = 0; k < nvars; k++) row[k] = cols[k][i];
+        ref[i] = eval(root, row);
+    }
+    report("tree", rows, now() - t0, NULL, NULL);
+
+    Bytecode bc = { 0 };
+    bc_compile(root, &bc, NULL);
+    t0 = now();
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t k = 0; k < nvars; k++) row[k] = cols[k][i];
+        got[i] = bc_run(&bc, row);
+    }
+    report("bytecode", rows, now() - t0, ref, got);
+    bc_free(&bc);
+
+    JitCode jit;
+    if (jit_compile(get_asm(&cg_ctx), &jit) == 0) {
+        t0 = now();
+        for (size_t i = 0; i < rows; i++) {
+            for (size_t k = 0; k < nvars; k++) row[k] = cols[k][i];
+            got[i] = jit.fn(row);
+        }
+        report("jit", rows, now() - t0, ref, got);
+        jit_free(&jit);
+    }
+
+    BatchProgram bp;
+    batch_compile(&bp, get_opt_ir(&opt_ctx), NULL);
+    static const BatchIsa isas[] = { BATCH_SCALAR, BATCH_AVX2, BATCH_AVX512 };
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+        if (batch_set_isa(&bp, isas[k]) < 0) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "batch-%s", batch_isa_name(isas[k]));
+        t0 = now();
+        batch_eval(&bp, (const double *const *)cols, got, rows);
+        report(name, rows, now() - t0, ref, got);
+    }
+    batch_free(&bp);
+
+    for (size_t k = 0; k < nvars; k++) free(cols[k]);
+    free(cols);
+    free(ref);
+    free(got);
+    free(row);
+    free(probe);
+    free(bound);
+    codegen_ctx_free(&cg_ctx);
+    opt_ctx_free(&opt_ctx);
+    ir_ctx_free(&ir_ctx);
+    semantic_ctx_free(&sem_ctx);
+    range_ctx_free(&range_ctx);
+    ast_builder_free(&builder);
+    arena_free(&arena);
+    return 0;
+}
@@ -0,0 +1,150 @@
+/* Evaluation benchmark: the tree-walking eval() against the bytecode VM
+   and JIT-compiled code.
+
+   usage: mymathc-bench-eval [-n iterations] [expression]
+
+   Every statement in the expression (default: a small built-in mix) is
+   compiled once, then evaluated `iterations` times by each backend. The
+   variables are inputs, bound to 0.5, 0.75, 1, ... in order of first use
+   and passed to every backend as the vars array, so the optimizer cannot
+   fold a statement to a constant; a closed statement times little more
+   than the call. The bytecode and JIT results are cross-checked bit for
+   bit against eval(). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena.h"
+#include "ast.h"
+#include "range.h"
+#include "semantic.h"
+#include "ir.h"
+#include "opt.h"
+#include "codegen.h"
+#include "jit.h"
+#include "bytecode.h"
+#include "parse.h"
+
+static const char *default_program =
+    "1+2*x;"
+    "sin(x)^2 + cos(x)^2;"
+    "sqrt(2*x)*sqrt(3*y) - exp(x)/log(10*y);"
+    "(x+2)*(y+4)*(x+6)/(y-8) - -(x*y*10);"
+    "tan(0.6*x)*sin(0.4*y) + cos(0.2*x)*exp(0.8*y) - log(5+x)^1.5;";
+
+static ASTNode **roots = NULL;
+static int nroots = 0;
+
+/* parser callback; the benchmark only needs the trees */
+static void add_statement(ParseHooks *h, ASTNode *n) {
+    (void)h;
+    roots = realloc(roots, (nroots + 1) * sizeof(*roots));
+    roots[nroots++] = n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static RangeCtx range_ctx;
+static SemanticCtx sem_ctx;
+static IRCtx ir_ctx;
+static OptCtx opt_ctx;
+static CodegenCtx cg_ctx;
+static VarEnv env;
+
+/* run the pipeline up to codegen for one tree; 0 if it has no errors */
+static int compile_stmt(ASTNode *n) {
+    init_range(&range_ctx);
+    analyze_ranges(&range_ctx, n);
+    init_semantic(&sem_ctx);
+    check_semantics(&sem_ctx, n, &env, &range_ctx);
+    if (semantic_error_count(&sem_ctx) > 0) return -1;
+
+    init_ir(&ir_ctx);
+    if (gen_ir(&ir_ctx, n, &env) < 0) return -1;
+    init_opt(&opt_ctx);
+    optimize_ir(&opt_ctx, get_ir(&ir_ctx));
+    init_codegen(&cg_ctx);
+    generate_assembly(&cg_ctx, get_opt_ir(&opt_ctx));
+    peephole_asm(&cg_ctx);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long iters = 1000000;
+    const char *src = default_program;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iters = atol(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-n iterations] [expression]\n", argv[0]);
+            return 1;
+        } else {
+            src = argv[i];
+        }
+    }
+    if (iters < 1) iters = 1;
+
+    Arena arena;
+    ASTBuilder builder;
+    arena_init(&arena, 0);
+    ast_builder_init(&builder, &arena);
+    ParseHooks hooks = { &builder, NULL, add_statement };
+    parse_string(&hooks, src);
+
+    size_t nvars = builder.nvars;
+    double *vars = malloc((nvars + 1) * sizeof(double));
+    unsigned char *bound = malloc(nvars + 1);
+    for (size_t k = 0; k < nvars; k++) {
+        vars[k] = 0.5 + 0.25 * k;
+        bound[k] = 1;
+    }
+    env = (VarEnv){ (const char *const *)builder.var_names, vars, bound, nvars };
+
+    printf("%-4s %12s %12s %12s  %s\n", "stmt", "tree ns/op", "bc ns/op", "jit ns/op", "result");
+    int failures = 0;
+    volatile double sink = 0;
+    Bytecode bc = { 0 };
+    for (int s = 0; s < nroots; s++) {
+        if (compile_stmt(roots[s]) < 0) {
+            printf("%-4d %12s\n", s, "skipped (semantic errors)");
+            continue;
+        }
+        JitCode jit;
+        if (jit_compile(get_asm(&cg_ctx), &jit) < 0) {
+            fprintf(stderr, "JIT is not available on this platform\n");
+            return 1;
+        }
+
+        bc_compile(roots[s], &bc, NULL);
+
+        double t0 = now();
+        for (long i = 0; i < iters; i++) sink += eval(roots[s], vars);
+        double t1 = now();
+        for (long i = 0; i < iters; i++) sink += bc_run(&bc, vars);
+        double t2 = now();
+        for (long i = 0; i < iters; i++) sink += jit.fn(vars);
+        double t3 = now();
+
+        double tree = eval(roots[s], vars), vm = bc_run(&bc, vars), native = jit.fn(vars);
+        int same = memcmp(&tree, &vm, sizeof(double)) == 0 &&
+                   memcmp(&tree, &native, sizeof(double)) == 0;
+        if (!same) failures++;
+        printf("%-4d %12.1f %12.1f %12.1f  %.17g%s\n", s,
+               (t1 - t0) * 1e9 / iters, (t2 - t1) * 1e9 / iters,
+               (t3 - t2) * 1e9 / iters, tree,
+               same ? "" : "  MISMATCH");
+        jit_free(&jit);
+    }
+
+    bc_free(&bc);
+    free(vars);
+    free(bound);
+    free(roots);
+    ast_builder_free(&builder);
+    arena_free(&arena);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,357 @@
+/* Per-stage compile-time benchmark.
+
+   usage: mymathc-bench-stages [-r repeats] [-o results.json] [-c baseline.json] corpus
+
+   The corpus holds one statement per line, as mymathc-gen-corpus writes
+   it. Every statement is put through each stage of the pipeline on its
+   own: lexing (the scanner alone), parsing (yyparse, which scans again
+   as it goes), range analysis, semantic checks, IR generation,
+   optimization, code generation, and writing the JSON fields of those
+   stages. Each stage runs `repeats` times per statement (default 5) and
+   the fastest run counts, which filters out most scheduling noise.
+   Statements with semantic errors stop after the checks, like they do
+   in the compiler.
+
+   A table goes to stdout. With -o the same numbers are written as JSON
+   lines, one per stage after a line describing the corpus:
+
+       {"stage":"parse","statements":1000,"total_ms":..,"per_sec":..,
+        "p50_ns":..,"p90_ns":..,"p99_ns":..,"max_ns":..}
+
+   and -c compares against such a file from an earlier build, printing
+   the change in total time and median per stage. Variables in the
+   corpus are bound to values in [0.5, 1.5). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena.h"
+#include "ast.h"
+#include "range.h"
+#include "semantic.h"
+#include "ir.h"
+#include "opt.h"
+#include "codegen.h"
+#include "json.h"
+#include "parse.h"
+
+enum { ST_LEX, ST_PARSE, ST_RANGE, ST_SEMANTIC, ST_IR, ST_OPT, ST_ASM, ST_JSON, NSTAGES };
+
+static const char *stage_names[NSTAGES] = {
+    "lex", "parse", "range", "semantic", "ir", "opt", "asm", "json"
+};
+
+/* Fastest run of each stage, per statement that reached it */
+typedef struct {
+    double *ns;
+    size_t count, cap;
+} Samples;
+
+static Samples samples[NSTAGES];
+
+static ASTNode *root = NULL;
+
+static void add_statement(ParseHooks *h, ASTNode *n) {
+    (void)h;
+    if (!root) root = n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void add_sample(int stage, double secs) {
+    Samples *s = &samples[stage];
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+        if (!s->ns) {
+            fprintf(stderr, "Out of memory recording timings\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->ns[s->count++] = secs * 1e9;
+}
+
+static char* read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    size_t cap = 1 << 16, n = 0;
+    char *buf = malloc(cap);
+    size_t got;
+    while (buf && (got = fread(buf + n, 1, cap - n - 1, f)) > 0) {
+        n += got;
+        if (cap - n - 1 == 0) buf = realloc(buf, cap *= 2);
+    }
+    if (!buf) {
+        fprintf(stderr, "Out of memory reading %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+/* ---- timing one statement ---- */
+static Arena arena;
+static ASTBuilder builder;
+static RangeCtx range_ctx;
+static SemanticCtx sem_ctx;
+static IRCtx ir_ctx;
+static OptCtx opt_ctx;
+static CodegenCtx cg_ctx;
+static JsonWriter json;
+static int repeats = 5;
+
+static double values[64];
+static unsigned char bound[64];
+
+/* The fields a stage-complete statement contributes to --emit=all output */
+static void write_fields(int compiled) {
+    json_writer_clear(&json);
+    json_begin_object(&json);
+    json_key(&json, "range");
+    range_report_json(&json, &range_ctx.report);
+    json_key(&json, "semantic");
+    diag_json(&json, &sem_ctx.errors);
+    if (compiled) {
+        json_key(&json, "ir");
+        ir_program_json(&json, get_ir(&ir_ctx));
+        json_key(&json, "opt_ir");
+        ir_program_json(&json, get_opt_ir(&opt_ctx));
+        json_key(&json, "asm");
+        asm_program_json(&json, get_asm(&cg_ctx));
+        json_key(&json, "regalloc");
+        asm_regalloc_json(&json, get_asm(&cg_ctx));
+    }
+    json_end_object(&json);
+}
+
+/* Times `body` `repeats` times and records the fastest run */
+#define TIME_STAGE(stage, body) do {                        \
+        double best_ = 1e30;                                \
+        for (int r_ = 0; r_ < repeats; r_++) {              \
+            double t0_ = now();                             \
+            body;                                           \
+            double t_ = now() - t0_;                        \
+            if (t_ < best_) best_ = t_;                     \
+        }                                                   \
+        add_sample(stage, best_);                           \
+    } while (0)
+
+static void bench_statement(const char *src) {
+    ParseHooks lex_hooks = { &builder, NULL, NULL };
+    TIME_STAGE(ST_LEX, lex_string(&lex_hooks, src));
+
+    // A fresh builder each time, so hash-consing never finds the nodes
+    // of the previous run
+    ParseHooks hooks = { &builder, NULL, add_statement };
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++) {
+        arena_reset(&arena);
+        ast_builder_reset(&builder);
+        root = NULL;
+        double t0 = now();
+        parse_string(&hooks, src);
+        double t = now() - t0;
+        if (t < best) best = t;
+    }
+    add_sample(ST_PARSE, best);
+    if (!root) return;
+
+    VarEnv env = { (const char *const *)builder.var_names, values, bound,
+                   builder.nvars < 64 ? builder.nvars : 64 };
+
+    TIME_STAGE(ST_RANGE, (init_range(&range_ctx), analyze_ranges(&range_ctx, root)));
+    TIME_STAGE(ST_SEMANTIC, (init_semantic(&sem_ctx), check_semantics(&sem_ctx, root, &env, &range_ctx)));
+    int compiled = semantic_error_count(&sem_ctx) == 0;
+    if (compiled) {
+        int ok = 0;
+        TIME_STAGE(ST_IR, (init_ir(&ir_ctx), ok = gen_ir(&ir_ctx, root, &env)));
+        compiled = ok >= 0;
+    }
+    if (compiled) {
+        TIME_STAGE(ST_OPT, (init_opt(&opt_ctx), optimize_ir(&opt_ctx, get_ir(&ir_ctx))));
+        TIME_STAGE(ST_ASM, (init_codegen(&cg_ctx), generate_assembly(&cg_ctx, get_opt_ir(&opt_ctx)),
+                            peephole_asm(&cg_ctx)));
+    }
+    TIME_STAGE(ST_JSON, write_fields(compiled));
+}
+
+/* ---- reporting ---- */
+typedef struct {
+    size_t count;
+    double total_ms, per_sec, p50, p90, p99, max;
+} StageStats;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const Samples *s, double p) {
+    if (s->count == 0) return 0.0;
+    size_t i = (size_t)(p * (s->count - 1) + 0.5);
+    return s->ns[i];
+}
+
+static StageStats stats_of(Samples *s) {
+    StageStats st = { s->count, 0, 0, 0, 0, 0, 0 };
+    qsort(s->ns, s->count, sizeof(*s->ns), cmp_double);
+    for (size_t i = 0; i < s->count; i++) st.total_ms += s->ns[i] * 1e-6;
+    st.per_sec = st.total_ms > 0 ? s->count / (st.total_ms * 1e-3) : 0.0;
+    st.p50 = percentile(s, 0.50);
+    st.p90 = percentile(s, 0.90);
+    st.p99 = percentile(s, 0.99);
+    st.max = s->count ? s->ns[s->count - 1] : 0.0;
+    return st;
+}
+
+static void write_results(const char *path, const char *corpus, size_t nstmts, size_t bytes,
+                          const StageStats *st) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    JsonWriter w;
+    json_writer_init(&w, f, 0);
+    json_begin_object(&w);
+    json_key(&w, "corpus");
+    json_string(&w, corpus);
+    json_key(&w, "statements");
+    json_number(&w, (double)nstmts);
+    json_key(&w, "bytes");
+    json_number(&w, (double)bytes);
+    json_key(&w, "repeats");
+    json_number(&w, repeats);
+    json_end_object(&w);
+    json_raw(&w, "\n", 1);
+    for (int k = 0; k < NSTAGES; k++) {
+        json_begin_object(&w);
+        json_key(&w, "stage");
+        json_string(&w, stage_names[k]);
+        json_key(&w, "statements");
+        json_number(&w, (double)st[k].count);
+        json_key(&w, "total_ms");
+        json_number(&w, st[k].total_ms);
+        json_key(&w, "per_sec");
+        json_number(&w, st[k].per_sec);
+        json_key(&w, "p50_ns");
+        json_number(&w, st[k].p50);
+        json_key(&w, "p90_ns");
+        json_number(&w, st[k].p90);
+        json_key(&w, "p99_ns");
+        json_number(&w, st[k].p99);
+        json_key(&w, "max_ns");
+        json_number(&w, st[k].max);
+        json_end_object(&w);
+        json_raw(&w, "\n", 1);
+    }
+    json_writer_free(&w);
+    fclose(f);
+}
+
+/* A number field of a line write_results wrote; -1 if it is missing */
+static double field(const char *line, const char *key) {
+    char pat[32];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = strstr(line, pat);
+    return p ? strtod(p + strlen(pat), NULL) : -1.0;
+}
+
+static void compare(const char *path, const StageStats *st) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    printf("\nagainst %s\n%-9s %12s %12s %8s %12s %12s %8s\n", path,
+           "stage", "old ms", "new ms", "change", "old p50", "new p50", "change");
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        for (int k = 0; k < NSTAGES; k++) {
+            char pat[32];
+            snprintf(pat, sizeof(pat), "\"stage\":\"%s\"", stage_names[k]);
+            if (!strstr(line, pat)) continue;
+            double ms = field(line, "total_ms"), p50 = field(line, "p50_ns");
+            printf("%-9s %12.3f %12.3f %+7.1f%% %12.0f %12.0f %+7.1f%%\n", stage_names[k],
+                   ms, st[k].total_ms, ms > 0 ? (st[k].total_ms / ms - 1) * 100 : 0.0,
+                   p50, st[k].p50, p50 > 0 ? (st[k].p50 / p50 - 1) * 100 : 0.0);
+        }
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    const char *corpus = NULL, *out = NULL, *baseline = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (argv[i][0] == '-' || corpus) {
+            corpus = NULL;
+            break;
+        } else {
+            corpus = argv[i];
+        }
+    }
+    if (!corpus) {
+        fprintf(stderr, "usage: %s [-r repeats] [-o results.json] [-c baseline.json] corpus\n", argv[0]);
+        return 1;
+    }
+    if (repeats < 1) repeats = 1;
+    for (int i = 0; i < 64; i++) {
+        values[i] = 0.5 + i / 64.0;
+        bound[i] = 1;
+    }
+
+    size_t bytes;
+    char *text = read_file(corpus, &bytes);
+    arena_init(&arena, 0);
+    ast_builder_init(&builder, &arena);
+    json_writer_init(&json, NULL, 0);
+
+    size_t nstmts = 0;
+    for (char *line = text, *next; *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        else next = line + strlen(line);
+        if (strspn(line, " \t\r") == strlen(line)) continue;
+        bench_statement(line);
+        nstmts++;
+    }
+
+    StageStats st[NSTAGES];
+    printf("%zu statements, %zu bytes, best of %d\n", nstmts, bytes, repeats);
+    printf("%-9s %8s %12s %12s %10s %10s %10s %10s\n",
+           "stage", "stmts", "total ms", "stmts/s", "p50 ns", "p90 ns", "p99 ns", "max ns");
+    for (int k = 0; k < NSTAGES; k++) {
+        st[k] = stats_of(&samples[k]);
+        printf("%-9s %8zu %12.3f %12.4g %10.0f %10.0f %10.0f %10.0f\n", stage_names[k],
+               st[k].count, st[k].total_ms, st[k].per_sec, st[k].p50, st[k].p90, st[k].p99, st[k].max);
+    }
+    if (baseline) compare(baseline, st);
+    if (out) write_results(out, corpus, nstmts, bytes, st);
+
+    for (int k = 0; k < NSTAGES; k++) free(samples[k].ns);
+    json_writer_free(&json);
+    range_ctx_free(&range_ctx);
+    semantic_ctx_free(&sem_ctx);
+    ir_ctx_free(&ir_ctx);
+    opt_ctx_free(&opt_ctx);
+    codegen_ctx_free(&cg_ctx);
+    ast_builder_free(&builder);
+    arena_free(&arena);
+    free(text);
+    return 0;
+}
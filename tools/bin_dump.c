@@ -0,0 +1,242 @@
+/* mymathc-bin-dump: print `mymathc --format=binary` output as JSON.
+
+   usage: mymathc-bin-dump [-c] [file]
+
+   Reads the records from the file or stdin and writes each as one
+   compact JSON line, in the layout `mymathc --stream` uses for the same
+   statement, so the two outputs can be compared byte for byte:
+
+       mymathc --stream -f prog.txt > a.json
+       mymathc --stream --format=binary -f prog.txt | mymathc-bin-dump > b.json
+       cmp a.json b.json
+
+   `make check-binfmt` does this over a generated corpus.
+
+   The record header always carries a result, so "result" is always
+   written; compare against a run that emits results. Error codes are
+   listed on stderr with -c. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ast.h"
+#include "json.h"
+#include "binfmt.h"
+#include "codegen.h"
+
+static const char *node_names[] = {
+    [NODE_NUM] = "NUMBER", [NODE_ADD] = "ADD", [NODE_SUB] = "SUB", [NODE_MUL] = "MUL",
+    [NODE_DIV] = "DIV", [NODE_POW] = "POW", [NODE_NEG] = "NEG", [NODE_SIN] = "SIN",
+    [NODE_COS] = "COS", [NODE_TAN] = "TAN", [NODE_LOG] = "LOG", [NODE_EXP] = "EXP",
+    [NODE_SQRT] = "SQRT", [NODE_VAR] = "VAR"
+};
+
+static void strings(JsonWriter *w, BinCursor *c) {
+    json_begin_array(w);
+    while (!bin_at_end(c) && !c->bad) json_string(w, bin_read_str(c));
+    json_end_array(w);
+}
+
+static void tokens(JsonWriter *w, BinCursor *c) {
+    json_begin_array(w);
+    while (!bin_at_end(c) && !c->bad) {
+        json_begin_object(w);
+        json_key(w, "type");
+        json_string(w, bin_read_str(c));
+        json_key(w, "value");
+        json_string(w, bin_read_str(c));
+        json_end_object(w);
+    }
+    json_end_array(w);
+}
+
+static void ast(JsonWriter *w, BinCursor *c) {
+    unsigned type = bin_read_u8(c);
+    if (c->bad || type > NODE_VAR) {
+        c->bad = 1;
+        json_null(w);
+        return;
+    }
+    json_begin_object(w);
+    json_key(w, "type");
+    json_string(w, node_names[type]);
+    switch (type) {
+        case NODE_NUM:
+            json_key(w, "value");
+            json_number(w, bin_read_f64(c));
+            break;
+        case NODE_VAR:
+            json_key(w, "name");
+            json_string(w, bin_read_str(c));
+            break;
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_POW:
+            json_key(w, "left");
+            ast(w, c);
+            json_key(w, "right");
+            ast(w, c);
+            break;
+        default:
+            json_key(w, "operand");
+            ast(w, c);
+            break;
+    }
+    json_end_object(w);
+}
+
+static void bound(JsonWriter *w, double x) {
+    if (isfinite(x)) json_number(w, x);
+    else json_string(w, x > 0 ? "inf" : "-inf");
+}
+
+static void range(JsonWriter *w, BinCursor *c) {
+    json_begin_object(w);
+    json_key(w, "interval");
+    json_begin_array(w);
+    bound(w, bin_read_f64(c));
+    bound(w, bin_read_f64(c));
+    json_end_array(w);
+    json_key(w, "safe");
+    json_bool(w, bin_read_u8(c));
+    json_key(w, "safe_nodes");
+    json_number(w, bin_read_u32(c));
+    json_key(w, "nodes");
+    json_number(w, bin_read_u32(c));
+    json_key(w, "warnings");
+    strings(w, c);
+    json_end_object(w);
+}
+
+static void assembly(JsonWriter *w, BinCursor *c) {
+    unsigned section = ASM_SECTION_TEXT;
+    json_begin_array(w);
+    json_begin_array(w);
+    while (!bin_at_end(c) && !c->bad) {
+        unsigned s = bin_read_u8(c);
+        if (s != section) {
+            json_end_array(w);
+            json_begin_array(w);
+            section = s;
+        }
+        json_string(w, bin_read_str(c));
+    }
+    json_end_array(w);
+    json_end_array(w);
+}
+
+static void regalloc(JsonWriter *w, BinCursor *c) {
+    static const char *keys[] = { "registers_used", "spills", "call_saves", "call_reloads", "frame_bytes" };
+    json_begin_object(w);
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        json_key(w, keys[k]);
+        json_number(w, bin_read_u32(c));
+    }
+    json_end_object(w);
+}
+
+/* u32 counters under `keys`, then (str name, u32 count)... under `list` */
+static void report(JsonWriter *w, BinCursor *c, const char *const *keys, size_t nkeys, const char *list) {
+    json_begin_object(w);
+    for (size_t k = 0; k < nkeys; k++) {
+        json_key(w, keys[k]);
+        json_number(w, bin_read_u32(c));
+    }
+    json_key(w, list);
+    json_begin_object(w);
+    while (!bin_at_end(c) && !c->bad) {
+        json_key(w, bin_read_str(c));
+        json_number(w, bin_read_u32(c));
+    }
+    json_end_object(w);
+    json_end_object(w);
+}
+
+static void opt_passes(JsonWriter *w, BinCursor *c) {
+    static const char *const keys[] = { "rounds", "before", "after" };
+    report(w, c, keys, 3, "passes");
+}
+
+static void peephole(JsonWriter *w, BinCursor *c) {
+    static const char *const keys[] = { "before", "after" };
+    report(w, c, keys, 2, "rules");
+}
+
+int main(int argc, char **argv) {
+    int show_codes = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) show_codes = 1;
+        else if (argv[i][0] == '-' && argv[i][1]) {
+            fprintf(stderr, "usage: %s [-c] [file]\n", argv[0]);
+            return 1;
+        } else path = argv[i];
+    }
+
+    FILE *in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, "rb");
+        if (!in) {
+            perror(path);
+            return 1;
+        }
+    }
+    if (bin_read_header(in) < 0) {
+        fprintf(stderr, "not mymathc binary output (version %d)\n", BIN_VERSION);
+        return 1;
+    }
+
+    JsonWriter w;
+    json_writer_init(&w, stdout, 0);
+    BinRecord r;
+    memset(&r, 0, sizeof(r));
+    int status = 0, got;
+    while ((got = bin_read_record(in, &r)) > 0) {
+        BinCursor *p = r.payload;
+        json_begin_object(&w);
+        if (p[BIN_TOKENS].p)   { json_key(&w, "tokens");   tokens(&w, &p[BIN_TOKENS]); }
+        if (p[BIN_AST].p)      { json_key(&w, "ast");      ast(&w, &p[BIN_AST]); }
+        if (p[BIN_DEDUP].p)    { json_key(&w, "dedup");    json_number(&w, bin_read_u32(&p[BIN_DEDUP])); }
+        if (p[BIN_RANGE].p)    { json_key(&w, "range");    range(&w, &p[BIN_RANGE]); }
+        if (p[BIN_MESSAGES].p) { json_key(&w, "semantic"); strings(&w, &p[BIN_MESSAGES]); }
+        if (p[BIN_IR].p) {
+            // an extra array, as in the JSON output
+            json_key(&w, "ir");
+            json_begin_array(&w);
+            strings(&w, &p[BIN_IR]);
+            json_end_array(&w);
+        }
+        if (p[BIN_OPT].p)      { json_key(&w, "opt_ir");   strings(&w, &p[BIN_OPT]); }
+        if (p[BIN_ASM].p)      { json_key(&w, "asm");      assembly(&w, &p[BIN_ASM]); }
+        if (p[BIN_REGALLOC].p) { json_key(&w, "regalloc"); regalloc(&w, &p[BIN_REGALLOC]); }
+        if (p[BIN_OPT_PASSES].p) { json_key(&w, "opt_passes"); opt_passes(&w, &p[BIN_OPT_PASSES]); }
+        if (p[BIN_PEEPHOLE].p) { json_key(&w, "peephole"); peephole(&w, &p[BIN_PEEPHOLE]); }
+        json_key(&w, "result");
+        json_number(&w, r.result);
+        json_end_object(&w);
+        json_raw(&w, "\n", 1);
+
+        for (int k = 1; k < BIN_NKINDS; k++) {
+            if (p[k].bad) {
+                fprintf(stderr, "record %u: malformed payload %d\n", r.index, k);
+                status = 1;
+            }
+        }
+        if (show_codes && r.nerrors > 0) {
+            fprintf(stderr, "record %u: error codes", r.index);
+            for (int i = 0; i < r.nerrors; i++) fprintf(stderr, " %d", (int)r.errors[i]);
+            fprintf(stderr, "\n");
+        }
+    }
+    if (got < 0) {
+        fprintf(stderr, "truncated or malformed record\n");
+        status = 1;
+    }
+
+    json_writer_free(&w);
+    bin_record_free(&r);
+    if (in != stdin) fclose(in);
+    return status;
+}
@@ -0,0 +1,222 @@
+/* mymathc-client: latency probe for `mymathc --serve`.
+ *
+ * Sends the same request (or the lines of a file, round-robin) over one
+ * connection, keeping up to `depth` requests in flight, and reports
+ * p50/p90/p99 latency and throughput. With --spawn it instead runs the
+ * given mymathc binary once per request, which is the cost the server
+ * mode is meant to remove. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_LINE 65536
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int idx = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+static int connect_socket(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Read until `want` newlines have been seen; returns how many were.
+   Replies that arrive in the same read as earlier ones are carried over
+   to the next call. */
+static int read_replies(int fd, int want) {
+    static char buf[MAX_LINE];
+    static int surplus = 0;
+    int seen = surplus;
+    while (seen < want) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\n') seen++;
+        }
+    }
+    surplus = seen > want ? seen - want : 0;
+    return seen > want ? want : seen;
+}
+
+static int run_socket(const char *path, char **reqs, int nreq, int count, int depth,
+                      double *lat) {
+    int fd = connect_socket(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    // Requests go out in rounds of `depth`; each round's replies come back
+    // in order, so every request in a round is charged the round's latency
+    // up to its own reply
+    int sent = 0;
+    char line[MAX_LINE];
+    while (sent < count) {
+        int round = count - sent < depth ? count - sent : depth;
+        double start = now_us();
+        for (int i = 0; i < round; i++) {
+            const char *r = reqs[(sent + i) % nreq];
+            snprintf(line, sizeof(line), "%s\n", r);
+            if (write_all(fd, line, strlen(line)) < 0) {
+                perror("write");
+                close(fd);
+                return -1;
+            }
+        }
+        for (int i = 0; i < round; i++) {
+            if (read_replies(fd, 1) != 1) {
+                fprintf(stderr, "server closed the connection\n");
+                close(fd);
+                return -1;
+            }
+            lat[sent + i] = now_us() - start;
+        }
+        sent += round;
+    }
+    close(fd);
+    return 0;
+}
+
+static int run_spawn(const char *binary, char **reqs, int nreq, int count, double *lat) {
+    for (int i = 0; i < count; i++) {
+        double start = now_us();
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (pid == 0) {
+            int devnull = open("/dev/null", O_WRONLY);
+            if (devnull >= 0) dup2(devnull, STDOUT_FILENO);
+            execl(binary, binary, reqs[i % nreq], (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s failed on request %d\n", binary, i);
+            return -1;
+        }
+        lat[i] = now_us() - start;
+    }
+    return 0;
+}
+
+static char** read_lines(const char *path, int *n) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    char **lines = NULL;
+    char buf[MAX_LINE];
+    *n = 0;
+    while (fgets(buf, sizeof(buf), fp)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (!buf[0]) continue;
+        lines = realloc(lines, (*n + 1) * sizeof(*lines));
+        lines[(*n)++] = strdup(buf);
+    }
+    fclose(fp);
+    return lines;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s (<socket> | --spawn <mymathc>) [-n count] [-d depth] [-e expr | -f file]\n"
+        "  -n  requests to send (default 1000)\n"
+        "  -d  requests kept in flight on the connection (default 1)\n"
+        "  -e  request text (default \"1+2*3;\")\n"
+        "  -f  file with one request per line, sent round-robin\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = NULL, *spawn = NULL, *file = NULL;
+    char *expr = "1+2*3;";
+    int count = 1000, depth = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--spawn") == 0 && i + 1 < argc) spawn = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) expr = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) file = argv[++i];
+        else if (argv[i][0] != '-' && !socket_path) socket_path = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((!socket_path && !spawn) || count <= 0 || depth <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char **reqs = &expr;
+    int nreq = 1;
+    if (file && !(reqs = read_lines(file, &nreq))) return 1;
+    if (nreq == 0) {
+        fprintf(stderr, "no requests in %s\n", file);
+        return 1;
+    }
+
+    double *lat = malloc(count * sizeof(*lat));
+    double start = now_us();
+    int rc = spawn ? run_spawn(spawn, reqs, nreq, count, lat)
+                   : run_socket(socket_path, reqs, nreq, count, depth, lat);
+    double elapsed = now_us() - start;
+    if (rc < 0) return 1;
+
+    qsort(lat, count, sizeof(*lat), cmp_double);
+    printf("mode=%s requests=%d depth=%d\n", spawn ? "spawn" : "socket", count, spawn ? 1 : depth);
+    printf("p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n",
+           percentile(lat, count, 50), percentile(lat, count, 90),
+           percentile(lat, count, 99), lat[count - 1]);
+    printf("throughput=%.0f req/s\n", count / (elapsed / 1e6));
+    free(lat);
+    return 0;
+}
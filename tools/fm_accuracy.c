@@ -0,0 +1,134 @@
+/* mymathc-fm-accuracy: error and speed of the --fast-math kernels.
+
+   usage: mymathc-fm-accuracy [-n samples] [-S seed]
+
+   Every kernel is run on `samples` arguments (default 1000000) drawn
+   over fm_domain: uniformly for sin, cos, tan and exp, log-uniformly
+   for log and sqrt, whose domains span the positive doubles. Each
+   result is compared with libm's, and the worst distance in ulps is
+   printed next to the bound fm_select trusts, which should never be
+   below it. ns/call is for fm_eval and for the libm function over the
+   same arguments. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "fastmath.h"
+
+static uint64_t state;
+
+/* xorshift64*, so runs are the same on every platform */
+static uint64_t next(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+}
+
+static double uniform(void) {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* distance in representable doubles; NaN only matches NaN */
+static uint64_t ulp_diff(double a, double b) {
+    if (isnan(a) || isnan(b)) return isnan(a) && isnan(b) ? 0 : UINT64_MAX;
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    if (ia < 0) ia = INT64_MIN - ia;
+    if (ib < 0) ib = INT64_MIN - ib;
+    return ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia;
+}
+
+static const char* op_name(IROp op) {
+    switch (op) {
+        case IR_SIN:  return "sin";
+        case IR_COS:  return "cos";
+        case IR_TAN:  return "tan";
+        case IR_LOG:  return "log";
+        case IR_EXP:  return "exp";
+        default:      return "sqrt";
+    }
+}
+
+static double libm(IROp op, double x) {
+    switch (op) {
+        case IR_SIN:  return sin(x);
+        case IR_COS:  return cos(x);
+        case IR_TAN:  return tan(x);
+        case IR_LOG:  return log(x);
+        case IR_EXP:  return exp(x);
+        default:      return sqrt(x);
+    }
+}
+
+static volatile double sink;
+
+int main(int argc, char **argv) {
+    long n = 1000000;
+    state = 0x9e3779b97f4a7c15ull;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        int ok = i + 1 < argc;
+        if (ok && strcmp(a, "-n") == 0) n = atol(argv[++i]);
+        else if (ok && strcmp(a, "-S") == 0) state ^= strtoull(argv[++i], NULL, 10) * 0xbf58476d1ce4e5b9ull;
+        else ok = 0;
+        if (!ok) {
+            fprintf(stderr, "usage: %s [-n samples] [-S seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n < 1) n = 1;
+    if (!state) state = 1;
+
+    double *x = malloc(n * sizeof(double));
+    if (!x) {
+        fprintf(stderr, "Out of memory allocating samples\n");
+        return 1;
+    }
+
+    int over = 0;
+    printf("%-5s %-7s %12s %10s %9s %9s %8s\n",
+           "func", "degree", "max ulp", "bound", "ns/call", "libm", "speedup");
+    for (int i = 0; i < fm_kernel_count(); i++) {
+        const FmKernel *k = fm_kernel_at(i);
+        double lo, hi;
+        fm_domain(k->op, &lo, &hi);
+        for (long j = 0; j < n; j++)
+            x[j] = lo > 0 ? exp2(log2(lo) + uniform() * (log2(hi) - log2(lo)))
+                          : lo + uniform() * (hi - lo);
+
+        uint64_t worst = 0;
+        for (long j = 0; j < n; j++) {
+            uint64_t d = ulp_diff(fm_eval(k, x[j]), libm(k->op, x[j]));
+            if (d > worst) worst = d;
+        }
+
+        double s = 0.0, t0 = now();
+        for (long j = 0; j < n; j++) s += fm_eval(k, x[j]);
+        double t1 = now();
+        for (long j = 0; j < n; j++) s += libm(k->op, x[j]);
+        double t2 = now();
+        sink = s;
+
+        char degree[32];
+        if (k->p2) snprintf(degree, sizeof(degree), "%d/%d", k->n1 - 1, k->n2 - 1);
+        else if (k->p1) snprintf(degree, sizeof(degree), "%d", k->n1 - 1);
+        else snprintf(degree, sizeof(degree), "-");
+        double ns = (t1 - t0) * 1e9 / n, ns_libm = (t2 - t1) * 1e9 / n;
+        printf("%-5s %-7s %12llu %10g %9.2f %9.2f %7.2fx%s\n",
+               op_name(k->op), degree, (unsigned long long)worst, k->max_ulp,
+               ns, ns_libm, ns_libm / ns, worst > k->max_ulp ? "  over bound" : "");
+        if (worst > k->max_ulp) over = 1;
+    }
+    free(x);
+    return over;
+}
@@ -0,0 +1,182 @@
+/* mymathc-gen-corpus: write a synthetic program for benchmarking.
+
+   usage: mymathc-gen-corpus [-n statements] [-s nodes] [-d depth]
+                             [-t density] [-m mix] [-v vars] [-S seed]
+
+   One statement per line. Each is a random expression of about `nodes`
+   AST nodes (default 40) and at most `depth` levels (default 12).
+   `density` (0..1, default 0.2) is the share of operators that are
+   calls to sin, cos, tan, log, exp and sqrt; the rest are drawn from
+   `mix`, relative weights written as op=weight for add, sub, mul, div,
+   pow and neg (default add=3,sub=2,mul=3,div=1,pow=1,neg=1). Leaves are
+   constants, or with -v x,y,... one of the variables half the time.
+
+   The arguments of log and sqrt are kept positive, and exponents are
+   small integers, so most statements pass semantic checks and every
+   stage gets to run on them. The same seed always gives the same
+   program. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_NEG, NOPS };
+
+static const char *op_names[NOPS] = { "add", "sub", "mul", "div", "pow", "neg" };
+static const char *op_text[NOPS] = { "+", "-", "*", "/", "^", "-" };
+static const char *funcs[] = { "sin", "cos", "tan", "log", "exp", "sqrt" };
+
+static int weights[NOPS] = { 3, 2, 3, 1, 1, 1 };
+static double density = 0.2;
+static int max_depth = 12;
+static char **vars = NULL;
+static int nvars = 0;
+static uint64_t state;
+
+/* xorshift64*, so corpora are the same on every platform */
+static uint64_t next(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+}
+
+static double uniform(void) {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int below(int n) {
+    return (int)(uniform() * n);
+}
+
+static void leaf(FILE *out) {
+    if (nvars > 0 && below(2)) fputs(vars[below(nvars)], out);
+    else fprintf(out, "%.3g", 0.1 + uniform() * 9.9);
+}
+
+static void expr(FILE *out, int nodes, int depth);
+
+/* An operand of a binary operator: parenthesized unless it is a leaf */
+static void operand(FILE *out, int nodes, int depth) {
+    if (nodes <= 1 || depth <= 1) {
+        leaf(out);
+        return;
+    }
+    fputc('(', out);
+    expr(out, nodes, depth);
+    fputc(')', out);
+}
+
+/* `1 + e^2`: positive whatever e is, for log and sqrt */
+static void positive(FILE *out, int nodes, int depth) {
+    fputs("1 + ", out);
+    operand(out, nodes - 4, depth - 2);
+    fputs("^2", out);
+}
+
+static int pick_op(void) {
+    int total = 0;
+    for (int i = 0; i < NOPS; i++) total += weights[i];
+    int r = below(total);
+    for (int i = 0; i < NOPS; i++) {
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return OP_ADD;
+}
+
+/* An expression of about `nodes` nodes */
+static void expr(FILE *out, int nodes, int depth) {
+    if (nodes <= 1 || depth <= 1) {
+        leaf(out);
+        return;
+    }
+    if (uniform() < density) {
+        const char *f = funcs[below(6)];
+        fprintf(out, "%s(", f);
+        if ((strcmp(f, "log") == 0 || strcmp(f, "sqrt") == 0) && nodes > 5 && depth > 3)
+            positive(out, nodes - 1, depth - 1);
+        else
+            expr(out, nodes - 1, depth - 1);
+        fputc(')', out);
+        return;
+    }
+    int op = pick_op();
+    if (op == OP_NEG) {
+        fputc('-', out);
+        operand(out, nodes - 1, depth - 1);
+        return;
+    }
+    if (op == OP_POW) {
+        operand(out, nodes - 2, depth - 1);
+        fprintf(out, "^%d", 2 + below(2));
+        return;
+    }
+    int left = 1 + below(nodes - 2 > 0 ? nodes - 2 : 1);
+    operand(out, left, depth - 1);
+    fprintf(out, " %s ", op_text[op]);
+    operand(out, nodes - 1 - left, depth - 1);
+}
+
+static int parse_mix(char *spec) {
+    for (int i = 0; i < NOPS; i++) weights[i] = 0;
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int i = 0;
+        while (i < NOPS && strcmp(tok, op_names[i]) != 0) i++;
+        if (i == NOPS || atoi(eq + 1) < 0) return -1;
+        weights[i] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int i = 0; i < NOPS; i++) total += weights[i];
+    return total > 0 ? 0 : -1;
+}
+
+static int parse_vars(char *spec) {
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        vars = realloc(vars, (nvars + 1) * sizeof(*vars));
+        if (!vars) {
+            fprintf(stderr, "Out of memory reading variables\n");
+            exit(EXIT_FAILURE);
+        }
+        vars[nvars++] = tok;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long count = 1000;
+    int nodes = 40;
+    state = 0x9e3779b97f4a7c15ull;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        int ok = i + 1 < argc;
+        if (ok && strcmp(a, "-n") == 0) count = atol(argv[++i]);
+        else if (ok && strcmp(a, "-s") == 0) nodes = atoi(argv[++i]);
+        else if (ok && strcmp(a, "-d") == 0) max_depth = atoi(argv[++i]);
+        else if (ok && strcmp(a, "-t") == 0) density = atof(argv[++i]);
+        else if (ok && strcmp(a, "-m") == 0) ok = parse_mix(argv[++i]) == 0;
+        else if (ok && strcmp(a, "-v") == 0) ok = parse_vars(argv[++i]) == 0;
+        else if (ok && strcmp(a, "-S") == 0) state ^= strtoull(argv[++i], NULL, 10) * 0xbf58476d1ce4e5b9ull;
+        else ok = 0;
+        if (!ok) {
+            fprintf(stderr,
+                    "usage: %s [-n statements] [-s nodes] [-d depth] [-t density]\n"
+                    "          [-m add=3,sub=2,mul=3,div=1,pow=1,neg=1] [-v x,y] [-S seed]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nodes < 1) nodes = 1;
+    if (max_depth < 1) max_depth = 1;
+    if (!state) state = 1;
+
+    for (long i = 0; i < count; i++) {
+        expr(stdout, nodes, max_depth);
+        fputs(";\n", stdout);
+    }
+    free(vars);
+    return 0;
+}